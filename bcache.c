@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+#include "util.h"
+#include "thread.h"
+#include "bcache.h"
+
+#define CHUNK_LOADING	1
+#define CHUNK_VALID	2
+
+struct bchunk {
+	int64_t        no;		/* chunk number */
+	int            state;
+	int            nsect;		/* short at the end of the partition */
+	struct bchunk *hnext;
+	struct bchunk *prev, *next;	/* LRU, valid chunks only */
+	uint8_t       *data;
+};
+
+struct prefetch_req {
+	int64_t start;
+	int64_t num;
+};
+
+struct bcache {
+	bcache_read_t  read;
+	void          *ctx;
+	uint64_t       nsectors;
+	xmutex_t       lock;
+	xcond_t        loaded;
+
+	struct bchunk **hash;
+	unsigned       nhash;
+	struct bchunk  lru;		/* head is most recently used */
+	int            nchunks;
+	int            maxchunks;
+
+	/* Prefetch workers */
+	xthread_t      workers[BCACHE_WORKERS];
+	int            nworkers;
+	xcond_t        wake;
+	int            stop;
+	struct prefetch_req queue[BCACHE_QUEUE];
+	int            qhead;
+	int            qlen;
+
+	/* Chunks touched by demand reads, in first-touch order */
+	uint32_t      *trace;
+	uint32_t      *trace_set;	/* open addressing on chunk + 1 */
+	int            ntrace;
+};
+
+static unsigned bcache_hash(struct bcache *bc, int64_t no)
+{
+	return (unsigned)(no * 2654435761u) % bc->nhash;
+}
+
+static struct bchunk *bcache_lookup(struct bcache *bc, int64_t no)
+{
+	struct bchunk *c = bc->hash[bcache_hash(bc, no)];
+
+	while (c && c->no != no)
+		c = c->hnext;
+	return c;
+}
+
+static void bcache_unhash(struct bcache *bc, struct bchunk *c)
+{
+	struct bchunk **pp = &bc->hash[bcache_hash(bc, c->no)];
+
+	while (*pp != c)
+		pp = &(*pp)->hnext;
+	*pp = c->hnext;
+}
+
+static void lru_del(struct bchunk *c)
+{
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+}
+
+static void lru_add(struct bcache *bc, struct bchunk *c)
+{
+	c->next = bc->lru.next;
+	c->prev = &bc->lru;
+	bc->lru.next->prev = c;
+	bc->lru.next = c;
+}
+
+/* Take a chunk for no, recycling the least recently used one if full. */
+static struct bchunk *bcache_get_chunk(struct bcache *bc, int64_t no)
+{
+	struct bchunk *c;
+	unsigned h;
+
+	if (bc->nchunks < bc->maxchunks) {
+		c = calloc(1, sizeof *c);
+		if (!c)
+			return NULL;
+		c->data = malloc(BCACHE_CHUNK * SECTOR_SIZE);
+		if (!c->data) {
+			free(c);
+			return NULL;
+		}
+		bc->nchunks++;
+	} else {
+		c = bc->lru.prev;
+		if (c == &bc->lru)
+			return NULL;
+		lru_del(c);
+		bcache_unhash(bc, c);
+	}
+	c->no = no;
+	c->state = CHUNK_LOADING;
+	h = bcache_hash(bc, no);
+	c->hnext = bc->hash[h];
+	bc->hash[h] = c;
+	return c;
+}
+
+static void bcache_put_chunk(struct bcache *bc, struct bchunk *c)
+{
+	bcache_unhash(bc, c);
+	free(c->data);
+	free(c);
+	bc->nchunks--;
+}
+
+/*
+ * Fill the run of missing chunks starting at no, up to end, with one
+ * device read.  Called and returns with the lock held; the lock is
+ * dropped during I/O.  Returns the number of chunks loaded, 0 if there
+ * was no room, -1 on a read error.
+ */
+static int bcache_load(struct bcache *bc, int64_t no, int64_t end)
+{
+	struct bchunk *run[BCACHE_MAX_RUN];
+	int64_t start, num;
+	uint8_t *buf;
+	int n, k, status;
+
+	for (n = 0; n < BCACHE_MAX_RUN && no + n < end && !bcache_lookup(bc, no + n); n++) {
+		run[n] = bcache_get_chunk(bc, no + n);
+		if (!run[n])
+			break;
+	}
+	if (n == 0)
+		return 0;
+
+	start = no << BCACHE_CHUNK_BITS;
+	num = (int64_t)n << BCACHE_CHUNK_BITS;
+	if (start + num > (int64_t)bc->nsectors)
+		num = bc->nsectors - start;
+
+	xmutex_unlock(bc->lock);
+	buf = malloc(num * SECTOR_SIZE);
+	status = buf ? bc->read(bc->ctx, start, num, buf) : -1;
+	xmutex_lock(bc->lock);
+
+	for (k = 0; k < n; k++) {
+		if (status < 0) {
+			bcache_put_chunk(bc, run[k]);
+			continue;
+		}
+		run[k]->nsect = MIN(num - ((int64_t)k << BCACHE_CHUNK_BITS), BCACHE_CHUNK);
+		memcpy(run[k]->data, buf + ((size_t)k << BCACHE_CHUNK_BITS) * SECTOR_SIZE,
+		       run[k]->nsect * SECTOR_SIZE);
+		run[k]->state = CHUNK_VALID;
+		lru_add(bc, run[k]);
+	}
+	free(buf);
+	xcond_broadcast(bc->loaded);
+	return status < 0 ? -1 : n;
+}
+
+#define TRACE_SET_SIZE	(BCACHE_TRACE_MAX * 2)
+
+static void bcache_trace_add(struct bcache *bc, int64_t no)
+{
+	unsigned h;
+
+	if (!bc->trace || bc->ntrace == BCACHE_TRACE_MAX || no >= UINT32_MAX)
+		return;
+	for (h = bcache_hash(bc, no) % TRACE_SET_SIZE; bc->trace_set[h];
+	     h = (h + 1) % TRACE_SET_SIZE)
+		if (bc->trace_set[h] == no + 1)
+			return;
+	bc->trace_set[h] = no + 1;
+	bc->trace[bc->ntrace++] = no;
+}
+
+/*
+ * Read len sectors at pos straight into dst with one device read, then
+ * keep copies of the chunks it covered whole.  Called and returns with
+ * the lock held; the lock is dropped during I/O.
+ */
+static int bcache_read_span(struct bcache *bc, int64_t pos, int64_t len, uint8_t *dst)
+{
+	int64_t no, cstart, cend;
+	struct bchunk *c;
+	int status;
+
+	xmutex_unlock(bc->lock);
+	status = bc->read(bc->ctx, pos, len, dst);
+	xmutex_lock(bc->lock);
+	if (status < 0)
+		return status;
+
+	for (no = (pos + BCACHE_CHUNK - 1) >> BCACHE_CHUNK_BITS; ; no++) {
+		cstart = no << BCACHE_CHUNK_BITS;
+		cend = MIN(cstart + BCACHE_CHUNK, (int64_t)bc->nsectors);
+		if (cstart >= cend || cend > pos + len)
+			break;
+		if (bcache_lookup(bc, no))
+			continue;
+		c = bcache_get_chunk(bc, no);
+		if (!c)
+			break;
+		c->nsect = cend - cstart;
+		memcpy(c->data, dst + (cstart - pos) * SECTOR_SIZE, c->nsect * SECTOR_SIZE);
+		c->state = CHUNK_VALID;
+		lru_add(bc, c);
+	}
+	return status;
+}
+
+int bcache_read(struct bcache *bc, int64_t start, int64_t num, uint8_t *buf)
+{
+	int64_t pos = start, end = start + num;
+	struct bchunk *c;
+	int status = 0;
+
+	xmutex_lock(bc->lock);
+	while (pos < end) {
+		int64_t no = pos >> BCACHE_CHUNK_BITS;
+		int64_t off = pos & (BCACHE_CHUNK - 1);
+		int64_t n = MIN(BCACHE_CHUNK - off, end - pos);
+
+		bcache_trace_add(bc, no);
+		c = bcache_lookup(bc, no);
+		if (c && c->state == CHUNK_LOADING) {
+			xcond_wait(bc->loaded, bc->lock, -1);
+			continue;
+		}
+		if (c && off + n <= c->nsect) {
+			memcpy(buf + (pos - start) * SECTOR_SIZE,
+			       c->data + off * SECTOR_SIZE, n * SECTOR_SIZE);
+			lru_del(c);
+			lru_add(bc, c);
+			pos += n;
+			continue;
+		}
+
+		/* Small misses load whole chunks through the cache. */
+		if (num < BCACHE_BYPASS && !c) {
+			status = bcache_load(bc, no, ((end - 1) >> BCACHE_CHUNK_BITS) + 1);
+			if (status < 0)
+				break;
+			if (status > 0)
+				continue;
+		}
+		if (c) {
+			/* Only a short chunk at the end of the partition gets here. */
+			xmutex_unlock(bc->lock);
+			status = bc->read(bc->ctx, pos, n, buf + (pos - start) * SECTOR_SIZE);
+			xmutex_lock(bc->lock);
+			if (status < 0)
+				break;
+			pos += n;
+			continue;
+		}
+
+		/* Large misses go to the device in one read, up to the next cached chunk. */
+		while (pos + n < end && !bcache_lookup(bc, (pos + n) >> BCACHE_CHUNK_BITS)) {
+			bcache_trace_add(bc, (pos + n) >> BCACHE_CHUNK_BITS);
+			n = MIN(n + BCACHE_CHUNK, end - pos);
+		}
+		status = bcache_read_span(bc, pos, n, buf + (pos - start) * SECTOR_SIZE);
+		if (status < 0)
+			break;
+		pos += n;
+	}
+	xmutex_unlock(bc->lock);
+	return status < 0 ? -1 : 0;
+}
+
+static void bcache_worker(void *arg)
+{
+	struct bcache *bc = arg;
+	struct prefetch_req req;
+	int64_t no, end;
+	int n;
+
+	xmutex_lock(bc->lock);
+	for (;;) {
+		while (!bc->qlen && !bc->stop)
+			xcond_wait(bc->wake, bc->lock, -1);
+		if (bc->stop)
+			break;
+		req = bc->queue[bc->qhead];
+		bc->qhead = (bc->qhead + 1) % BCACHE_QUEUE;
+		bc->qlen--;
+
+		no = req.start >> BCACHE_CHUNK_BITS;
+		end = ((req.start + req.num - 1) >> BCACHE_CHUNK_BITS) + 1;
+		while (no < end && !bc->stop) {
+			if (bcache_lookup(bc, no)) {
+				no++;
+				continue;
+			}
+			n = bcache_load(bc, no, end);
+			if (n <= 0)
+				break;
+			no += n;
+		}
+	}
+	xmutex_unlock(bc->lock);
+}
+
+/*
+ * Queue a range to be read into the cache in the background.  Returns 1
+ * if the queue was full and the request dropped.
+ */
+int bcache_prefetch(struct bcache *bc, int64_t start, int64_t num)
+{
+	int dropped = 1;
+
+	if (num <= 0 || start < 0 || start >= (int64_t)bc->nsectors)
+		return 0;
+	if (start + num > (int64_t)bc->nsectors)
+		num = bc->nsectors - start;
+
+	xmutex_lock(bc->lock);
+	while (bc->nworkers < BCACHE_WORKERS && !bc->stop) {
+		bc->workers[bc->nworkers] = xthread_create(bcache_worker, bc);
+		if (!bc->workers[bc->nworkers])
+			break;
+		bc->nworkers++;
+	}
+	if (bc->nworkers && bc->qlen < BCACHE_QUEUE) {
+		bc->queue[(bc->qhead + bc->qlen) % BCACHE_QUEUE].start = start;
+		bc->queue[(bc->qhead + bc->qlen) % BCACHE_QUEUE].num = num;
+		bc->qlen++;
+		xcond_signal(bc->wake);
+		dropped = 0;
+	}
+	xmutex_unlock(bc->lock);
+	return dropped;
+}
+
+/* Start remembering which chunks demand reads touch. */
+int bcache_trace_start(struct bcache *bc)
+{
+	int status = 0;
+
+	xmutex_lock(bc->lock);
+	if (!bc->trace) {
+		bc->trace = malloc(BCACHE_TRACE_MAX * sizeof *bc->trace);
+		bc->trace_set = calloc(TRACE_SET_SIZE, sizeof *bc->trace_set);
+		if (!bc->trace || !bc->trace_set) {
+			free(bc->trace);
+			free(bc->trace_set);
+			bc->trace = bc->trace_set = NULL;
+			status = 1;
+		}
+		bc->ntrace = 0;
+	}
+	xmutex_unlock(bc->lock);
+	return status;
+}
+
+static int cmp_chunk(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Copy out the traced chunk numbers, sorted.  Returns the count. */
+int bcache_trace_get(struct bcache *bc, uint32_t **chunks)
+{
+	int n;
+
+	*chunks = NULL;
+	xmutex_lock(bc->lock);
+	n = bc->ntrace;
+	if (n > 0) {
+		*chunks = malloc(n * sizeof **chunks);
+		if (*chunks)
+			memcpy(*chunks, bc->trace, n * sizeof **chunks);
+		else
+			n = 0;
+	}
+	xmutex_unlock(bc->lock);
+	if (n > 0)
+		qsort(*chunks, n, sizeof **chunks, cmp_chunk);
+	return n;
+}
+
+/* Drop cached chunks overlapping a range, e.g. after it was written. */
+void bcache_invalidate(struct bcache *bc, int64_t start, int64_t num)
+{
+	int64_t no, end = ((start + num - 1) >> BCACHE_CHUNK_BITS) + 1;
+	struct bchunk *c;
+
+	xmutex_lock(bc->lock);
+	for (no = start >> BCACHE_CHUNK_BITS; no < end; no++) {
+		c = bcache_lookup(bc, no);
+		if (c && c->state == CHUNK_VALID) {
+			lru_del(c);
+			bcache_put_chunk(bc, c);
+		}
+	}
+	xmutex_unlock(bc->lock);
+}
+
+struct bcache *bcache_create(bcache_read_t read, void *ctx, uint64_t nsectors, uint64_t bytes)
+{
+	struct bcache *bc = calloc(1, sizeof *bc);
+
+	if (!bc)
+		return NULL;
+	bc->read = read;
+	bc->ctx = ctx;
+	bc->nsectors = nsectors;
+	bc->maxchunks = bytes / (BCACHE_CHUNK * SECTOR_SIZE);
+	if (bc->maxchunks < BCACHE_MAX_RUN)
+		bc->maxchunks = BCACHE_MAX_RUN;
+	bc->nhash = bc->maxchunks * 2 + 1;
+	bc->hash = calloc(bc->nhash, sizeof *bc->hash);
+	bc->lock = xmutex_create();
+	bc->loaded = xcond_create();
+	bc->wake = xcond_create();
+	bc->lru.next = bc->lru.prev = &bc->lru;
+	if (!bc->hash || !bc->lock || !bc->loaded || !bc->wake) {
+		bcache_destroy(bc);
+		return NULL;
+	}
+	return bc;
+}
+
+void bcache_destroy(struct bcache *bc)
+{
+	struct bchunk *c;
+	int i;
+
+	if (bc->nworkers) {
+		xmutex_lock(bc->lock);
+		bc->stop = 1;
+		xcond_broadcast(bc->wake);
+		xmutex_unlock(bc->lock);
+		for (i = 0; i < bc->nworkers; i++)
+			xthread_join(bc->workers[i]);
+	}
+	while (bc->lru.next && bc->lru.next != &bc->lru) {
+		c = bc->lru.next;
+		lru_del(c);
+		bcache_put_chunk(bc, c);
+	}
+	free(bc->hash);
+	free(bc->trace);
+	free(bc->trace_set);
+	if (bc->wake)
+		xcond_destroy(bc->wake);
+	if (bc->loaded)
+		xcond_destroy(bc->loaded);
+	if (bc->lock)
+		xmutex_destroy(bc->lock);
+	free(bc);
+}
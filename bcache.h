@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __XOKAN_BCACHE_H__
+#define __XOKAN_BCACHE_H__
+#include <stdint.h>
+
+/*
+ * Sector cache for a partition.  Data is kept in fixed chunks of
+ * BCACHE_CHUNK sectors, evicted in LRU order.  Background threads fill
+ * chunks ahead of demand for bcache_prefetch(), several reads in flight.
+ */
+#define BCACHE_CHUNK_BITS	7	/* 128 sectors, 64 KiB per chunk */
+#define BCACHE_CHUNK		(1 << BCACHE_CHUNK_BITS)
+#define BCACHE_MAX_RUN		16	/* chunks filled by one device read */
+#define BCACHE_BYPASS		2048	/* misses this large are read in one span */
+#define BCACHE_QUEUE		4096	/* pending prefetch requests */
+#define BCACHE_WORKERS		4	/* prefetch threads */
+#define BCACHE_TRACE_MAX	65536	/* chunks remembered by an access trace */
+
+typedef int (*bcache_read_t)(void *ctx, int64_t start, int64_t num, uint8_t *buf);
+
+struct bcache;
+
+struct bcache *bcache_create(bcache_read_t read, void *ctx, uint64_t nsectors, uint64_t bytes);
+void bcache_destroy(struct bcache *);
+int  bcache_read(struct bcache *, int64_t start, int64_t num, uint8_t *buf);
+int  bcache_prefetch(struct bcache *, int64_t start, int64_t num);
+void bcache_invalidate(struct bcache *, int64_t start, int64_t num);
+int  bcache_trace_start(struct bcache *);
+int  bcache_trace_get(struct bcache *, uint32_t **chunks);
+
+#endif
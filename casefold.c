@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "casefold.h"
+
+/* A byte that does not start a valid UTF-8 sequence. */
+#define CASEFOLD_RAW	0x80000000U
+
+/*
+ * Ranges of code points that fold by adding delta; stride 2 is for the
+ * blocks where capital and small letters alternate.  Generated from the
+ * simple mappings (status C and S) of CaseFolding.txt, Unicode 14.0.
+ */
+static const struct {
+	uint32_t first, last;
+	int32_t  stride, delta;
+} casefold_table[] = {
+	{ 0x00041, 0x0005a, 1,     32 },
+	{ 0x000b5, 0x000b5, 1,    775 },
+	{ 0x000c0, 0x000d6, 1,     32 },
+	{ 0x000d8, 0x000de, 1,     32 },
+	{ 0x00100, 0x0012e, 2,      1 },
+	{ 0x00132, 0x00136, 2,      1 },
+	{ 0x00139, 0x00147, 2,      1 },
+	{ 0x0014a, 0x00176, 2,      1 },
+	{ 0x00178, 0x00178, 1,   -121 },
+	{ 0x00179, 0x0017d, 2,      1 },
+	{ 0x0017f, 0x0017f, 1,   -268 },
+	{ 0x00181, 0x00181, 1,    210 },
+	{ 0x00182, 0x00184, 2,      1 },
+	{ 0x00186, 0x00186, 1,    206 },
+	{ 0x00187, 0x00187, 1,      1 },
+	{ 0x00189, 0x0018a, 1,    205 },
+	{ 0x0018b, 0x0018b, 1,      1 },
+	{ 0x0018e, 0x0018e, 1,     79 },
+	{ 0x0018f, 0x0018f, 1,    202 },
+	{ 0x00190, 0x00190, 1,    203 },
+	{ 0x00191, 0x00191, 1,      1 },
+	{ 0x00193, 0x00193, 1,    205 },
+	{ 0x00194, 0x00194, 1,    207 },
+	{ 0x00196, 0x00196, 1,    211 },
+	{ 0x00197, 0x00197, 1,    209 },
+	{ 0x00198, 0x00198, 1,      1 },
+	{ 0x0019c, 0x0019c, 1,    211 },
+	{ 0x0019d, 0x0019d, 1,    213 },
+	{ 0x0019f, 0x0019f, 1,    214 },
+	{ 0x001a0, 0x001a4, 2,      1 },
+	{ 0x001a6, 0x001a6, 1,    218 },
+	{ 0x001a7, 0x001a7, 1,      1 },
+	{ 0x001a9, 0x001a9, 1,    218 },
+	{ 0x001ac, 0x001ac, 1,      1 },
+	{ 0x001ae, 0x001ae, 1,    218 },
+	{ 0x001af, 0x001af, 1,      1 },
+	{ 0x001b1, 0x001b2, 1,    217 },
+	{ 0x001b3, 0x001b5, 2,      1 },
+	{ 0x001b7, 0x001b7, 1,    219 },
+	{ 0x001b8, 0x001b8, 1,      1 },
+	{ 0x001bc, 0x001bc, 1,      1 },
+	{ 0x001c4, 0x001c4, 1,      2 },
+	{ 0x001c5, 0x001c5, 1,      1 },
+	{ 0x001c7, 0x001c7, 1,      2 },
+	{ 0x001c8, 0x001c8, 1,      1 },
+	{ 0x001ca, 0x001ca, 1,      2 },
+	{ 0x001cb, 0x001db, 2,      1 },
+	{ 0x001de, 0x001ee, 2,      1 },
+	{ 0x001f1, 0x001f1, 1,      2 },
+	{ 0x001f2, 0x001f4, 2,      1 },
+	{ 0x001f6, 0x001f6, 1,    -97 },
+	{ 0x001f7, 0x001f7, 1,    -56 },
+	{ 0x001f8, 0x0021e, 2,      1 },
+	{ 0x00220, 0x00220, 1,   -130 },
+	{ 0x00222, 0x00232, 2,      1 },
+	{ 0x0023a, 0x0023a, 1,  10795 },
+	{ 0x0023b, 0x0023b, 1,      1 },
+	{ 0x0023d, 0x0023d, 1,   -163 },
+	{ 0x0023e, 0x0023e, 1,  10792 },
+	{ 0x00241, 0x00241, 1,      1 },
+	{ 0x00243, 0x00243, 1,   -195 },
+	{ 0x00244, 0x00244, 1,     69 },
+	{ 0x00245, 0x00245, 1,     71 },
+	{ 0x00246, 0x0024e, 2,      1 },
+	{ 0x00345, 0x00345, 1,    116 },
+	{ 0x00370, 0x00372, 2,      1 },
+	{ 0x00376, 0x00376, 1,      1 },
+	{ 0x0037f, 0x0037f, 1,    116 },
+	{ 0x00386, 0x00386, 1,     38 },
+	{ 0x00388, 0x0038a, 1,     37 },
+	{ 0x0038c, 0x0038c, 1,     64 },
+	{ 0x0038e, 0x0038f, 1,     63 },
+	{ 0x00391, 0x003a1, 1,     32 },
+	{ 0x003a3, 0x003ab, 1,     32 },
+	{ 0x003c2, 0x003c2, 1,      1 },
+	{ 0x003cf, 0x003cf, 1,      8 },
+	{ 0x003d0, 0x003d0, 1,    -30 },
+	{ 0x003d1, 0x003d1, 1,    -25 },
+	{ 0x003d5, 0x003d5, 1,    -15 },
+	{ 0x003d6, 0x003d6, 1,    -22 },
+	{ 0x003d8, 0x003ee, 2,      1 },
+	{ 0x003f0, 0x003f0, 1,    -54 },
+	{ 0x003f1, 0x003f1, 1,    -48 },
+	{ 0x003f4, 0x003f4, 1,    -60 },
+	{ 0x003f5, 0x003f5, 1,    -64 },
+	{ 0x003f7, 0x003f7, 1,      1 },
+	{ 0x003f9, 0x003f9, 1,     -7 },
+	{ 0x003fa, 0x003fa, 1,      1 },
+	{ 0x003fd, 0x003ff, 1,   -130 },
+	{ 0x00400, 0x0040f, 1,     80 },
+	{ 0x00410, 0x0042f, 1,     32 },
+	{ 0x00460, 0x00480, 2,      1 },
+	{ 0x0048a, 0x004be, 2,      1 },
+	{ 0x004c0, 0x004c0, 1,     15 },
+	{ 0x004c1, 0x004cd, 2,      1 },
+	{ 0x004d0, 0x0052e, 2,      1 },
+	{ 0x00531, 0x00556, 1,     48 },
+	{ 0x010a0, 0x010c5, 1,   7264 },
+	{ 0x010c7, 0x010c7, 1,   7264 },
+	{ 0x010cd, 0x010cd, 1,   7264 },
+	{ 0x013f8, 0x013fd, 1,     -8 },
+	{ 0x01c80, 0x01c80, 1,  -6222 },
+	{ 0x01c81, 0x01c81, 1,  -6221 },
+	{ 0x01c82, 0x01c82, 1,  -6212 },
+	{ 0x01c83, 0x01c84, 1,  -6210 },
+	{ 0x01c85, 0x01c85, 1,  -6211 },
+	{ 0x01c86, 0x01c86, 1,  -6204 },
+	{ 0x01c87, 0x01c87, 1,  -6180 },
+	{ 0x01c88, 0x01c88, 1,  35267 },
+	{ 0x01c90, 0x01cba, 1,  -3008 },
+	{ 0x01cbd, 0x01cbf, 1,  -3008 },
+	{ 0x01e00, 0x01e94, 2,      1 },
+	{ 0x01e9b, 0x01e9b, 1,    -58 },
+	{ 0x01e9e, 0x01e9e, 1,  -7615 },
+	{ 0x01ea0, 0x01efe, 2,      1 },
+	{ 0x01f08, 0x01f0f, 1,     -8 },
+	{ 0x01f18, 0x01f1d, 1,     -8 },
+	{ 0x01f28, 0x01f2f, 1,     -8 },
+	{ 0x01f38, 0x01f3f, 1,     -8 },
+	{ 0x01f48, 0x01f4d, 1,     -8 },
+	{ 0x01f59, 0x01f5f, 2,     -8 },
+	{ 0x01f68, 0x01f6f, 1,     -8 },
+	{ 0x01f88, 0x01f8f, 1,     -8 },
+	{ 0x01f98, 0x01f9f, 1,     -8 },
+	{ 0x01fa8, 0x01faf, 1,     -8 },
+	{ 0x01fb8, 0x01fb9, 1,     -8 },
+	{ 0x01fba, 0x01fbb, 1,    -74 },
+	{ 0x01fbc, 0x01fbc, 1,     -9 },
+	{ 0x01fbe, 0x01fbe, 1,  -7173 },
+	{ 0x01fc8, 0x01fcb, 1,    -86 },
+	{ 0x01fcc, 0x01fcc, 1,     -9 },
+	{ 0x01fd8, 0x01fd9, 1,     -8 },
+	{ 0x01fda, 0x01fdb, 1,   -100 },
+	{ 0x01fe8, 0x01fe9, 1,     -8 },
+	{ 0x01fea, 0x01feb, 1,   -112 },
+	{ 0x01fec, 0x01fec, 1,     -7 },
+	{ 0x01ff8, 0x01ff9, 1,   -128 },
+	{ 0x01ffa, 0x01ffb, 1,   -126 },
+	{ 0x01ffc, 0x01ffc, 1,     -9 },
+	{ 0x02126, 0x02126, 1,  -7517 },
+	{ 0x0212a, 0x0212a, 1,  -8383 },
+	{ 0x0212b, 0x0212b, 1,  -8262 },
+	{ 0x02132, 0x02132, 1,     28 },
+	{ 0x02160, 0x0216f, 1,     16 },
+	{ 0x02183, 0x02183, 1,      1 },
+	{ 0x024b6, 0x024cf, 1,     26 },
+	{ 0x02c00, 0x02c2f, 1,     48 },
+	{ 0x02c60, 0x02c60, 1,      1 },
+	{ 0x02c62, 0x02c62, 1, -10743 },
+	{ 0x02c63, 0x02c63, 1,  -3814 },
+	{ 0x02c64, 0x02c64, 1, -10727 },
+	{ 0x02c67, 0x02c6b, 2,      1 },
+	{ 0x02c6d, 0x02c6d, 1, -10780 },
+	{ 0x02c6e, 0x02c6e, 1, -10749 },
+	{ 0x02c6f, 0x02c6f, 1, -10783 },
+	{ 0x02c70, 0x02c70, 1, -10782 },
+	{ 0x02c72, 0x02c72, 1,      1 },
+	{ 0x02c75, 0x02c75, 1,      1 },
+	{ 0x02c7e, 0x02c7f, 1, -10815 },
+	{ 0x02c80, 0x02ce2, 2,      1 },
+	{ 0x02ceb, 0x02ced, 2,      1 },
+	{ 0x02cf2, 0x02cf2, 1,      1 },
+	{ 0x0a640, 0x0a66c, 2,      1 },
+	{ 0x0a680, 0x0a69a, 2,      1 },
+	{ 0x0a722, 0x0a72e, 2,      1 },
+	{ 0x0a732, 0x0a76e, 2,      1 },
+	{ 0x0a779, 0x0a77b, 2,      1 },
+	{ 0x0a77d, 0x0a77d, 1, -35332 },
+	{ 0x0a77e, 0x0a786, 2,      1 },
+	{ 0x0a78b, 0x0a78b, 1,      1 },
+	{ 0x0a78d, 0x0a78d, 1, -42280 },
+	{ 0x0a790, 0x0a792, 2,      1 },
+	{ 0x0a796, 0x0a7a8, 2,      1 },
+	{ 0x0a7aa, 0x0a7aa, 1, -42308 },
+	{ 0x0a7ab, 0x0a7ab, 1, -42319 },
+	{ 0x0a7ac, 0x0a7ac, 1, -42315 },
+	{ 0x0a7ad, 0x0a7ad, 1, -42305 },
+	{ 0x0a7ae, 0x0a7ae, 1, -42308 },
+	{ 0x0a7b0, 0x0a7b0, 1, -42258 },
+	{ 0x0a7b1, 0x0a7b1, 1, -42282 },
+	{ 0x0a7b2, 0x0a7b2, 1, -42261 },
+	{ 0x0a7b3, 0x0a7b3, 1,    928 },
+	{ 0x0a7b4, 0x0a7c2, 2,      1 },
+	{ 0x0a7c4, 0x0a7c4, 1,    -48 },
+	{ 0x0a7c5, 0x0a7c5, 1, -42307 },
+	{ 0x0a7c6, 0x0a7c6, 1, -35384 },
+	{ 0x0a7c7, 0x0a7c9, 2,      1 },
+	{ 0x0a7d0, 0x0a7d0, 1,      1 },
+	{ 0x0a7d6, 0x0a7d8, 2,      1 },
+	{ 0x0a7f5, 0x0a7f5, 1,      1 },
+	{ 0x0ab70, 0x0abbf, 1, -38864 },
+	{ 0x0ff21, 0x0ff3a, 1,     32 },
+	{ 0x10400, 0x10427, 1,     40 },
+	{ 0x104b0, 0x104d3, 1,     40 },
+	{ 0x10570, 0x1057a, 1,     39 },
+	{ 0x1057c, 0x1058a, 1,     39 },
+	{ 0x1058c, 0x10592, 1,     39 },
+	{ 0x10594, 0x10595, 1,     39 },
+	{ 0x10c80, 0x10cb2, 1,     64 },
+	{ 0x118a0, 0x118bf, 1,     32 },
+	{ 0x16e40, 0x16e5f, 1,     32 },
+	{ 0x1e900, 0x1e921, 1,     34 },
+};
+
+uint32_t casefold_char(uint32_t c)
+{
+	size_t lo = 0, hi = sizeof casefold_table / sizeof casefold_table[0], mid;
+
+	if (c < 0x80)
+		return c >= 'A' && c <= 'Z' ? c + 32 : c;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (c < casefold_table[mid].first)
+			hi = mid;
+		else if (c > casefold_table[mid].last)
+			lo = mid + 1;
+		else if ((c - casefold_table[mid].first) % casefold_table[mid].stride)
+			return c;
+		else
+			return c + casefold_table[mid].delta;
+	}
+	return c;
+}
+
+/* Decode the code point at *p and step over it. */
+static uint32_t casefold_next(const unsigned char **p, const unsigned char *end)
+{
+	const unsigned char *s = *p;
+	uint32_t c = *s, min;
+	int n, i;
+
+	if (c < 0x80) {
+		*p = s + 1;
+		return c;
+	}
+	if (c >= 0xc2 && c < 0xe0) {
+		n = 1;
+		c &= 0x1f;
+		min = 0x80;
+	} else if (c >= 0xe0 && c < 0xf0) {
+		n = 2;
+		c &= 0x0f;
+		min = 0x800;
+	} else if (c >= 0xf0 && c < 0xf5) {
+		n = 3;
+		c &= 0x07;
+		min = 0x10000;
+	} else {
+		goto raw;
+	}
+	if (end - s <= n)
+		goto raw;
+	for (i = 1; i <= n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			goto raw;
+		c = c << 6 | (s[i] & 0x3f);
+	}
+	if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+		goto raw;
+	*p = s + n + 1;
+	return c;
+raw:
+	*p = s + 1;
+	return CASEFOLD_RAW | *s;
+}
+
+uint32_t casefold_decode(const char **p, const char *end, int fold)
+{
+	const unsigned char *s = (const unsigned char *)*p;
+	uint32_t c = casefold_next(&s, (const unsigned char *)end);
+
+	*p = (const char *)s;
+	if (fold && !(c & CASEFOLD_RAW))
+		c = casefold_char(c);
+	return c;
+}
+
+uint32_t casefold_hash(const char *name, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)name, *end = p + len;
+	uint32_t h = 2166136261U, c;
+
+	while (p < end) {
+		c = casefold_next(&p, end);
+		if (!(c & CASEFOLD_RAW))
+			c = casefold_char(c);
+		h = (h ^ c) * 16777619U;
+	}
+	return h;
+}
+
+int casefold_equal(const char *a, size_t alen, const char *b, size_t blen)
+{
+	const unsigned char *p = (const unsigned char *)a, *pend = p + alen;
+	const unsigned char *q = (const unsigned char *)b, *qend = q + blen;
+	uint32_t x, y;
+
+	while (p < pend && q < qend) {
+		x = casefold_next(&p, pend);
+		y = casefold_next(&q, qend);
+		if (!(x & CASEFOLD_RAW))
+			x = casefold_char(x);
+		if (!(y & CASEFOLD_RAW))
+			y = casefold_char(y);
+		if (x != y)
+			return 0;
+	}
+	return p == pend && q == qend;
+}
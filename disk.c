@@ -20,25 +20,30 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
-#include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include "disk.h"
+#include "bcache.h"
+#include "thread.h"
 
 struct disk_dev {
-	CRITICAL_SECTION lock;
+	xmutex_t lock;
 	unsigned char disk_descr[1];
 };
 
 #define GET_DISKDEV(dk) ((struct disk_dev *)((unsigned char *)dk - offsetof(struct disk_dev, disk_descr)))
 extern struct disk_probe_spec vmdk_disk_spec;
 extern struct disk_probe_spec phy_disk_spec;
+extern struct disk_probe_spec img_disk_spec;
 
 static struct disk_probe_spec *disks[] = {
+#ifdef _WIN32
 	&phy_disk_spec,
 	&vmdk_disk_spec,
+#endif
+	&img_disk_spec,
 	NULL
 };
 
@@ -55,8 +60,10 @@ disk_descr_t disk_open(const char *type, const char *path, uint32_t flags)
 			ddev = calloc(1, sizeof *ddev + dp->size);
 			if (ddev) {
 				disk = (disk_descr_t)ddev->disk_descr;
-				InitializeCriticalSection(&ddev->lock);
-				if (dp->probe(disk, path, flags) < 0) {
+				ddev->lock = xmutex_create();
+				if (!ddev->lock || dp->probe(disk, path, flags) < 0) {
+					if (ddev->lock)
+						xmutex_destroy(ddev->lock);
 					free(ddev);
 					disk = NULL;
 				}
@@ -72,7 +79,7 @@ void disk_close(disk_descr_t disk)
 {
 	struct disk_dev *ddk = GET_DISKDEV(disk);
 	disk->release(disk);
-	DeleteCriticalSection(&ddk->lock);
+	xmutex_destroy(ddk->lock);
 	free(ddk);
 }
 
@@ -80,9 +87,9 @@ int disk_read(disk_descr_t disk, int64_t start, int64_t num, uint8_t *buf)
 {
 	int x;
 	struct disk_dev *ddk = GET_DISKDEV(disk);
-	EnterCriticalSection(&ddk->lock);
+	xmutex_lock(ddk->lock);
 	x= disk->read(disk, start, num, buf);
-	LeaveCriticalSection(&ddk->lock);
+	xmutex_unlock(ddk->lock);
 	return x;
 }
 
@@ -90,9 +97,9 @@ int disk_write(disk_descr_t disk, int64_t start, int64_t num, const uint8_t *buf
 {
 	int x;
 	struct disk_dev *ddk = GET_DISKDEV(disk);
-	EnterCriticalSection(&ddk->lock);
+	xmutex_lock(ddk->lock);
 	x= disk->write(disk, start, num, buf);
-	LeaveCriticalSection(&ddk->lock);
+	xmutex_unlock(ddk->lock);
 	return x;
 }
 
@@ -125,14 +132,14 @@ static part_descr_t parse_logic_partition(disk_descr_t disk, uint32_t logic_off,
 		type   = *(ep + 4);
 		xoff    = *(uint32_t *)(ep + 8);
 		xlen    = *(uint32_t *)(ep + 12);
-		printf("xbr,part %d: status %d, type %d, off %u, len %u\n", x, status, type, xoff, xlen);
+		fprintf(stderr, "xbr,part %d: status %d, type %d, off %u, len %u\n", x, status, type, xoff, xlen);
 		if (type == 0x5 || type == 0xf) {
 			part = parse_logic_partition(disk, logic_off, xoff, got, no);
 			if (part)
 				goto xdone;
 		} else if (type > 0) {
 			*got = *got + 1;
-			printf("xbr: got %d, no: %d\n", *got, no);
+			fprintf(stderr, "xbr: got %d, no: %d\n", *got, no);
 			if (*got == no) {
 				part = __alloc_partition(disk, logic_off + off + xoff, xlen);
 				goto xdone;
@@ -159,14 +166,14 @@ static part_descr_t disk_get_mbr_partition(disk_descr_t disk, int no)
 		type   = *(ep + 4);
 		off    = *(uint32_t *)(ep + 8);
 		len    = *(uint32_t *)(ep + 12);
-		printf("mbr,part %d: status %d, type %d, off %u, len %u\n", x, status, type, off, len);
+		fprintf(stderr, "mbr,part %d: status %d, type %d, off %u, len %u\n", x, status, type, off, len);
 		if (type == 0x5 || type == 0xf) {
 			part = parse_logic_partition(disk, off, 0, &got, no);
 			if (part)
 				goto done;
 		} else if (type > 0) {
 			++got;
-			printf("mbr: got %d, no: %d\n", got, no);
+			fprintf(stderr, "mbr: got %d, no: %d\n", got, no);
 			if (got == no) {
 				part = __alloc_partition(disk, off, len);
 				goto done;
@@ -177,23 +184,63 @@ done:
 	return part;
 }
 
+/* Partition 0 is the whole disk, for images of a bare filesystem. */
 part_descr_t disk_get_partition(disk_descr_t disk, int no)
 {
+	if (no == 0)
+		return __alloc_partition(disk, 0, disk->capacity(disk));
 	return disk_get_mbr_partition(disk, no);
 }
 
 void part_close(part_descr_t part)
 {
+	if (part->cache)
+		bcache_destroy(part->cache);
 	free(part);
 }
 
-int  part_read(part_descr_t part, int64_t start, int64_t num, uint8_t *buf)
+static int part_read_raw(void *ctx, int64_t start, int64_t num, uint8_t *buf)
 {
+	part_descr_t part = ctx;
+
 	return disk_read(part->disk, start + part->off, num, buf);
 }
 
+int  part_read(part_descr_t part, int64_t start, int64_t num, uint8_t *buf)
+{
+	if (part->cache)
+		return bcache_read(part->cache, start, num, buf);
+	return part_read_raw(part, start, num, buf);
+}
+
 int  part_write(part_descr_t part, int64_t start, int64_t num, const uint8_t *buf)
 {
+	if (part->cache)
+		bcache_invalidate(part->cache, start, num);
 	return disk_write(part->disk, start + part->off, num, buf);
 }
 
+/* Put a sector cache of the given size in front of the partition. */
+int  part_set_cache(part_descr_t part, uint64_t bytes)
+{
+	if (part->cache) {
+		bcache_destroy(part->cache);
+		part->cache = NULL;
+	}
+	if (bytes == 0)
+		return 0;
+	part->cache = bcache_create(part_read_raw, part, part->length, bytes);
+	if (!part->cache) {
+		fprintf(stderr, "can't allocate partition cache.\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Start reading a range into the cache; a no-op without one. */
+void part_prefetch(part_descr_t part, int64_t start, int64_t num)
+{
+	if (part->cache)
+		bcache_prefetch(part->cache, start, num);
+}
+
@@ -58,10 +58,13 @@ struct part_descr {
 	disk_descr_t disk;
 	uint64_t     off;
 	uint64_t     length;
+	struct bcache *cache;
 };
 
 int  part_read(part_descr_t, int64_t start, int64_t num, uint8_t *buf);
 int  part_write(part_descr_t, int64_t start, int64_t num, const uint8_t *buf);
 void part_close(part_descr_t);
+int  part_set_cache(part_descr_t, uint64_t bytes);
+void part_prefetch(part_descr_t, int64_t start, int64_t num);
 #endif
 
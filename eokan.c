@@ -30,9 +30,11 @@
 #include "disk.h"
 #include "util.h"
 #include "fs.h"
+#include "thread.h"
 
 static BOOL g_UseStdErr;
 static BOOL g_DebugMode;
+static BOOL g_CaseFold;
 HINSTANCE libdokan;
 static int DOKANAPI (*dokan_main_ptr)(PDOKAN_OPTIONS	DokanOptions, PDOKAN_OPERATIONS DokanOperations);
 static BOOL DOKANAPI (*dokan_umount_ptr)(LPCWSTR);
@@ -70,6 +72,296 @@ static int GetFilePath(char *file, int size, LPCWSTR name)
 	return nby;
 }
 
+#define EOKAN_SERIAL		0x19821215
+#define EOKAN_EPOCH_DIFF	11644473600LL	/* seconds from 1601 to 1970 */
+#define EOKAN_DIRS		64		/* directory listings kept */
+#define EOKAN_DIR_BYTES		(16 << 20)	/* memory they may take */
+
+/*
+ * The entries of a directory, converted for Dokan once and never changed
+ * after.  The handles open on the directory share it with the cache.
+ */
+struct dir_listing {
+	char              *path;
+	WIN32_FIND_DATAW  *ents;
+	uint32_t          *names;	/* UTF-8 names in pool, for patterns */
+	char              *pool;
+	int                n, max;
+	size_t             pool_len, pool_max;
+	int                failed;
+	int                refs;
+	struct dir_listing *prev, *next;	/* in the cache, newest first */
+};
+
+/* The context of an open directory handle. */
+struct dir_handle {
+	struct xstat        st;		/* of the directory, at open */
+	struct dir_listing *listing;	/* built on the first enumeration */
+};
+
+static xmutex_t g_DirLock;
+static struct dir_listing g_Dirs = { .prev = &g_Dirs, .next = &g_Dirs };
+static int g_nDirs;
+static size_t g_DirBytes;
+
+struct find_cb_data {
+	PFillFindData fill_find;
+	PDOKAN_FILE_INFO finfo;
+};
+
+/* FILETIME counts 100ns units from 1601; earlier times are clamped to it. */
+static void unix_to_filetime(const struct xtimespec *ts, FILETIME *ft)
+{
+	uint64_t t = 0;
+
+	if (ts->sec >= -EOKAN_EPOCH_DIFF)
+		t = (uint64_t)(ts->sec + EOKAN_EPOCH_DIFF) * 10000000 + ts->nsec / 100;
+	ft->dwLowDateTime  = (DWORD)t;
+	ft->dwHighDateTime = (DWORD)(t >> 32);
+}
+
+/* Windows has no change time; the creation time is ctime on older inodes. */
+static const struct xtimespec *creation_time(const struct xstat *st)
+{
+	return st->crtime.sec || st->crtime.nsec ? &st->crtime : &st->ctime;
+}
+
+static void fill_find_data(WIN32_FIND_DATAW *dw, const char *name, struct xstat *st, int is_dir)
+{
+	char path[MAX_PATH] = {0}, *dp;
+	const char *sp;
+
+	sp = name;
+	dp = path;
+
+	while (*sp && dp < path + sizeof path - 1) {
+		if (*sp == '/') {
+			*dp = '\\';
+		} else {
+			*dp = *sp;
+		}
+		++sp;
+		++dp;
+	}
+	memset(dw, 0, sizeof *dw);
+	dw->dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+	if (is_dir) {
+		dw->dwFileAttributes |= FILE_ATTRIBUTE_DIRECTORY;
+	}
+	utf8_to_utf16(path, strlen(path), dw->cFileName, MAX_PATH);
+	dw->nFileSizeHigh = (DWORD)(st->size >> 32);
+	dw->nFileSizeLow  = (DWORD)st->size;
+	unix_to_filetime(&st->atime, &dw->ftLastAccessTime);
+	unix_to_filetime(&st->mtime, &dw->ftLastWriteTime);
+	unix_to_filetime(creation_time(st), &dw->ftCreationTime);
+}
+
+static int list_all_files(void *data, const char *name, struct xstat *st, int is_dir)
+{
+	WIN32_FIND_DATAW    dw;
+	struct find_cb_data *fdp = data;
+
+	fill_find_data(&dw, name, st, is_dir);
+/*	wprintf(L"list_files: %s\n", dw.cFileName); */
+	fdp->fill_find(&dw, fdp->finfo);
+	return 0;
+}
+
+static size_t dir_listing_size(struct dir_listing *l)
+{
+	return sizeof *l + l->max * (sizeof *l->ents + sizeof *l->names) + l->pool_max;
+}
+
+static void dir_listing_free(struct dir_listing *l)
+{
+	free(l->path);
+	free(l->ents);
+	free(l->names);
+	free(l->pool);
+	free(l);
+}
+
+/* Drop a reference; call with g_DirLock held. */
+static void dir_listing_put_locked(struct dir_listing *l)
+{
+	if (--l->refs == 0)
+		dir_listing_free(l);
+}
+
+static void dir_listing_put(struct dir_listing *l)
+{
+	if (!l)
+		return;
+	xmutex_lock(g_DirLock);
+	dir_listing_put_locked(l);
+	xmutex_unlock(g_DirLock);
+}
+
+static int dir_listing_add(void *data, const char *name, struct xstat *st, int is_dir)
+{
+	struct dir_listing *l = data;
+	size_t len = strlen(name) + 1;
+	void *p;
+
+	if (l->n == l->max) {
+		l->max = l->max ? l->max * 2 : 64;
+		p = realloc(l->ents, l->max * sizeof *l->ents);
+		if (p)
+			l->ents = p;
+		p = p ? realloc(l->names, l->max * sizeof *l->names) : NULL;
+		if (!p)
+			goto nomem;
+		l->names = p;
+	}
+	if (l->pool_len + len > l->pool_max) {
+		l->pool_max = MAX(l->pool_max * 2, l->pool_len + len);
+		p = realloc(l->pool, l->pool_max);
+		if (!p)
+			goto nomem;
+		l->pool = p;
+	}
+	fill_find_data(&l->ents[l->n], name, st, is_dir);
+	memcpy(l->pool + l->pool_len, name, len);
+	l->names[l->n++] = (uint32_t)l->pool_len;
+	l->pool_len += len;
+	return 0;
+nomem:
+	l->failed = 1;
+	return 1;
+}
+
+static struct dir_listing *dir_listing_find(const char *path)
+{
+	struct dir_listing *l;
+
+	for (l = g_Dirs.next; l != &g_Dirs; l = l->next)
+		if (strcmp(l->path, path) == 0)
+			return l;
+	return NULL;
+}
+
+static void dir_listing_unlink(struct dir_listing *l)
+{
+	l->prev->next = l->next;
+	l->next->prev = l->prev;
+	g_nDirs--;
+	g_DirBytes -= dir_listing_size(l);
+}
+
+static void dir_listing_push(struct dir_listing *l)
+{
+	l->next = g_Dirs.next;
+	l->prev = &g_Dirs;
+	l->next->prev = l;
+	g_Dirs.next = l;
+	g_nDirs++;
+	g_DirBytes += dir_listing_size(l);
+}
+
+/*
+ * The listing of path from the cache, else read from the filesystem when
+ * build is set.  The caller gets a reference.
+ */
+static struct dir_listing *dir_listing_get(filesys_t fs, const char *path, int build)
+{
+	struct dir_listing *l, *old;
+
+	xmutex_lock(g_DirLock);
+	l = dir_listing_find(path);
+	if (l) {
+		dir_listing_unlink(l);
+		dir_listing_push(l);
+		l->refs++;
+	}
+	xmutex_unlock(g_DirLock);
+	if (l || !build)
+		return l;
+
+	l = calloc(1, sizeof *l);
+	if (!l)
+		return NULL;
+	l->path = strdup(path);
+	if (!l->path || vfs_dir_iterate(fs, path, dir_listing_add, l) != 0 || l->failed) {
+		dir_listing_free(l);
+		return NULL;
+	}
+
+	xmutex_lock(g_DirLock);
+	old = dir_listing_find(path);
+	if (old) {
+		/* Another thread listed it first. */
+		dir_listing_free(l);
+		l = old;
+		l->refs++;
+	} else {
+		l->refs = 2;
+		dir_listing_push(l);
+		while (g_Dirs.prev != l && (g_nDirs > EOKAN_DIRS || g_DirBytes > EOKAN_DIR_BYTES)) {
+			old = g_Dirs.prev;
+			dir_listing_unlink(old);
+			dir_listing_put_locked(old);
+		}
+	}
+	xmutex_unlock(g_DirLock);
+	return l;
+}
+
+/*
+ * The listing an enumeration should use: the handle's own, else a cached
+ * one, else (with build) a new one that the handle then keeps.
+ */
+static struct dir_listing *dir_listing_open(filesys_t fs, PDOKAN_FILE_INFO DokanFileInfo,
+		const char *path, int build)
+{
+	struct dir_handle *dh = DokanFileInfo->IsDirectory ? (struct dir_handle *)DokanFileInfo->Context : NULL;
+	struct dir_listing *l = NULL;
+
+	if (dh) {
+		xmutex_lock(g_DirLock);
+		l = dh->listing;
+		if (l)
+			l->refs++;
+		xmutex_unlock(g_DirLock);
+		if (l)
+			return l;
+	}
+	l = dir_listing_get(fs, path, build);
+	if (l && dh) {
+		xmutex_lock(g_DirLock);
+		if (!dh->listing) {
+			dh->listing = l;
+			l->refs++;
+		}
+		xmutex_unlock(g_DirLock);
+	}
+	return l;
+}
+
+static int dir_handle_stat(void *data, const char *name, struct xstat *st, int is_dir)
+{
+	struct dir_handle *dh = data;
+
+	if (is_dir)
+		dh->st = *st;
+	return 1;
+}
+
+/* Resolve a directory and keep its attributes; NULL if there is none. */
+static struct dir_handle *dir_handle_open(filesys_t fs, const char *path)
+{
+	struct dir_handle *dh = calloc(1, sizeof *dh);
+
+	if (!dh)
+		return NULL;
+	/* A directory's own entry, looked up rather than listed. */
+	vfs_dir_iterate_pattern(fs, path, ".", 0, dir_handle_stat, dh);
+	if (!dh->st.ino) {
+		free(dh);
+		return NULL;
+	}
+	return dh;
+}
+
 static int __CreateFile(
 	LPCWSTR					FileName,
 	DWORD					AccessMode,
@@ -81,6 +373,7 @@ static int __CreateFile(
 	char filePath[MAX_PATH];
 	filesys_t fs = (filesys_t)DokanFileInfo->DokanOptions->GlobalContext;
 	file_entry_t filp = NULL;
+	struct dir_handle *dh;
 
 	DbgPrint(L"CreateFile : %s\n", FileName);
 
@@ -97,9 +390,16 @@ static int __CreateFile(
 
 	DbgPrint(L"\tShareMode = 0x%x\n", ShareMode);
 
-	if (!DokanFileInfo->IsDirectory) {
-		GetFilePath(filePath, MAX_PATH, FileName);
+	GetFilePath(filePath, MAX_PATH, FileName);
+	if (!DokanFileInfo->IsDirectory)
 		filp = vfs_open(fs, filePath);
+	if (!filp) {
+		/* Directories opened like files get a directory context. */
+		dh = dir_handle_open(fs, filePath);
+		if (dh)
+			DokanFileInfo->IsDirectory = TRUE;
+		DokanFileInfo->Context = (ULONG64)dh;
+		return 0;
 	}
 	// save the file handle in Context
 	DokanFileInfo->Context = (ULONG64)filp;
@@ -118,11 +418,12 @@ static int __OpenDirectory(
 	LPCWSTR					FileName,
 	PDOKAN_FILE_INFO		DokanFileInfo)
 {
-	char FilePath[MAX_PATH] = {0};
+	char filePath[MAX_PATH];
+	filesys_t fs = (filesys_t)DokanFileInfo->DokanOptions->GlobalContext;
 
 	DbgPrint(L"OpenDirectory : %s\n", FileName);
-	utf16_to_utf8(FileName, wcslen(FileName), FilePath, sizeof FilePath);
-	DokanFileInfo->Context = (ULONG64)0;
+	GetFilePath(filePath, MAX_PATH, FileName);
+	DokanFileInfo->Context = (ULONG64)dir_handle_open(fs, filePath);
 
 	return 0;
 }
@@ -133,7 +434,15 @@ static int __CloseFile(
 {
 	filesys_t fs = (filesys_t) DokanFileInfo->DokanOptions->GlobalContext;
 	file_entry_t filp = (file_entry_t)DokanFileInfo->Context;
-	if (filp) {
+	struct dir_handle *dh = (struct dir_handle *)DokanFileInfo->Context;
+
+	if (DokanFileInfo->IsDirectory) {
+		if (dh) {
+			dir_listing_put(dh->listing);
+			free(dh);
+		}
+		DokanFileInfo->Context = 0;
+	} else if (filp) {
 		vfs_file_close(filp, fs);
 		DokanFileInfo->Context = 0;
 	}
@@ -161,6 +470,11 @@ static int __ReadFile(
 	filesys_t fs = (filesys_t)DokanFileInfo->DokanOptions->GlobalContext;
 	file_entry_t filp = (file_entry_t)DokanFileInfo->Context;
 
+	/* Context holds a dir_handle for directories. */
+	if (DokanFileInfo->IsDirectory) {
+		*ReadLength = 0;
+		return -ERROR_INVALID_FUNCTION;
+	}
 	if (filp) {
 		nrd = vfs_file_read(filp, fs, Offset, Buffer, BufferLength);
 		*ReadLength = nrd;
@@ -202,75 +516,104 @@ static int __GetFileInformation(
 {
 	filesys_t fs = (filesys_t)DokanFileInfo->DokanOptions->GlobalContext;
 	file_entry_t filp = (file_entry_t)DokanFileInfo->Context;
+	struct dir_handle *dh = (struct dir_handle *)DokanFileInfo->Context;
+	LPBY_HANDLE_FILE_INFORMATION info = HandleFileInformation;
 	struct xstat stbuf;
 
-	if (filp) {
-		memset(&stbuf, 0, sizeof stbuf);
-		vfs_file_stat(filp, fs, &stbuf);
-		HandleFileInformation->dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
-		HandleFileInformation->nFileSizeLow = stbuf.size;
-		HandleFileInformation->nFileSizeHigh = stbuf.size_high;
-	}
-
 	DbgPrint(L"GetFileInfo : %s\n", FileName);
+
+	/* Both kinds of handle keep the inode they were opened with. */
+	memset(&stbuf, 0, sizeof stbuf);
+	if (DokanFileInfo->IsDirectory && dh)
+		stbuf = dh->st;
+	else if (!DokanFileInfo->IsDirectory && filp)
+		vfs_file_stat(filp, fs, &stbuf);
+	else
+		return 0;
+
+	memset(info, 0, sizeof *info);
+	info->dwFileAttributes = DokanFileInfo->IsDirectory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+	unix_to_filetime(creation_time(&stbuf), &info->ftCreationTime);
+	unix_to_filetime(&stbuf.atime, &info->ftLastAccessTime);
+	unix_to_filetime(&stbuf.mtime, &info->ftLastWriteTime);
+	info->dwVolumeSerialNumber = EOKAN_SERIAL;
+	info->nFileSizeHigh = (DWORD)(stbuf.size >> 32);
+	info->nFileSizeLow = (DWORD)stbuf.size;
+	info->nNumberOfLinks = stbuf.nlinks;
+	info->nFileIndexHigh = 0;
+	info->nFileIndexLow = stbuf.ino;
 	return 0;
 }
 
-struct find_cb_data {
-	PFillFindData fill_find;
-	PDOKAN_FILE_INFO finfo;
-};
-
-static int list_all_files(void *data, const char *name, struct xstat *st, int is_dir)
+static int __FindFiles(LPCWSTR	FileName, PFillFindData	FillFindData /* function pointer */, PDOKAN_FILE_INFO	DokanFileInfo)
 {
-	char path[MAX_PATH] = {0}, *dp;
-	const char *sp;
-	WIN32_FIND_DATAW    dw;
-	struct find_cb_data *fdp = data;
+	char filePath[MAX_PATH] = {0};
+	struct find_cb_data find_data;
+	struct dir_listing *l;
+	filesys_t fs = (filesys_t)DokanFileInfo->DokanOptions->GlobalContext;
+	int i;
 
-	sp = name;
-	dp = path;
+	memset(&find_data, 0, sizeof find_data);
 
-	while (*sp) {
-		if (*sp == '/') {
-			*dp = '\\';
-		} else {
-			*dp = *sp;
-		}
-		++sp;
-		++dp;
-	}
-	memset(&dw, 0, sizeof dw);
-	dw.dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
-	if (is_dir) {
-		dw.dwFileAttributes |= FILE_ATTRIBUTE_DIRECTORY;
+	GetFilePath(filePath, sizeof filePath, FileName);
+
+	//DbgPrint(L"FindFiles :%s -> %s\n", FileName, filePath);
+	l = dir_listing_open(fs, DokanFileInfo, filePath, 1);
+	if (l) {
+		for (i = 0; i < l->n; i++)
+			FillFindData(&l->ents[i], DokanFileInfo);
+		dir_listing_put(l);
+		return 0;
 	}
-	utf8_to_utf16(path, strlen(path), dw.cFileName, MAX_PATH);
-/*	wprintf(L"list_files: %s\n", dw.cFileName); */
-	dw.nFileSizeHigh = st->size_high;
-	dw.nFileSizeLow  = st->size;
-	dw.ftLastAccessTime.dwLowDateTime = st->atime;
-	dw.ftLastWriteTime.dwLowDateTime = st->mtime;
-	dw.ftCreationTime.dwLowDateTime = st->ctime;
-	fdp->fill_find(&dw, fdp->finfo);
+	find_data.fill_find = FillFindData;
+	find_data.finfo = DokanFileInfo;
+
+	vfs_dir_iterate(fs, filePath, list_all_files, &find_data);
 	return 0;
 }
 
-static int __FindFiles(LPCWSTR	FileName, PFillFindData	FillFindData /* function pointer */, PDOKAN_FILE_INFO	DokanFileInfo)
+/*
+ * Wildcards match regardless of case, as they did when Dokan filtered;
+ * they are applied to a listing already at hand, else pushed down to the
+ * filesystem.  A plain name is always a lookup.
+ */
+static int __FindFilesWithPattern(LPCWSTR FileName, LPCWSTR SearchPattern, PFillFindData FillFindData,
+		PDOKAN_FILE_INFO DokanFileInfo)
 {
-	char filePath[MAX_PATH] = {0};
+	char filePath[MAX_PATH] = {0}, pattern[MAX_PATH] = {0};
 	struct find_cb_data find_data;
+	struct dir_listing *l = NULL;
 	filesys_t fs = (filesys_t)DokanFileInfo->DokanOptions->GlobalContext;
+	int i;
+
+	if (!SearchPattern[0] || wcscmp(SearchPattern, L"*") == 0)
+		return __FindFiles(FileName, FillFindData, DokanFileInfo);
 
 	memset(&find_data, 0, sizeof find_data);
 
 	GetFilePath(filePath, sizeof filePath, FileName);
-
-	//DbgPrint(L"FindFiles :%s -> %s\n", FileName, filePath);
+	utf16_to_utf8(SearchPattern, wcslen(SearchPattern), pattern, sizeof pattern);
+
+	/*
+	 * Wildcards filter a listing we already have.  A literal name goes to
+	 * the fold index when there is one; without it a direct lookup would
+	 * be case-sensitive, so filter the whole listing instead.
+	 */
+	if (wcspbrk(SearchPattern, L"*?<>\""))
+		l = dir_listing_open(fs, DokanFileInfo, filePath, 0);
+	else if (!g_CaseFold)
+		l = dir_listing_open(fs, DokanFileInfo, filePath, 1);
+	if (l) {
+		for (i = 0; i < l->n; i++)
+			if (vfs_name_match(pattern, l->pool + l->names[i], 1))
+				FillFindData(&l->ents[i], DokanFileInfo);
+		dir_listing_put(l);
+		return 0;
+	}
 	find_data.fill_find = FillFindData;
 	find_data.finfo = DokanFileInfo;
 
-	vfs_dir_iterate(fs, filePath, list_all_files, &find_data);
+	vfs_dir_iterate_pattern(fs, filePath, pattern, 1, list_all_files, &find_data);
 	return 0;
 }
 
@@ -419,9 +762,9 @@ static int __GetVolumeInformation(
 		ep = "linuxfs";
 	}
 	utf8_to_utf16(ep, strlen(ep), VolumeNameBuffer, VolumeNameSize);
-	*VolumeSerialNumber = 0x19821215;
+	*VolumeSerialNumber = EOKAN_SERIAL;
 	*MaximumComponentLength = 256;
-	*FileSystemFlags = FILE_CASE_SENSITIVE_SEARCH |
+	*FileSystemFlags = (g_CaseFold ? 0 : FILE_CASE_SENSITIVE_SEARCH) |
 						FILE_CASE_PRESERVED_NAMES |
 						FILE_SUPPORTS_REMOTE_STORAGE |
 						FILE_UNICODE_ON_DISK |
@@ -482,7 +825,7 @@ int eokan_umount(int c)
 	return dokan_umount_ptr(wmount_point);
 }
 
-int eokan_main(filesys_t fs, int drive)
+int eokan_main(filesys_t fs, int drive, int casefold)
 {
 	int status;
 	WCHAR wmount_point[MAX_PATH];
@@ -506,6 +849,10 @@ int eokan_main(filesys_t fs, int drive)
 	dokanOptions->Options |= DOKAN_OPTION_KEEP_ALIVE;
 
 	dokanOptions->GlobalContext = (ULONG64)fs;
+	g_CaseFold = casefold;
+	g_DirLock = xmutex_create();
+	if (!g_DirLock)
+		return -1;
 
 	memset(dokanOperations, 0, sizeof *dokanOperations);
 	dokanOperations->CreateFile            = __CreateFile;
@@ -532,7 +879,7 @@ int eokan_main(filesys_t fs, int drive)
 	dokanOperations->GetVolumeInformation  = __GetVolumeInformation;
 	dokanOperations->Unmount               = __Unmount;
 	dokanOperations->GetDiskFreeSpace      = __GetDiskFreeSpace;
-	dokanOperations->FindFilesWithPattern  = NULL;
+	dokanOperations->FindFilesWithPattern  = __FindFilesWithPattern;
 	dokanOptions->MountPoint = wmount_point;
 
 	mount_point[0] = drive;
@@ -565,6 +912,13 @@ int eokan_main(filesys_t fs, int drive)
 		fprintf(stderr, "Unknown error: %d\n", status);
 		break;
 	}
+	while (g_Dirs.next != &g_Dirs) {
+		struct dir_listing *l = g_Dirs.next;
+
+		dir_listing_unlink(l);
+		dir_listing_put_locked(l);
+	}
+	xmutex_destroy(g_DirLock);
 	return 0;
 }
 
@@ -23,12 +23,16 @@
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include "disk.h"
 #include "fs.h"
 #include "util.h"
+#include "profile.h"
 
 #define EOKAN_SVCNAME TEXT("eokan_svc")
+#define EOKAN_CACHE_MB 64
+#define EOKAN_WARMUP_MS 30000
 static	SERVICE_STATUS_HANDLE   gSvcStatusHandle;
 static	SERVICE_STATUS			gSvcStatus;
 static  HANDLE                  ghSvcStopEvent = NULL;
@@ -503,6 +507,10 @@ static void print_usage()
 	printf("    -s, --service: service mode (default this mode).\n");
 	printf("    -d, --disk: disk type [vmdk, physical]\n");
 	printf("    -p, --part: disk partition number, 1, 2, 3 ...\n");
+	printf("    -c, --cache: partition cache size in MB, 0 disables (default %d).\n", EOKAN_CACHE_MB);
+	printf("    -w, --warmup: load directory metadata into the cache after mount.\n");
+	printf("    -n, --nocase: look paths up regardless of case.\n");
+	printf("    -l, --profile-dir: where access profiles and metadata snapshots are kept\n\t(default: beside eokan).\n");
 	printf("    disk_path: is vmdk file path or physical disk path. like:\n\t(\\\\.\\PhysicalDrive0 or \\\\.\\PhysicalDrive1, ...)\n");
 }
 
@@ -512,9 +520,11 @@ int main(int argc, char *argv[])
 	disk_descr_t disk;
 	filesys_t  fs;
 	int part = 1;
+	int cache_mb = EOKAN_CACHE_MB;
+	char profile_dir[MAX_PATH] = "", profile[MAX_PATH] = "", snapshot[MAX_PATH];
 	part_descr_t partition;
 	const char *disk_type = "physical";
-	int iflag = 0, rflag = 0, uflag = 0, sflag = 0, mflag = 0;
+	int iflag = 0, rflag = 0, uflag = 0, sflag = 0, mflag = 0, wflag = 0, nflag = 0;
 	SERVICE_TABLE_ENTRY svc_dispatch_table[] = {
 		{EOKAN_SVCNAME, eokan_svc_main},
 		{NULL, NULL}
@@ -528,10 +538,14 @@ int main(int argc, char *argv[])
 		{"umount", required_argument, NULL, 'u'},
 		{"mountpoint", required_argument, NULL, 'm'},
 		{"service", no_argument, NULL, 's'},
+		{"cache", required_argument, NULL, 'c'},
+		{"warmup", no_argument, NULL, 'w'},
+		{"nocase", no_argument, NULL, 'n'},
+		{"profile-dir", required_argument, NULL, 'l'},
 		{NULL, 0, NULL, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "hird:p:u:sm:", long_options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hird:p:u:sm:c:wnl:", long_options, NULL)) != -1) {
 		switch (c) {
 			case 'h':
 				print_usage();
@@ -557,6 +571,18 @@ int main(int argc, char *argv[])
 			case 'm':
 				mflag = optarg[0];
 				break;
+			case 'c':
+				cache_mb = atoi(optarg);
+				break;
+			case 'w':
+				wflag = 1;
+				break;
+			case 'n':
+				nflag = 1;
+				break;
+			case 'l':
+				snprintf(profile_dir, sizeof profile_dir, "%s", optarg);
+				break;
 		};
 	}
 
@@ -599,12 +625,31 @@ int main(int argc, char *argv[])
 		goto skip;
 	}
 	printf("parition: %d, offset: %I64u, length: %I64u\n", part, partition->off, partition->length);
+	if (cache_mb > 0 && part_set_cache(partition, (uint64_t)cache_mb << 20) == 0)
+		profile_record(partition);
 	if ((fs = vfs_mount(partition)) == NULL) {
 		retval = -3;
 		part_close(partition);
 		goto skip;
 	}
-	eokan_main(fs, mflag ? mflag : find_valid_drive('C'));
+	if (!profile_dir[0] && GetModuleFileNameA(NULL, profile_dir, sizeof profile_dir)) {
+		char *sep = strrchr(profile_dir, '\\');
+
+		if (sep)
+			*sep = '\0';
+	}
+	/* Leave half of the cache for demand reads. */
+	if (cache_mb > 0 && profile_path(fs, profile_dir, ".prof", profile, sizeof profile) == 0)
+		profile_replay(partition, profile, (uint64_t)cache_mb << 19);
+	if (profile_path(fs, profile_dir, ".snap", snapshot, sizeof snapshot) == 0)
+		vfs_snapshot(fs, snapshot);
+	if (wflag && cache_mb > 0)
+		vfs_warmup(fs, EOKAN_WARMUP_MS, (uint64_t)cache_mb << 19);
+	if (nflag && vfs_casefold(fs, 1))
+		nflag = 0;
+	eokan_main(fs, mflag ? mflag : find_valid_drive('C'), nflag);
+	if (profile[0])
+		profile_save(partition, profile);
 	vfs_umount(fs);
 	part_close(partition);
 skip:
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+#define EOTOOL_CACHE_MB 64
+#ifdef _WIN32
+#define EOTOOL_DISK "physical"
+#else
+#define EOTOOL_DISK "image"
+#endif
+
+/*
+ * Offline tools working on a disk through the vfs layer, without Dokan:
+ *   catalog  list every path with its inode and size
+ *   image    copy the blocks in use to a sparse file or a stream
+ *   diff     list the paths that changed between two images
+ *   export   copy a subtree out with its times
+ *   tar      archive a subtree as a pax stream
+ *   hash     hash the content of every file
+ *   grep     search file contents for fixed strings
+ *   find     list the files whose attributes match a query
+ *   owner    find the files that own ranges of the partition
+ *   du       sum up the disk usage of every directory
+ */
+FILE *eotool_create(const char *path, int sparse)
+{
+	FILE *fp;
+
+	if (strcmp(path, "-") == 0) {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		return stdout;
+	}
+	fp = fopen(path, "wb");
+	if (!fp) {
+		fprintf(stderr, "can't create: %s\n", path);
+		return NULL;
+	}
+#ifdef _WIN32
+	if (sparse) {
+		DWORD n;
+
+		DeviceIoControl((HANDLE)_get_osfhandle(_fileno(fp)), FSCTL_SET_SPARSE,
+				NULL, 0, NULL, 0, &n, NULL);
+	}
+#endif
+	return fp;
+}
+
+/* Nonzero if anything written to fp was lost. */
+int eotool_close(FILE *fp)
+{
+	int error = ferror(fp);
+
+	if (fp != stdout)
+		return fclose(fp) || error;
+	return fflush(fp) || error;
+}
+
+int eotool_open(struct eotool *tool, const char *path, struct eotool_volume *vol)
+{
+	memset(vol, 0, sizeof *vol);
+	vol->disk = disk_open(tool->disk_type, path, DISK_FLAG_READ);
+	if (!vol->disk) {
+		fprintf(stderr, "can't open disk: %s %s\n", tool->disk_type, path);
+		return -1;
+	}
+	vol->part = disk_get_partition(vol->disk, tool->partno);
+	if (!vol->part) {
+		fprintf(stderr, "can't find partition: %d\n", tool->partno);
+		disk_close(vol->disk);
+		return -2;
+	}
+	if (tool->cache_mb > 0)
+		part_set_cache(vol->part, (uint64_t)tool->cache_mb << 20);
+	if ((vol->fs = vfs_mount(vol->part)) == NULL) {
+		part_close(vol->part);
+		disk_close(vol->disk);
+		return -3;
+	}
+	return 0;
+}
+
+void eotool_release(struct eotool_volume *vol)
+{
+	vfs_umount(vol->fs);
+	part_close(vol->part);
+	disk_close(vol->disk);
+}
+
+uint64_t eotool_rate(uint64_t bytes, uint64_t ms)
+{
+	return ms ? bytes * 1000 / ms : bytes;
+}
+
+static int catalog_entry(void *arg, const char *path, uint32_t parent, struct xstat *st)
+{
+	struct eotool *tool = arg;
+
+	tool->count++;
+	fprintf(tool->out, "%s\t%" PRIu32 "\t%" PRIu64 "\n", path, st->ino, st->size);
+	return ferror(tool->out);
+}
+
+static int eotool_catalog(struct eotool *tool, int argc, char *argv[])
+{
+	uint64_t start = xclock_ms();
+	int retval;
+
+	retval = vfs_catalog(tool->vol.fs, tool->threads, catalog_entry, tool);
+	fprintf(stderr, "%" PRIu64 " entries in %" PRIu64 " ms\n", tool->count, xclock_ms() - start);
+	return retval;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(struct eotool *, int argc, char *argv[]);
+} commands[] = {
+	{"catalog", eotool_catalog},
+	{"image", eotool_image},
+	{"diff", eotool_diff},
+	{"export", eotool_export},
+	{"tar", eotool_tar},
+	{"hash", eotool_hash},
+	{"grep", eotool_grep},
+	{"find", eotool_find},
+	{"owner", eotool_owner},
+	{"du", eotool_du},
+	{NULL, NULL}
+};
+
+static void print_usage()
+{
+	printf("usage: eotool [options] command disk_path [args]\n");
+	printf("    -h, --help: print this message\n");
+	printf("    -d, --disk: disk type [vmdk, physical, image] (default %s)\n", EOTOOL_DISK);
+	printf("    -p, --part: disk partition number, 1, 2, 3 ..., 0 for the whole disk\n");
+	printf("    -c, --cache: partition cache size in MB, 0 disables (default %d).\n", EOTOOL_CACHE_MB);
+	printf("    -t, --threads: worker threads (default: one per CPU).\n");
+	printf("    -o, --output: write results to this file instead of stdout.\n");
+	printf("commands:\n");
+	printf("    catalog: list every path with its inode number and size.\n");
+	printf("    image <dest>: copy the blocks in use to a sparse raw file,\n\tor to stdout as framed runs if dest is \"-\".\n");
+	printf("    diff <new_disk>: list paths added (A), deleted (D), modified (M)\n\tor with changed attributes only (m) since disk_path.\n");
+	printf("    export <path> <dest>: copy a directory tree out of the image;\n\tsymlinks and special files are skipped.\n");
+	printf("    tar <path> <dest>: archive a directory tree in pax format to a file,\n\tto stdout if dest is \"-\", or through zstd if dest ends in .zst.\n");
+	printf("    hash [path]: print the SHA-256 and XXH3 hashes, size and path\n\tof every file below path.\n");
+	printf("    grep [-i] <path> <pattern|@file> ...: print path:offset:pattern for every\n\tmatch of the strings in files below path; @file reads one per line.\n");
+	printf("    find [path] [tests]: print path, inode, size, mtime, uid and gid of the\n\tentries below path that pass every test: -type f|d|l|p|s|c|b,\n\t-size +N|-N|N (bytes, or k, M, G, T), -mtime -N|+N (modified within,\n\tor before, N days, or s, m, h, d), -uid N, -gid N.\n");
+	printf("    owner [-s] [-x index] <range> ...: print offset, length, inode, file offset\n\tand paths of the owners of each range, N, A-B or A+N in bytes of the\n\tpartition, or with -s in sectors of the disk; \"-\" marks free space and\n\tfilesystem metadata.  -x keeps the index in a file, reused until the filesystem changes.\n");
+	printf("    du [-u] [-d depth] [path]: print bytes allocated, bytes by size, inodes\n\tand path of every directory below path, with all it holds; sorted by\n\tpath, or by usage with -u.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, retval;
+	struct eotool tool;
+	const char *output = NULL;
+	const struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"disk", required_argument, NULL, 'd'},
+		{"part", required_argument, NULL, 'p'},
+		{"cache", required_argument, NULL, 'c'},
+		{"threads", required_argument, NULL, 't'},
+		{"output", required_argument, NULL, 'o'},
+		{NULL, 0, NULL, 0}
+	};
+
+	memset(&tool, 0, sizeof tool);
+	tool.disk_type = EOTOOL_DISK;
+	tool.partno = 1;
+	tool.cache_mb = EOTOOL_CACHE_MB;
+	while ((c = getopt_long(argc, argv, "+hd:p:c:t:o:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'h':
+				print_usage();
+				exit(0);
+			case 'd':
+				tool.disk_type = optarg;
+				break;
+			case 'p':
+				tool.partno = atoi(optarg);
+				break;
+			case 'c':
+				tool.cache_mb = atoi(optarg);
+				break;
+			case 't':
+				tool.threads = atoi(optarg);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			default:
+				print_usage();
+				return -1;
+		};
+	}
+
+	argv += optind;
+	argc -= optind;
+	if (argc < 2) {
+		print_usage();
+		return -1;
+	}
+	for (i = 0; commands[i].name; i++)
+		if (strcmp(commands[i].name, argv[0]) == 0)
+			break;
+	if (!commands[i].name) {
+		printf("unknown command: %s\n", argv[0]);
+		return -1;
+	}
+
+	tool.out = output ? fopen(output, "w") : stdout;
+	if (!tool.out) {
+		printf("can't create: %s\n", output);
+		return -1;
+	}
+	retval = eotool_open(&tool, argv[1], &tool.vol);
+	if (retval == 0) {
+		if (commands[i].run(&tool, argc - 2, argv + 2))
+			retval = -4;
+		eotool_release(&tool.vol);
+	}
+	if (output)
+		fclose(tool.out);
+	return retval;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __XOKAN_EOTOOL_H__
+#define __XOKAN_EOTOOL_H__
+#include <stdio.h>
+#include <stdint.h>
+#include "disk.h"
+#include "fs.h"
+
+struct eotool_volume {
+	disk_descr_t disk;
+	part_descr_t part;
+	filesys_t    fs;
+};
+
+struct eotool {
+	struct eotool_volume vol;	/* the disk named on the command line */
+	const char  *disk_type;
+	int          partno;
+	int          cache_mb;
+	int          threads;
+	FILE        *out;
+	uint64_t     count;
+};
+
+/* Mount the configured partition of another disk, for two-volume tools. */
+int   eotool_open(struct eotool *, const char *path, struct eotool_volume *);
+void  eotool_release(struct eotool_volume *);
+
+/* Open an output file, "-" for stdout; binary, sparse if asked. */
+FILE *eotool_create(const char *path, int sparse);
+int   eotool_close(FILE *);
+/* Bytes per second, for reports. */
+uint64_t eotool_rate(uint64_t bytes, uint64_t ms);
+
+/*
+ * The regular files below a path, in order of their first physical block
+ * and cut into units of work: one large file, or a batch of small ones
+ * that lie next to each other.  Later names of a hard-linked inode follow
+ * the first one and are in no unit.
+ */
+#define EOTOOL_SMALL		(256 << 10)	/* files batched below this size */
+#define EOTOOL_BATCH		(8 << 20)	/* data per batch */
+#define EOTOOL_BATCH_FILES	1024
+
+struct eotool_file {
+	char    *path;
+	uint32_t ino;
+	uint16_t nlinks;
+	int      link;		/* same inode as the file before */
+	uint64_t size;
+	uint64_t first;		/* first physical byte and length of its run */
+	uint64_t first_len;
+};
+
+struct eotool_unit {
+	size_t   start, end;	/* files */
+};
+
+struct eotool_files {
+	struct eotool_file *files;
+	size_t   nr_files, max_files;
+	struct eotool_unit *units;
+	size_t   nr_units, max_units;
+};
+
+int   eotool_list_files(struct eotool *, const char *path, struct eotool_files *);
+void  eotool_prefetch_unit(struct eotool *, struct eotool_files *, struct eotool_unit *);
+void  eotool_free_files(struct eotool_files *);
+
+int eotool_image(struct eotool *, int argc, char *argv[]);
+int eotool_diff(struct eotool *, int argc, char *argv[]);
+int eotool_export(struct eotool *, int argc, char *argv[]);
+int eotool_tar(struct eotool *, int argc, char *argv[]);
+int eotool_hash(struct eotool *, int argc, char *argv[]);
+int eotool_grep(struct eotool *, int argc, char *argv[]);
+int eotool_find(struct eotool *, int argc, char *argv[]);
+int eotool_owner(struct eotool *, int argc, char *argv[]);
+int eotool_du(struct eotool *, int argc, char *argv[]);
+
+#endif
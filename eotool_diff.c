@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+/*
+ * Compare two images of the same filesystem, such as daily snapshots of
+ * one guest, using metadata only:
+ *
+ * 1. Both inode tables are scanned, and the inodes whose attributes or
+ *    times differ are noted.  Nothing else can have changed.
+ * 2. Both directory trees are catalogued, keeping the entries that name a
+ *    changed inode or live in a changed directory.  A directory found on
+ *    one side only is walked, so a moved tree is listed in full.  Merging
+ *    the two path lists gives the paths added and deleted.
+ * 3. A path on both sides whose inode changed is modified when its type,
+ *    size or mtime moved.  When only ctime or attributes moved, the
+ *    extent maps are compared, and file data is read only for the ranges
+ *    that map to different blocks.
+ */
+#define DIFF_IO		(1 << 20)	/* bytes per read when comparing data */
+#define DIFF_EXTENTS	32
+
+struct diff_inode {
+	uint32_t ino;
+	uint16_t mode;
+	uint16_t nlinks;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	int64_t  mtime;		/* ns */
+	int64_t  ctime;
+	int64_t  crtime;
+};
+
+struct diff_path {
+	char    *path;
+	uint32_t ino;
+};
+
+struct diff;
+
+struct diff_side {
+	struct diff *diff;
+	struct eotool_volume *vol;
+	struct diff_inode *inodes;
+	size_t   nr_inodes, max_inodes;
+	struct diff_path *paths;
+	size_t   nr_paths, max_paths;
+	int      error;
+};
+
+struct diff {
+	struct eotool *tool;
+	struct diff_side side[2];	/* old, new */
+	uint32_t *changed;		/* inodes that differ, sorted */
+	size_t   nr_changed, max_changed;
+	uint32_t *dirs;			/* directories among them */
+	size_t   nr_dirs, max_dirs;
+	char    *buf[2];
+	uint64_t count[4];
+};
+
+#define DIFF_OLD	0
+#define DIFF_NEW	1
+
+static const char diff_kinds[] = "ADMm";
+#define DIFF_ADDED	0
+#define DIFF_DELETED	1
+#define DIFF_MODIFIED	2
+#define DIFF_ATTRS	3	/* attributes or location of data only */
+
+static int64_t diff_time(struct xtimespec *ts)
+{
+	return ts->sec * 1000000000 + ts->nsec;
+}
+
+static int diff_cmp_inode(const void *a, const void *b)
+{
+	const struct diff_inode *x = a, *y = b;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int diff_cmp_ino(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+static int diff_cmp_path(const void *a, const void *b)
+{
+	const struct diff_path *x = a, *y = b;
+
+	return strcmp(x->path, y->path);
+}
+
+static int diff_add_inode(void *arg, struct xstat *st)
+{
+	struct diff_side *side = arg;
+	struct diff_inode *di;
+
+	if (!xgrow((void **)&side->inodes, &side->max_inodes, side->nr_inodes + 1, sizeof *di))
+		return side->error = 1;
+	di = &side->inodes[side->nr_inodes++];
+	di->ino    = st->ino;
+	di->mode   = st->mode;
+	di->nlinks = st->nlinks;
+	di->uid    = st->uid;
+	di->gid    = st->gid;
+	di->size   = st->size;
+	di->mtime  = diff_time(&st->mtime);
+	di->ctime  = diff_time(&st->ctime);
+	di->crtime = diff_time(&st->crtime);
+	return 0;
+}
+
+static struct diff_inode *diff_find_inode(struct diff_side *side, uint32_t ino)
+{
+	struct diff_inode key;
+
+	key.ino = ino;
+	return bsearch(&key, side->inodes, side->nr_inodes, sizeof key, diff_cmp_inode);
+}
+
+static int diff_note(struct diff *d, const struct diff_inode *a, const struct diff_inode *b)
+{
+	uint32_t ino = a ? a->ino : b->ino;
+
+	if (!xgrow((void **)&d->changed, &d->max_changed, d->nr_changed + 1, sizeof ino))
+		return 1;
+	d->changed[d->nr_changed++] = ino;
+	if ((a && S_ISDIR(a->mode)) || (b && S_ISDIR(b->mode))) {
+		if (!xgrow((void **)&d->dirs, &d->max_dirs, d->nr_dirs + 1, sizeof ino))
+			return 1;
+		d->dirs[d->nr_dirs++] = ino;
+	}
+	return 0;
+}
+
+/* Walk both inode lists in ino order and note every difference. */
+static int diff_inodes(struct diff *d)
+{
+	struct diff_side *o = &d->side[DIFF_OLD], *n = &d->side[DIFF_NEW];
+	struct diff_inode *a, *b;
+	size_t i = 0, j = 0;
+
+	while (i < o->nr_inodes || j < n->nr_inodes) {
+		a = i < o->nr_inodes ? &o->inodes[i] : NULL;
+		b = j < n->nr_inodes ? &n->inodes[j] : NULL;
+		if (a && b && a->ino == b->ino) {
+			i++;
+			j++;
+			if (!memcmp(a, b, sizeof *a))
+				continue;
+		} else if (a && (!b || a->ino < b->ino)) {
+			i++;
+			b = NULL;
+		} else {
+			j++;
+			a = NULL;
+		}
+		if (diff_note(d, a, b))
+			return 1;
+	}
+	return 0;
+}
+
+static int diff_keep(struct diff_side *side, const char *path, uint32_t ino)
+{
+	struct diff_path *dp;
+
+	if (!xgrow((void **)&side->paths, &side->max_paths, side->nr_paths + 1, sizeof *dp))
+		return side->error = 1;
+	dp = &side->paths[side->nr_paths];
+	dp->path = strdup(path);
+	dp->ino = ino;
+	if (!dp->path)
+		return side->error = 1;
+	side->nr_paths++;
+	return 0;
+}
+
+static int diff_add_path(void *arg, const char *path, uint32_t parent, struct xstat *st)
+{
+	struct diff_side *side = arg;
+	struct diff *d = side->diff;
+
+	if (!bsearch(&parent, d->dirs, d->nr_dirs, sizeof parent, diff_cmp_ino) &&
+	    !bsearch(&st->ino, d->changed, d->nr_changed, sizeof st->ino, diff_cmp_ino))
+		return 0;
+	return diff_keep(side, path, st->ino);
+}
+
+struct diff_walk {
+	struct diff_side *side;
+	const char *dir;
+	char   **stack;
+	size_t   nr_stack, max_stack;
+};
+
+static int diff_walk_entry(void *arg, const char *name, struct xstat *st, int is_dir)
+{
+	struct diff_walk *w = arg;
+	char *path;
+
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return 0;
+	path = malloc(strlen(w->dir) + strlen(name) + 2);
+	if (!path)
+		return w->side->error = 1;
+	sprintf(path, "%s/%s", w->dir, name);
+	if (diff_keep(w->side, path, st->ino)) {
+		free(path);
+		return 1;
+	}
+	if (is_dir) {
+		if (!xgrow((void **)&w->stack, &w->max_stack, w->nr_stack + 1, sizeof *w->stack)) {
+			free(path);
+			return w->side->error = 1;
+		}
+		w->stack[w->nr_stack++] = path;
+		return 0;
+	}
+	free(path);
+	return 0;
+}
+
+/* Keep every path below dir, which exists on this side only. */
+static int diff_walk(struct diff_side *side, const char *top)
+{
+	struct diff_walk w;
+	char *dir;
+	int retval = 0;
+
+	memset(&w, 0, sizeof w);
+	w.side = side;
+	dir = strdup(top);
+	if (!dir || !xgrow((void **)&w.stack, &w.max_stack, 1, sizeof *w.stack)) {
+		free(dir);
+		return side->error = 1;
+	}
+	w.stack[w.nr_stack++] = dir;
+	while (w.nr_stack) {
+		dir = w.stack[--w.nr_stack];
+		w.dir = dir;
+		if (!retval && (vfs_dir_iterate(side->vol->fs, dir, diff_walk_entry, &w) || side->error)) {
+			fprintf(stderr, "diff: can't list %s\n", dir);
+			retval = 1;
+		}
+		free(dir);
+	}
+	free(w.stack);
+	return retval;
+}
+
+static int diff_cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* 1 if an ancestor of path is among the sorted tops. */
+static int diff_below(char **tops, size_t n, const char *path)
+{
+	char *parent, *slash;
+	int found = 0;
+
+	parent = strdup(path);
+	if (!parent)
+		return 0;
+	while (!found && (slash = strrchr(parent, '/')) && slash != parent) {
+		*slash = 0;
+		found = bsearch(&parent, tops, n, sizeof *tops, diff_cmp_str) != NULL;
+	}
+	free(parent);
+	return found;
+}
+
+/*
+ * A directory only one side has takes its whole subtree with it, though
+ * entries in unchanged directories below it were not catalogued.  Find
+ * the topmost such directories on both sides, walk them, and sort the
+ * path lists again without duplicates.
+ */
+static int diff_subtrees(struct diff *d)
+{
+	struct diff_side *side, *other;
+	struct diff_inode *di;
+	char **tops[2] = { NULL, NULL };
+	size_t nr_tops[2] = { 0, 0 }, max_tops[2] = { 0, 0 };
+	size_t i, j, k;
+	int s, c, retval = 1;
+
+	for (s = 0; s < 2; s++) {
+		side = &d->side[s];
+		other = &d->side[!s];
+		for (i = j = 0; i < side->nr_paths; i++) {
+			c = 1;
+			while (j < other->nr_paths &&
+			       (c = strcmp(other->paths[j].path, side->paths[i].path)) < 0)
+				j++;
+			if (c == 0)
+				continue;
+			di = diff_find_inode(side, side->paths[i].ino);
+			if (!di || !S_ISDIR(di->mode) ||
+			    diff_below(tops[s], nr_tops[s], side->paths[i].path))
+				continue;
+			if (!xgrow((void **)&tops[s], &max_tops[s], nr_tops[s] + 1, sizeof *tops[s]))
+				goto out;
+			tops[s][nr_tops[s]++] = side->paths[i].path;
+		}
+	}
+
+	for (s = 0; s < 2; s++) {
+		side = &d->side[s];
+		for (i = 0; i < nr_tops[s]; i++)
+			if (diff_walk(side, tops[s][i]))
+				goto out;
+		if (!nr_tops[s])
+			continue;
+		qsort(side->paths, side->nr_paths, sizeof *side->paths, diff_cmp_path);
+		for (i = k = 0; i < side->nr_paths; i++) {
+			if (k && !strcmp(side->paths[k - 1].path, side->paths[i].path)) {
+				free(side->paths[i].path);
+				continue;
+			}
+			side->paths[k++] = side->paths[i];
+		}
+		side->nr_paths = k;
+	}
+	retval = 0;
+out:
+	free(tops[0]);
+	free(tops[1]);
+	return retval;
+}
+
+struct diff_cursor {
+	file_entry_t file;
+	filesys_t fs;
+	struct xextent ext[DIFF_EXTENTS];
+	int n, i;
+};
+
+/* The extent holding pos; positions only move forward. */
+static struct xextent *diff_extent(struct diff_cursor *c, uint64_t pos)
+{
+	while (c->i < c->n && c->ext[c->i].logical + c->ext[c->i].length <= pos)
+		c->i++;
+	if (c->i == c->n) {
+		c->n = vfs_file_extent_map(c->file, c->fs, pos, c->ext, DIFF_EXTENTS);
+		c->i = 0;
+		if (c->n <= 0)
+			return NULL;
+	}
+	return &c->ext[c->i];
+}
+
+static int diff_same_blocks(struct xextent *a, struct xextent *b, uint64_t pos)
+{
+	uint32_t fa = a->flags & ~XEXTENT_LAST, fb = b->flags & ~XEXTENT_LAST;
+
+	if (fa != fb || (fa & XEXTENT_INLINE))
+		return 0;
+	if (fa & (XEXTENT_HOLE | XEXTENT_UNWRITTEN))
+		return 1;
+	return a->physical + (pos - a->logical) == b->physical + (pos - b->logical);
+}
+
+/* 1 if the data of two same-sized files differs, -1 on error. */
+static int diff_contents(struct diff *d, file_entry_t *f, uint64_t size)
+{
+	struct diff_cursor c[2];
+	struct xextent *a, *b;
+	uint64_t pos = 0, end;
+	unsigned len;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		c[i].file = f[i];
+		c[i].fs = d->side[i].vol->fs;
+		c[i].n = c[i].i = 0;
+	}
+	while (pos < size) {
+		a = diff_extent(&c[0], pos);
+		b = diff_extent(&c[1], pos);
+		if (!a || !b)
+			return -1;
+		end = MIN(a->logical + a->length, b->logical + b->length);
+		if (diff_same_blocks(a, b, pos)) {
+			pos = end;
+			continue;
+		}
+		for (; pos < end; pos += len) {
+			len = MIN(end - pos, DIFF_IO);
+			for (i = 0; i < 2; i++)
+				if (vfs_file_read(f[i], d->side[i].vol->fs, pos, d->buf[i], len) != (int)len)
+					return -1;
+			if (memcmp(d->buf[0], d->buf[1], len))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* How a path that exists in both images changed, or -1 if it did not. */
+static int diff_classify(struct diff *d, const char *path, uint32_t ino_old, uint32_t ino_new)
+{
+	struct diff_inode *a, *b;
+	file_entry_t f[2];
+	int i, kind;
+
+	if (ino_old != ino_new)
+		return DIFF_MODIFIED;
+	if (!bsearch(&ino_new, d->changed, d->nr_changed, sizeof ino_new, diff_cmp_ino))
+		return -1;
+	a = diff_find_inode(&d->side[DIFF_OLD], ino_old);
+	b = diff_find_inode(&d->side[DIFF_NEW], ino_new);
+	if (!a || !b || ((a->mode ^ b->mode) & S_IFMT) || a->crtime != b->crtime ||
+	    a->size != b->size || a->mtime != b->mtime)
+		return DIFF_MODIFIED;
+	if (!S_ISREG(b->mode))
+		return DIFF_ATTRS;
+
+	for (i = 0; i < 2; i++)
+		f[i] = vfs_open(d->side[i].vol->fs, path);
+	kind = DIFF_MODIFIED;
+	if (f[0] && f[1]) {
+		switch (diff_contents(d, f, b->size)) {
+		case 0:
+			kind = DIFF_ATTRS;
+			break;
+		case -1:
+			fprintf(stderr, "diff: can't compare %s\n", path);
+			break;
+		}
+	}
+	for (i = 0; i < 2; i++)
+		if (f[i])
+			vfs_file_close(f[i], d->side[i].vol->fs);
+	return kind;
+}
+
+static int diff_emit(struct diff *d, int kind, const char *path)
+{
+	d->count[kind]++;
+	fprintf(d->tool->out, "%c\t%s\n", diff_kinds[kind], path);
+	return ferror(d->tool->out);
+}
+
+/* Merge the sorted path lists of both sides. */
+static int diff_paths(struct diff *d)
+{
+	struct diff_side *o = &d->side[DIFF_OLD], *n = &d->side[DIFF_NEW];
+	size_t i = 0, j = 0;
+	int c, kind;
+
+	while (i < o->nr_paths || j < n->nr_paths) {
+		if (i == o->nr_paths)
+			c = 1;
+		else if (j == n->nr_paths)
+			c = -1;
+		else
+			c = strcmp(o->paths[i].path, n->paths[j].path);
+
+		if (c < 0) {
+			if (diff_emit(d, DIFF_DELETED, o->paths[i].path))
+				return 1;
+			i++;
+		} else if (c > 0) {
+			if (diff_emit(d, DIFF_ADDED, n->paths[j].path))
+				return 1;
+			j++;
+		} else {
+			kind = diff_classify(d, n->paths[j].path, o->paths[i].ino, n->paths[j].ino);
+			if (kind >= 0 && diff_emit(d, kind, n->paths[j].path))
+				return 1;
+			i++;
+			j++;
+		}
+	}
+	return 0;
+}
+
+static void diff_free(struct diff *d)
+{
+	struct diff_side *side;
+	size_t j;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		side = &d->side[i];
+		for (j = 0; j < side->nr_paths; j++)
+			free(side->paths[j].path);
+		free(side->paths);
+		free(side->inodes);
+		free(d->buf[i]);
+	}
+	free(d->changed);
+	free(d->dirs);
+}
+
+int eotool_diff(struct eotool *tool, int argc, char *argv[])
+{
+	struct eotool_volume vol;
+	struct diff d;
+	uint64_t start = xclock_ms();
+	int i, retval = 1;
+
+	if (argc < 1) {
+		fprintf(stderr, "diff: missing the newer disk\n");
+		return 1;
+	}
+	if (eotool_open(tool, argv[0], &vol))
+		return 1;
+
+	memset(&d, 0, sizeof d);
+	d.tool = tool;
+	d.side[DIFF_OLD].vol = &tool->vol;
+	d.side[DIFF_NEW].vol = &vol;
+	for (i = 0; i < 2; i++) {
+		d.side[i].diff = &d;
+		d.buf[i] = malloc(DIFF_IO);
+		if (!d.buf[i])
+			goto out;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (vfs_scan_inodes(d.side[i].vol->fs, tool->threads, diff_add_inode, &d.side[i]) ||
+		    d.side[i].error)
+			goto out;
+		qsort(d.side[i].inodes, d.side[i].nr_inodes, sizeof *d.side[i].inodes, diff_cmp_inode);
+	}
+	if (diff_inodes(&d))
+		goto out;
+	fprintf(stderr, "%" PRIu64 " + %" PRIu64 " inodes, %" PRIu64 " changed\n",
+		(uint64_t)d.side[DIFF_OLD].nr_inodes, (uint64_t)d.side[DIFF_NEW].nr_inodes,
+		(uint64_t)d.nr_changed);
+
+	if (d.nr_changed) {
+		for (i = 0; i < 2; i++) {
+			if (vfs_catalog(d.side[i].vol->fs, tool->threads, diff_add_path, &d.side[i]) ||
+			    d.side[i].error)
+				goto out;
+			qsort(d.side[i].paths, d.side[i].nr_paths, sizeof *d.side[i].paths, diff_cmp_path);
+		}
+		if (diff_subtrees(&d) || diff_paths(&d))
+			goto out;
+	}
+	retval = 0;
+	fprintf(stderr, "%" PRIu64 " added, %" PRIu64 " deleted, %" PRIu64 " modified, "
+		"%" PRIu64 " attributes only, in %" PRIu64 " ms\n",
+		d.count[DIFF_ADDED], d.count[DIFF_DELETED], d.count[DIFF_MODIFIED],
+		d.count[DIFF_ATTRS], xclock_ms() - start);
+out:
+	if (retval)
+		fprintf(stderr, "diff: failed\n");
+	diff_free(&d);
+	eotool_release(&vol);
+	return retval;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+/*
+ * Disk usage per directory from the catalog: the sizes and block counts
+ * come from the inode scan and the tree from the directory entries, so
+ * the totals are summed in memory, from the deepest directories up,
+ * without a stat per entry.  A file with several links counts once, in
+ * the directory with the lowest inode number that holds it.
+ */
+struct du_sum {
+	uint64_t usage;		/* bytes allocated */
+	uint64_t apparent;	/* bytes by size */
+	uint64_t inodes;
+};
+
+struct du_dir {
+	uint32_t ino;
+	uint32_t parent;	/* 0 for the root */
+	int      depth;
+	char    *path;
+	struct du_sum sum;
+};
+
+/* Totals of the files in one directory. */
+struct du_group {
+	uint32_t parent;
+	struct du_sum sum;
+};
+
+struct du_link {
+	uint32_t ino;
+	uint32_t parent;
+	struct du_sum sum;
+};
+
+struct du {
+	struct du_dir *dirs;
+	size_t   nr_dirs, max_dirs;
+	struct du_group *groups;
+	size_t   nr_groups, max_groups;
+	struct du_link *links;
+	size_t   nr_links, max_links;
+	uint32_t root;
+	uint64_t entries;
+	int      failed;
+};
+
+static void du_add(struct du_sum *sum, const struct du_sum *add)
+{
+	sum->usage    += add->usage;
+	sum->apparent += add->apparent;
+	sum->inodes   += add->inodes;
+}
+
+static int du_slashes(const char *path)
+{
+	int n = 0;
+
+	for (; *path; path++)
+		n += *path == '/';
+	return n;
+}
+
+static int du_add_dir(struct du *du, uint32_t ino, uint32_t parent, const char *path)
+{
+	struct du_dir *d;
+
+	if (!xgrow((void **)&du->dirs, &du->max_dirs, du->nr_dirs + 1, sizeof *d))
+		return du->failed = 1;
+	d = &du->dirs[du->nr_dirs];
+	memset(d, 0, sizeof *d);
+	d->ino = ino;
+	d->parent = parent;
+	d->path = strdup(path);
+	if (!d->path)
+		return du->failed = 1;
+	d->depth = parent ? du_slashes(path) : 0;
+	du->nr_dirs++;
+	return 0;
+}
+
+static int du_entry(void *arg, const char *path, uint32_t parent, struct xstat *st)
+{
+	struct du *du = arg;
+	struct du_sum sum = { st->blocks * 512, st->size, 1 };
+	struct du_group *g;
+	struct du_link *l;
+
+	du->entries++;
+	/* The catalog has no entry for the root; it is the parent of "/name". */
+	if (!du->root && !strchr(path + 1, '/')) {
+		du->root = parent;
+		if (du_add_dir(du, parent, 0, "/"))
+			return 1;
+	}
+	if (S_ISDIR(st->mode)) {
+		if (du_add_dir(du, st->ino, parent, path))
+			return 1;
+		du->dirs[du->nr_dirs - 1].sum = sum;
+		return 0;
+	}
+	if (st->nlinks > 1) {
+		if (!xgrow((void **)&du->links, &du->max_links, du->nr_links + 1, sizeof *l))
+			return du->failed = 1;
+		l = &du->links[du->nr_links++];
+		l->ino = st->ino;
+		l->parent = parent;
+		l->sum = sum;
+		return 0;
+	}
+	/* Entries come grouped by directory. */
+	if (!du->nr_groups || du->groups[du->nr_groups - 1].parent != parent) {
+		if (!xgrow((void **)&du->groups, &du->max_groups, du->nr_groups + 1, sizeof *g))
+			return du->failed = 1;
+		g = &du->groups[du->nr_groups++];
+		memset(g, 0, sizeof *g);
+		g->parent = parent;
+	}
+	du_add(&du->groups[du->nr_groups - 1].sum, &sum);
+	return 0;
+}
+
+/* The root's own inode, from its "." entry. */
+static int du_root(void *arg, const char *name, struct xstat *st, int is_dir)
+{
+	struct du_sum *sum = arg;
+
+	if (strcmp(name, ".") != 0)
+		return 0;
+	sum->usage = st->blocks * 512;
+	sum->apparent = st->size;
+	sum->inodes = 1;
+	return 1;
+}
+
+static int du_cmp_ino(const void *a, const void *b)
+{
+	const struct du_dir *x = a, *y = b;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int du_cmp_link(const void *a, const void *b)
+{
+	const struct du_link *x = a, *y = b;
+
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return x->parent < y->parent ? -1 : x->parent > y->parent;
+}
+
+static int du_cmp_depth(const void *a, const void *b)
+{
+	const struct du_dir *x = *(const struct du_dir **)a, *y = *(const struct du_dir **)b;
+
+	return y->depth - x->depth;
+}
+
+static int du_cmp_path(const void *a, const void *b)
+{
+	const struct du_dir *x = *(const struct du_dir **)a, *y = *(const struct du_dir **)b;
+
+	return strcmp(x->path, y->path);
+}
+
+static int du_cmp_usage(const void *a, const void *b)
+{
+	const struct du_dir *x = *(const struct du_dir **)a, *y = *(const struct du_dir **)b;
+
+	if (x->sum.usage != y->sum.usage)
+		return x->sum.usage > y->sum.usage ? -1 : 1;
+	return strcmp(x->path, y->path);
+}
+
+static struct du_dir *du_find(struct du *du, uint32_t ino)
+{
+	struct du_dir key;
+
+	key.ino = ino;
+	return bsearch(&key, du->dirs, du->nr_dirs, sizeof key, du_cmp_ino);
+}
+
+/* Put the files in their directories, then add each directory to its parent. */
+static void du_sum_up(struct du *du, struct du_dir **order)
+{
+	struct du_dir *d;
+	size_t i;
+
+	qsort(du->dirs, du->nr_dirs, sizeof *du->dirs, du_cmp_ino);
+	for (i = 0; i < du->nr_groups; i++)
+		if ((d = du_find(du, du->groups[i].parent)) != NULL)
+			du_add(&d->sum, &du->groups[i].sum);
+	qsort(du->links, du->nr_links, sizeof *du->links, du_cmp_link);
+	for (i = 0; i < du->nr_links; i++)
+		if ((i == 0 || du->links[i].ino != du->links[i - 1].ino) &&
+		    (d = du_find(du, du->links[i].parent)) != NULL)
+			du_add(&d->sum, &du->links[i].sum);
+
+	for (i = 0; i < du->nr_dirs; i++)
+		order[i] = &du->dirs[i];
+	qsort(order, du->nr_dirs, sizeof *order, du_cmp_depth);
+	for (i = 0; i < du->nr_dirs; i++)
+		if (order[i]->parent && (d = du_find(du, order[i]->parent)) != NULL)
+			du_add(&d->sum, &order[i]->sum);
+}
+
+int eotool_du(struct eotool *tool, int argc, char *argv[])
+{
+	struct du du;
+	struct du_dir **order = NULL, *d;
+	struct du_sum root;
+	const char *src = "/";
+	uint64_t start = xclock_ms();
+	size_t i, len;
+	int by_usage = 0, max_depth = -1, depth, retval = 1;
+
+	for (i = 0; i < (size_t)argc; i++) {
+		if (strcmp(argv[i], "-u") == 0)
+			by_usage = 1;
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < (size_t)argc)
+			max_depth = atoi(argv[++i]);
+		else if (argv[i][0] != '-')
+			src = argv[i];
+		else {
+			fprintf(stderr, "du: bad option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	for (len = strlen(src); len > 0 && src[len - 1] == '/'; len--)
+		;
+
+	memset(&du, 0, sizeof du);
+	if (vfs_catalog(tool->vol.fs, tool->threads, du_entry, &du) || du.failed) {
+		fprintf(stderr, "du: can't list the files\n");
+		goto out;
+	}
+	if (!du.root) {
+		/* An empty filesystem: the root is all there is. */
+		if (du_add_dir(&du, 1, 0, "/"))
+			goto out;
+	}
+	memset(&root, 0, sizeof root);
+	vfs_dir_iterate(tool->vol.fs, "/", du_root, &root);
+	for (i = 0; i < du.nr_dirs; i++)
+		if (!du.dirs[i].parent)
+			du.dirs[i].sum = root;
+
+	order = malloc(du.nr_dirs * sizeof *order);
+	if (!order)
+		goto out;
+	du_sum_up(&du, order);
+
+	qsort(order, du.nr_dirs, sizeof *order, by_usage ? du_cmp_usage : du_cmp_path);
+	for (i = 0; i < du.nr_dirs; i++) {
+		d = order[i];
+		if (len && (strncmp(d->path, src, len) || (d->path[len] != '/' && d->path[len] != '\0')))
+			continue;
+		depth = len ? du_slashes(d->path + len) : d->depth;
+		if (max_depth >= 0 && depth > max_depth)
+			continue;
+		fprintf(tool->out, "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n",
+			d->sum.usage, d->sum.apparent, d->sum.inodes, d->path);
+	}
+	retval = 0;
+	if (ferror(tool->out)) {
+		fprintf(stderr, "du: write error\n");
+		retval = 1;
+	}
+	fprintf(stderr, "%" PRIu64 " entries, %" PRIu64 " directories in %" PRIu64 " ms\n",
+		du.entries, (uint64_t)du.nr_dirs, xclock_ms() - start);
+out:
+	for (i = 0; i < du.nr_dirs; i++)
+		free(du.dirs[i].path);
+	free(du.dirs);
+	free(du.groups);
+	free(du.links);
+	free(order);
+	return retval;
+}
@@ -0,0 +1,633 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define export_mkdir(path, mode)	_mkdir(path)
+#define export_chmod(path, mode)	0
+#else
+#include <fcntl.h>
+#define export_mkdir(path, mode)	mkdir(path, (mode) | 0700)
+#define export_chmod(path, mode)	chmod(path, mode)
+#endif
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+/*
+ * Subtree export.  Directories are walked by a pool of threads that each
+ * keep a deque of directories to list and steal from the others when
+ * they run dry; the walk creates the directory tree and collects the
+ * files.  The files are then read in order of their first physical block
+ * by one reader, so the disk sees a mostly sequential stream, and the
+ * data is passed in pooled buffers to writer threads.  All chunks of a
+ * file go to the same writer, which writes it front to back and restores
+ * its times, to the nanosecond where the platform allows, and mode.
+ * Symlinks and special files are skipped and counted.
+ */
+#define EXPORT_IO	(1 << 20)	/* bytes per chunk */
+#define EXPORT_BUFS	4		/* chunks in flight per writer */
+
+struct export_file {
+	char    *path;		/* in the image */
+	uint64_t size;
+	uint64_t first;		/* first physical byte, orders the reads */
+	uint16_t mode;
+	struct xtimespec atime;
+	struct xtimespec mtime;
+	int      failed;	/* read side */
+	FILE    *fp;		/* write side, owned by one writer */
+	int      bad;
+};
+
+struct export_dir {
+	char    *path;
+	uint16_t mode;
+	struct xtimespec atime;
+	struct xtimespec mtime;
+};
+
+struct export_deque {
+	xmutex_t lock;
+	char   **jobs;
+	size_t   head, tail, max;
+};
+
+struct export_chunk {
+	struct export_file *file;
+	uint64_t off;
+	unsigned len;
+	int      last;
+	int      failed;		/* the file could not be read */
+	char    *buf;
+	struct export_chunk *next;
+};
+
+struct export_writer {
+	struct export *ex;
+	struct export_chunk *head, *tail;
+	xcond_t  cond;
+	int      done;
+};
+
+struct export {
+	struct eotool *tool;
+	filesys_t fs;
+	const char *src;		/* subtree root, no trailing slash */
+	const char *dest;
+	xmutex_t lock;
+	xcond_t  cond;
+
+	/* walk */
+	struct export_deque *deques;
+	int      nr_deques;
+	int      next_deque;		/* hands each walker its deque */
+	size_t   pending;		/* directories queued or being listed */
+	struct export_file *files;
+	size_t   nr_files, max_files;
+	struct export_dir *dirs;
+	size_t   nr_dirs, max_dirs;
+
+	/* copy */
+	struct export_chunk *chunks;
+	struct export_chunk *free_chunks;
+	struct export_writer *writers;
+	int      nr_writers;
+
+	uint64_t bytes;
+	uint64_t symlinks;	/* skipped */
+	uint64_t skipped;	/* other special files */
+	uint64_t errors;
+};
+
+static char *export_dest(struct export *ex, const char *path)
+{
+	const char *rel = path + strlen(ex->src);
+	char *p = malloc(strlen(ex->dest) + strlen(rel) + 1);
+
+	if (p)
+		sprintf(p, "%s%s", ex->dest, rel);
+	return p;
+}
+
+static void export_error(struct export *ex, const char *what, const char *path)
+{
+	fprintf(stderr, "export: can't %s %s\n", what, path);
+	xmutex_lock(ex->lock);
+	ex->errors++;
+	xmutex_unlock(ex->lock);
+}
+
+#ifdef _WIN32
+#define EXPORT_EPOCH_DIFF	11644473600LL	/* seconds from 1601 to 1970 */
+
+static FILETIME export_filetime(const struct xtimespec *ts)
+{
+	uint64_t t = (uint64_t)(ts->sec + EXPORT_EPOCH_DIFF) * 10000000 + ts->nsec / 100;
+	FILETIME ft;
+
+	ft.dwLowDateTime = (DWORD)t;
+	ft.dwHighDateTime = (DWORD)(t >> 32);
+	return ft;
+}
+#endif
+
+static void export_set_times(const char *path, const struct xtimespec *atime,
+			     const struct xtimespec *mtime, uint16_t mode)
+{
+#ifdef _WIN32
+	FILETIME a = export_filetime(atime), m = export_filetime(mtime);
+	HANDLE h;
+
+	/* Backup semantics lets directories be opened too. */
+	h = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (h != INVALID_HANDLE_VALUE) {
+		SetFileTime(h, NULL, &a, &m);
+		CloseHandle(h);
+	}
+#else
+	struct timespec t[2];
+
+	t[0].tv_sec = atime->sec;
+	t[0].tv_nsec = atime->nsec;
+	t[1].tv_sec = mtime->sec;
+	t[1].tv_nsec = mtime->nsec;
+	utimensat(AT_FDCWD, path, t, 0);
+#endif
+	export_chmod(path, mode & 07777);
+}
+
+/* Queue a directory on a walker's own deque. */
+static int export_push(struct export *ex, struct export_deque *q, char *path)
+{
+	int ok;
+
+	xmutex_lock(q->lock);
+	if (q->tail == q->max && q->head) {
+		memmove(q->jobs, q->jobs + q->head, (q->tail - q->head) * sizeof *q->jobs);
+		q->tail -= q->head;
+		q->head = 0;
+	}
+	ok = xgrow((void **)&q->jobs, &q->max, q->tail + 1, sizeof *q->jobs);
+	if (ok)
+		q->jobs[q->tail++] = path;
+	xmutex_unlock(q->lock);
+	if (!ok)
+		return 1;
+
+	xmutex_lock(ex->lock);
+	ex->pending++;
+	xcond_broadcast(ex->cond);
+	xmutex_unlock(ex->lock);
+	return 0;
+}
+
+/* Newest job from our own deque, else the oldest one of another walker. */
+static char *export_pop(struct export *ex, int self)
+{
+	struct export_deque *q;
+	char *path = NULL;
+	int i;
+
+	for (i = 0; i < ex->nr_deques && !path; i++) {
+		q = &ex->deques[(self + i) % ex->nr_deques];
+		xmutex_lock(q->lock);
+		if (q->head < q->tail)
+			path = i == 0 ? q->jobs[--q->tail] : q->jobs[q->head++];
+		xmutex_unlock(q->lock);
+	}
+	return path;
+}
+
+struct export_walk {
+	struct export *ex;
+	int      self;
+	const char *dir;
+	struct export_file *files;	/* found by this walker */
+	size_t   nr_files, max_files;
+};
+
+static int export_entry(void *arg, const char *name, struct xstat *st, int is_dir)
+{
+	struct export_walk *w = arg;
+	struct export *ex = w->ex;
+	struct export_file *f;
+	struct export_dir *d;
+	struct xextent ext;
+	file_entry_t file;
+	char *path, *dest;
+
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return 0;
+	path = malloc(strlen(w->dir) + strlen(name) + 2);
+	if (!path)
+		return 1;
+	sprintf(path, "%s/%s", strcmp(w->dir, "/") ? w->dir : "", name);
+
+	if (is_dir) {
+		dest = export_dest(ex, path);
+		if (!dest || (export_mkdir(dest, st->mode & 07777) && errno != EEXIST)) {
+			export_error(ex, "create", dest ? dest : path);
+			free(dest);
+			free(path);
+			return 0;
+		}
+		free(dest);
+		xmutex_lock(ex->lock);
+		if (xgrow((void **)&ex->dirs, &ex->max_dirs, ex->nr_dirs + 1, sizeof *d)) {
+			d = &ex->dirs[ex->nr_dirs++];
+			d->path = strdup(path);
+			d->mode = st->mode;
+			d->atime = st->atime;
+			d->mtime = st->mtime;
+		}
+		xmutex_unlock(ex->lock);
+		if (export_push(ex, &ex->deques[w->self], path)) {
+			free(path);
+			return 1;
+		}
+		return 0;
+	}
+	if (!S_ISREG(st->mode)) {
+		xmutex_lock(ex->lock);
+		if (S_ISLNK(st->mode))
+			ex->symlinks++;
+		else
+			ex->skipped++;
+		xmutex_unlock(ex->lock);
+		free(path);
+		return 0;
+	}
+
+	if (!xgrow((void **)&w->files, &w->max_files, w->nr_files + 1, sizeof *f)) {
+		free(path);
+		return 1;
+	}
+	f = &w->files[w->nr_files++];
+	memset(f, 0, sizeof *f);
+	f->path = path;
+	f->size = st->size;
+	f->mode = st->mode;
+	f->atime = st->atime;
+	f->mtime = st->mtime;
+	file = vfs_open(ex->fs, path);
+	if (file) {
+		if (vfs_file_extent_map(file, ex->fs, 0, &ext, 1) == 1)
+			f->first = ext.physical;
+		vfs_file_close(file, ex->fs);
+	}
+	return 0;
+}
+
+static void export_walker(void *arg)
+{
+	struct export *ex = arg;
+	struct export_walk w;
+	char *dir;
+
+	memset(&w, 0, sizeof w);
+	w.ex = ex;
+	xmutex_lock(ex->lock);
+	w.self = ex->next_deque++ % ex->nr_deques;
+	xmutex_unlock(ex->lock);
+
+	for (;;) {
+		dir = export_pop(ex, w.self);
+		if (!dir) {
+			xmutex_lock(ex->lock);
+			if (ex->pending == 0) {
+				xmutex_unlock(ex->lock);
+				break;
+			}
+			xcond_wait(ex->cond, ex->lock, 10);
+			xmutex_unlock(ex->lock);
+			continue;
+		}
+		w.dir = dir;
+		if (vfs_dir_iterate(ex->fs, dir, export_entry, &w))
+			export_error(ex, "list", dir);
+		free(dir);
+		xmutex_lock(ex->lock);
+		if (--ex->pending == 0)
+			xcond_broadcast(ex->cond);
+		xmutex_unlock(ex->lock);
+	}
+
+	xmutex_lock(ex->lock);
+	if (xgrow((void **)&ex->files, &ex->max_files, ex->nr_files + w.nr_files, sizeof *ex->files)) {
+		memcpy(ex->files + ex->nr_files, w.files, w.nr_files * sizeof *w.files);
+		ex->nr_files += w.nr_files;
+	} else {
+		ex->errors += w.nr_files;
+	}
+	xmutex_unlock(ex->lock);
+	free(w.files);
+}
+
+static int export_cmp_file(const void *a, const void *b)
+{
+	const struct export_file *x = a, *y = b;
+
+	return x->first < y->first ? -1 : x->first > y->first;
+}
+
+static struct export_chunk *export_get_chunk(struct export *ex)
+{
+	struct export_chunk *c;
+
+	xmutex_lock(ex->lock);
+	while (!ex->free_chunks)
+		xcond_wait(ex->cond, ex->lock, -1);
+	c = ex->free_chunks;
+	ex->free_chunks = c->next;
+	xmutex_unlock(ex->lock);
+	return c;
+}
+
+static void export_put_chunk(struct export *ex, struct export_chunk *c)
+{
+	xmutex_lock(ex->lock);
+	c->next = ex->free_chunks;
+	ex->free_chunks = c;
+	xcond_broadcast(ex->cond);
+	xmutex_unlock(ex->lock);
+}
+
+static void export_queue(struct export *ex, struct export_writer *w, struct export_chunk *c)
+{
+	c->next = NULL;
+	xmutex_lock(ex->lock);
+	if (w->tail)
+		w->tail->next = c;
+	else
+		w->head = c;
+	w->tail = c;
+	xcond_signal(w->cond);
+	xmutex_unlock(ex->lock);
+}
+
+static void export_write(struct export *ex, struct export_chunk *c)
+{
+	struct export_file *f = c->file;
+	char *dest;
+
+	if (c->failed)
+		f->bad = 1;
+	if (!f->bad && !f->fp) {
+		dest = export_dest(ex, f->path);
+		f->fp = dest ? fopen(dest, "wb") : NULL;
+		if (!f->fp) {
+			export_error(ex, "create", dest ? dest : f->path);
+			f->bad = 1;
+		}
+		free(dest);
+	}
+	if (!f->bad && c->len && fwrite(c->buf, 1, c->len, f->fp) != c->len) {
+		export_error(ex, "write", f->path);
+		f->bad = 1;
+	}
+	if (!c->last)
+		return;
+
+	if (f->fp && fclose(f->fp) && !f->bad) {
+		export_error(ex, "write", f->path);
+		f->bad = 1;
+	}
+	f->fp = NULL;
+	if (!f->bad) {
+		dest = export_dest(ex, f->path);
+		if (dest)
+			export_set_times(dest, &f->atime, &f->mtime, f->mode);
+		free(dest);
+	}
+}
+
+static void export_writer(void *arg)
+{
+	struct export_writer *w = arg;
+	struct export *ex = w->ex;
+	struct export_chunk *c;
+
+	for (;;) {
+		xmutex_lock(ex->lock);
+		while (!w->head && !w->done)
+			xcond_wait(w->cond, ex->lock, -1);
+		c = w->head;
+		if (c) {
+			w->head = c->next;
+			if (!w->head)
+				w->tail = NULL;
+		}
+		xmutex_unlock(ex->lock);
+		if (!c)
+			break;
+		export_write(ex, c);
+		export_put_chunk(ex, c);
+	}
+}
+
+/* Read every file in physical order and hand the chunks to the writers. */
+static void export_read(struct export *ex)
+{
+	struct export_file *f;
+	struct export_chunk *c;
+	file_entry_t file;
+	uint64_t off;
+	size_t i;
+
+	for (i = 0; i < ex->nr_files; i++) {
+		f = &ex->files[i];
+		file = vfs_open(ex->fs, f->path);
+		if (!file) {
+			export_error(ex, "open", f->path);
+			f->failed = 1;
+		}
+		off = 0;
+		do {
+			c = export_get_chunk(ex);
+			c->file = f;
+			c->off = off;
+			c->len = f->failed ? 0 : MIN(f->size - off, EXPORT_IO);
+			if (c->len && vfs_file_read(file, ex->fs, off, c->buf, c->len) != (int)c->len) {
+				export_error(ex, "read", f->path);
+				f->failed = 1;
+				c->len = 0;
+			}
+			off += c->len;
+			c->failed = f->failed;
+			c->last = f->failed || off >= f->size;
+			ex->bytes += c->len;
+			export_queue(ex, &ex->writers[i % ex->nr_writers], c);
+		} while (!c->last);
+		if (file)
+			vfs_file_close(file, ex->fs);
+	}
+}
+
+static int export_copy(struct export *ex, int threads)
+{
+	xthread_t *workers;
+	int i, n, started = 0;
+
+	ex->nr_writers = threads;
+	n = threads * EXPORT_BUFS;
+	ex->writers = calloc(threads, sizeof *ex->writers);
+	ex->chunks = calloc(n, sizeof *ex->chunks);
+	workers = calloc(threads, sizeof *workers);
+	if (!ex->writers || !ex->chunks || !workers)
+		goto out;
+	for (i = 0; i < n; i++) {
+		ex->chunks[i].buf = malloc(EXPORT_IO);
+		if (!ex->chunks[i].buf)
+			goto out;
+		ex->chunks[i].next = ex->free_chunks;
+		ex->free_chunks = &ex->chunks[i];
+	}
+	for (i = 0; i < threads; i++) {
+		ex->writers[i].ex = ex;
+		ex->writers[i].cond = xcond_create();
+		if (!ex->writers[i].cond)
+			goto out;
+	}
+	for (; started < threads; started++) {
+		workers[started] = xthread_create(export_writer, &ex->writers[started]);
+		if (!workers[started])
+			break;
+	}
+	/* Files of writers that did not start go to the ones that did. */
+	ex->nr_writers = started;
+	if (started)
+		export_read(ex);
+
+out:
+	xmutex_lock(ex->lock);
+	for (i = 0; i < started; i++) {
+		ex->writers[i].done = 1;
+		xcond_signal(ex->writers[i].cond);
+	}
+	xmutex_unlock(ex->lock);
+	for (i = 0; i < started; i++)
+		xthread_join(workers[i]);
+	for (i = 0; ex->writers && i < threads; i++)
+		if (ex->writers[i].cond)
+			xcond_destroy(ex->writers[i].cond);
+	for (i = 0; ex->chunks && i < n; i++)
+		free(ex->chunks[i].buf);
+	free(ex->chunks);
+	free(ex->writers);
+	free(workers);
+	return started == 0;
+}
+
+int eotool_export(struct eotool *tool, int argc, char *argv[])
+{
+	struct export ex;
+	struct export_dir *d;
+	uint64_t start = xclock_ms(), walked, ms;
+	int threads = tool->threads > 0 ? tool->threads : xcpu_count();
+	char *root, *src;
+	size_t i;
+	int retval = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "export: need a path and a destination\n");
+		return 1;
+	}
+	memset(&ex, 0, sizeof ex);
+	ex.tool = tool;
+	ex.fs = tool->vol.fs;
+	ex.dest = argv[1];
+	src = strdup(argv[0]);
+	ex.lock = xmutex_create();
+	ex.cond = xcond_create();
+	ex.nr_deques = threads;
+	ex.deques = calloc(threads, sizeof *ex.deques);
+	if (!src || !ex.lock || !ex.cond || !ex.deques)
+		goto out;
+	for (i = strlen(src); i > 1 && src[i - 1] == '/'; i--)
+		src[i - 1] = '\0';
+	ex.src = strcmp(src, "/") ? src : "";
+	for (i = 0; i < (size_t)threads; i++)
+		if (!(ex.deques[i].lock = xmutex_create()))
+			goto out;
+
+	if (export_mkdir(ex.dest, 0755) && errno != EEXIST) {
+		fprintf(stderr, "export: can't create %s\n", ex.dest);
+		goto out;
+	}
+	root = strdup(src);
+	if (!root || export_push(&ex, &ex.deques[0], root))
+		goto out;
+	xthread_run(threads, export_walker, &ex);
+	walked = xclock_ms() - start;
+	fprintf(stderr, "%" PRIu64 " directories, %" PRIu64 " files found in %" PRIu64 " ms\n",
+		(uint64_t)ex.nr_dirs, (uint64_t)ex.nr_files, walked);
+
+	qsort(ex.files, ex.nr_files, sizeof *ex.files, export_cmp_file);
+	if (export_copy(&ex, threads))
+		goto out;
+
+	/* Children were found after their parents: restore times bottom up. */
+	for (i = ex.nr_dirs; i-- > 0; ) {
+		char *dest = export_dest(&ex, ex.dirs[i].path);
+
+		d = &ex.dirs[i];
+		if (dest)
+			export_set_times(dest, &d->atime, &d->mtime, d->mode);
+		free(dest);
+	}
+	ms = xclock_ms() - start;
+	fprintf(stderr, "%" PRIu64 " MB in %" PRIu64 " files copied in %" PRIu64 " ms (%" PRIu64 " MB/s), "
+		"%" PRIu64 " symlinks and %" PRIu64 " special files skipped, %" PRIu64 " errors\n",
+		ex.bytes >> 20, (uint64_t)ex.nr_files, ms, eotool_rate(ex.bytes, ms) >> 20,
+		ex.symlinks, ex.skipped, ex.errors);
+	retval = ex.errors != 0;
+out:
+	for (i = 0; i < ex.nr_files; i++)
+		free(ex.files[i].path);
+	for (i = 0; i < ex.nr_dirs; i++)
+		free(ex.dirs[i].path);
+	for (i = 0; ex.deques && i < (size_t)threads; i++) {
+		free(ex.deques[i].jobs);
+		if (ex.deques[i].lock)
+			xmutex_destroy(ex.deques[i].lock);
+	}
+	free(ex.deques);
+	free(ex.files);
+	free(ex.dirs);
+	free(src);
+	if (ex.cond)
+		xcond_destroy(ex.cond);
+	if (ex.lock)
+		xmutex_destroy(ex.lock);
+	return retval;
+}
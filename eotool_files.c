@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+/*
+ * File lists for the content tools.  The files come from the catalog;
+ * their first extents are looked up by a pool of threads, since each
+ * lookup resolves a path.
+ */
+struct files_ctx {
+	struct eotool_files *list;
+	filesys_t fs;
+	const char *src;
+	size_t   src_len;
+	xmutex_t lock;
+	size_t   next;
+};
+
+static int files_entry(void *arg, const char *path, uint32_t parent, struct xstat *st)
+{
+	struct files_ctx *ctx = arg;
+	struct eotool_files *list = ctx->list;
+	struct eotool_file *f;
+
+	if (!S_ISREG(st->mode))
+		return 0;
+	if (ctx->src_len && (strncmp(path, ctx->src, ctx->src_len) ||
+			     (path[ctx->src_len] != '/' && path[ctx->src_len] != '\0')))
+		return 0;
+	if (!xgrow((void **)&list->files, &list->max_files, list->nr_files + 1, sizeof *f))
+		return 1;
+	f = &list->files[list->nr_files];
+	memset(f, 0, sizeof *f);
+	f->path = strdup(path);
+	if (!f->path)
+		return 1;
+	f->ino = st->ino;
+	f->nlinks = st->nlinks;
+	f->size = st->size;
+	list->nr_files++;
+	return 0;
+}
+
+static void files_locate(void *arg)
+{
+	struct files_ctx *ctx = arg;
+	struct eotool_file *f;
+	struct xextent ext;
+	file_entry_t file;
+	size_t i;
+
+	for (;;) {
+		xmutex_lock(ctx->lock);
+		i = ctx->next++;
+		xmutex_unlock(ctx->lock);
+		if (i >= ctx->list->nr_files)
+			break;
+		f = &ctx->list->files[i];
+		file = vfs_open(ctx->fs, f->path);
+		if (!file)
+			continue;
+		if (vfs_file_extent_map(file, ctx->fs, 0, &ext, 1) == 1 && !(ext.flags & XEXTENT_INLINE)) {
+			f->first = ext.physical;
+			f->first_len = ext.length;
+		}
+		vfs_file_close(file, ctx->fs);
+	}
+}
+
+static int files_cmp_first(const void *a, const void *b)
+{
+	const struct eotool_file *x = a, *y = b;
+
+	if (x->first != y->first)
+		return x->first < y->first ? -1 : 1;
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int files_plan(struct eotool_files *list)
+{
+	struct eotool_unit *u = NULL;
+	struct eotool_file *f;
+	uint64_t batch = 0;
+	size_t i;
+
+	for (i = 0; i < list->nr_files; i++) {
+		f = &list->files[i];
+		if (i && f->nlinks > 1 && f->ino == f[-1].ino) {
+			f->link = 1;
+			continue;
+		}
+		if (!u || f->size >= EOTOOL_SMALL || list->files[u->start].size >= EOTOOL_SMALL ||
+		    u->end - u->start == EOTOOL_BATCH_FILES || batch + f->size > EOTOOL_BATCH) {
+			if (!xgrow((void **)&list->units, &list->max_units, list->nr_units + 1, sizeof *u))
+				return 1;
+			u = &list->units[list->nr_units++];
+			u->start = i;
+			batch = 0;
+		}
+		u->end = i + 1;
+		batch += f->size;
+	}
+	return 0;
+}
+
+int eotool_list_files(struct eotool *tool, const char *path, struct eotool_files *list)
+{
+	struct files_ctx ctx;
+	char src[strlen(path) + 1];
+	size_t n;
+	int retval = 1;
+
+	memset(list, 0, sizeof *list);
+	memset(&ctx, 0, sizeof ctx);
+	strcpy(src, path);
+	for (n = strlen(src); n > 0 && src[n - 1] == '/'; n--)
+		src[n - 1] = '\0';
+	ctx.list = list;
+	ctx.fs = tool->vol.fs;
+	ctx.src = src;
+	ctx.src_len = n;
+	ctx.lock = xmutex_create();
+	if (!ctx.lock)
+		return 1;
+
+	if (vfs_catalog(ctx.fs, tool->threads, files_entry, &ctx)) {
+		fprintf(stderr, "can't list the files\n");
+		goto out;
+	}
+	xthread_run(tool->threads, files_locate, &ctx);
+	qsort(list->files, list->nr_files, sizeof *list->files, files_cmp_first);
+	retval = files_plan(list);
+out:
+	xmutex_destroy(ctx.lock);
+	return retval;
+}
+
+/* Bring a batch in with one sweep before its files are read one by one. */
+void eotool_prefetch_unit(struct eotool *tool, struct eotool_files *list, struct eotool_unit *u)
+{
+	struct eotool_file *f;
+	size_t i;
+
+	if (u->end - u->start < 2)
+		return;
+	for (i = u->start; i < u->end; i++) {
+		f = &list->files[i];
+		if (f->first && f->size && !f->link)
+			part_prefetch(tool->vol.part, f->first >> SECTOR_BITS,
+				      (MIN(f->first_len, f->size) + SECTOR_SIZE - 1) >> SECTOR_BITS);
+	}
+}
+
+void eotool_free_files(struct eotool_files *list)
+{
+	size_t i;
+
+	for (i = 0; i < list->nr_files; i++)
+		free(list->files[i].path);
+	free(list->files);
+	free(list->units);
+	memset(list, 0, sizeof *list);
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+/*
+ * Attribute queries: the inode tables are filtered by the scanning
+ * threads and only the matches are given paths, so a question like "what
+ * changed today" costs one pass over the metadata instead of a stat of
+ * every entry.
+ */
+struct find {
+	struct eotool *tool;
+	const char *src;
+	size_t   src_len;
+	uint64_t bytes;
+};
+
+static int find_entry(void *arg, const char *path, uint32_t parent, struct xstat *st)
+{
+	struct find *f = arg;
+
+	if (f->src_len && (strncmp(path, f->src, f->src_len) ||
+			   (path[f->src_len] != '/' && path[f->src_len] != '\0')))
+		return 0;
+	f->tool->count++;
+	f->bytes += st->size;
+	fprintf(f->tool->out, "%s\t%" PRIu32 "\t%" PRIu64 "\t%" PRId64 "\t%" PRIu32 "\t%" PRIu32 "\n",
+		path, st->ino, st->size, st->mtime.sec, st->uid, st->gid);
+	return ferror(f->tool->out);
+}
+
+/* A number with an optional unit; the units are powers of 1024 or seconds. */
+static int find_number(const char *s, const char *units, const uint64_t *scale, uint64_t *v)
+{
+	const char *u;
+	char *end;
+
+	if (*s < '0' || *s > '9')
+		return 1;
+	*v = strtoull(s, &end, 10);
+	if (*end) {
+		u = strchr(units, *end);
+		if (!u || end[1])
+			return 1;
+		*v *= scale[u - units];
+	}
+	return 0;
+}
+
+static int find_option(struct xquery *q, const char *opt, const char *val)
+{
+	static const uint64_t sizes[] = { 1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40 };
+	static const uint64_t times[] = { 1, 60, 3600, 86400 };
+	static const struct {
+		char c;
+		uint16_t type;
+	} types[] = {
+		{'f', S_IFREG}, {'d', S_IFDIR}, {'l', S_IFLNK}, {'p', S_IFIFO},
+#ifdef S_IFSOCK
+		{'s', S_IFSOCK},
+#endif
+		{'c', S_IFCHR}, {'b', S_IFBLK}, {0, 0}
+	};
+	int sign = 0, i;
+	uint64_t v;
+	int64_t now;
+
+	if (*val == '+' || *val == '-')
+		sign = *val++;
+	if (strcmp(opt, "-type") == 0) {
+		for (i = 0; types[i].c; i++)
+			if (!sign && val[0] == types[i].c && !val[1])
+				break;
+		q->type = types[i].type;
+		return !types[i].c;
+	}
+	if (strcmp(opt, "-size") == 0) {
+		if (find_number(val, "kMGT", sizes, &v))
+			return 1;
+		if (sign == '+')
+			q->size_min = v + 1;
+		else if (sign == '-')
+			q->size_max = v ? v - 1 : 0;
+		else
+			q->size_min = q->size_max = v;
+		return sign == '-' && v == 0;
+	}
+	if (strcmp(opt, "-mtime") == 0) {
+		/* Days unless a unit is given: -1 is within a day, +7h before that. */
+		if (!sign || find_number(val, "smhd", times, &v))
+			return 1;
+		if (val[strlen(val) - 1] >= '0' && val[strlen(val) - 1] <= '9')
+			v *= 86400;
+		now = time(NULL);
+		if (sign == '-')
+			q->mtime_min = now - (int64_t)v;
+		else
+			q->mtime_max = now - (int64_t)v - 1;
+		return 0;
+	}
+	if (strcmp(opt, "-uid") == 0 || strcmp(opt, "-gid") == 0) {
+		if (sign || find_number(val, "", NULL, &v) || v >= XQUERY_ANY)
+			return 1;
+		if (opt[1] == 'u')
+			q->uid = v;
+		else
+			q->gid = v;
+		return 0;
+	}
+	return 1;
+}
+
+int eotool_find(struct eotool *tool, int argc, char *argv[])
+{
+	struct xquery q;
+	struct find f;
+	uint64_t start = xclock_ms();
+	char *src = NULL;
+	size_t n = 0;
+	int i = 0, retval;
+
+	memset(&f, 0, sizeof f);
+	f.tool = tool;
+	if (argc > 0 && argv[0][0] != '-') {
+		src = argv[i++];
+		for (n = strlen(src); n > 0 && src[n - 1] == '/'; n--)
+			;
+	}
+	f.src = src;
+	f.src_len = n;
+
+	vfs_query_init(&q);
+	for (; i < argc; i += 2) {
+		if (i + 1 == argc || find_option(&q, argv[i], argv[i + 1])) {
+			fprintf(stderr, "find: bad test: %s %s\n", argv[i], i + 1 < argc ? argv[i + 1] : "");
+			return 1;
+		}
+	}
+
+	retval = vfs_query(tool->vol.fs, tool->threads, &q, find_entry, &f);
+	if (retval)
+		fprintf(stderr, "find: the query did not complete\n");
+	if (ferror(tool->out)) {
+		fprintf(stderr, "find: write error\n");
+		retval = 1;
+	}
+	fprintf(stderr, "%" PRIu64 " matches, %" PRIu64 " MB in %" PRIu64 " ms\n",
+		tool->count, f.bytes >> 20, xclock_ms() - start);
+	return retval;
+}
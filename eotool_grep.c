@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+/*
+ * Multi-pattern search of file contents.  The patterns are compiled into
+ * an Aho-Corasick automaton with a full transition table, so scanning is
+ * one table lookup per byte whatever the number of patterns, and a match
+ * may span reads.  Workers take the units of the file list in physical
+ * order like the hash tool, and every match is reported with its path
+ * and byte offset as soon as its unit and all the units before it are
+ * done, so output follows the file list.  Workers wait rather than run
+ * more than GREP_AHEAD units ahead of the output, which bounds the matches
+ * held back.
+ */
+#define GREP_IO		(4 << 20)	/* bytes per read */
+#define GREP_AHEAD	64		/* units scanned but not yet printed */
+
+struct grep_pattern {
+	char    *text;
+	size_t   len;
+};
+
+struct grep_match {
+	size_t   file;
+	uint64_t off;
+	int      pattern;
+};
+
+/* Matches of one unit, until the units before it are printed. */
+struct grep_unit {
+	struct grep_match *matches;
+	size_t   nr_matches;
+	int      done;
+};
+
+struct grep {
+	struct eotool *tool;
+	struct eotool_files list;
+	struct grep_pattern *patterns;
+	size_t   nr_patterns, max_patterns;
+	uint8_t  fold[256];
+	uint8_t  start[256];	/* bytes that leave the root state */
+
+	/* automaton */
+	int32_t *next;		/* 256 transitions per state */
+	int32_t *pattern;	/* pattern ending at a state, -1 if none */
+	int32_t *out;		/* this state or the nearest suffix with a pattern, 0 if none */
+	int32_t *dict;		/* the next suffix with a pattern, 0 if none */
+	size_t   nr_states, max_states;
+
+	xmutex_t lock;
+	xcond_t  printed_cond;
+	size_t   next_unit;
+	struct grep_unit *units;	/* one per unit of the file list */
+	size_t   printed;		/* units before this one are printed */
+	uint64_t nr_matches;
+	uint64_t bytes;
+	uint64_t errors;
+	int      failed;	/* out of memory */
+};
+
+static int grep_add_pattern(struct grep *g, const char *text, size_t len)
+{
+	struct grep_pattern *p;
+
+	if (!len)
+		return 0;
+	if (!xgrow((void **)&g->patterns, &g->max_patterns, g->nr_patterns + 1, sizeof *p))
+		return 1;
+	p = &g->patterns[g->nr_patterns];
+	p->text = malloc(len + 1);
+	if (!p->text)
+		return 1;
+	memcpy(p->text, text, len);
+	p->text[len] = '\0';
+	p->len = len;
+	g->nr_patterns++;
+	return 0;
+}
+
+/* One pattern per line of a file, for lists of indicators. */
+static int grep_load_patterns(struct grep *g, const char *path)
+{
+	char line[4096];
+	size_t len;
+	FILE *fp = fopen(path, "r");
+
+	if (!fp) {
+		fprintf(stderr, "grep: can't open %s\n", path);
+		return 1;
+	}
+	while (fgets(line, sizeof line, fp)) {
+		len = strlen(line);
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			len--;
+		if (grep_add_pattern(g, line, len)) {
+			fclose(fp);
+			return 1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int32_t grep_new_state(struct grep *g)
+{
+	size_t n = g->max_states;
+
+	if (!xgrow((void **)&g->pattern, &n, g->nr_states + 1, sizeof *g->pattern))
+		return -1;
+	n = g->max_states;
+	if (!xgrow((void **)&g->out, &n, g->nr_states + 1, sizeof *g->out))
+		return -1;
+	n = g->max_states;
+	if (!xgrow((void **)&g->dict, &n, g->nr_states + 1, sizeof *g->dict))
+		return -1;
+	n = g->max_states;
+	if (!xgrow((void **)&g->next, &n, g->nr_states + 1, 256 * sizeof *g->next))
+		return -1;
+	g->max_states = n;
+	memset(g->next + g->nr_states * 256, 0xff, 256 * sizeof *g->next);
+	g->pattern[g->nr_states] = -1;
+	g->out[g->nr_states] = 0;
+	g->dict[g->nr_states] = 0;
+	return g->nr_states++;
+}
+
+static int grep_compile(struct grep *g)
+{
+	int32_t *fail, *queue, s, u, f;
+	size_t i, j, head = 0, tail = 0;
+	int c;
+
+	if (grep_new_state(g) < 0)
+		return 1;
+	for (i = 0; i < g->nr_patterns; i++) {
+		s = 0;
+		for (j = 0; j < g->patterns[i].len; j++) {
+			c = g->fold[(uint8_t)g->patterns[i].text[j]];
+			u = g->next[s * 256 + c];
+			if (u < 0) {
+				u = grep_new_state(g);
+				if (u < 0)
+					return 1;
+				g->next[s * 256 + c] = u;
+			}
+			s = u;
+		}
+		/* A repeated pattern is reported once, as its first copy. */
+		if (g->pattern[s] < 0)
+			g->pattern[s] = i;
+	}
+
+	/* Fill in the missing transitions breadth first, from the fail links. */
+	fail = calloc(g->nr_states, sizeof *fail);
+	queue = malloc(g->nr_states * sizeof *queue);
+	if (!fail || !queue) {
+		free(fail);
+		free(queue);
+		return 1;
+	}
+	for (c = 0; c < 256; c++) {
+		u = g->next[c];
+		if (u < 0) {
+			g->next[c] = 0;
+		} else {
+			fail[u] = 0;
+			queue[tail++] = u;
+		}
+	}
+	while (head < tail) {
+		s = queue[head++];
+		g->out[s] = g->pattern[s] >= 0 ? s : g->out[fail[s]];
+		for (c = 0; c < 256; c++) {
+			u = g->next[s * 256 + c];
+			f = g->next[fail[s] * 256 + c];
+			if (u < 0) {
+				g->next[s * 256 + c] = f;
+				continue;
+			}
+			fail[u] = f;
+			queue[tail++] = u;
+		}
+		g->dict[s] = g->out[fail[s]];
+	}
+	free(fail);
+	free(queue);
+	for (c = 0; c < 256; c++)
+		g->start[c] = g->next[g->fold[c]] != 0;
+	return 0;
+}
+
+static int grep_record(struct grep_match **m, size_t *nr, size_t *max, size_t file, uint64_t off, int pattern)
+{
+	if (!xgrow((void **)m, max, *nr + 1, sizeof **m))
+		return 1;
+	(*m)[*nr].file = file;
+	(*m)[*nr].off = off;
+	(*m)[*nr].pattern = pattern;
+	(*nr)++;
+	return 0;
+}
+
+struct grep_worker {
+	struct grep *g;
+	struct grep_match *matches;
+	size_t   nr_matches, max_matches;
+	char    *buf;
+};
+
+static int grep_file(struct grep_worker *w, size_t i)
+{
+	struct grep *g = w->g;
+	struct eotool_file *f = &g->list.files[i];
+	filesys_t fs = g->tool->vol.fs;
+	const uint8_t *p;
+	file_entry_t file;
+	uint64_t off = 0;
+	int32_t s = 0, t;
+	int n, k;
+
+	file = vfs_open(fs, f->path);
+	if (!file) {
+		fprintf(stderr, "grep: can't open %s\n", f->path);
+		xmutex_lock(g->lock);
+		g->errors++;
+		xmutex_unlock(g->lock);
+		return 0;
+	}
+	while (off < f->size) {
+		n = vfs_file_read(file, fs, off, w->buf, MIN(f->size - off, GREP_IO));
+		if (n <= 0) {
+			fprintf(stderr, "grep: read error in %s\n", f->path);
+			xmutex_lock(g->lock);
+			g->errors++;
+			xmutex_unlock(g->lock);
+			break;
+		}
+		p = (const uint8_t *)w->buf;
+		for (k = 0; k < n; k++) {
+			/* At the root, skip bytes that can't begin a match. */
+			if (s == 0)
+				while (k < n && !g->start[p[k]])
+					k++;
+			if (k == n)
+				break;
+			s = g->next[s * 256 + g->fold[p[k]]];
+			for (t = g->out[s]; t; t = g->dict[t])
+				if (grep_record(&w->matches, &w->nr_matches, &w->max_matches, i,
+						off + k + 1 - g->patterns[g->pattern[t]].len, g->pattern[t])) {
+					vfs_file_close(file, fs);
+					return 1;
+				}
+		}
+		off += n;
+	}
+	vfs_file_close(file, fs);
+	xmutex_lock(g->lock);
+	g->bytes += off;
+	xmutex_unlock(g->lock);
+	return 0;
+}
+
+static int grep_cmp_match(const void *a, const void *b)
+{
+	const struct grep_match *x = a, *y = b;
+
+	if (x->file != y->file)
+		return x->file < y->file ? -1 : 1;
+	if (x->off != y->off)
+		return x->off < y->off ? -1 : 1;
+	return x->pattern - y->pattern;
+}
+
+/*
+ * Print the matches of unit k by file and offset.  The hard links that
+ * follow the unit's last file, up to the next unit, belong to it and
+ * share their inode's matches.
+ */
+static void grep_print_unit(struct grep *g, size_t k)
+{
+	struct grep_unit *gu = &g->units[k];
+	struct grep_match *m, key;
+	size_t i, end, owner, lo, hi, mid;
+
+	end = k + 1 < g->list.nr_units ? g->list.units[k + 1].start : g->list.nr_files;
+	qsort(gu->matches, gu->nr_matches, sizeof *gu->matches, grep_cmp_match);
+	for (i = g->list.units[k].start; i < end; i++) {
+		owner = i;
+		while (g->list.files[owner].link)
+			owner--;
+		key.file = owner;
+		key.off = 0;
+		key.pattern = -1;
+		lo = 0;
+		hi = gu->nr_matches;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (grep_cmp_match(&gu->matches[mid], &key) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (m = gu->matches + lo; m < gu->matches + gu->nr_matches && m->file == owner; m++)
+			fprintf(g->tool->out, "%s:%" PRIu64 ":%s\n", g->list.files[i].path, m->off,
+				g->patterns[m->pattern].text);
+	}
+}
+
+/* Print the finished units that have nothing unprinted before them; lock held. */
+static void grep_flush(struct grep *g)
+{
+	struct grep_unit *gu;
+
+	while (g->printed < g->list.nr_units && g->units[g->printed].done) {
+		gu = &g->units[g->printed];
+		grep_print_unit(g, g->printed);
+		free(gu->matches);
+		gu->matches = NULL;
+		g->printed++;
+	}
+	fflush(g->tool->out);
+	xcond_broadcast(g->printed_cond);
+}
+
+static void grep_worker(void *arg)
+{
+	struct grep *g = arg;
+	struct grep_worker w;
+	struct grep_unit *gu;
+	struct eotool_unit *u;
+	size_t i, k;
+	int failed = 0;
+
+	memset(&w, 0, sizeof w);
+	w.g = g;
+	w.buf = malloc(GREP_IO);
+	failed = !w.buf;
+	while (!failed) {
+		xmutex_lock(g->lock);
+		while (!g->failed && g->next_unit < g->list.nr_units &&
+		       g->next_unit >= g->printed + GREP_AHEAD)
+			xcond_wait(g->printed_cond, g->lock, -1);
+		k = g->failed ? g->list.nr_units : g->next_unit;
+		if (k < g->list.nr_units)
+			g->next_unit++;
+		xmutex_unlock(g->lock);
+		if (k == g->list.nr_units)
+			break;
+		u = &g->list.units[k];
+		eotool_prefetch_unit(g->tool, &g->list, u);
+		w.nr_matches = 0;
+		for (i = u->start; i < u->end && !failed; i++)
+			if (!g->list.files[i].link)
+				failed = grep_file(&w, i);
+		if (failed)
+			break;
+
+		xmutex_lock(g->lock);
+		gu = &g->units[k];
+		gu->matches = w.matches;
+		gu->nr_matches = w.nr_matches;
+		gu->done = 1;
+		g->nr_matches += w.nr_matches;
+		w.matches = NULL;
+		w.nr_matches = w.max_matches = 0;
+		grep_flush(g);
+		xmutex_unlock(g->lock);
+	}
+
+	if (failed) {
+		xmutex_lock(g->lock);
+		g->failed = 1;
+		xcond_broadcast(g->printed_cond);
+		xmutex_unlock(g->lock);
+	}
+	free(w.matches);
+	free(w.buf);
+}
+
+int eotool_grep(struct eotool *tool, int argc, char *argv[])
+{
+	struct grep g;
+	uint64_t start = xclock_ms(), ms;
+	int i, icase = 0, retval = 1;
+
+	if (argc > 0 && strcmp(argv[0], "-i") == 0) {
+		icase = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "grep: need a path and patterns\n");
+		return 1;
+	}
+	memset(&g, 0, sizeof g);
+	g.tool = tool;
+	for (i = 0; i < 256; i++)
+		g.fold[i] = icase ? tolower(i) : i;
+	g.lock = xmutex_create();
+	g.printed_cond = xcond_create();
+	if (!g.lock || !g.printed_cond)
+		goto out;
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '@' ? grep_load_patterns(&g, argv[i] + 1) :
+					grep_add_pattern(&g, argv[i], strlen(argv[i])))
+			goto out;
+	}
+	if (!g.nr_patterns) {
+		fprintf(stderr, "grep: no patterns\n");
+		goto out;
+	}
+	if (grep_compile(&g) || eotool_list_files(tool, argv[0], &g.list))
+		goto out;
+	g.units = calloc(g.list.nr_units + 1, sizeof *g.units);
+	if (!g.units)
+		goto out;
+	xthread_run(tool->threads, grep_worker, &g);
+	if (g.failed) {
+		fprintf(stderr, "grep: out of memory\n");
+		goto out;
+	}
+	retval = g.errors != 0;
+	if (ferror(tool->out)) {
+		fprintf(stderr, "grep: write error\n");
+		retval = 1;
+	}
+	ms = xclock_ms() - start;
+	fprintf(stderr, "%" PRIu64 " patterns, %" PRIu64 " states; %" PRIu64 " files, %" PRIu64 " MB searched "
+		"in %" PRIu64 " ms (%" PRIu64 " MB/s), %" PRIu64 " matches, %" PRIu64 " errors\n",
+		(uint64_t)g.nr_patterns, (uint64_t)g.nr_states, (uint64_t)g.list.nr_files, g.bytes >> 20,
+		ms, eotool_rate(g.bytes, ms) >> 20, g.nr_matches, g.errors);
+out:
+	for (i = 0; i < (int)g.nr_patterns; i++)
+		free(g.patterns[i].text);
+	free(g.patterns);
+	free(g.next);
+	free(g.pattern);
+	free(g.out);
+	free(g.dict);
+	if (g.units)
+		for (i = 0; i < (int)g.list.nr_units; i++)
+			free(g.units[i].matches);
+	free(g.units);
+	eotool_free_files(&g.list);
+	if (g.printed_cond)
+		xcond_destroy(g.printed_cond);
+	if (g.lock)
+		xmutex_destroy(g.lock);
+	return retval;
+}
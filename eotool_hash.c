@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "hash.h"
+#include "eotool.h"
+
+/*
+ * Content hashing.  Workers take the units of the file list in order, so
+ * the disk is swept front to back whatever their number, and give each
+ * file a SHA-256 and an XXH3 hash from one pass over its data.
+ */
+#define HASH_IO		(4 << 20)	/* bytes per read */
+
+struct hash_sum {
+	uint8_t  sha256[SHA256_SIZE];
+	uint64_t xxh3;
+	int      done;
+};
+
+struct hash {
+	struct eotool *tool;
+	struct eotool_files list;
+	struct hash_sum *sums;		/* one per file */
+	xmutex_t lock;
+	size_t   next;		/* next unit to take */
+	uint64_t bytes;
+	int      failed;	/* out of memory */
+};
+
+static void hash_file(struct hash *h, size_t i, char *buf)
+{
+	struct eotool_file *f = &h->list.files[i];
+	filesys_t fs = h->tool->vol.fs;
+	struct sha256_ctx sha;
+	struct xxh3_ctx xxh;
+	file_entry_t file;
+	uint64_t off = 0;
+	int n;
+
+	file = vfs_open(fs, f->path);
+	if (!file) {
+		fprintf(stderr, "hash: can't open %s\n", f->path);
+		return;
+	}
+	sha256_init(&sha);
+	xxh3_init(&xxh);
+	while (off < f->size) {
+		n = vfs_file_read(file, fs, off, buf, MIN(f->size - off, HASH_IO));
+		if (n <= 0)
+			break;
+		sha256_update(&sha, buf, n);
+		xxh3_update(&xxh, buf, n);
+		off += n;
+	}
+	vfs_file_close(file, fs);
+	if (off < f->size) {
+		fprintf(stderr, "hash: read error in %s\n", f->path);
+		return;
+	}
+	sha256_final(&sha, h->sums[i].sha256);
+	h->sums[i].xxh3 = xxh3_digest(&xxh);
+	h->sums[i].done = 1;
+
+	xmutex_lock(h->lock);
+	h->bytes += off;
+	xmutex_unlock(h->lock);
+}
+
+static void hash_worker(void *arg)
+{
+	struct hash *h = arg;
+	struct eotool_unit *u;
+	char *buf = malloc(HASH_IO);
+	size_t i;
+
+	if (!buf) {
+		xmutex_lock(h->lock);
+		h->failed = 1;
+		xmutex_unlock(h->lock);
+		return;
+	}
+	for (;;) {
+		xmutex_lock(h->lock);
+		u = h->next < h->list.nr_units ? &h->list.units[h->next++] : NULL;
+		xmutex_unlock(h->lock);
+		if (!u)
+			break;
+		eotool_prefetch_unit(h->tool, &h->list, u);
+		for (i = u->start; i < u->end; i++)
+			if (!h->list.files[i].link)
+				hash_file(h, i, buf);
+	}
+	free(buf);
+}
+
+static int hash_cmp_path(const void *a, const void *b)
+{
+	return strcmp((*(struct eotool_file * const *)a)->path, (*(struct eotool_file * const *)b)->path);
+}
+
+int eotool_hash(struct eotool *tool, int argc, char *argv[])
+{
+	struct hash h;
+	struct eotool_file *f, **order = NULL;
+	struct hash_sum *s;
+	uint64_t start = xclock_ms(), errors = 0, ms;
+	size_t i;
+	int j, retval = 1;
+
+	memset(&h, 0, sizeof h);
+	h.tool = tool;
+	h.lock = xmutex_create();
+	if (!h.lock)
+		return 1;
+	if (eotool_list_files(tool, argc > 0 ? argv[0] : "/", &h.list))
+		goto out;
+	h.sums = calloc(h.list.nr_files + 1, sizeof *h.sums);
+	order = malloc((h.list.nr_files + 1) * sizeof *order);
+	if (!h.sums || !order)
+		goto out;
+	xthread_run(tool->threads, hash_worker, &h);
+	if (h.failed) {
+		fprintf(stderr, "hash: out of memory\n");
+		goto out;
+	}
+
+	/* Later names of an inode take the sums of the first. */
+	for (i = 0; i < h.list.nr_files; i++) {
+		if (h.list.files[i].link)
+			h.sums[i] = h.sums[i - 1];
+		order[i] = &h.list.files[i];
+	}
+	qsort(order, h.list.nr_files, sizeof *order, hash_cmp_path);
+	for (i = 0; i < h.list.nr_files; i++) {
+		f = order[i];
+		s = &h.sums[f - h.list.files];
+		if (!s->done) {
+			errors++;
+			continue;
+		}
+		for (j = 0; j < SHA256_SIZE; j++)
+			fprintf(tool->out, "%02x", s->sha256[j]);
+		fprintf(tool->out, " %016" PRIx64 " %" PRIu64 " %s\n", s->xxh3, f->size, f->path);
+	}
+	retval = errors != 0;
+	if (ferror(tool->out)) {
+		fprintf(stderr, "hash: write error\n");
+		retval = 1;
+	}
+	ms = xclock_ms() - start;
+	fprintf(stderr, "%" PRIu64 " files, %" PRIu64 " MB hashed in %" PRIu64 " ms (%" PRIu64 " MB/s), "
+		"%" PRIu64 " errors\n", (uint64_t)h.list.nr_files, h.bytes >> 20, ms,
+		eotool_rate(h.bytes, ms) >> 20, errors);
+out:
+	eotool_free_files(&h.list);
+	free(h.sums);
+	free(order);
+	xmutex_destroy(h.lock);
+	return retval;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+/*
+ * Used-block image export.  The filesystem reports the ranges it has in
+ * use; they are gathered into large reads, skipping over small gaps, and
+ * written out by a second thread while the next buffer is read.
+ *
+ * The stream format, all numbers little-endian 64 bit:
+ *   "EOKRAW1\0" size
+ *   offset length <length bytes>   ...
+ *   size 0                         end of stream
+ */
+#define IMAGE_IO	(4 << 20)	/* bytes per read */
+#define IMAGE_GAP	(64 << 10)	/* free space a read may span */
+#define IMAGE_RUNS	256		/* used ranges per read */
+#define IMAGE_MAGIC	"EOKRAW1"
+
+struct image_run {
+	uint64_t off;
+	uint64_t len;
+};
+
+struct image_buf {
+	char    *data;
+	uint64_t start;		/* partition offset of data[0] */
+	uint64_t len;
+	struct image_run runs[IMAGE_RUNS];
+	int      nr_runs;
+	int      full;		/* read, waiting for the writer */
+};
+
+struct image {
+	struct eotool *tool;
+	FILE    *out;
+	int      stream;
+	struct image_buf bufs[2];
+	int      fill;		/* buffer the reader fills */
+	int      done;
+	int      error;
+	xmutex_t lock;
+	xcond_t  cond;
+	uint64_t used;
+	uint64_t end;		/* end of the last range written */
+};
+
+static int image_put64(FILE *out, uint64_t v)
+{
+	uint8_t b[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		b[i] = v >> (i * 8);
+	return fwrite(b, 1, 8, out) != 8;
+}
+
+static int image_write(struct image *img, struct image_buf *b)
+{
+	struct image_run *run;
+	int i;
+
+	for (i = 0; i < b->nr_runs; i++) {
+		run = &b->runs[i];
+		if (img->stream) {
+			if (image_put64(img->out, run->off) || image_put64(img->out, run->len))
+				return 1;
+		} else if (xfseek(img->out, run->off, SEEK_SET)) {
+			return 1;
+		}
+		if (fwrite(b->data + (run->off - b->start), 1, run->len, img->out) != run->len)
+			return 1;
+		img->end = run->off + run->len;
+	}
+	return 0;
+}
+
+static void image_writer(void *arg)
+{
+	struct image *img = arg;
+	struct image_buf *b;
+	int i = 0, error;
+
+	for (;;) {
+		b = &img->bufs[i];
+		xmutex_lock(img->lock);
+		while (!b->full && !img->done && !img->error)
+			xcond_wait(img->cond, img->lock, -1);
+		if (!b->full || img->error) {
+			xmutex_unlock(img->lock);
+			break;
+		}
+		xmutex_unlock(img->lock);
+
+		error = image_write(img, b);
+
+		xmutex_lock(img->lock);
+		if (error)
+			img->error = 1;
+		b->full = 0;
+		b->nr_runs = 0;
+		xcond_broadcast(img->cond);
+		xmutex_unlock(img->lock);
+		i ^= 1;
+	}
+}
+
+/* Read the buffer being filled, pass it on and wait for the other one. */
+static int image_submit(struct image *img)
+{
+	struct image_buf *b = &img->bufs[img->fill];
+
+	if (part_read(img->tool->vol.part, b->start >> SECTOR_BITS,
+		      (b->len + SECTOR_SIZE - 1) >> SECTOR_BITS, (uint8_t *)b->data) < 0) {
+		fprintf(stderr, "image: read error at %" PRIu64 "\n", b->start);
+		xmutex_lock(img->lock);
+		img->error = 1;
+		xcond_broadcast(img->cond);
+		xmutex_unlock(img->lock);
+		return 1;
+	}
+
+	xmutex_lock(img->lock);
+	b->full = 1;
+	xcond_broadcast(img->cond);
+	img->fill ^= 1;
+	while (img->bufs[img->fill].full && !img->error)
+		xcond_wait(img->cond, img->lock, -1);
+	xmutex_unlock(img->lock);
+	return img->error;
+}
+
+static int image_range(void *arg, uint64_t off, uint64_t len)
+{
+	struct image *img = arg;
+	struct image_buf *b;
+	uint64_t n;
+
+	img->used += len;
+	while (len) {
+		b = &img->bufs[img->fill];
+		if (b->nr_runs && (b->nr_runs == IMAGE_RUNS || off - (b->start + b->len) > IMAGE_GAP ||
+				   off - b->start >= IMAGE_IO) && image_submit(img))
+			return 1;
+		b = &img->bufs[img->fill];
+		if (b->nr_runs == 0) {
+			b->start = off;
+			b->len = 0;
+		}
+		n = MIN(len, IMAGE_IO - (off - b->start));
+		b->runs[b->nr_runs].off = off;
+		b->runs[b->nr_runs++].len = n;
+		b->len = off + n - b->start;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int eotool_image(struct eotool *tool, int argc, char *argv[])
+{
+	struct image img;
+	uint64_t size = tool->vol.part->length * SECTOR_SIZE;
+	uint64_t start = xclock_ms(), ms;
+	xthread_t writer;
+	int retval;
+
+	if (argc < 1) {
+		fprintf(stderr, "image: missing destination\n");
+		return 1;
+	}
+	memset(&img, 0, sizeof img);
+	img.tool = tool;
+	img.stream = strcmp(argv[0], "-") == 0;
+	img.bufs[0].data = malloc(IMAGE_IO);
+	img.bufs[1].data = malloc(IMAGE_IO);
+	img.lock = xmutex_create();
+	img.cond = xcond_create();
+	if (!img.bufs[0].data || !img.bufs[1].data || !img.lock || !img.cond) {
+		fprintf(stderr, "image: out of memory\n");
+		retval = 1;
+		goto out;
+	}
+	img.out = eotool_create(argv[0], !img.stream);
+	if (!img.out) {
+		retval = 1;
+		goto out;
+	}
+	if (img.stream && (fwrite(IMAGE_MAGIC, 1, 8, img.out) != 8 || image_put64(img.out, size))) {
+		eotool_close(img.out);
+		retval = 1;
+		goto out;
+	}
+
+	writer = xthread_create(image_writer, &img);
+	if (!writer) {
+		eotool_close(img.out);
+		retval = 1;
+		goto out;
+	}
+	retval = vfs_used_ranges(tool->vol.fs, image_range, &img);
+	if (!retval && !img.error && img.bufs[img.fill].nr_runs)
+		image_submit(&img);
+	xmutex_lock(img.lock);
+	img.done = 1;
+	xcond_broadcast(img.cond);
+	xmutex_unlock(img.lock);
+	xthread_join(writer);
+
+	/* Give the sparse file the size of the partition. */
+	if (!img.error && !img.stream && img.end < size &&
+	    (xfseek(img.out, size - 1, SEEK_SET) || fputc(0, img.out) == EOF))
+		img.error = 1;
+	if (!img.error && img.stream && (image_put64(img.out, size) || image_put64(img.out, 0)))
+		img.error = 1;
+	if (eotool_close(img.out))
+		img.error = 1;
+	if (img.error)
+		fprintf(stderr, "image: write error\n");
+	retval = retval || img.error;
+
+	ms = xclock_ms() - start;
+	fprintf(stderr, "%" PRIu64 " of %" PRIu64 " MB in use, copied in %" PRIu64 " ms (%" PRIu64 " MB/s)\n",
+		img.used >> 20, size >> 20, ms, eotool_rate(img.used, ms) >> 20);
+out:
+	free(img.bufs[0].data);
+	free(img.bufs[1].data);
+	if (img.cond)
+		xcond_destroy(img.cond);
+	if (img.lock)
+		xmutex_destroy(img.lock);
+	return retval;
+}
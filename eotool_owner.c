@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+/*
+ * Block ownership index: every allocated range of every file, from the
+ * block maps, kept sorted by physical offset with the largest end of each
+ * subtree of the implicit balanced tree over the array, so that a range
+ * query only descends into subtrees that reach it.  The paths come from
+ * the catalog, for the inodes that own blocks.  The index can be saved
+ * next to the image and is reused while the filesystem stamp matches.
+ */
+#define OWNER_MAGIC	"EOOWNER1"
+
+struct owner_ext {
+	uint64_t start;		/* bytes in the partition */
+	uint64_t len;
+	uint64_t logical;	/* offset in the file */
+	uint32_t ino;
+	uint32_t flags;
+};
+
+struct owner_name {
+	uint32_t ino;
+	uint32_t len;
+	uint64_t name;		/* offset in the name pool */
+};
+
+struct owner_header {
+	char     magic[8];
+	uint8_t  stamp[32];
+	uint64_t nr_exts;
+	uint64_t nr_names;
+	uint64_t names_len;
+};
+
+struct owner {
+	struct owner_ext *exts;
+	size_t   nr_exts, max_exts;
+	uint64_t *max_end;	/* interval tree over exts */
+	uint32_t *inos;		/* inodes owning blocks, sorted */
+	size_t   nr_inos;
+	struct owner_name *names;
+	size_t   nr_names, max_names;
+	char    *pool;
+	size_t   pool_len, pool_max;
+	int      root;		/* "/" is named */
+	int      failed;
+};
+
+static int owner_add_ext(void *arg, uint32_t ino, const struct xextent *ext)
+{
+	struct owner *o = arg;
+	struct owner_ext *e;
+
+	if (!xgrow((void **)&o->exts, &o->max_exts, o->nr_exts + 1, sizeof *e))
+		return o->failed = 1;
+	e = &o->exts[o->nr_exts++];
+	e->start   = ext->physical;
+	e->len     = ext->length;
+	e->logical = ext->logical;
+	e->ino     = ino;
+	e->flags   = ext->flags;
+	return 0;
+}
+
+static int owner_cmp_ext(const void *a, const void *b)
+{
+	const struct owner_ext *x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int owner_cmp_ino(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/* By inode, then in catalog order, so the first path of an inode is stable. */
+static int owner_cmp_name(const void *a, const void *b)
+{
+	const struct owner_name *x = a, *y = b;
+
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return x->name < y->name ? -1 : x->name > y->name;
+}
+
+static int owner_cmp_name_ino(const void *a, const void *b)
+{
+	const struct owner_name *x = a, *y = b;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int owner_name(struct owner *o, uint32_t ino, const char *path)
+{
+	struct owner_name *n;
+	size_t len = strlen(path);
+
+	if (!bsearch(&ino, o->inos, o->nr_inos, sizeof *o->inos, owner_cmp_ino))
+		return 0;
+	if (!xgrow((void **)&o->names, &o->max_names, o->nr_names + 1, sizeof *n) ||
+	    !xgrow((void **)&o->pool, &o->pool_max, o->pool_len + len, 1))
+		return o->failed = 1;
+	n = &o->names[o->nr_names++];
+	n->ino  = ino;
+	n->len  = len;
+	n->name = o->pool_len;
+	memcpy(o->pool + o->pool_len, path, len);
+	o->pool_len += len;
+	return 0;
+}
+
+/* The catalog has no entry for the root; it is the parent of "/name". */
+static int owner_add_name(void *arg, const char *path, uint32_t parent, struct xstat *st)
+{
+	struct owner *o = arg;
+
+	if (!o->root && !strchr(path + 1, '/')) {
+		o->root = 1;
+		if (owner_name(o, parent, "/"))
+			return 1;
+	}
+	return owner_name(o, st->ino, path);
+}
+
+/* Fill in the subtree maxima of exts[lo, hi); returns the largest end. */
+static uint64_t owner_tree(struct owner *o, size_t lo, size_t hi)
+{
+	size_t mid = lo + (hi - lo) / 2;
+	uint64_t m, end;
+
+	if (lo >= hi)
+		return 0;
+	m = o->exts[mid].start + o->exts[mid].len;
+	end = owner_tree(o, lo, mid);
+	m = MAX(m, end);
+	end = owner_tree(o, mid + 1, hi);
+	m = MAX(m, end);
+	o->max_end[mid] = m;
+	return m;
+}
+
+static int owner_build(struct eotool *tool, struct owner *o)
+{
+	size_t i;
+
+	if (vfs_block_map(tool->vol.fs, tool->threads, owner_add_ext, o)) {
+		fprintf(stderr, "owner: can't read the block maps\n");
+		return 1;
+	}
+	if (o->failed)
+		return 1;
+	qsort(o->exts, o->nr_exts, sizeof *o->exts, owner_cmp_ext);
+
+	o->inos = malloc((o->nr_exts + 1) * sizeof *o->inos);
+	if (!o->inos)
+		return 1;
+	for (i = 0; i < o->nr_exts; i++)
+		o->inos[i] = o->exts[i].ino;
+	qsort(o->inos, o->nr_exts, sizeof *o->inos, owner_cmp_ino);
+	for (i = 0; i < o->nr_exts; i++)
+		if (!o->nr_inos || o->inos[o->nr_inos - 1] != o->inos[i])
+			o->inos[o->nr_inos++] = o->inos[i];
+
+	if (vfs_catalog(tool->vol.fs, tool->threads, owner_add_name, o))
+		fprintf(stderr, "owner: the catalog is incomplete, some paths are missing\n");
+	if (o->failed)
+		return 1;
+	qsort(o->names, o->nr_names, sizeof *o->names, owner_cmp_name);
+	return 0;
+}
+
+static int owner_save(struct owner *o, const uint8_t stamp[32], const char *path)
+{
+	struct owner_header hdr;
+	FILE *fp;
+	int error;
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		fprintf(stderr, "can't create: %s\n", path);
+		return 1;
+	}
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, OWNER_MAGIC, sizeof hdr.magic);
+	memcpy(hdr.stamp, stamp, sizeof hdr.stamp);
+	hdr.nr_exts = o->nr_exts;
+	hdr.nr_names = o->nr_names;
+	hdr.names_len = o->pool_len;
+	fwrite(&hdr, sizeof hdr, 1, fp);
+	fwrite(o->exts, sizeof *o->exts, o->nr_exts, fp);
+	fwrite(o->names, sizeof *o->names, o->nr_names, fp);
+	fwrite(o->pool, 1, o->pool_len, fp);
+	error = ferror(fp);
+	if (fclose(fp) || error) {
+		fprintf(stderr, "owner: can't write %s\n", path);
+		remove(path);
+		return 1;
+	}
+	return 0;
+}
+
+/* Returns 0 if an index for this state of the filesystem was loaded. */
+static int owner_load(struct owner *o, const uint8_t stamp[32], const char *path)
+{
+	struct owner_header hdr;
+	uint64_t size;
+	size_t i;
+	FILE *fp;
+	int status = 1;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return 1;
+	if (fread(&hdr, sizeof hdr, 1, fp) != 1 || memcmp(hdr.magic, OWNER_MAGIC, sizeof hdr.magic) ||
+	    memcmp(hdr.stamp, stamp, sizeof hdr.stamp) || xfseek(fp, 0, SEEK_END))
+		goto out;
+	size = xftell(fp);
+	if (hdr.nr_exts > size / sizeof *o->exts || hdr.nr_names > size / sizeof *o->names ||
+	    sizeof hdr + hdr.nr_exts * sizeof *o->exts + hdr.nr_names * sizeof *o->names +
+	    hdr.names_len != size || xfseek(fp, sizeof hdr, SEEK_SET))
+		goto out;
+
+	o->exts  = malloc(hdr.nr_exts * sizeof *o->exts + 1);
+	o->names = malloc(hdr.nr_names * sizeof *o->names + 1);
+	o->pool  = malloc(hdr.names_len + 1);
+	if (!o->exts || !o->names || !o->pool ||
+	    fread(o->exts, sizeof *o->exts, hdr.nr_exts, fp) != hdr.nr_exts ||
+	    fread(o->names, sizeof *o->names, hdr.nr_names, fp) != hdr.nr_names ||
+	    fread(o->pool, 1, hdr.names_len, fp) != hdr.names_len)
+		goto out;
+	for (i = 0; i < hdr.nr_names; i++)
+		if (o->names[i].name + o->names[i].len > hdr.names_len)
+			goto out;
+	o->nr_exts = o->max_exts = hdr.nr_exts;
+	o->nr_names = o->max_names = hdr.nr_names;
+	o->pool_len = o->pool_max = hdr.names_len;
+	status = 0;
+out:
+	if (status) {
+		free(o->exts);
+		free(o->names);
+		free(o->pool);
+		o->exts = NULL;
+		o->names = NULL;
+		o->pool = NULL;
+	}
+	fclose(fp);
+	return status;
+}
+
+static void owner_print(struct eotool *tool, struct owner *o, uint64_t start, uint64_t end,
+		const struct owner_ext *e)
+{
+	struct owner_name key, *n;
+
+	fprintf(tool->out, "%" PRIu64 "\t%" PRIu64 "\t", start, end - start);
+	if (!e) {
+		fprintf(tool->out, "-\n");
+		return;
+	}
+	key.ino = e->ino;
+	n = bsearch(&key, o->names, o->nr_names, sizeof *n, owner_cmp_name_ino);
+	/* bsearch finds some name of the inode; step back to the first. */
+	while (n && n > o->names && n[-1].ino == e->ino)
+		n--;
+	fprintf(tool->out, "%" PRIu32 "\t%" PRIu64 "\t", e->ino, e->logical + (start - e->start));
+	if (!n) {
+		fprintf(tool->out, "<inode %" PRIu32 ">%s\n", e->ino,
+			e->flags & XEXTENT_UNWRITTEN ? "\tunwritten" : "");
+		return;
+	}
+	fprintf(tool->out, "%.*s%s\n", (int)n->len, o->pool + n->name,
+		e->flags & XEXTENT_UNWRITTEN ? "\tunwritten" : "");
+	for (n++; n < o->names + o->nr_names && n->ino == e->ino; n++)
+		fprintf(tool->out, "\t\t\t\t%.*s\n", (int)n->len, o->pool + n->name);
+}
+
+/* Report the owners of [start, end) in order, and the ranges nobody owns. */
+static void owner_query(struct eotool *tool, struct owner *o, size_t lo, size_t hi,
+		uint64_t start, uint64_t end, uint64_t *pos)
+{
+	size_t mid = lo + (hi - lo) / 2;
+	const struct owner_ext *e;
+	uint64_t a, b;
+
+	if (lo >= hi || o->max_end[mid] <= start)
+		return;
+	owner_query(tool, o, lo, mid, start, end, pos);
+	e = &o->exts[mid];
+	if (e->start >= end)
+		return;
+	if (e->start + e->len > start) {
+		a = MAX(e->start, start);
+		b = MIN(e->start + e->len, end);
+		if (a > *pos)
+			owner_print(tool, o, *pos, a, NULL);
+		owner_print(tool, o, a, b, e);
+		*pos = MAX(*pos, b);
+	}
+	owner_query(tool, o, mid + 1, hi, start, end, pos);
+}
+
+/* N, A-B (inclusive) or A+N; in bytes, or sectors of the whole disk. */
+static int owner_range(struct eotool *tool, const char *s, int sectors, uint64_t *start, uint64_t *end)
+{
+	uint64_t a, b, base = tool->vol.part->off;
+	char *p;
+
+	a = strtoull(s, &p, 0);
+	if (p == s)
+		return 1;
+	if (*p == '-')
+		b = strtoull(p + 1, &p, 0) + 1;
+	else if (*p == '+')
+		b = a + strtoull(p + 1, &p, 0);
+	else
+		b = a + 1;
+	if (*p || b <= a)
+		return 1;
+	if (sectors) {
+		if (a < base)
+			return 1;
+		a = (a - base) * SECTOR_SIZE;
+		b = (b - base) * SECTOR_SIZE;
+	}
+	*start = a;
+	*end = b;
+	return 0;
+}
+
+int eotool_owner(struct eotool *tool, int argc, char *argv[])
+{
+	struct owner o;
+	const char *index = NULL;
+	uint64_t t0 = xclock_ms(), start, end, pos;
+	uint8_t stamp[32];
+	int i, sectors = 0, retval = 1;
+
+	for (i = 0; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-s") == 0)
+			sectors = 1;
+		else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+			index = argv[++i];
+		else
+			break;
+	}
+	argc -= i;
+	argv += i;
+	if (!index && argc == 0) {
+		fprintf(stderr, "owner: need an index file or ranges to look up\n");
+		return 1;
+	}
+
+	memset(&o, 0, sizeof o);
+	if (vfs_stamp(tool->vol.fs, stamp)) {
+		fprintf(stderr, "owner: the filesystem has no stamp\n");
+		return 1;
+	}
+	if (index && owner_load(&o, stamp, index) == 0) {
+		fprintf(stderr, "index %s: %" PRIu64 " extents, %" PRIu64 " paths\n",
+			index, (uint64_t)o.nr_exts, (uint64_t)o.nr_names);
+	} else {
+		if (owner_build(tool, &o)) {
+			if (o.failed)
+				fprintf(stderr, "owner: out of memory\n");
+			goto out;
+		}
+		fprintf(stderr, "%" PRIu64 " extents of %" PRIu64 " inodes, %" PRIu64 " paths in %" PRIu64 " ms\n",
+			(uint64_t)o.nr_exts, (uint64_t)o.nr_inos, (uint64_t)o.nr_names, xclock_ms() - t0);
+		if (index && owner_save(&o, stamp, index))
+			goto out;
+	}
+	o.max_end = malloc((o.nr_exts + 1) * sizeof *o.max_end);
+	if (!o.max_end)
+		goto out;
+	owner_tree(&o, 0, o.nr_exts);
+
+	for (i = 0; i < argc; i++) {
+		if (owner_range(tool, argv[i], sectors, &start, &end)) {
+			fprintf(stderr, "owner: bad range: %s\n", argv[i]);
+			goto out;
+		}
+		pos = start;
+		owner_query(tool, &o, 0, o.nr_exts, start, end, &pos);
+		if (pos < end)
+			owner_print(tool, &o, pos, end, NULL);
+	}
+	retval = 0;
+	if (ferror(tool->out)) {
+		fprintf(stderr, "owner: write error\n");
+		retval = 1;
+	}
+out:
+	free(o.exts);
+	free(o.max_end);
+	free(o.inos);
+	free(o.names);
+	free(o.pool);
+	return retval;
+}
@@ -0,0 +1,718 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+#include "eotool.h"
+
+#ifdef _WIN32
+#define tar_popen(cmd)	_popen(cmd, "wb")
+#define tar_pclose	_pclose
+#else
+#define tar_popen(cmd)	popen(cmd, "w")
+#define tar_pclose	pclose
+#endif
+
+/*
+ * Streaming pax archive of a subtree.  The tree is listed first; then
+ * directories, links and special files are written, followed by regular
+ * files in order of their first physical block, with the next files'
+ * first extents prefetched into the partition cache.  Headers and data
+ * are put straight into a pool of archive buffers that a writer thread
+ * drains to the output, so reading overlaps writing.  A destination
+ * ending in ".zst" is fed to a zstd process, which compresses alongside.
+ *
+ * Every entry gets a pax header with its path and nanosecond times, and
+ * with the size, ids and link target when the ustar fields can't hold
+ * them, so nothing is cut short.
+ */
+#define TAR_BLOCK	512
+#define TAR_RECORD	(20 * TAR_BLOCK)	/* archives end on a record */
+#define TAR_IO		(1 << 20)		/* bytes per archive buffer */
+#define TAR_BUFS	8
+#define TAR_AHEAD	(32 << 20)		/* most file data prefetched ahead */
+#define TAR_ZSTD	"zstd -q -f -o"
+
+struct tar_entry {
+	char    *path;		/* in the image */
+	struct xstat st;
+	uint64_t first;		/* first physical byte and length of its run */
+	uint64_t first_len;
+};
+
+struct tar_buf {
+	char    *data;
+	size_t   len;
+	struct tar_buf *next;
+};
+
+struct tar {
+	struct eotool *tool;
+	filesys_t fs;
+	const char *src;
+	FILE    *out;
+	int      pipe;		/* out is a compressor */
+
+	struct tar_entry *meta;		/* directories, links and others */
+	size_t   nr_meta, max_meta;
+	struct tar_entry *files;	/* regular files */
+	size_t   nr_files, max_files;
+	char   **stack;			/* directories left to list */
+	size_t   nr_stack, max_stack;
+	char    *pax;
+	size_t   pax_len, max_pax;
+
+	xmutex_t lock;
+	xcond_t  cond;
+	struct tar_buf bufs[TAR_BUFS];
+	struct tar_buf *free_bufs;
+	struct tar_buf *head, *tail;	/* waiting for the writer */
+	struct tar_buf *cur;		/* being filled */
+	int      done;
+	int      error;		/* the output failed */
+
+	uint64_t written;
+	uint64_t data;
+	uint64_t links;
+	uint64_t skipped;
+	uint64_t errors;
+};
+
+static void tar_writer(void *arg)
+{
+	struct tar *t = arg;
+	struct tar_buf *b;
+	int error;
+
+	for (;;) {
+		xmutex_lock(t->lock);
+		while (!t->head && !t->done)
+			xcond_wait(t->cond, t->lock, -1);
+		b = t->head;
+		if (b) {
+			t->head = b->next;
+			if (!t->head)
+				t->tail = NULL;
+		}
+		error = t->error;
+		xmutex_unlock(t->lock);
+		if (!b)
+			break;
+
+		if (!error && fwrite(b->data, 1, b->len, t->out) != b->len)
+			error = 1;
+
+		xmutex_lock(t->lock);
+		t->error |= error;
+		b->len = 0;
+		b->next = t->free_bufs;
+		t->free_bufs = b;
+		xcond_broadcast(t->cond);
+		xmutex_unlock(t->lock);
+	}
+}
+
+/* Queue the buffer being filled and take a free one. */
+static int tar_flush(struct tar *t)
+{
+	struct tar_buf *b = t->cur;
+	int error;
+
+	t->written += b->len;
+	xmutex_lock(t->lock);
+	b->next = NULL;
+	if (t->tail)
+		t->tail->next = b;
+	else
+		t->head = b;
+	t->tail = b;
+	xcond_broadcast(t->cond);
+	while (!t->free_bufs)
+		xcond_wait(t->cond, t->lock, -1);
+	t->cur = t->free_bufs;
+	t->free_bufs = t->cur->next;
+	error = t->error;
+	xmutex_unlock(t->lock);
+	return error;
+}
+
+/* Room left in the buffer being filled, flushing it when full. */
+static char *tar_space(struct tar *t, size_t *room)
+{
+	if (t->cur->len == TAR_IO && tar_flush(t))
+		return NULL;
+	*room = TAR_IO - t->cur->len;
+	return t->cur->data + t->cur->len;
+}
+
+static int tar_put(struct tar *t, const void *p, size_t n)
+{
+	size_t room, k;
+	char *dst;
+
+	while (n) {
+		dst = tar_space(t, &room);
+		if (!dst)
+			return 1;
+		k = MIN(n, room);
+		if (p) {
+			memcpy(dst, p, k);
+			p = (const char *)p + k;
+		} else {
+			memset(dst, 0, k);
+		}
+		t->cur->len += k;
+		n -= k;
+	}
+	return 0;
+}
+
+static int tar_pad(struct tar *t, uint64_t size)
+{
+	return tar_put(t, NULL, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+static void tar_octal(char *field, int size, uint64_t v)
+{
+	/* Too large values are left zero; the pax header has them. */
+	if (v < (uint64_t)1 << (3 * (size - 1)))
+		sprintf(field, "%0*" PRIo64, size - 1, v);
+}
+
+static int tar_digits(size_t n)
+{
+	int d = 1;
+
+	while (n >= 10) {
+		n /= 10;
+		d++;
+	}
+	return d;
+}
+
+/* Append a "<length> key=value\n" record to the pax header being built. */
+static int tar_record(struct tar *t, const char *key, const char *value)
+{
+	size_t body = strlen(key) + strlen(value) + 3;
+	int digits = tar_digits(body);
+	size_t len;
+
+	/* The length counts its own digits. */
+	while (tar_digits(body + digits) != digits)
+		digits = tar_digits(body + digits);
+	len = body + digits;
+	if (!xgrow((void **)&t->pax, &t->max_pax, t->pax_len + len + 1, 1))
+		return 1;
+	sprintf(t->pax + t->pax_len, "%" PRIu64 " %s=%s\n", (uint64_t)len, key, value);
+	t->pax_len += len;
+	return 0;
+}
+
+static int tar_record_time(struct tar *t, const char *key, struct xtimespec *ts)
+{
+	char value[32];
+
+	if (ts->sec < 0 && ts->nsec)
+		sprintf(value, "-%" PRId64 ".%09u", -(ts->sec + 1), 1000000000 - ts->nsec);
+	else
+		sprintf(value, "%" PRId64 ".%09u", ts->sec, ts->nsec);
+	return tar_record(t, key, value);
+}
+
+static int tar_record_num(struct tar *t, const char *key, uint64_t v, int size)
+{
+	char value[24];
+
+	if (v < (uint64_t)1 << (3 * (size - 1)))
+		return 0;
+	sprintf(value, "%" PRIu64, v);
+	return tar_record(t, key, value);
+}
+
+static int tar_header(struct tar *t, const char *name, struct xstat *st, uint64_t size,
+		      char type, const char *link)
+{
+	char h[TAR_BLOCK];
+	unsigned sum = 0;
+	size_t len = strlen(name);
+	const char *slash;
+	int i;
+
+	memset(h, 0, sizeof h);
+	if (len <= 100) {
+		memcpy(h, name, len);
+	} else {
+		/* Split into prefix and name where it fits, else the pax path rules. */
+		slash = memchr(name + len - 101, '/', 101);
+		if (slash && slash - name <= 155 && slash[1]) {
+			memcpy(h + 345, name, slash - name);
+			memcpy(h, slash + 1, len - (slash - name) - 1);
+		} else {
+			memcpy(h, name, 100);
+		}
+	}
+	tar_octal(h + 100, 8, st->mode & 07777);
+	tar_octal(h + 108, 8, st->uid);
+	tar_octal(h + 116, 8, st->gid);
+	tar_octal(h + 124, 12, size);
+	tar_octal(h + 136, 12, st->mtime.sec > 0 ? st->mtime.sec : 0);
+	h[156] = type;
+	if (link)
+		strncpy(h + 157, link, 100);
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+
+	memset(h + 148, ' ', 8);
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += (uint8_t)h[i];
+	sprintf(h + 148, "%06o", sum);
+	h[155] = ' ';
+	return tar_put(t, h, TAR_BLOCK);
+}
+
+/* Write an entry's pax and ustar headers; name is its path in the archive. */
+static int tar_entry(struct tar *t, const char *name, struct xstat *st, uint64_t size,
+		     char type, const char *link)
+{
+	struct xstat pst;
+	const char *base = name;
+	size_t i, len = strlen(name);
+	char pname[100];
+
+	t->pax_len = 0;
+	if (tar_record(t, "path", name) ||
+	    (link && strlen(link) > 100 && tar_record(t, "linkpath", link)) ||
+	    tar_record_num(t, "size", size, 12) ||
+	    tar_record_num(t, "uid", st->uid, 8) ||
+	    tar_record_num(t, "gid", st->gid, 8) ||
+	    tar_record_time(t, "mtime", &st->mtime) ||
+	    tar_record_time(t, "atime", &st->atime) ||
+	    tar_record_time(t, "ctime", &st->ctime))
+		return 1;
+
+	/* The base name, ignoring the trailing slash of a directory. */
+	for (i = 0; i + 1 < len; i++)
+		if (name[i] == '/')
+			base = name + i + 1;
+	snprintf(pname, sizeof pname, "PaxHeaders/%s", base);
+	memset(&pst, 0, sizeof pst);
+	pst.mode = 0644;
+	pst.mtime = st->mtime;
+	if (tar_header(t, pname, &pst, t->pax_len, 'x', NULL) ||
+	    tar_put(t, t->pax, t->pax_len) || tar_pad(t, t->pax_len))
+		return 1;
+	return tar_header(t, name, st, size, type, link);
+}
+
+/* The archive name of an image path: relative, directories end in '/'. */
+static char *tar_name(const char *path, int is_dir)
+{
+	char *name;
+
+	while (*path == '/')
+		path++;
+	if (!*path)
+		return strdup("./");
+	name = malloc(strlen(path) + 2);
+	if (name)
+		sprintf(name, "%s%s", path, is_dir ? "/" : "");
+	return name;
+}
+
+static int tar_add(struct tar *t, struct tar_entry **array, size_t *nr, size_t *max,
+		   const char *path, struct xstat *st)
+{
+	struct tar_entry *e;
+
+	if (!xgrow((void **)array, max, *nr + 1, sizeof *e))
+		return 1;
+	e = &(*array)[*nr];
+	memset(e, 0, sizeof *e);
+	e->path = strdup(path);
+	if (!e->path)
+		return 1;
+	e->st = *st;
+	(*nr)++;
+	return 0;
+}
+
+struct tar_list {
+	struct tar *t;
+	const char *dir;
+};
+
+static int tar_list_entry(void *arg, const char *name, struct xstat *st, int is_dir)
+{
+	struct tar_list *l = arg;
+	struct tar *t = l->t;
+	struct tar_entry *e;
+	struct xextent ext;
+	file_entry_t file;
+	char *path;
+	int retval = 0;
+
+	if (!strcmp(name, ".."))
+		return 0;
+	if (!strcmp(name, "."))
+		return tar_add(t, &t->meta, &t->nr_meta, &t->max_meta, l->dir, st);
+
+	path = malloc(strlen(l->dir) + strlen(name) + 2);
+	if (!path)
+		return 1;
+	sprintf(path, "%s/%s", strcmp(l->dir, "/") ? l->dir : "", name);
+	if (is_dir) {
+		if (xgrow((void **)&t->stack, &t->max_stack, t->nr_stack + 1, sizeof *t->stack)) {
+			t->stack[t->nr_stack++] = path;
+			return 0;
+		}
+		retval = 1;
+	} else if (S_ISREG(st->mode)) {
+		retval = tar_add(t, &t->files, &t->nr_files, &t->max_files, path, st);
+		file = retval ? NULL : vfs_open(t->fs, path);
+		if (file) {
+			e = &t->files[t->nr_files - 1];
+			if (vfs_file_extent_map(file, t->fs, 0, &ext, 1) == 1 &&
+			    !(ext.flags & XEXTENT_INLINE)) {
+				e->first = ext.physical;
+				e->first_len = ext.length;
+			}
+			vfs_file_close(file, t->fs);
+		}
+	} else if (S_ISLNK(st->mode) || S_ISFIFO(st->mode)) {
+		retval = tar_add(t, &t->meta, &t->nr_meta, &t->max_meta, path, st);
+	} else {
+		/* Devices need numbers the vfs does not give; sockets are not archived. */
+		t->skipped++;
+	}
+	free(path);
+	return retval;
+}
+
+static int tar_list(struct tar *t)
+{
+	struct tar_list l;
+	char *dir;
+	int retval = 0;
+
+	l.t = t;
+	dir = strdup(t->src);
+	if (!dir)
+		return 1;
+	t->stack = malloc(sizeof *t->stack);
+	t->max_stack = t->stack ? 1 : 0;
+	if (!t->stack) {
+		free(dir);
+		return 1;
+	}
+	t->stack[t->nr_stack++] = dir;
+	while (t->nr_stack) {
+		dir = t->stack[--t->nr_stack];
+		l.dir = dir;
+		if (!retval && vfs_dir_iterate(t->fs, dir, tar_list_entry, &l)) {
+			fprintf(stderr, "tar: can't list %s\n", dir);
+			retval = 1;
+		}
+		free(dir);
+	}
+	free(t->stack);
+	return retval;
+}
+
+static int tar_cmp_file(const void *a, const void *b)
+{
+	const struct tar_entry *x = a, *y = b;
+
+	if (x->first != y->first)
+		return x->first < y->first ? -1 : 1;
+	return x->st.ino < y->st.ino ? -1 : x->st.ino > y->st.ino;
+}
+
+static int tar_write_meta(struct tar *t, struct tar_entry *e)
+{
+	char *name, *link = NULL;
+	int len, retval;
+	char type;
+
+	if (S_ISDIR(e->st.mode)) {
+		type = '5';
+	} else if (S_ISFIFO(e->st.mode)) {
+		type = '6';
+	} else {
+		type = '2';
+		len = vfs_readlink(t->fs, e->path, NULL, 0);
+		link = len < 0 ? NULL : malloc(len + 1);
+		if (!link || vfs_readlink(t->fs, e->path, link, len + 1) != len) {
+			fprintf(stderr, "tar: can't read link %s\n", e->path);
+			free(link);
+			t->errors++;
+			return 0;
+		}
+	}
+	name = tar_name(e->path, type == '5');
+	retval = !name || tar_entry(t, name, &e->st, 0, type, link);
+	free(name);
+	free(link);
+	return retval;
+}
+
+/* Prefetch the first runs of the files after i, up to ahead bytes. */
+static void tar_prefetch(struct tar *t, size_t i, size_t *next, uint64_t *queued, uint64_t ahead)
+{
+	struct tar_entry *e;
+	uint64_t len;
+
+	while (*next < t->nr_files && *queued < ahead) {
+		e = &t->files[(*next)++];
+		len = MIN(e->first_len, e->st.size);
+		if (!e->first || !len)
+			continue;
+		part_prefetch(t->tool->vol.part, e->first >> SECTOR_BITS,
+			      (len + SECTOR_SIZE - 1) >> SECTOR_BITS);
+		*queued += len;
+	}
+	e = &t->files[i];
+	*queued -= MIN(*queued, MIN(e->first_len, e->st.size));
+}
+
+static int tar_write_file(struct tar *t, struct tar_entry *e, struct tar_entry *prev)
+{
+	file_entry_t file;
+	uint64_t off = 0;
+	size_t room;
+	char *name, *dst, *link;
+	int n, retval;
+
+	name = tar_name(e->path, 0);
+	if (!name)
+		return 1;
+	/* Later names of a hard-linked inode sort right after the first one. */
+	if (prev && prev->st.ino == e->st.ino && e->st.nlinks > 1) {
+		link = tar_name(prev->path, 0);
+		retval = !link || tar_entry(t, name, &e->st, 0, '1', link);
+		t->links++;
+		free(link);
+		free(name);
+		return retval;
+	}
+	file = vfs_open(t->fs, e->path);
+	if (!file) {
+		fprintf(stderr, "tar: can't open %s\n", e->path);
+		t->errors++;
+		free(name);
+		return 0;
+	}
+	retval = tar_entry(t, name, &e->st, e->st.size, '0', NULL);
+	free(name);
+
+	/* Read into the archive buffers; what can't be read is sent as zeros. */
+	while (!retval && off < e->st.size) {
+		dst = tar_space(t, &room);
+		if (!dst) {
+			retval = 1;
+			break;
+		}
+		room = MIN(room, e->st.size - off);
+		n = vfs_file_read(file, t->fs, off, dst, room);
+		if (n <= 0) {
+			fprintf(stderr, "tar: read error in %s\n", e->path);
+			t->errors++;
+			retval = tar_put(t, NULL, e->st.size - off);
+			break;
+		}
+		t->cur->len += n;
+		off += n;
+	}
+	vfs_file_close(file, t->fs);
+	t->data += off;
+	return retval || tar_pad(t, e->st.size);
+}
+
+static int tar_write(struct tar *t)
+{
+	uint64_t ahead = MIN(TAR_AHEAD, (uint64_t)MAX(t->tool->cache_mb, 0) << 19);
+	uint64_t queued = 0;
+	size_t i, next = 0;
+
+	for (i = 0; i < t->nr_meta; i++)
+		if (tar_write_meta(t, &t->meta[i]))
+			return 1;
+	for (i = 0; i < t->nr_files; i++) {
+		if (ahead)
+			tar_prefetch(t, i, &next, &queued, ahead);
+		if (tar_write_file(t, &t->files[i], i ? &t->files[i - 1] : NULL))
+			return 1;
+	}
+	/* Two zero blocks end the archive, padded to a full record. */
+	if (tar_put(t, NULL, 2 * TAR_BLOCK))
+		return 1;
+	return tar_put(t, NULL, (TAR_RECORD - (t->written + t->cur->len) % TAR_RECORD) % TAR_RECORD);
+}
+
+/*
+ * The zstd command line with dest quoted for the shell: single quotes on
+ * POSIX, with embedded ones closed and escaped; double quotes for cmd.exe,
+ * which can't hold a '"' or a '%' safely.
+ */
+static char *tar_zstd_cmd(const char *dest)
+{
+	size_t len = strlen(dest);
+	char *cmd;
+#ifndef _WIN32
+	char *p;
+#endif
+
+#ifdef _WIN32
+	if (strpbrk(dest, "\"%")) {
+		fprintf(stderr, "tar: bad file name %s\n", dest);
+		return NULL;
+	}
+	cmd = malloc(sizeof TAR_ZSTD + len + 3);
+	if (cmd)
+		sprintf(cmd, TAR_ZSTD " \"%s\"", dest);
+#else
+	cmd = malloc(sizeof TAR_ZSTD + 4 * len + 3);
+	if (!cmd)
+		return NULL;
+	p = cmd + sprintf(cmd, TAR_ZSTD " '");
+	for (; *dest; dest++) {
+		if (*dest == '\'') {
+			memcpy(p, "'\\''", 4);
+			p += 4;
+		} else {
+			*p++ = *dest;
+		}
+	}
+	strcpy(p, "'");
+#endif
+	return cmd;
+}
+
+static FILE *tar_open(struct tar *t, const char *dest)
+{
+	size_t len = strlen(dest);
+	char *cmd;
+	FILE *fp;
+
+	if (len < 4 || strcmp(dest + len - 4, ".zst"))
+		return eotool_create(dest, 0);
+	cmd = tar_zstd_cmd(dest);
+	if (!cmd)
+		return NULL;
+	fflush(NULL);
+	fp = tar_popen(cmd);
+	if (!fp)
+		fprintf(stderr, "tar: can't run %s\n", cmd);
+	free(cmd);
+	t->pipe = fp != NULL;
+	return fp;
+}
+
+int eotool_tar(struct eotool *tool, int argc, char *argv[])
+{
+	struct tar t;
+	uint64_t start = xclock_ms(), ms;
+	xthread_t writer = NULL;
+	char *src = NULL;
+	size_t i;
+	int retval = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "tar: need a path and a destination\n");
+		return 1;
+	}
+	memset(&t, 0, sizeof t);
+	t.tool = tool;
+	t.fs = tool->vol.fs;
+	t.lock = xmutex_create();
+	t.cond = xcond_create();
+	src = strdup(argv[0]);
+	if (!t.lock || !t.cond || !src)
+		goto out;
+	for (i = strlen(src); i > 1 && src[i - 1] == '/'; i--)
+		src[i - 1] = '\0';
+	t.src = src;
+	for (i = 0; i < TAR_BUFS; i++) {
+		t.bufs[i].data = malloc(TAR_IO);
+		if (!t.bufs[i].data)
+			goto out;
+		t.bufs[i].next = t.free_bufs;
+		t.free_bufs = &t.bufs[i];
+	}
+	t.cur = t.free_bufs;
+	t.free_bufs = t.cur->next;
+
+	if (tar_list(&t))
+		goto out;
+	qsort(t.files, t.nr_files, sizeof *t.files, tar_cmp_file);
+
+	t.out = tar_open(&t, argv[1]);
+	if (!t.out)
+		goto out;
+	writer = xthread_create(tar_writer, &t);
+	if (!writer) {
+		eotool_close(t.out);
+		goto out;
+	}
+	retval = tar_write(&t);
+	if (!retval && t.cur->len)
+		retval = tar_flush(&t);
+	xmutex_lock(t.lock);
+	t.done = 1;
+	xcond_broadcast(t.cond);
+	xmutex_unlock(t.lock);
+	xthread_join(writer);
+
+	if (t.pipe ? tar_pclose(t.out) != 0 : eotool_close(t.out))
+		t.error = 1;
+	if (t.error)
+		fprintf(stderr, "tar: write error\n");
+	retval = retval || t.error || t.errors;
+
+	ms = xclock_ms() - start;
+	fprintf(stderr, "%" PRIu64 " directories and others, %" PRIu64 " files (%" PRIu64 " links), "
+		"%" PRIu64 " MB archived in %" PRIu64 " ms (%" PRIu64 " MB/s), %" PRIu64 " skipped, %" PRIu64 " errors\n",
+		(uint64_t)t.nr_meta, (uint64_t)t.nr_files, t.links, t.data >> 20, ms,
+		eotool_rate(t.data, ms) >> 20, t.skipped, t.errors);
+out:
+	for (i = 0; i < t.nr_meta; i++)
+		free(t.meta[i].path);
+	for (i = 0; i < t.nr_files; i++)
+		free(t.files[i].path);
+	for (i = 0; i < TAR_BUFS; i++)
+		free(t.bufs[i].data);
+	free(t.meta);
+	free(t.files);
+	free(t.pax);
+	free(src);
+	if (t.cond)
+		xcond_destroy(t.cond);
+	if (t.lock)
+		xmutex_destroy(t.lock);
+	return retval;
+}
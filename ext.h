@@ -105,6 +105,17 @@ struct ext2_sblock {
 	char volume_name[16];
 	char last_mounted_on[64];
 	uint32_t compression_info;
+	uint8_t  prealloc_blocks;
+	uint8_t  prealloc_dir_blocks;
+	uint16_t reserved_gdt_blocks;
+	uint8_t  journal_uuid[16];
+	uint32_t journal_inode;
+	uint32_t journal_dev;
+	uint32_t last_orphan;
+	uint32_t hash_seed[4];
+	uint8_t  default_hash_version;
+	uint8_t  journal_backup_type;
+	uint16_t desc_size;	/* group descriptor size, 64bit only */
 };
 
 struct ext2_block_group {
@@ -120,6 +131,29 @@ struct ext2_block_group {
 	uint16_t bg_checksum;	/* crc16(s_uuid+grouo_num+group_desc)*/
 };
 
+/* With the 64bit feature, high halves follow the first 32 bytes. */
+struct ext4_block_group_hi {
+	uint32_t block_id_hi;
+	uint32_t inode_id_hi;
+	uint32_t inode_table_id_hi;
+	uint16_t free_blocks_hi;
+	uint16_t free_inodes_hi;
+	uint16_t used_dir_cnt_hi;
+	uint16_t itable_unused_hi;
+};
+
+/* The in-memory group descriptor, decoded once at mount. */
+struct ext2fs_group {
+	uint64_t block_bitmap;
+	uint64_t inode_bitmap;
+	uint64_t inode_table;
+	uint32_t free_blocks;
+	uint32_t free_inodes;
+	uint32_t used_dirs;
+	uint32_t itable_unused;
+	uint16_t flags;
+};
+
 /* The ext2 inode. */
 struct ext2_inode {
 	uint16_t mode;
@@ -150,6 +184,48 @@ struct ext2_inode {
 	uint32_t osd2[3];
 };
 
+/*
+ * Fields following the 128-byte ext2 inode in a large inode.  Only the
+ * first extra_isize bytes of this area are valid.
+ */
+struct ext2_inode_extra {
+	uint16_t extra_isize;
+	uint16_t checksum_hi;
+	uint32_t ctime_extra;	/* extra change time (nsec << 2 | epoch) */
+	uint32_t mtime_extra;	/* extra modification time */
+	uint32_t atime_extra;	/* extra access time */
+	uint32_t crtime;	/* file creation time */
+	uint32_t crtime_extra;	/* extra file creation time */
+	uint32_t version_hi;
+	uint32_t projid;
+};
+
+/* A decoded inode timestamp. */
+struct ext2_timespec {
+	int64_t  sec;
+	uint32_t nsec;
+};
+
+/* The in-memory inode, decoded once from the full on-disk record. */
+struct ext2fs_inode {
+	struct ext2_inode raw;	/* first 128 bytes, as stored on disk */
+	uint16_t mode;
+	uint16_t nlinks;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t flags;
+	uint64_t size;
+	uint64_t blocks;	/* Blocks of 512 bytes */
+	uint32_t dtime;
+	uint16_t extra_isize;
+	struct ext2_timespec atime;
+	struct ext2_timespec ctime;
+	struct ext2_timespec mtime;
+	struct ext2_timespec crtime;
+	char *inline_data;	/* i_block + system.data, if inline */
+	uint32_t inline_size;
+};
+
 /* The header of an ext2 directory entry. */
 struct ext2_dirent {
 	uint32_t inode;
@@ -158,21 +234,28 @@ struct ext2_dirent {
 	uint8_t filetype;
 };
 
-struct ext2fs_node {
-	struct ext2_data *data;
-	struct ext2_inode inode;
+/* Length of a directory entry holding a name of name_len bytes. */
+#define EXT2_DIR_REC_LEN(name_len)	(((name_len) + 8 + 3) & ~3)
+
+/* A run of logically contiguous blocks, decoded from the block map. */
+struct ext2fs_run {
+	uint32_t lblk;		/* first logical block */
+	uint32_t len;		/* number of blocks */
+	uint64_t pblk;		/* first physical block */
+	uint32_t flags;
+};
 
-	uint32_t *indir1_block;
-	int indir1_size;
-	int indir1_blkno;
+#define EXT2FS_RUN_UNWRITTEN	0x0001	/* allocated, reads as zeroes */
 
-	uint32_t *indir2_block;
-	int indir2_size;
-	int indir2_blkno;
+struct ext2fs_node {
+	struct ext2_data *data;
+	struct ext2fs_inode inode;
 
-	uint32_t *indir3_block;
-	int indir3_size;
-	int indir3_blkno;
+	/* Block map, sorted by lblk; holes are not stored. */
+	struct ext2fs_run *runs;
+	int nr_runs;
+	int max_runs;
+	int runs_read;
 
 	int ino;
 	int inode_read;
@@ -181,7 +264,7 @@ struct ext2fs_node {
 /* Information about a "mounted" ext2 filesystem. */
 struct ext2_data {
 	struct ext2_sblock sblock;
-	struct ext2_inode *inode;
+	struct ext2fs_inode *inode;
 	struct ext2fs_node diropen;
 };
 
@@ -24,10 +24,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include "ext.h"
 #include "ext4.h"
 #include "disk.h"
 #include "fs.h"
+#include "util.h"
+#include "thread.h"
 
 struct filesys_spec {
 	struct ext_filesystem extfs;
@@ -36,560 +39,1081 @@ struct filesys_spec {
 struct ext2fs_file_entry {
 	struct file_entry  base;
 	struct ext2fs_node *ext4fs_file;
+	/* Sequential readahead state */
+	int64_t            next_pos;	/* offset a sequential reader asks for next */
+	int                seq_reads;
+	uint64_t           ra_end;	/* prefetch has been issued up to here */
+	uint64_t           ra_window;
+	uint64_t           ra_rate;	/* reader throughput, bytes per second */
+	uint64_t           ra_time;	/* clock of the previous read, ms */
 };
 
-static struct ext4_extent_header *ext4fs_get_extent_block(struct ext_filesystem *fs,
-	struct ext2_data *data, char *buf,
-		struct ext4_extent_header *ext_block,
-		uint32_t fileblock, int log2_blksz);
+static void ext4fs_release_node(struct ext2fs_node *node)
+{
+	free(node->runs);
+	free(node->inode.inline_data);
+	free(node);
+}
 
 static void ext4fs_free_node(struct ext_filesystem *fs, struct ext2fs_node *node, struct ext2fs_node *currroot)
 {
 	if (!node) {
 		return;
 	}
-	if ((node != &fs->ext4fs_root->diropen) && (node != currroot)) {
-		free(node->indir1_block);
-		free(node->indir2_block);
-		free(node->indir3_block);
-		free(node);
-	}
+	if ((node != &fs->ext4fs_root->diropen) && (node != currroot))
+		ext4fs_release_node(node);
 }
 
-long int read_allocated_block1(struct ext_filesystem *fs, struct ext2fs_node *fsinode, int fileblock)
+static int ext4fs_is_inline_dir(struct ext2fs_inode *inode)
 {
-	long int blknr;
-	int blksz;
-	int log2_blksz;
-	int status;
-	long int rblock;
-	long int perblock_parent;
-	long int perblock_child;
-	unsigned long long start;
-	struct ext2_inode *inode = &fsinode->inode;
-
-	/* get the blocksize of the filesystem */
-	blksz = EXT2_BLOCK_SIZE(fs->ext4fs_root);
-	log2_blksz = LOG2_EXT2_BLOCK_SIZE(fs->ext4fs_root);
-	if (inode->flags & EXT4_EXTENTS_FL) {
-		char *buf = zalloc(blksz);
-		if (!buf)
-			return -1;
-		struct ext4_extent_header *ext_block;
-		struct ext4_extent *extent;
-		int i = -1;
-		ext_block = ext4fs_get_extent_block(fs, fs->ext4fs_root, buf,
-						    (struct ext4_extent_header*)inode->b.blocks.dir_blocks,
-						    fileblock, log2_blksz);
-		if (!ext_block) {
-			printf("invalid extent block\n");
-			free(buf);
-			return -2;
-		}
+	return (inode->flags & EXT4_INLINE_DATA_FL) &&
+		(inode->mode & FILETYPE_INO_MASK) == FILETYPE_INO_DIRECTORY;
+}
 
-		extent = (struct ext4_extent *)(ext_block + 1);
+/* Length of the byte stream ext4fs_read_file serves for an inode. */
+static uint64_t ext4fs_data_size(struct ext2fs_inode *inode)
+{
+	if (ext4fs_is_inline_dir(inode))
+		return inode->inline_size;
+	return inode->size;
+}
 
-		do {
-			i++;
-			if (i >= ext_block->eh_entries)
-				break;
-		} while (fileblock >= extent[i].ee_block);
-		if (--i >= 0) {
-			fileblock -= extent[i].ee_block;
-			if (fileblock >= extent[i].ee_len) {
-				free(buf);
-				return 0;
-			}
+/* Serve a read of an inline-data inode from the already-loaded bytes. */
+static int ext4fs_read_inline(struct ext2fs_node *node, int64_t pos,
+		unsigned int len, char *buf)
+{
+	uint64_t filesize = ext4fs_data_size(&node->inode);
+	unsigned int ncopy = 0;
 
-			start = extent[i].ee_start_hi;
-			start = (start << 32) + extent[i].ee_start_lo;
-			free(buf);
-			return fileblock + start;
+	if (pos < 0 || pos >= filesize)
+		return 0;
+	if (len > filesize - pos)
+		len = filesize - pos;
+
+	if (pos < node->inode.inline_size)
+		ncopy = MIN(len, node->inode.inline_size - pos);
+	memcpy(buf, node->inode.inline_data + pos, ncopy);
+	memset(buf + ncopy, 0, len - ncopy);
+	return len;
+}
+
+static int ext4fs_add_run(struct ext2fs_node *node, uint32_t lblk, uint32_t len,
+		uint64_t pblk, uint32_t flags)
+{
+	struct ext2fs_run *run;
+
+	/* Extend the last run if this one continues it on disk. */
+	if (node->nr_runs) {
+		run = &node->runs[node->nr_runs - 1];
+		if (run->lblk + run->len == lblk && run->pblk + run->len == pblk &&
+		    run->flags == flags && run->len <= UINT32_MAX - len) {
+			run->len += len;
+			return 1;
 		}
+	}
 
-		printf("Extent Error\n");
-		free(buf);
-		return -1;
+	if (node->nr_runs == node->max_runs) {
+		int max = node->max_runs ? node->max_runs * 2 : 16;
+
+		run = realloc(node->runs, max * sizeof *run);
+		if (!run)
+			return 0;
+		node->runs = run;
+		node->max_runs = max;
 	}
+	run = &node->runs[node->nr_runs++];
+	run->lblk  = lblk;
+	run->len   = len;
+	run->pblk  = pblk;
+	run->flags = flags;
+	return 1;
+}
 
-	/* Direct blocks. */
-	if (fileblock < INDIRECT_BLOCKS)
-		blknr = (inode->b.blocks.dir_blocks[fileblock]);
-
-	/* Indirect. */
-	else if (fileblock < (INDIRECT_BLOCKS + (blksz / 4))) {
-		if (fsinode->indir1_block == NULL) {
-			fsinode->indir1_block = zalloc(blksz);
-			if (fsinode->indir1_block == NULL) {
-				printf("** SI ext2fs read block (indir 1)"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir1_size = blksz;
-			fsinode->indir1_blkno = -1;
-		}
-		if (blksz != fsinode->indir1_size) {
-			free(fsinode->indir1_block);
-			fsinode->indir1_block = NULL;
-			fsinode->indir1_size = 0;
-			fsinode->indir1_blkno = -1;
-			fsinode->indir1_block = zalloc(blksz);
-			if (fsinode->indir1_block == NULL) {
-				printf("** SI ext2fs read block (indir 1):"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir1_size = blksz;
-		}
-		if (((inode->b.blocks.indir_block) <<
-		     log2_blksz) != fsinode->indir1_blkno) {
-			status = vfs_devread(fs->dev_desc,
-					   (inode->b.blocks.
-					    indir_block) << log2_blksz, 0,
-					   blksz, (char *)fsinode->indir1_block);
-			if (status == 0) {
-				printf("** SI ext2fs read block (indir 1)"
-					"failed. **\n");
-				return 0;
-			}
-			fsinode->indir1_blkno =
-				(inode->b.blocks.indir_block) << log2_blksz;
+static int ext4fs_check_extent_header(struct ext4_extent_header *ext_block,
+		int bufsz)
+{
+	return ext_block->eh_magic == EXT4_EXT_MAGIC &&
+		ext_block->eh_entries <= ext_block->eh_max &&
+		sizeof *ext_block + ext_block->eh_entries *
+		sizeof(struct ext4_extent) <= bufsz;
+}
+
+/* Append the extents of a leaf node to the run list. */
+static int ext4fs_add_leaf_runs(struct ext2fs_node *node,
+		struct ext4_extent_header *ext_block)
+{
+	struct ext4_extent *extent = (struct ext4_extent *)(ext_block + 1);
+	uint64_t block;
+	int i;
+
+	for (i = 0; i < ext_block->eh_entries; i++) {
+		uint32_t len = extent[i].ee_len, flags = 0;
+
+		if (len > EXT_INIT_MAX_LEN) {
+			len -= EXT_INIT_MAX_LEN;
+			flags |= EXT2FS_RUN_UNWRITTEN;
 		}
-		blknr = (fsinode->indir1_block[fileblock - INDIRECT_BLOCKS]);
+		block = extent[i].ee_start_hi;
+		block = (block << 32) + extent[i].ee_start_lo;
+		if (!ext4fs_add_run(node, extent[i].ee_block, len, block, flags))
+			return 0;
 	}
-	/* Double indirect. */
-	else if (fileblock < (INDIRECT_BLOCKS + (blksz / 4 *
-					(blksz / 4 + 1)))) {
-
-		long int perblock = blksz / 4;
-		long int rblock = fileblock - (INDIRECT_BLOCKS + blksz / 4);
-
-		if (fsinode->indir1_block == NULL) {
-			fsinode->indir1_block = zalloc(blksz);
-			if (fsinode->indir1_block == NULL) {
-				printf("** DI ext2fs read block (indir 2 1)"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir1_size = blksz;
-			fsinode->indir1_blkno = -1;
-		}
-		if (blksz != fsinode->indir1_size) {
-			free(fsinode->indir1_block);
-			fsinode->indir1_block = NULL;
-			fsinode->indir1_size = 0;
-			fsinode->indir1_blkno = -1;
-			fsinode->indir1_block = zalloc(blksz);
-			if (fsinode->indir1_block == NULL) {
-				printf("** DI ext2fs read block (indir 2 1)"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir1_size = blksz;
-		}
-		if (((inode->b.blocks.double_indir_block) <<
-		     log2_blksz) != fsinode->indir1_blkno) {
-			status =
-			    vfs_devread(fs->dev_desc,
-					   (inode->b.blocks.
-					    double_indir_block) << log2_blksz,
-					   0, blksz,
-					   (char *)fsinode->indir1_block);
-			if (status == 0) {
-				printf("** DI ext2fs read block (indir 2 1)"
-					"failed. **\n");
-				return -1;
-			}
-			fsinode->indir1_blkno =
-			    (inode->b.blocks.double_indir_block) <<
-			    log2_blksz;
-		}
+	return 1;
+}
 
-		if (fsinode->indir2_block == NULL) {
-			fsinode->indir2_block = zalloc(blksz);
-			if (fsinode->indir2_block == NULL) {
-				printf("** DI ext2fs read block (indir 2 2)"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir2_size = blksz;
-			fsinode->indir2_blkno = -1;
-		}
-		if (blksz != fsinode->indir2_size) {
-			free(fsinode->indir2_block);
-			fsinode->indir2_block = NULL;
-			fsinode->indir2_size = 0;
-			fsinode->indir2_blkno = -1;
-			fsinode->indir2_block = zalloc(blksz);
-			if (fsinode->indir2_block == NULL) {
-				printf("** DI ext2fs read block (indir 2 2)"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir2_size = blksz;
-		}
-		if (((fsinode->indir1_block[rblock / perblock]) <<
-		     log2_blksz) !=fsinode->indir2_blkno) {
-			status = vfs_devread(fs->dev_desc,
-						(fsinode->indir1_block
-						 [rblock /
-						  perblock]) << log2_blksz, 0,
-						blksz,
-						(char *)fsinode->indir2_block);
-			if (status == 0) {
-				printf("** DI ext2fs read block (indir 2 2)"
-					"failed. **\n");
-				return -1;
-			}
-			fsinode->indir2_blkno =(fsinode->indir1_block[rblock/perblock]) << log2_blksz;
+struct ext4_tree_block {
+	uint64_t pblk;
+	int slot;
+};
+
+static int ext4fs_cmp_tree_block(const void *a, const void *b)
+{
+	const struct ext4_tree_block *x = a, *y = b;
+
+	return x->pblk < y->pblk ? -1 : x->pblk > y->pblk;
+}
+
+/*
+ * Read a batch of tree blocks, block i into buf + slot * blksz.  The
+ * batch is issued in ascending disk order and physically adjacent blocks
+ * are fetched with a single request.
+ */
+static int ext4fs_read_tree_blocks(struct ext_filesystem *fs, struct ext2_data *data,
+		struct ext4_tree_block *blk, int n, char *buf)
+{
+	int i, j, k, status;
+	char *tmp;
+
+	qsort(blk, n, sizeof *blk, ext4fs_cmp_tree_block);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && blk[j].pblk == blk[j - 1].pblk + 1; j++)
+			;
+		tmp = malloc((size_t)(j - i) * fs->blksz);
+		if (!tmp)
+			return 0;
+		status = vfs_devread(fs->dev_desc, blk[i].pblk << LOG2_EXT2_BLOCK_SIZE(data),
+				0, (j - i) * fs->blksz, tmp);
+		if (status == 0) {
+			free(tmp);
+			return 0;
 		}
-		blknr = fsinode->indir2_block[rblock % perblock];
+		for (k = i; k < j; k++)
+			memcpy(buf + (size_t)blk[k].slot * fs->blksz,
+			       tmp + (size_t)(k - i) * fs->blksz, fs->blksz);
+		free(tmp);
 	}
-	/* Tripple indirect. */
-	else {
-		rblock = fileblock - (INDIRECT_BLOCKS + blksz / 4 +
-				      (blksz / 4 * blksz / 4));
-		perblock_child = blksz / 4;
-		perblock_parent = ((blksz / 4) * (blksz / 4));
-
-		if (fsinode->indir1_block == NULL) {
-			fsinode->indir1_block = zalloc(blksz);
-			if (fsinode->indir1_block == NULL) {
-				printf("** TI ext2fs read block (indir 2 1)"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir1_size = blksz;
-			fsinode->indir1_blkno = -1;
-		}
-		if (blksz != fsinode->indir1_size) {
-			free(fsinode->indir1_block);
-			fsinode->indir1_block = NULL;
-			fsinode->indir1_size = 0;
-			fsinode->indir1_blkno = -1;
-			fsinode->indir1_block = zalloc(blksz);
-			if (fsinode->indir1_block == NULL) {
-				printf("** TI ext2fs read block (indir 2 1)"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir1_size = blksz;
-		}
-		if (((inode->b.blocks.triple_indir_block) <<
-		     log2_blksz) != fsinode->indir1_blkno) {
-			status = vfs_devread(fs->dev_desc,inode->b.blocks.triple_indir_block << log2_blksz, 0, blksz,
-			     (char *)fsinode->indir1_block);
-			if (status == 0) {
-				printf("** TI ext2fs read block (indir 2 1)"
-					"failed. **\n");
-				return -1;
+	return 1;
+}
+
+/*
+ * Append the leaves below a set of index nodes, all at the given depth,
+ * to the run list.  Their children are fetched a level at a time, in
+ * batches of up to EXT4_EXTENT_BATCH bytes, and walked in logical order.
+ */
+static int ext4fs_load_extent_level(struct ext_filesystem *fs, struct ext2fs_node *node,
+		struct ext4_extent_header **hdr, int nhdr, int depth)
+{
+	int per_batch = MAX(EXT4_EXTENT_BATCH / (int)fs->blksz, 1);
+	struct ext4_extent_header **child = NULL;
+	struct ext4_tree_block *blk = NULL;
+	struct ext4_extent_idx *index;
+	char *buf = NULL;
+	int h = 0, i = 0, n, k, ret = 0;
+
+	blk = calloc(per_batch, sizeof *blk);
+	child = calloc(per_batch, sizeof *child);
+	buf = malloc((size_t)per_batch * fs->blksz);
+	if (!blk || !child || !buf)
+		goto out;
+
+	while (h < nhdr) {
+		/* Collect the next batch of children, in logical order. */
+		for (n = 0; n < per_batch && h < nhdr; ) {
+			if (i >= hdr[h]->eh_entries) {
+				i = 0;
+				h++;
+				continue;
 			}
-			fsinode->indir1_blkno =
-			    (inode->b.blocks.triple_indir_block) <<
-			    log2_blksz;
+			index = (struct ext4_extent_idx *)(hdr[h] + 1);
+			blk[n].pblk = ((uint64_t)index[i].ei_leaf_hi << 32) + index[i].ei_leaf_lo;
+			blk[n].slot = n;
+			n++;
+			i++;
 		}
+		if (n == 0)
+			break;
+
+		if (!ext4fs_read_tree_blocks(fs, node->data, blk, n, buf))
+			goto out;
 
-		if (fsinode->indir2_block == NULL) {
-			fsinode->indir2_block = zalloc(blksz);
-			if (fsinode->indir2_block == NULL) {
-				printf("** TI ext2fs read block (indir 2 2)"
-					"malloc failed. **\n");
-				return -1;
+		for (k = 0; k < n; k++) {
+			child[k] = (struct ext4_extent_header *)(buf + (size_t)k * fs->blksz);
+			if (!ext4fs_check_extent_header(child[k], fs->blksz) ||
+			    child[k]->eh_depth != depth - 1) {
+				fprintf(stderr, "invalid extent block\n");
+				goto out;
 			}
-			fsinode->indir2_size = blksz;
-			fsinode->indir2_blkno = -1;
 		}
-		if (blksz != fsinode->indir2_size) {
-			free(fsinode->indir2_block);
-			fsinode->indir2_block = NULL;
-			fsinode->indir2_size = 0;
-			fsinode->indir2_blkno = -1;
-			fsinode->indir2_block = zalloc(blksz);
-			if (fsinode->indir2_block == NULL) {
-				printf("** TI ext2fs read block (indir 2 2)"
-					"malloc failed. **\n");
-				return -1;
-			}
-			fsinode->indir2_size = blksz;
+
+		if (depth - 1 == 0) {
+			for (k = 0; k < n; k++)
+				if (!ext4fs_add_leaf_runs(node, child[k]))
+					goto out;
+		} else if (!ext4fs_load_extent_level(fs, node, child, n, depth - 1)) {
+			goto out;
 		}
-		if (((fsinode->indir1_block[rblock /
-						       perblock_parent]) <<
-		     log2_blksz)!= fsinode->indir2_blkno) {
-			status = vfs_devread(fs->dev_desc,
-						(fsinode->indir1_block
-						 [rblock /
-						  perblock_parent]) <<
-						log2_blksz, 0, blksz,
-						(char *)fsinode->indir2_block);
-			if (status == 0) {
-				printf("** TI ext2fs read block (indir 2 2)"
-					"failed. **\n");
-				return -1;
-			}
-			fsinode->indir2_blkno =
-			    (fsinode->indir1_block[rblock /
-							      perblock_parent])
-			    << log2_blksz;
+	}
+	ret = 1;
+out:
+	free(buf);
+	free(child);
+	free(blk);
+	return ret;
+}
+
+static int ext4fs_cmp_run(const void *a, const void *b)
+{
+	const struct ext2fs_run *x = a, *y = b;
+
+	return x->lblk < y->lblk ? -1 : x->lblk > y->lblk;
+}
+
+/* Sort the run list by logical block and merge runs that touch. */
+static void ext4fs_sort_runs(struct ext2fs_node *node)
+{
+	struct ext2fs_run *runs = node->runs;
+	int i, n = node->nr_runs;
+
+	qsort(runs, n, sizeof *runs, ext4fs_cmp_run);
+	node->nr_runs = 0;
+	for (i = 0; i < n; i++)
+		ext4fs_add_run(node, runs[i].lblk, runs[i].len, runs[i].pblk, runs[i].flags);
+}
+
+/* An indirect block still to be read, and what it maps. */
+struct ext2_indir_block {
+	uint64_t pblk;
+	uint64_t lblk;		/* first file block mapped below it */
+	int level;		/* 1: holds data block numbers */
+};
+
+/*
+ * Decode an ext2/ext3 block map into the run list.  The indirect blocks
+ * are read a level at a time, each level in batches sorted by disk
+ * address, so the single, double and triple indirect blocks cost a few
+ * large reads instead of one read per lookup.
+ */
+static int ext4fs_load_block_map(struct ext_filesystem *fs, struct ext2fs_node *node)
+{
+	uint32_t *dir_blocks = node->inode.raw.b.blocks.dir_blocks;
+	uint64_t per = fs->blksz / 4, nblocks, span, first;
+	uint32_t top[3];
+	int per_batch = MAX(EXT4_EXTENT_BATCH / (int)fs->blksz, 1);
+	struct ext2_indir_block *cur = NULL, *next = NULL, *tmp;
+	int ncur = 0, nnext = 0, maxnext = 0, i, k, n;
+	struct ext4_tree_block *blk = NULL;
+	uint32_t *buf = NULL;
+	int ret = 0;
+
+	nblocks = (node->inode.size + fs->blksz - 1) / fs->blksz;
+	nblocks = MIN(nblocks, (uint64_t)UINT32_MAX);
+
+	for (i = 0; i < INDIRECT_BLOCKS && i < nblocks; i++)
+		if (dir_blocks[i] && !ext4fs_add_run(node, i, 1, dir_blocks[i], 0))
+			return 0;
+
+	cur = calloc(3, sizeof *cur);
+	blk = calloc(per_batch, sizeof *blk);
+	buf = malloc((size_t)per_batch * fs->blksz);
+	if (!cur || !blk || !buf)
+		goto out;
+
+	/* The single, double and triple indirect blocks. */
+	top[0] = node->inode.raw.b.blocks.indir_block;
+	top[1] = node->inode.raw.b.blocks.double_indir_block;
+	top[2] = node->inode.raw.b.blocks.triple_indir_block;
+	for (i = 0, span = 1, first = INDIRECT_BLOCKS; i < 3; i++) {
+		span *= per;
+		if (top[i] && first < nblocks) {
+			cur[ncur].pblk  = top[i];
+			cur[ncur].lblk  = first;
+			cur[ncur].level = i + 1;
+			ncur++;
 		}
+		first += span;
+	}
 
-		if (fsinode->indir3_block == NULL) {
-			fsinode->indir3_block = zalloc(blksz);
-			if (fsinode->indir3_block == NULL) {
-				printf("** TI ext2fs read block (indir 2 2)"
-					"malloc failed. **\n");
-				return -1;
+	while (ncur) {
+		nnext = 0;
+		for (i = 0; i < ncur; i += n) {
+			n = MIN(ncur - i, per_batch);
+			for (k = 0; k < n; k++) {
+				if (cur[i + k].pblk >= fs->total_blocks) {
+					fprintf(stderr, "invalid indirect block\n");
+					goto out;
+				}
+				blk[k].pblk = cur[i + k].pblk;
+				blk[k].slot = k;
 			}
-			fsinode->indir3_size = blksz;
-			fsinode->indir3_blkno = -1;
-		}
-		if (blksz != fsinode->indir3_size) {
-			free(fsinode->indir3_block);
-			fsinode->indir3_block = NULL;
-			fsinode->indir3_size = 0;
-			fsinode->indir3_blkno = -1;
-			fsinode->indir3_block = zalloc(blksz);
-			if (fsinode->indir3_block == NULL) {
-				printf("** TI ext2fs read block (indir 2 2)"
-					"malloc failed. **\n");
-				return -1;
+			if (!ext4fs_read_tree_blocks(fs, node->data, blk, n, (char *)buf))
+				goto out;
+
+			for (k = 0; k < n; k++) {
+				struct ext2_indir_block *ib = &cur[i + k];
+				uint32_t *ptr = buf + (size_t)k * per;
+				uint64_t j, child = 1;
+				int l;
+
+				for (l = 1; l < ib->level; l++)
+					child *= per;
+				for (j = 0; j < per && ib->lblk + j * child < nblocks; j++) {
+					if (!ptr[j])
+						continue;
+					if (ib->level == 1) {
+						if (!ext4fs_add_run(node, ib->lblk + j, 1, ptr[j], 0))
+							goto out;
+						continue;
+					}
+					if (nnext == maxnext) {
+						maxnext = maxnext ? maxnext * 2 : per;
+						tmp = realloc(next, maxnext * sizeof *next);
+						if (!tmp)
+							goto out;
+						next = tmp;
+					}
+					next[nnext].pblk  = ptr[j];
+					next[nnext].lblk  = ib->lblk + j * child;
+					next[nnext].level = ib->level - 1;
+					nnext++;
+				}
 			}
-			fsinode->indir3_size = blksz;
 		}
-		if (((fsinode->indir2_block[rblock / perblock_child]) << log2_blksz) != fsinode->indir3_blkno) {
-			status = vfs_devread(fs->dev_desc,
-					   (fsinode->indir2_block
-					    [(rblock / perblock_child)
-					     % (blksz / 4)]) << log2_blksz, 0,
-					   blksz, (char *)fsinode->indir3_block);
-			if (status == 0) {
-				printf("** TI ext2fs read block (indir 2 2)"
-				       "failed. **\n");
-				return -1;
-			}
-			fsinode->indir3_blkno =
-			    (fsinode->indir2_block[(rblock /
-							       perblock_child) %
-							      (blksz /
-							       4)]) <<
-			    log2_blksz;
+		free(cur);
+		cur = next;
+		ncur = nnext;
+		next = NULL;
+		maxnext = 0;
+	}
+	ext4fs_sort_runs(node);
+	ret = 1;
+out:
+	free(buf);
+	free(blk);
+	free(next);
+	free(cur);
+	return ret;
+}
+
+/*
+ * Decode the whole block map of a node into its run list, once.  The
+ * extent leaves are visited in logical order, so the list comes out
+ * sorted.
+ */
+int ext4fs_load_runs(struct ext_filesystem *fs, struct ext2fs_node *node)
+{
+	struct ext4_extent_header *ext_block;
+	int status;
+
+	if (node->runs_read)
+		return 1;
+
+	if (!(node->inode.flags & EXT4_EXTENTS_FL)) {
+		if (!ext4fs_load_block_map(fs, node)) {
+			node->nr_runs = 0;
+			return 0;
 		}
+		node->runs_read = 1;
+		return 1;
+	}
+
+	ext_block = (struct ext4_extent_header *)node->inode.raw.b.blocks.dir_blocks;
+	if (!ext4fs_check_extent_header(ext_block, sizeof node->inode.raw.b) ||
+	    ext_block->eh_depth > EXT4_MAX_EXTENT_DEPTH) {
+		fprintf(stderr, "invalid extent block\n");
+		return 0;
+	}
 
-		blknr = (fsinode->indir3_block[rblock % perblock_child]);
+	if (ext_block->eh_depth == 0)
+		status = ext4fs_add_leaf_runs(node, ext_block);
+	else if (ext_block->eh_entries == 0)
+		status = 1;
+	else
+		status = ext4fs_load_extent_level(fs, node, &ext_block, 1,
+						  ext_block->eh_depth);
+	if (!status) {
+		node->nr_runs = 0;
+		return 0;
 	}
-#ifdef DEBUG
-	printf("ext4fs_read_block %ld\n", blknr);
-#endif
-	return blknr;
+	node->runs_read = 1;
+	return 1;
+}
+
+/*
+ * Map a file block to a physical block.  *count is set to the number of
+ * blocks from fileblock on that map the same way, so callers can step
+ * over a whole run at once.  Holes map to 0; unwritten extents keep
+ * their block and set EXT2FS_RUN_UNWRITTEN in *flags.
+ */
+static int64_t ext4fs_map_block(struct ext_filesystem *fs, struct ext2fs_node *node,
+		uint32_t fileblock, uint32_t *count, uint32_t *flags)
+{
+	struct ext2fs_run *run;
+	int lo, hi, mid;
+
+	*flags = 0;
+	if (!ext4fs_load_runs(fs, node))
+		return -1;
+
+	/* Find the last run starting at or before fileblock. */
+	lo = 0;
+	hi = node->nr_runs;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (node->runs[mid].lblk <= fileblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo > 0) {
+		run = &node->runs[lo - 1];
+		if (fileblock - run->lblk < run->len) {
+			*count = run->len - (fileblock - run->lblk);
+			*flags = run->flags;
+			return run->pblk + (fileblock - run->lblk);
+		}
+	}
+
+	/* A hole, up to the next run or the end of the file. */
+	if (lo < node->nr_runs)
+		*count = node->runs[lo].lblk - fileblock;
+	else
+		*count = UINT32_MAX - fileblock;
+	return 0;
 }
 
 /*
- * Taken from openmoko-kernel mailing list: By Andy green
- * Optimized read file API : collects and defers contiguous sector
- * reads into one potentially more efficient larger sequential read action
+ * Read len bytes at pos.  The file is walked a run at a time: holes and
+ * unwritten extents are zero-filled without touching the device, and
+ * physically contiguous runs are collected into one larger read.
  */
-static int ext4fs_read_file(struct ext_filesystem *fs, struct ext2fs_node *node,  int pos,
+static int ext4fs_read_file(struct ext_filesystem *fs, struct ext2fs_node *node, int64_t pos,
 		unsigned int len, char *buf)
 {
-	int i;
-	int blockcnt;
-	int previous_block_number = -1;
-	int delayed_start = 0;
-	int delayed_extent = 0;
-	int delayed_skipfirst = 0;
-	int delayed_next = 0;
+	int log2blocksize = LOG2_BLOCK_SIZE(node->data);
+	uint64_t blocksize = 1 << log2blocksize;
+	uint64_t filesize = ext4fs_data_size(&node->inode);
+	uint64_t delayed_start = 0;
+	unsigned int delayed_extent = 0;
 	char *delayed_buf = NULL;
-	short status;
-	int log2blocksize = LOG2_EXT2_BLOCK_SIZE(node->data);
-	int blocksize = 1 << (log2blocksize + DISK_SECTOR_BITS);
-	unsigned int filesize = node->inode.size;
+	unsigned int done = 0;
+
+	if (node->inode.flags & EXT4_INLINE_DATA_FL)
+		return ext4fs_read_inline(node, pos, len, buf);
 
 	/* Adjust len so it we can't read past the end of the file. */
-	if (len > filesize)
-		len = filesize;
+	if (pos < 0 || pos >= filesize)
+		return 0;
+	if (len > filesize - pos)
+		len = filesize - pos;
 
-	blockcnt = ((len + pos) + blocksize - 1) / blocksize;
+	while (done < len) {
+		uint64_t off = pos + done;
+		uint64_t blockoff = off & (blocksize - 1);
+		uint64_t nbytes;
+		uint32_t count, flags;
+		int64_t blknr;
 
-	for (i = pos / blocksize; i < blockcnt; i++) {
-		int blknr;
-		int blockoff = pos % blocksize;
-		int blockend = blocksize;
-		int skipfirst = 0;
-		blknr = read_allocated_block1(fs, node, i);
+		blknr = ext4fs_map_block(fs, node, off >> log2blocksize, &count, &flags);
 		if (blknr < 0)
 			return -1;
+		if (flags & EXT2FS_RUN_UNWRITTEN)
+			blknr = 0;
 
-		blknr = blknr << log2blocksize;
-
-		/* Last block.  */
-		if (i == blockcnt - 1) {
-			blockend = (len + pos) % blocksize;
-
-			/* The last portion is exactly blocksize. */
-			if (!blockend)
-				blockend = blocksize;
-		}
+		nbytes = MIN(((uint64_t)count << log2blocksize) - blockoff,
+			     (uint64_t)(len - done));
 
-		/* First block. */
-		if (i == pos / blocksize) {
-			skipfirst = blockoff;
-			blockend -= skipfirst;
-		}
-		if (blknr) {
-			int status;
-
-			if (previous_block_number != -1) {
-				if (delayed_next == blknr) {
-					delayed_extent += blockend;
-					delayed_next += blockend >> SECTOR_BITS;
-				} else {	/* spill */
-					status = vfs_devread(fs->dev_desc,delayed_start,
-							delayed_skipfirst,
-							delayed_extent,
-							delayed_buf);
-					if (status == 0)
-						return -1;
-					previous_block_number = blknr;
-					delayed_start = blknr;
-					delayed_extent = blockend;
-					delayed_skipfirst = skipfirst;
-					delayed_buf = buf;
-					delayed_next = blknr +
-						(blockend >> SECTOR_BITS);
-				}
-			} else {
-				previous_block_number = blknr;
-				delayed_start = blknr;
-				delayed_extent = blockend;
-				delayed_skipfirst = skipfirst;
-				delayed_buf = buf;
-				delayed_next = blknr +
-					(blockend >> SECTOR_BITS);
-			}
+		if (blknr && delayed_extent &&
+		    delayed_start + delayed_extent == ((uint64_t)blknr << log2blocksize) + blockoff) {
+			delayed_extent += nbytes;
 		} else {
-			if (previous_block_number != -1) {
+			if (delayed_extent) {
 				/* spill */
-				status = vfs_devread(fs->dev_desc,delayed_start,
-						delayed_skipfirst,
-						delayed_extent,
-						delayed_buf);
-				if (status == 0)
+				if (vfs_devread(fs->dev_desc, delayed_start >> SECTOR_BITS,
+						delayed_start & (SECTOR_SIZE - 1),
+						delayed_extent, delayed_buf) == 0)
 					return -1;
-				previous_block_number = -1;
+				delayed_extent = 0;
+			}
+			if (blknr) {
+				delayed_start = ((uint64_t)blknr << log2blocksize) + blockoff;
+				delayed_extent = nbytes;
+				delayed_buf = buf + done;
+			} else {
+				memset(buf + done, 0, nbytes);
 			}
-			memset(buf, 0, blocksize - skipfirst);
 		}
-		buf += blocksize - skipfirst;
+		done += nbytes;
 	}
-	if (previous_block_number != -1) {
+	if (delayed_extent) {
 		/* spill */
-		status = vfs_devread(fs->dev_desc,delayed_start,
-				delayed_skipfirst, delayed_extent,
-				delayed_buf);
-		if (status == 0)
+		if (vfs_devread(fs->dev_desc, delayed_start >> SECTOR_BITS,
+				delayed_start & (SECTOR_SIZE - 1),
+				delayed_extent, delayed_buf) == 0)
 			return -1;
-		previous_block_number = -1;
 	}
 
 	return len;
 }
 
-static struct ext4_extent_header *ext4fs_get_extent_block
-	(struct ext_filesystem *fs, struct ext2_data *data, char *buf,
-		struct ext4_extent_header *ext_block,
-		uint32_t fileblock, int log2_blksz)
+/*
+ * Read the whole group descriptor table in one go and decode it.  With
+ * the 64bit feature descriptors are desc_size bytes apart and carry the
+ * high halves of their block numbers and counts.
+ */
+static int ext4fs_load_groups(struct ext_filesystem *fs, struct ext2_data *data)
 {
-	struct ext4_extent_idx *index;
-	unsigned long long block;
-	int i;
-
-	while (1) {
-		index = (struct ext4_extent_idx *)(ext_block + 1);
+	struct ext2_sblock *sblock = &data->sblock;
+	uint64_t bytes;
+	char *buf;
+	uint32_t g;
 
-		if (ext_block->eh_magic != EXT4_EXT_MAGIC)
+	if (sblock->blocks_per_group == 0 || sblock->inodes_per_group == 0)
+		return 0;
+	fs->no_blkgrp = (sblock->total_blocks - sblock->first_data_block +
+			 sblock->blocks_per_group - 1) / sblock->blocks_per_group;
+	fs->desc_size = EXT2_MIN_DESC_SIZE;
+	if (sblock->feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		fs->desc_size = sblock->desc_size;
+		if (fs->desc_size < EXT4_MIN_DESC_SIZE_64BIT ||
+		    fs->desc_size > EXT2_MAX_DESC_SIZE ||
+		    (fs->desc_size & (fs->desc_size - 1)))
 			return 0;
+	}
+	fs->gdtable_blkno = sblock->first_data_block + 1;
+	bytes = (uint64_t)fs->no_blkgrp * fs->desc_size;
+	fs->no_blk_pergdt = (bytes + fs->block_size - 1) / fs->block_size;
 
-		if (ext_block->eh_depth == 0)
-			return ext_block;
-		i = -1;
-		do {
-			i++;
-			if (i >= ext_block->eh_entries)
-				break;
-		} while (fileblock > index[i].ei_block);
+	buf = malloc(bytes);
+	fs->groups = zalloc(fs->no_blkgrp * sizeof(struct ext2fs_group));
+	if (!buf || !fs->groups)
+		goto fail;
+	if (vfs_devread(fs->dev_desc, (uint64_t)fs->gdtable_blkno << LOG2_EXT2_BLOCK_SIZE(data),
+			0, bytes, buf) == 0)
+		goto fail;
 
-		if (--i < 0)
-			return 0;
+	for (g = 0; g < fs->no_blkgrp; g++) {
+		struct ext2_block_group *bg = (struct ext2_block_group *)(buf + (uint64_t)g * fs->desc_size);
+		struct ext4_block_group_hi *hi = (struct ext4_block_group_hi *)(bg + 1);
+		struct ext2fs_group *grp = &fs->groups[g];
+
+		grp->block_bitmap  = bg->block_id;
+		grp->inode_bitmap  = bg->inode_id;
+		grp->inode_table   = bg->inode_table_id;
+		grp->free_blocks   = bg->free_blocks;
+		grp->free_inodes   = bg->free_inodes;
+		grp->used_dirs     = bg->used_dir_cnt;
+		grp->itable_unused = bg->bg_itable_unused;
+		grp->flags         = bg->bg_flags;
+		if (fs->desc_size >= EXT4_MIN_DESC_SIZE_64BIT) {
+			grp->block_bitmap  |= (uint64_t)hi->block_id_hi << 32;
+			grp->inode_bitmap  |= (uint64_t)hi->inode_id_hi << 32;
+			grp->inode_table   |= (uint64_t)hi->inode_table_id_hi << 32;
+			grp->free_blocks   |= (uint32_t)hi->free_blocks_hi << 16;
+			grp->free_inodes   |= (uint32_t)hi->free_inodes_hi << 16;
+			grp->used_dirs     |= (uint32_t)hi->used_dir_cnt_hi << 16;
+			grp->itable_unused |= (uint32_t)hi->itable_unused_hi << 16;
+		}
+	}
+	free(buf);
+	return 1;
+fail:
+	free(buf);
+	free(fs->groups);
+	fs->groups = NULL;
+	return 0;
+}
 
-		block = index[i].ei_leaf_hi;
-		block = (block << 32) + index[i].ei_leaf_lo;
+static void ext4fs_decode_time(struct ext2_timespec *ts, uint32_t time,
+		uint32_t extra, int has_extra)
+{
+	ts->sec = (int32_t)time;
+	ts->nsec = 0;
+	if (has_extra) {
+		ts->sec += (int64_t)(extra & EXT4_EPOCH_MASK) << 32;
+		ts->nsec = extra >> EXT4_EPOCH_BITS;
+	}
+}
 
-		if (vfs_devread(fs->dev_desc,block << log2_blksz, 0, fs->blksz, buf))
-			ext_block = (struct ext4_extent_header *)buf;
-		else
-			return 0;
+/*
+ * Find the value of "system.data" in the in-inode xattr area.  Returns
+ * its length and sets *value, or returns 0 when there is none.
+ */
+static uint32_t ext4fs_find_inline_xattr(struct ext_filesystem *fs,
+		const char *buf, uint16_t extra_isize, const char **value)
+{
+	const char *start = buf + EXT2_GOOD_OLD_INODE_SIZE + extra_isize;
+	const char *end = buf + fs->inodesz;
+	const char *ep;
+	uint32_t magic;
+
+	if (start + sizeof magic > end)
+		return 0;
+	memcpy(&magic, start, sizeof magic);
+	if (magic != EXT4_XATTR_MAGIC)
+		return 0;
+	start += sizeof magic;
+
+	ep = start;
+	while (ep + sizeof(struct ext4_xattr_entry) <= end && *(const uint32_t *)ep) {
+		const struct ext4_xattr_entry *entry = (const struct ext4_xattr_entry *)ep;
+
+		if (ep + EXT4_XATTR_LEN(entry->e_name_len) > end)
+			break;
+		if (entry->e_name_index == EXT4_XATTR_INDEX_SYSTEM &&
+		    entry->e_name_len == 4 && !memcmp(entry + 1, "data", 4)) {
+			if (entry->e_value_inum ||
+			    start + entry->e_value_offs + entry->e_value_size > end)
+				return 0;
+			*value = start + entry->e_value_offs;
+			return entry->e_value_size;
+		}
+		ep += EXT4_XATTR_LEN(entry->e_name_len);
 	}
+	return 0;
 }
 
-static int ext4fs_blockgroup(struct ext_filesystem *fs, struct ext2_data *data, int group, struct ext2_block_group *blkgrp)
+static void ext4fs_put_dirent(char *buf, uint32_t ino, uint16_t direntlen,
+		const char *name)
 {
-	long int blkno;
-	unsigned int blkoff, desc_per_blk;
+	struct ext2_dirent dirent;
+
+	dirent.inode = ino;
+	dirent.direntlen = direntlen;
+	dirent.namelen = strlen(name);
+	dirent.filetype = FILETYPE_DIRECTORY;
+	memcpy(buf, &dirent, sizeof dirent);
+	memcpy(buf + sizeof dirent, name, dirent.namelen);
+}
 
-	desc_per_blk = EXT2_BLOCK_SIZE(data) / sizeof(struct ext2_block_group);
+/*
+ * Copy inline data out of the inode record.  An inline directory has no
+ * "." and ".." entries, only the parent inode number in front of i_block,
+ * so they are synthesized and the two dirent areas joined into the
+ * stream a block-mapped directory would have.
+ */
+static int ext4fs_load_inline_data(struct ext_filesystem *fs, int ino,
+		const char *buf, struct ext2fs_inode *inode)
+{
+	const char *xvalue = NULL;
+	uint32_t xsize, isize = EXT4_MIN_INLINE_DATA_SIZE;
+	const char *iblock = (const char *)inode->raw.b.symlink;
+	char *ep;
 
-	blkno = (data->sblock.first_data_block) + 1 +
-			group / desc_per_blk;
-	blkoff = (group % desc_per_blk) * sizeof(struct ext2_block_group);
+	xsize = ext4fs_find_inline_xattr(fs, buf, inode->extra_isize, &xvalue);
 
-#ifdef DEBUG
-	printf("ext4fs read %d group descriptor (blkno %ld blkoff %u)\n",
-	      group, blkno, blkoff);
-#endif
+	if (!ext4fs_is_inline_dir(inode)) {
+		inode->inline_data = zalloc(isize + xsize);
+		if (!inode->inline_data)
+			return 0;
+		memcpy(inode->inline_data, iblock, isize);
+		memcpy(inode->inline_data + isize, xvalue, xsize);
+		inode->inline_size = isize + xsize;
+		return 1;
+	}
+
+	isize -= EXT4_INLINE_DOTDOT_SIZE;
+	inode->inline_data = zalloc(2 * EXT2_DIR_REC_LEN(2) + isize + xsize);
+	if (!inode->inline_data)
+		return 0;
+	ep = inode->inline_data;
+	ext4fs_put_dirent(ep, ino, EXT2_DIR_REC_LEN(1), ".");
+	ep += EXT2_DIR_REC_LEN(1);
+	ext4fs_put_dirent(ep, *(const uint32_t *)iblock, EXT2_DIR_REC_LEN(2), "..");
+	ep += EXT2_DIR_REC_LEN(2);
+	memcpy(ep, iblock + EXT4_INLINE_DOTDOT_SIZE, isize);
+	memcpy(ep + isize, xvalue, xsize);
+	inode->inline_size = ep + isize + xsize - inode->inline_data;
+	return 1;
+}
+
+void ext4fs_decode_inode(struct ext_filesystem *fs, struct ext2_data *data,
+		const char *buf, struct ext2fs_inode *inode)
+{
+	const struct ext2_inode *raw = (const struct ext2_inode *)buf;
+	struct ext2_inode_extra extra;
+
+	memset(inode, 0, sizeof *inode);
+	memset(&extra, 0, sizeof extra);
+	memcpy(&inode->raw, raw, sizeof inode->raw);
+
+	if (fs->inodesz > EXT2_GOOD_OLD_INODE_SIZE) {
+		memcpy(&extra, buf + EXT2_GOOD_OLD_INODE_SIZE,
+		       MIN(sizeof extra, fs->inodesz - EXT2_GOOD_OLD_INODE_SIZE));
+		if (extra.extra_isize > fs->inodesz - EXT2_GOOD_OLD_INODE_SIZE)
+			extra.extra_isize = 0;
+	}
 
-	return vfs_devread(fs->dev_desc,blkno << LOG2_EXT2_BLOCK_SIZE(data),
-			      blkoff, sizeof(struct ext2_block_group),
-			      (char *)blkgrp);
+	inode->mode   = raw->mode;
+	inode->nlinks = raw->nlinks;
+	inode->flags  = raw->flags;
+	inode->dtime  = raw->dtime;
+	/* osd2: blocks_hi, file_acl_high, uid_high, gid_high, ... */
+	inode->uid    = raw->uid | (raw->osd2[1] & 0xffff) << 16;
+	inode->gid    = raw->gid | (raw->osd2[1] & 0xffff0000);
+	inode->size   = raw->size | (uint64_t)raw->dir_acl << 32;
+	inode->blocks = raw->blockcnt;
+	if (data->sblock.feature_ro_compat & EXT4_FEATURE_RO_COMPAT_HUGE_FILE) {
+		inode->blocks |= (uint64_t)(raw->osd2[0] & 0xffff) << 32;
+		if (raw->flags & EXT4_HUGE_FILE_FL)
+			inode->blocks <<= LOG2_EXT2_BLOCK_SIZE(data);
+	}
+	inode->extra_isize = extra.extra_isize;
+
+	ext4fs_decode_time(&inode->atime, raw->atime, extra.atime_extra,
+			   EXT4_FITS_IN_INODE(&extra, atime_extra));
+	ext4fs_decode_time(&inode->ctime, raw->ctime, extra.ctime_extra,
+			   EXT4_FITS_IN_INODE(&extra, ctime_extra));
+	ext4fs_decode_time(&inode->mtime, raw->mtime, extra.mtime_extra,
+			   EXT4_FITS_IN_INODE(&extra, mtime_extra));
+	if (EXT4_FITS_IN_INODE(&extra, crtime))
+		ext4fs_decode_time(&inode->crtime, extra.crtime, extra.crtime_extra,
+				   EXT4_FITS_IN_INODE(&extra, crtime_extra));
 }
 
-int ext4fs_read_inode(struct ext_filesystem *fs, struct ext2_data *data, int ino, struct ext2_inode *inode)
+int ext4fs_read_inode(struct ext_filesystem *fs, struct ext2_data *data, int ino, struct ext2fs_inode *inode)
 {
-	struct ext2_block_group blkgrp;
 	struct ext2_sblock *sblock = &data->sblock;
 	int inodes_per_block, status;
-	long int blkno;
-	unsigned int blkoff;
+	uint64_t blkno;
+	unsigned int blkoff, group;
+	char buf[fs->inodesz];
 
 	/* It is easier to calculate if the first inode is 0. */
 	ino--;
-	status = ext4fs_blockgroup(fs, data, ino /
-				   (sblock->inodes_per_group), &blkgrp);
-	if (status == 0)
+	group = ino / (sblock->inodes_per_group);
+	if (ino < 0 || group >= fs->no_blkgrp)
 		return 0;
 
 	inodes_per_block = EXT2_BLOCK_SIZE(data) / fs->inodesz;
-	blkno = (blkgrp.inode_table_id) +
+	blkno = (fs->groups[group].inode_table) +
 	    (ino % (sblock->inodes_per_group)) / inodes_per_block;
 	blkoff = (ino % inodes_per_block) * fs->inodesz;
-	/* Read the inode. */
+	/* Read the whole on-disk inode, extra fields included. */
 	status = vfs_devread(fs->dev_desc,blkno << LOG2_EXT2_BLOCK_SIZE(data), blkoff,
-				sizeof(struct ext2_inode), (char *)inode);
+				fs->inodesz, buf);
 	if (status == 0)
 		return 0;
 
+	ext4fs_decode_inode(fs, data, buf, inode);
+	if (inode->flags & EXT4_INLINE_DATA_FL)
+		return ext4fs_load_inline_data(fs, ino + 1, buf, inode);
 	return 1;
 }
 
+/* Fill a vfs stat buffer from an in-memory inode. */
+void ext4fs_inode_xstat(uint32_t ino, const struct ext2fs_inode *inode, struct xstat *st)
+{
+	st->mode   = inode->mode;
+	st->nlinks = inode->nlinks;
+	st->uid    = inode->uid;
+	st->gid    = inode->gid;
+	st->ino    = ino;
+	st->size   = inode->size;
+	st->blocks = inode->blocks;
+	st->dtime  = inode->dtime;
+	st->atime.sec   = inode->atime.sec;
+	st->atime.nsec  = inode->atime.nsec;
+	st->ctime.sec   = inode->ctime.sec;
+	st->ctime.nsec  = inode->ctime.nsec;
+	st->mtime.sec   = inode->mtime.sec;
+	st->mtime.nsec  = inode->mtime.nsec;
+	st->crtime.sec  = inode->crtime.sec;
+	st->crtime.nsec = inode->crtime.nsec;
+}
+
+static void ext4fs_fill_xstat(struct ext2fs_node *node, struct xstat *st)
+{
+	ext4fs_inode_xstat(node->ino, &node->inode, st);
+}
+
+/*
+ * Background warm-up of what a first browse needs: the data of the root
+ * and top-level directories and the inode table blocks of their entries.
+ * Reads are queued to the partition cache in ascending disk order, within
+ * a time and byte budget, and stop early when the volume is unmounted.
+ */
+struct ext4fs_warmup {
+	struct ext_filesystem *fs;
+	xthread_t  thread;
+	xmutex_t   lock;
+	int        cancel;
+	uint64_t   deadline;	/* xclock_ms() */
+	uint64_t   budget;	/* bytes still allowed */
+	uint32_t  *dirs;	/* top-level directory inodes */
+	int        ndirs;
+	int        maxdirs;
+};
+
+struct ext4fs_blkrange {
+	uint64_t blk;
+	uint32_t count;
+};
+
+struct ext4fs_blklist {
+	struct ext4fs_blkrange *v;
+	int n;
+	int max;
+};
+
+static void ext4fs_blklist_add(struct ext4fs_blklist *l, uint64_t blk, uint32_t count)
+{
+	if (l->n == l->max) {
+		int max = l->max ? l->max * 2 : 64;
+		void *v = realloc(l->v, max * sizeof *l->v);
+
+		if (!v)
+			return;
+		l->v = v;
+		l->max = max;
+	}
+	l->v[l->n].blk = blk;
+	l->v[l->n].count = count;
+	l->n++;
+}
+
+static int ext4fs_cmp_blkrange(const void *a, const void *b)
+{
+	const struct ext4fs_blkrange *x = a, *y = b;
+
+	return x->blk < y->blk ? -1 : x->blk > y->blk;
+}
+
+static int ext4fs_cmp_ino(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int ext4fs_warmup_stopped(struct ext4fs_warmup *w)
+{
+	int cancel;
+
+	xmutex_lock(w->lock);
+	cancel = w->cancel;
+	xmutex_unlock(w->lock);
+	return cancel || w->budget < w->fs->block_size || xclock_ms() >= w->deadline;
+}
+
+/* Queue the collected ranges, sorted and merged, and empty the list. */
+static void ext4fs_warmup_issue(struct ext4fs_warmup *w, struct ext4fs_blklist *l)
+{
+	struct ext_filesystem *fs = w->fs;
+	int shift = LOG2_EXT2_BLOCK_SIZE(fs->ext4fs_root);
+	uint64_t start, end;
+	int i, j;
+
+	qsort(l->v, l->n, sizeof *l->v, ext4fs_cmp_blkrange);
+	for (i = 0; i < l->n && !ext4fs_warmup_stopped(w); i = j) {
+		start = l->v[i].blk;
+		end = start + l->v[i].count;
+		for (j = i + 1; j < l->n && l->v[j].blk <= end; j++)
+			end = MAX(end, l->v[j].blk + l->v[j].count);
+		end = MIN(end, start + w->budget / fs->block_size);
+		w->budget -= (end - start) * fs->block_size;
+		vfs_devprefetch(fs->dev_desc, start << shift, (end - start) << shift);
+	}
+	l->n = 0;
+}
+
+static void ext4fs_warmup_dir_runs(struct ext4fs_warmup *w, struct ext2fs_node *dir,
+		struct ext4fs_blklist *l)
+{
+	int i;
+
+	if ((dir->inode.flags & EXT4_INLINE_DATA_FL) || !ext4fs_load_runs(w->fs, dir))
+		return;
+	for (i = 0; i < dir->nr_runs; i++)
+		if (!(dir->runs[i].flags & EXT2FS_RUN_UNWRITTEN))
+			ext4fs_blklist_add(l, dir->runs[i].pblk, dir->runs[i].len);
+}
+
+/*
+ * Walk the entries of a directory, adding the inode table block of each
+ * to itable.  With want_dirs, possible subdirectories are remembered.
+ */
+static void ext4fs_warmup_scan_dir(struct ext4fs_warmup *w, struct ext2fs_node *dir,
+		struct ext4fs_blklist *itable, int want_dirs)
+{
+	struct ext_filesystem *fs = w->fs;
+	struct ext2_sblock *sblock = &fs->ext4fs_root->sblock;
+	uint32_t inodes_per_block = fs->block_size / fs->inodesz;
+	uint64_t size = ext4fs_data_size(&dir->inode);
+	uint32_t pos, ino, group;
+	struct ext2_dirent *de;
+	char *buf, *name;
+
+	if (size == 0 || size > w->budget)
+		return;
+	buf = malloc(size);
+	if (!buf)
+		return;
+	if (ext4fs_read_file(fs, dir, 0, size, buf) != (int)size) {
+		free(buf);
+		return;
+	}
+	for (pos = 0; pos + sizeof *de <= size; pos += de->direntlen) {
+		de = (struct ext2_dirent *)(buf + pos);
+		name = (char *)(de + 1);
+		if (de->direntlen < sizeof *de)
+			break;
+		if (de->inode == 0 || de->namelen == 0 || pos + sizeof *de + de->namelen > size)
+			continue;
+		if (name[0] == '.' && (de->namelen == 1 || (de->namelen == 2 && name[1] == '.')))
+			continue;
+
+		ino = de->inode - 1;
+		group = ino / sblock->inodes_per_group;
+		if (group >= fs->no_blkgrp)
+			continue;
+		ext4fs_blklist_add(itable, fs->groups[group].inode_table +
+				   (ino % sblock->inodes_per_group) / inodes_per_block, 1);
+
+		if (!want_dirs || (de->filetype != FILETYPE_DIRECTORY &&
+				   de->filetype != FILETYPE_UNKNOWN))
+			continue;
+		if (w->ndirs == w->maxdirs) {
+			int max = w->maxdirs ? w->maxdirs * 2 : 64;
+			uint32_t *dirs = realloc(w->dirs, max * sizeof *dirs);
+
+			if (!dirs)
+				continue;
+			w->dirs = dirs;
+			w->maxdirs = max;
+		}
+		w->dirs[w->ndirs++] = de->inode;
+	}
+	free(buf);
+}
+
+static void ext4fs_warmup_thread(void *arg)
+{
+	struct ext4fs_warmup *w = arg;
+	struct ext_filesystem *fs = w->fs;
+	struct ext2_data *data = fs->ext4fs_root;
+	struct ext4fs_blklist blocks = { 0 }, itable = { 0 };
+	struct ext2fs_node **nodes, *node;
+	int i, n = 0;
+
+	/* The root directory and the inodes of its entries. */
+	ext4fs_warmup_dir_runs(w, &data->diropen, &blocks);
+	ext4fs_warmup_issue(w, &blocks);
+	ext4fs_warmup_scan_dir(w, &data->diropen, &itable, 1);
+	ext4fs_warmup_issue(w, &itable);
+
+	/* Then the top-level directories, in inode order. */
+	qsort(w->dirs, w->ndirs, sizeof *w->dirs, ext4fs_cmp_ino);
+	nodes = zalloc(w->ndirs * sizeof *nodes + 1);
+	for (i = 0; nodes && i < w->ndirs && !ext4fs_warmup_stopped(w); i++) {
+		node = zalloc(sizeof *node);
+		if (!node)
+			break;
+		node->data = data;
+		node->ino = w->dirs[i];
+		if (!ext4fs_read_inode(fs, data, node->ino, &node->inode) ||
+		    (node->inode.mode & FILETYPE_INO_MASK) != FILETYPE_INO_DIRECTORY) {
+			ext4fs_release_node(node);
+			continue;
+		}
+		node->inode_read = 1;
+		nodes[n++] = node;
+		ext4fs_warmup_dir_runs(w, node, &blocks);
+	}
+	ext4fs_warmup_issue(w, &blocks);
+	for (i = 0; i < n && !ext4fs_warmup_stopped(w); i++)
+		ext4fs_warmup_scan_dir(w, nodes[i], &itable, 0);
+	ext4fs_warmup_issue(w, &itable);
+
+	for (i = 0; i < n; i++)
+		ext4fs_release_node(nodes[i]);
+	free(nodes);
+	free(blocks.v);
+	free(itable.v);
+}
+
+static int ext4fs_warmup(struct filesys_spec *fsys, unsigned int ms, uint64_t bytes)
+{
+	struct ext_filesystem *fs = &fsys->extfs;
+	struct ext4fs_warmup *w;
+
+	/* Without a cache there is nowhere to keep what is read. */
+	if (fs->warmup || !fs->dev_desc->cache)
+		return 0;
+	w = zalloc(sizeof *w);
+	if (!w)
+		return 1;
+	w->fs = fs;
+	w->deadline = xclock_ms() + ms;
+	w->budget = bytes;
+	w->lock = xmutex_create();
+	if (w->lock)
+		w->thread = xthread_create(ext4fs_warmup_thread, w);
+	if (!w->thread) {
+		fprintf(stderr, "can't start metadata warm-up.\n");
+		if (w->lock)
+			xmutex_destroy(w->lock);
+		free(w);
+		return 1;
+	}
+	fs->warmup = w;
+	return 0;
+}
+
+static void ext4fs_warmup_stop(struct ext_filesystem *fs)
+{
+	struct ext4fs_warmup *w = fs->warmup;
+
+	if (!w)
+		return;
+	xmutex_lock(w->lock);
+	w->cancel = 1;
+	xmutex_unlock(w->lock);
+	xthread_join(w->thread);
+	xmutex_destroy(w->lock);
+	free(w->dirs);
+	free(w);
+	fs->warmup = NULL;
+}
+
 static int ext4fs_umount(struct filesys_spec *fs_descr)
 {
 	struct ext_filesystem *fs = &fs_descr->extfs;
+
+	ext4fs_warmup_stop(fs);
+	ext4_fold_destroy(fs->fold);
+	if (fs->snap) {
+		ext4_snap_save(fs->snap);
+		ext4_snap_close(fs->snap);
+	}
+	free(fs->ext4fs_root->diropen.runs);
+	free(fs->ext4fs_root->diropen.inode.inline_data);
+	free(fs->groups);
 	free(fs);
 	return 0;
 }
 
 
 typedef int (*dir_iterate_func_t)(void *, const char *, struct xstat *, int is_dir);
+typedef int (*dir_match_func_t)(void *, const char *);
+
+/*
+ * Find name in dir, or with name NULL, call dir_func for each entry that
+ * match (when given) accepts; only those entries are stat'ed.
+ */
 static int ext4fs_iterate_dir(struct ext_filesystem *fs, struct ext2fs_node *dir, char *name,
-				struct ext2fs_node **fnode, int *ftype, dir_iterate_func_t dir_func, void * user_data)
+				struct ext2fs_node **fnode, int *ftype, dir_match_func_t match,
+				dir_iterate_func_t dir_func, void * user_data)
 {
 	unsigned int fpos = 0;
 	int status, got = 0;
@@ -606,7 +1130,7 @@ static int ext4fs_iterate_dir(struct ext_filesystem *fs, struct ext2fs_node *dir
 			return 0;
 	}
 	/* Search the file.  */
-	while (!got && fpos < diro->inode.size) {
+	while (!got && fpos < ext4fs_data_size(&diro->inode)) {
 		struct ext2_dirent dirent;
 
 		status = ext4fs_read_file(fs, diro, fpos,
@@ -615,7 +1139,10 @@ static int ext4fs_iterate_dir(struct ext_filesystem *fs, struct ext2fs_node *dir
 		if (status < 1)
 			return 0;
 
-		if (dirent.namelen != 0) {
+		if (dirent.direntlen == 0)
+			return 0;
+
+		if (dirent.inode != 0 && dirent.namelen != 0) {
 			char filename[dirent.namelen + 1];
 			struct ext2fs_node *fdiro;
 			int type = FILETYPE_UNKNOWN;
@@ -626,6 +1153,11 @@ static int ext4fs_iterate_dir(struct ext_filesystem *fs, struct ext2fs_node *dir
 						  dirent.namelen, filename);
 			if (status < 1)
 				return 0;
+			filename[dirent.namelen] = '\0';
+			if (!name && match && !match(user_data, filename)) {
+				fpos += dirent.direntlen;
+				continue;
+			}
 
 			fdiro = zalloc(sizeof(struct ext2fs_node));
 			if (!fdiro)
@@ -634,8 +1166,6 @@ static int ext4fs_iterate_dir(struct ext_filesystem *fs, struct ext2fs_node *dir
 			fdiro->data = diro->data;
 			fdiro->ino  = dirent.inode;
 
-			filename[dirent.namelen] = '\0';
-
 			if (dirent.filetype != FILETYPE_UNKNOWN) {
 				fdiro->inode_read = 0;
 
@@ -676,6 +1206,7 @@ static int ext4fs_iterate_dir(struct ext_filesystem *fs, struct ext2fs_node *dir
 			if ((name != NULL) && (fnode != NULL)
 			    && (ftype != NULL)) {
 				if (strcmp(filename, name) == 0) {
+					ext4_snap_add_entry(fs->snap, diro->ino, filename, type, dirent.inode);
 					*ftype = type;
 					*fnode = fdiro;
 					return 1;
@@ -692,21 +1223,20 @@ static int ext4fs_iterate_dir(struct ext_filesystem *fs, struct ext2fs_node *dir
 					}
 					fdiro->inode_read = 1;
 				}
+				ext4_snap_add_entry(fs->snap, diro->ino, filename, type, dirent.inode);
+				ext4_snap_add_inode(fs->snap, dirent.inode, &fdiro->inode);
                 if (dir_func) {
-                    st.atime = fdiro->inode.atime;
-                    st.ctime = fdiro->inode.ctime;
-					st.mtime = fdiro->inode.mtime;
-                    st.dtime = fdiro->inode.dtime;
-                    st.mode  = fdiro->inode.mode;
-                    st.size  = fdiro->inode.size;
-                    st.size_high = fdiro->inode.dir_acl;
+                    ext4fs_fill_xstat(fdiro, &st);
                     got = dir_func(user_data, filename, &st, type == FILETYPE_DIRECTORY ? 1: 0);
                 }
 			}
-			free(fdiro);
+			ext4fs_release_node(fdiro);
 		}
 		fpos += dirent.direntlen;
 	}
+	/* A filtered listing leaves the snapshot short of entries. */
+	if (!got && name == NULL && !match)
+		ext4_snap_dir_done(fs->snap, diro->ino);
 	return 0;
 }
 
@@ -726,7 +1256,7 @@ static char *ext4fs_read_symlink(struct ext_filesystem *fs, struct ext2fs_node *
 		return 0;
 
 	if ((diro->inode.size) <= 60) {
-		strncpy(symlink, diro->inode.b.symlink,
+		strncpy(symlink, diro->inode.raw.b.symlink,
 			 (diro->inode.size));
 	} else {
 		status = ext4fs_read_file(fs, diro, 0,
@@ -741,6 +1271,89 @@ static char *ext4fs_read_symlink(struct ext_filesystem *fs, struct ext2fs_node *
 	return symlink;
 }
 
+/*
+ * Case-insensitive lookup of name in dir, indexing the directory on its
+ * first search.  Same results as ext4fs_iterate_dir, plus the name as
+ * spelt on disk in real, if not NULL.
+ */
+static int ext4fs_fold_find(struct ext_filesystem *fs, struct ext2fs_node *dir, const char *name,
+		struct ext2fs_node **fnode, int *ftype, char *real)
+{
+	struct ext2fs_node *node;
+	uint64_t size;
+	uint32_t ino;
+	int found, dtype;
+	char *buf;
+
+	if (!dir->inode_read) {
+		if (ext4fs_read_inode(fs, dir->data, dir->ino, &dir->inode) == 0)
+			return 0;
+		dir->inode_read = 1;
+	}
+	found = ext4_fold_lookup(fs->fold, dir->ino, name, &ino, &dtype, real);
+	if (found < 0) {
+		size = ext4fs_data_size(&dir->inode);
+		buf = malloc(MAX(size, 1));
+		if (!buf)
+			return 0;
+		if (size > UINT32_MAX || ext4fs_read_file(fs, dir, 0, size, buf) != (int)size ||
+		    ext4_fold_add(fs->fold, dir->ino, buf, size)) {
+			free(buf);
+			return 0;
+		}
+		free(buf);
+		found = ext4_fold_lookup(fs->fold, dir->ino, name, &ino, &dtype, real);
+	}
+	if (found <= 0)
+		return 0;
+
+	node = zalloc(sizeof *node);
+	if (!node)
+		return 0;
+	node->data = dir->data;
+	node->ino = ino;
+	if (dtype == FILETYPE_UNKNOWN) {
+		if (ext4fs_read_inode(fs, node->data, ino, &node->inode) == 0) {
+			free(node);
+			return 0;
+		}
+		node->inode_read = 1;
+		switch (node->inode.mode & FILETYPE_INO_MASK) {
+		case FILETYPE_INO_DIRECTORY:
+			dtype = FILETYPE_DIRECTORY;
+			break;
+		case FILETYPE_INO_SYMLINK:
+			dtype = FILETYPE_SYMLINK;
+			break;
+		case FILETYPE_INO_REG:
+			dtype = FILETYPE_REG;
+			break;
+		}
+	}
+	if (dtype != FILETYPE_DIRECTORY && dtype != FILETYPE_SYMLINK && dtype != FILETYPE_REG)
+		dtype = FILETYPE_UNKNOWN;
+	*fnode = node;
+	*ftype = dtype;
+	return 1;
+}
+
+/*
+ * Look a single name up in dir, ignoring case when the index is on.  The
+ * entry's own name goes to real[256], if not NULL.
+ */
+static int ext4fs_lookup(struct ext_filesystem *fs, struct ext2fs_node *dir, char *name,
+		struct ext2fs_node **fnode, int *ftype, char *real)
+{
+	int found;
+
+	if (fs->fold)
+		return ext4fs_fold_find(fs, dir, name, fnode, ftype, real);
+	found = ext4fs_iterate_dir(fs, dir, name, fnode, ftype, NULL, NULL, NULL);
+	if (found == 1 && real)
+		strcpy(real, name);
+	return found;
+}
+
 static int ext4fs_find_file1(struct ext_filesystem *fs, const char *currpath,
 			     struct ext2fs_node *currroot,
 			     struct ext2fs_node **currfound, int *foundtype, int *symlinknest)
@@ -783,7 +1396,7 @@ static int ext4fs_find_file1(struct ext_filesystem *fs, const char *currpath,
 		oldnode = currnode;
 
 		/* Iterate over the directory. */
-		found = ext4fs_iterate_dir(fs, currnode, name, &currnode, &type, NULL, NULL);
+		found = ext4fs_lookup(fs, currnode, name, &currnode, &type, NULL);
 		if (found == 0)
 			return 0;
 
@@ -857,22 +1470,167 @@ static int ext4fs_find_file(struct ext_filesystem *fs, const char *path, struct
 		return 0;
 
 	/* Check if the node that was found was of the expected type. */
-	if ((expecttype == FILETYPE_REG) && (foundtype != expecttype))
-		return 0;
-	else if ((expecttype == FILETYPE_DIRECTORY)
-		   && (foundtype != expecttype))
+	if ((expecttype == FILETYPE_REG || expecttype == FILETYPE_DIRECTORY) &&
+	    foundtype != expecttype) {
+		ext4fs_free_node(fs, *foundnode, rootnode);
+		*foundnode = NULL;
 		return 0;
+	}
 
 	return 1;
 }
 
-static int ext4fs_file_entry_read(struct file_entry *file, struct filesys_spec *fsys, int offset, char *buf, unsigned len)
+/*
+ * Keep ra_window bytes past pos queued for prefetch, topping up once half
+ * of it has been consumed.  Data runs are issued in logical order; holes
+ * and unwritten extents have nothing to read.
+ */
+static void ext4fs_readahead(struct ext_filesystem *fs, struct ext2fs_file_entry *filp, uint64_t pos)
+{
+	struct ext2fs_node *node = filp->ext4fs_file;
+	int log2blocksize = LOG2_BLOCK_SIZE(node->data);
+	uint64_t blocksize = 1 << log2blocksize;
+	uint64_t target, off;
+	int nruns = 0;
+
+	if (filp->ra_end < pos)
+		filp->ra_end = pos;
+	if (filp->ra_end - pos > filp->ra_window / 2)
+		return;
+
+	target = MIN(pos + filp->ra_window, node->inode.size);
+	off = filp->ra_end;
+	while (off < target && nruns < EXT4_RA_RUNS) {
+		uint64_t blockoff = off & (blocksize - 1);
+		uint64_t nbytes, start;
+		uint32_t count, flags;
+		int64_t blknr;
+
+		blknr = ext4fs_map_block(fs, node, off >> log2blocksize, &count, &flags);
+		if (blknr < 0)
+			break;
+		nbytes = MIN(((uint64_t)count << log2blocksize) - blockoff, target - off);
+		if (blknr && !(flags & EXT2FS_RUN_UNWRITTEN)) {
+			start = ((uint64_t)blknr << log2blocksize) + blockoff;
+			vfs_devprefetch(fs->dev_desc, start >> SECTOR_BITS,
+					((start + nbytes - 1) >> SECTOR_BITS) - (start >> SECTOR_BITS) + 1);
+			nruns++;
+		}
+		off += nbytes;
+	}
+	filp->ra_end = off;
+}
+
+static int ext4fs_file_entry_read(struct file_entry *file, struct filesys_spec *fsys, int64_t offset, char *buf, unsigned len)
 {
 	struct ext2fs_file_entry *filp = (struct ext2fs_file_entry *)file;
+	struct ext2fs_node *node;
+	uint64_t now, rate, want;
+	int ret;
 
 	if (!fsys || !filp)
 		return 0;
-	return ext4fs_read_file(&fsys->extfs, filp->ext4fs_file, offset, len, buf);
+	node = filp->ext4fs_file;
+	if (node->inode.flags & EXT4_INLINE_DATA_FL)
+		return ext4fs_read_file(&fsys->extfs, node, offset, len, buf);
+
+	now = xclock_ms();
+	if (offset == filp->next_pos) {
+		filp->seq_reads++;
+	} else {
+		filp->seq_reads = 0;
+		filp->ra_end = 0;
+		filp->ra_rate = 0;
+		filp->ra_window = EXT4_RA_MIN;
+	}
+
+	ret = ext4fs_read_file(&fsys->extfs, node, offset, len, buf);
+
+	if (ret > 0 && filp->seq_reads >= EXT4_RA_TRIGGER) {
+		/*
+		 * Size the window to stay EXT4_RA_LEAD_MS ahead of the reader,
+		 * growing it at most twice per read.
+		 */
+		rate = (uint64_t)ret * 1000 / MAX(now - filp->ra_time, 1);
+		filp->ra_rate = filp->ra_rate ? (filp->ra_rate * 3 + rate) / 4 : rate;
+		want = MAX(filp->ra_rate * EXT4_RA_LEAD_MS / 1000, EXT4_RA_MIN);
+		filp->ra_window = MIN(MIN(want, filp->ra_window * 2), EXT4_RA_MAX);
+		ext4fs_readahead(&fsys->extfs, filp, offset + ret);
+	}
+	if (ret > 0)
+		filp->next_pos = offset + ret;
+	filp->ra_time = now;
+	return ret;
+}
+
+/*
+ * Describe the file from start to its end as byte ranges: data runs with
+ * their partition offset, holes and unwritten ranges.  Adjacent blocks of
+ * the same kind are merged.  Returns the number of entries filled.
+ */
+static int ext4fs_file_entry_extent_map(struct file_entry *file, struct filesys_spec *fsys,
+		uint64_t start, struct xextent *ext, int max)
+{
+	struct ext2fs_file_entry *filp = (struct ext2fs_file_entry *)file;
+	struct ext_filesystem *fs = &fsys->extfs;
+	struct ext2fs_node *node = filp->ext4fs_file;
+	int log2blocksize = LOG2_BLOCK_SIZE(node->data);
+	uint64_t size = node->inode.size;
+	uint64_t blk, lastblk;
+	int n = 0;
+
+	if (start >= size || max <= 0)
+		return 0;
+
+	if (node->inode.flags & EXT4_INLINE_DATA_FL) {
+		ext[0].logical  = start;
+		ext[0].physical = 0;
+		ext[0].length   = size - start;
+		ext[0].flags    = XEXTENT_INLINE | XEXTENT_LAST;
+		return 1;
+	}
+
+	blk = start >> log2blocksize;
+	lastblk = (size - 1) >> log2blocksize;
+	while (blk <= lastblk) {
+		uint64_t logical, physical, length;
+		uint32_t count, flags, type;
+		int64_t blknr;
+
+		blknr = ext4fs_map_block(fs, node, blk, &count, &flags);
+		if (blknr < 0)
+			return -1;
+		count = MIN((uint64_t)count, lastblk - blk + 1);
+
+		if (!blknr)
+			type = XEXTENT_HOLE;
+		else if (flags & EXT2FS_RUN_UNWRITTEN)
+			type = XEXTENT_UNWRITTEN;
+		else
+			type = 0;
+
+		logical  = MAX(blk << log2blocksize, start);
+		physical = blknr ? ((uint64_t)blknr << log2blocksize) +
+			(logical & ((1 << log2blocksize) - 1)) : 0;
+		length   = MIN((blk + count) << log2blocksize, size) - logical;
+		blk += count;
+
+		if (n > 0 && ext[n - 1].flags == type &&
+		    (type == XEXTENT_HOLE ||
+		     ext[n - 1].physical + ext[n - 1].length == physical)) {
+			ext[n - 1].length += length;
+			continue;
+		}
+		if (n == max)
+			return n;
+		ext[n].logical  = logical;
+		ext[n].physical = physical;
+		ext[n].length   = length;
+		ext[n].flags    = type;
+		n++;
+	}
+	ext[n - 1].flags |= XEXTENT_LAST;
+	return n;
 }
 
 static int ext4fs_file_entry_close(struct file_entry *filp, struct filesys_spec *fsys)
@@ -889,13 +1647,7 @@ static int ext4fs_file_entry_stat(struct file_entry *filp, struct filesys_spec *
 {
 	struct ext2fs_file_entry *file = (struct ext2fs_file_entry *)filp;
 
-	st->mtime = file->ext4fs_file->inode.mtime;
-	st->atime = file->ext4fs_file->inode.atime;
-	st->mode  = file->ext4fs_file->inode.mode;
-	st->ctime = file->ext4fs_file->inode.ctime;
-	st->dtime = file->ext4fs_file->inode.dtime;
-	st->size = file->ext4fs_file->inode.size;
-	st->size_high= file->ext4fs_file->inode.dir_acl;
+	ext4fs_fill_xstat(file->ext4fs_file, st);
 	return 0;
 }
 
@@ -907,18 +1659,73 @@ __alloc_ext2fs_entry(struct ext2fs_node * node)
 	filp->base.read = ext4fs_file_entry_read;
 	filp->base.close = ext4fs_file_entry_close;
 	filp->base.stat = ext4fs_file_entry_stat;
+	filp->base.extent_map = ext4fs_file_entry_extent_map;
 	filp->ext4fs_file = node;
+	filp->ra_window = EXT4_RA_MIN;
 	return filp;
 }
 
+/*
+ * Build an open node from the snapshot, without reading the inode.
+ * *missing is set when the snapshot knows the open would fail.
+ */
+static struct ext2fs_node *ext4fs_snap_open(struct ext_filesystem *fs, const char *filename,
+		int *missing)
+{
+	const struct ext4_snap_inode *si = ext4_snap_lookup(fs->snap, filename, missing);
+	const struct ext2fs_run *runs;
+	struct ext2fs_node *node;
+
+	if (!si || !(si->flags & EXT4_SNAP_ATTR))
+		return NULL;
+	/* A directory never opens as a file. */
+	if ((si->mode & FILETYPE_INO_MASK) == FILETYPE_INO_DIRECTORY) {
+		*missing = 1;
+		return NULL;
+	}
+	if (!(si->flags & EXT4_SNAP_RUNS))
+		return NULL;
+	/* Only regular files open; inline data lives in the inode itself. */
+	if ((si->iflags & EXT4_INLINE_DATA_FL) ||
+	    (si->mode & FILETYPE_INO_MASK) != FILETYPE_INO_REG)
+		return NULL;
+	runs = ext4_snap_runs(fs->snap, si);
+	if (!runs)
+		return NULL;
+
+	node = zalloc(sizeof *node);
+	if (!node)
+		return NULL;
+	node->runs = malloc(MAX(si->nruns, 1) * sizeof *runs);
+	if (!node->runs) {
+		free(node);
+		return NULL;
+	}
+	memcpy(node->runs, runs, si->nruns * sizeof *runs);
+	node->nr_runs = node->max_runs = si->nruns;
+	node->runs_read = 1;
+	node->data = fs->ext4fs_root;
+	node->ino = si->ino;
+	ext4_snap_get_inode(si, &node->inode);
+	node->inode_read = 1;
+	return node;
+}
+
 static struct file_entry *
 ext4fs_open(struct filesys_spec *fsys, const char *filename)
 {
 	struct ext2fs_node *fdiro = NULL;
-	int status;
+	int status, missing;
 	struct ext2fs_file_entry *filp;
 	struct ext_filesystem *fs = &fsys->extfs;
 
+	fdiro = ext4fs_snap_open(fs, filename, &missing);
+	if (fdiro)
+		goto found;
+	/* The snapshot spells names exactly; it can't rule out other cases. */
+	if (missing && !fs->fold)
+		return NULL;
+
 	status = ext4fs_find_file(fs, filename, &fs->ext4fs_root->diropen, &fdiro,
 				  FILETYPE_REG);
 	if (status == 0)
@@ -931,6 +1738,14 @@ ext4fs_open(struct filesys_spec *fsys, const char *filename)
 			goto fail;
 	}
 
+	/* Bring the whole block map in now, a tree level per batch. */
+	if (!(fdiro->inode.flags & EXT4_INLINE_DATA_FL))
+		ext4fs_load_runs(fs, fdiro);
+
+	ext4_snap_add_inode(fs->snap, fdiro->ino, &fdiro->inode);
+	if (fdiro->runs_read)
+		ext4_snap_add_runs(fs->snap, fdiro->ino, fdiro->runs, fdiro->nr_runs);
+found:
 	filp = __alloc_ext2fs_entry(fdiro);
 
 	return &filp->base;
@@ -973,16 +1788,25 @@ static struct filesys_spec *ext4fs_mount(part_descr_t part)
 	fs->total_blocks = data->sblock.total_blocks;
 	fs->free_blocks = data->sblock.free_blocks;
 	fs->block_size = (1024 << data->sblock.log2_block_size);
+	fs->blksz = fs->block_size;
 
 	fprintf(stderr, "total_block: %u, free_blocks: %u, block_size: %d\n", fs->total_blocks,
 		fs->free_blocks, fs->block_size);
 
 	if ((data->sblock.revision_level == 0))
-		fs->inodesz = 128;
+		fs->inodesz = EXT2_GOOD_OLD_INODE_SIZE;
 	else
 		fs->inodesz = (data->sblock.inode_size);
 
-	printf("EXT2 rev %d, inode_size %d\n",(data->sblock.revision_level), fs->inodesz);
+	if (fs->inodesz < EXT2_GOOD_OLD_INODE_SIZE ||
+	    fs->inodesz > fs->block_size ||
+	    (fs->inodesz & (fs->inodesz - 1)))
+		goto fail;
+
+	fprintf(stderr, "EXT2 rev %d, inode_size %d\n",(data->sblock.revision_level), fs->inodesz);
+
+	if (!ext4fs_load_groups(fs, data))
+		goto fail;
 
 	data->diropen.data = data;
 	data->diropen.ino = 2;
@@ -992,15 +1816,67 @@ static struct filesys_spec *ext4fs_mount(part_descr_t part)
 	status = ext4fs_read_inode(fs, data, 2, data->inode);
 	if (status == 0)
 		goto fail;
+	/* Map the root now; it is shared and must not change later. */
+	if (!(data->inode->flags & EXT4_INLINE_DATA_FL) &&
+	    !ext4fs_load_runs(fs, &data->diropen))
+		goto fail;
 	return fs_descr;
 fail:
-	printf("Failed to mount ext2 filesystem...\n");
+	fprintf(stderr, "Failed to mount ext2 filesystem...\n");
+	free(data->diropen.runs);
+	free(data->diropen.inode.inline_data);
+	free(fs->groups);
 	free(fs_descr);
 	return NULL;
 }
 
 
-static int ext4fs_list_files(struct filesys_spec *fsys, const char *dirname, dir_iterate_func_t func, void *data)
+/*
+ * List a directory from the snapshot, if it holds every entry.  Returns
+ * 1 when listed, -1 when the snapshot knows there is no such directory.
+ */
+static int ext4fs_snap_list(struct ext_filesystem *fs, const char *dirname, dir_match_func_t match,
+		dir_iterate_func_t func, void *data)
+{
+	const struct ext4_snap_inode *dir, *si;
+	const struct ext4_snap_dirent *de;
+	struct ext2fs_node node;
+	struct xstat st;
+	uint32_t i;
+	int missing;
+
+	dir = ext4_snap_lookup(fs->snap, dirname, &missing);
+	if (missing)
+		return fs->fold ? 0 : -1;
+	if (!dir || !(dir->flags & EXT4_SNAP_DIR) || !(de = ext4_snap_dirents(fs->snap, dir)))
+		return 0;
+	/* Only answer when every entry has its attributes. */
+	for (i = 0; i < dir->ndirents; i++) {
+		si = ext4_snap_find(fs->snap, de[i].ino);
+		if (!si || !(si->flags & EXT4_SNAP_ATTR) || !ext4_snap_name(fs->snap, &de[i]))
+			return 0;
+	}
+	memset(&node, 0, sizeof node);
+	for (i = 0; i < dir->ndirents; i++) {
+		char filename[de[i].name_len + 1];
+
+		si = ext4_snap_find(fs->snap, de[i].ino);
+		memcpy(filename, ext4_snap_name(fs->snap, &de[i]), de[i].name_len);
+		filename[de[i].name_len] = '\0';
+		if (match && !match(data, filename))
+			continue;
+		node.ino = de[i].ino;
+		ext4_snap_get_inode(si, &node.inode);
+		ext4fs_fill_xstat(&node, &st);
+		if (func(data, filename, &st,
+			 (si->mode & FILETYPE_INO_MASK) == FILETYPE_INO_DIRECTORY))
+			break;
+	}
+	return 1;
+}
+
+static int ext4fs_list_matching(struct filesys_spec *fsys, const char *dirname, dir_match_func_t match,
+		dir_iterate_func_t func, void *data)
 {
 	struct ext2fs_node *dirnode;
 	int status;
@@ -1008,19 +1884,86 @@ static int ext4fs_list_files(struct filesys_spec *fsys, const char *dirname, dir
 
 	if (dirname == NULL)
 		return -1;
+	status = ext4fs_snap_list(fs, dirname, match, func, data);
+	if (status)
+		return status > 0 ? 0 : -1;
 
 	status = ext4fs_find_file(fs, dirname, &fs->ext4fs_root->diropen, &dirnode,
 			FILETYPE_DIRECTORY);
 	if (status != 1) {
-		printf("** Can not find directory. [%s] **\n", dirname);
+		fprintf(stderr, "** Can not find directory. [%s] **\n", dirname);
 		return -1;
 	}
-	ext4fs_iterate_dir(fs, dirnode, NULL, NULL, NULL, func, data);
+	ext4fs_iterate_dir(fs, dirnode, NULL, NULL, NULL, match, func, data);
 	ext4fs_free_node(fs, dirnode, &fs->ext4fs_root->diropen);
 
 	return 0;
 }
 
+static int ext4fs_list_files(struct filesys_spec *fsys, const char *dirname, dir_iterate_func_t func, void *data)
+{
+	return ext4fs_list_matching(fsys, dirname, NULL, func, data);
+}
+
+/* Report the one entry of dirname called name, if there is one. */
+static int ext4fs_dir_lookup(struct filesys_spec *fsys, const char *dirname, const char *name,
+		dir_iterate_func_t func, void *data)
+{
+	struct ext_filesystem *fs = &fsys->extfs;
+	struct ext2fs_node *root = &fs->ext4fs_root->diropen;
+	struct ext2fs_node *dirnode, *node;
+	char key[strlen(name) + 1], real[256];
+	struct xstat st;
+	int type;
+
+	if (ext4fs_find_file(fs, dirname, root, &dirnode, FILETYPE_DIRECTORY) != 1)
+		return -1;
+	strcpy(key, name);
+	if (!strchr(key, '/') && ext4fs_lookup(fs, dirnode, key, &node, &type, real) == 1) {
+		if (node->inode_read ||
+		    ext4fs_read_inode(fs, node->data, node->ino, &node->inode)) {
+			node->inode_read = 1;
+			ext4fs_fill_xstat(node, &st);
+			func(data, real, &st, type == FILETYPE_DIRECTORY);
+		}
+		ext4fs_free_node(fs, node, dirnode);
+	}
+	ext4fs_free_node(fs, dirnode, root);
+	return 0;
+}
+
+static int ext4fs_readlink(struct filesys_spec *fsys, const char *path, char *buf, int size)
+{
+	struct ext_filesystem *fs = &fsys->extfs;
+	struct ext2fs_node *root = &fs->ext4fs_root->diropen;
+	struct ext2fs_node *dirnode, *node = NULL;
+	char dir[strlen(path) + 1];
+	char *name, *target;
+	int type = FILETYPE_UNKNOWN;
+	int len = -1;
+
+	strcpy(dir, path);
+	name = strrchr(dir, '/');
+	if (!name || !name[1])
+		return -1;
+	*name++ = '\0';
+	if (ext4fs_find_file(fs, dir[0] ? dir : "/", root, &dirnode, FILETYPE_DIRECTORY) != 1)
+		return -1;
+
+	/* Look the last component up without following it. */
+	if (ext4fs_lookup(fs, dirnode, name, &node, &type, NULL) == 1 &&
+	    type == FILETYPE_SYMLINK) {
+		target = ext4fs_read_symlink(fs, node);
+		if (target) {
+			len = snprintf(buf, size, "%s", target);
+			free(target);
+		}
+	}
+	ext4fs_free_node(fs, node, dirnode);
+	ext4fs_free_node(fs, dirnode, root);
+	return len;
+}
+
 static int ext4fs_label(struct filesys_spec *fsys, char *buf, int buflen)
 {
 	struct ext_filesystem *fs = &fsys->extfs;
@@ -1041,6 +1984,136 @@ static int ext4fs_label(struct filesys_spec *fsys, char *buf, int buflen)
 	return nsize > buflen ? buflen : nsize;
 }
 
+/* Serve metadata from the sidecar at path and keep it up to date. */
+static int ext4fs_snapshot(struct filesys_spec *fsys, const char *path)
+{
+	struct ext_filesystem *fs = &fsys->extfs;
+	struct ext2fs_node *root = &fs->ext4fs_root->diropen;
+
+	if (fs->snap)
+		return 0;
+	fs->snap = ext4_snap_open(path, &fs->ext4fs_root->sblock);
+	if (!fs->snap)
+		return 1;
+	ext4_snap_add_inode(fs->snap, root->ino, &root->inode);
+	if (root->runs_read)
+		ext4_snap_add_runs(fs->snap, root->ino, root->runs, root->nr_runs);
+	return 0;
+}
+
+struct ext4fs_scan_ctx {
+	int (*func)(void *, struct xstat *);
+	void *arg;
+};
+
+static int ext4fs_scan_one(void *arg, uint32_t ino, struct ext2fs_inode *inode)
+{
+	struct ext4fs_scan_ctx *ctx = arg;
+	struct xstat st;
+
+	ext4fs_inode_xstat(ino, inode, &st);
+	return ctx->func(ctx->arg, &st);
+}
+
+static int ext4fs_scan(struct filesys_spec *fsys, int threads, int (*func)(void *, struct xstat *), void *arg)
+{
+	struct ext4fs_scan_ctx ctx = { func, arg };
+
+	return ext4fs_scan_inodes(&fsys->extfs, threads, ext4fs_scan_one, &ctx);
+}
+
+static int ext4fs_list_paths(struct filesys_spec *fsys, int threads,
+		int (*func)(void *, const char *, uint32_t, struct xstat *), void *arg)
+{
+	return ext4fs_catalog(&fsys->extfs, threads, func, arg);
+}
+
+static int ext4fs_find_paths(struct filesys_spec *fsys, int threads, const struct xquery *q,
+		int (*func)(void *, const char *, uint32_t, struct xstat *), void *arg)
+{
+	return ext4fs_query(&fsys->extfs, threads, q, func, arg);
+}
+
+struct ext4fs_ranges_ctx {
+	int (*func)(void *, uint64_t, uint64_t);
+	void *arg;
+	uint32_t block_size;
+};
+
+static int ext4fs_ranges_one(void *arg, uint64_t blk, uint64_t count)
+{
+	struct ext4fs_ranges_ctx *ctx = arg;
+
+	return ctx->func(ctx->arg, blk * ctx->block_size, count * ctx->block_size);
+}
+
+static int ext4fs_used_ranges(struct filesys_spec *fsys, int (*func)(void *, uint64_t, uint64_t), void *arg)
+{
+	struct ext4fs_ranges_ctx ctx = { func, arg, fsys->extfs.block_size };
+
+	return ext4fs_used_blocks(&fsys->extfs, ext4fs_ranges_one, &ctx);
+}
+
+static int ext4fs_uuid(struct filesys_spec *fsys, uint8_t uuid[16])
+{
+	memcpy(uuid, fsys->extfs.ext4fs_root->sblock.unique_id, 16);
+	return 0;
+}
+
+/* The same key that validates a snapshot sidecar. */
+static int ext4fs_stamp(struct filesys_spec *fsys, uint8_t stamp[32])
+{
+	struct ext2_sblock *sb = &fsys->extfs.ext4fs_root->sblock;
+
+	memset(stamp, 0, 32);
+	memcpy(stamp, sb->unique_id, 16);
+	memcpy(stamp + 16, &sb->mtime, 4);
+	memcpy(stamp + 20, &sb->utime, 4);
+	memcpy(stamp + 24, &sb->mnt_count, sizeof sb->mnt_count);
+	return 0;
+}
+
+static int ext4fs_casefold(struct filesys_spec *fsys, int on)
+{
+	struct ext_filesystem *fs = &fsys->extfs;
+
+	if (!on) {
+		ext4_fold_destroy(fs->fold);
+		fs->fold = NULL;
+	} else if (!fs->fold) {
+		fs->fold = ext4_fold_create();
+		if (!fs->fold)
+			return 1;
+	}
+	return 0;
+}
+
+struct ext4fs_map_ctx {
+	int (*func)(void *, uint32_t, const struct xextent *);
+	void *arg;
+	uint32_t block_size;
+};
+
+static int ext4fs_map_one(void *arg, uint32_t ino, const struct ext2fs_run *run)
+{
+	struct ext4fs_map_ctx *ctx = arg;
+	struct xextent ext;
+
+	ext.logical  = (uint64_t)run->lblk * ctx->block_size;
+	ext.physical = run->pblk * ctx->block_size;
+	ext.length   = (uint64_t)run->len * ctx->block_size;
+	ext.flags    = run->flags & EXT2FS_RUN_UNWRITTEN ? XEXTENT_UNWRITTEN : 0;
+	return ctx->func(ctx->arg, ino, &ext);
+}
+
+static int ext4fs_block_map(struct filesys_spec *fsys, int threads,
+		int (*func)(void *, uint32_t, const struct xextent *), void *arg)
+{
+	struct ext4fs_map_ctx ctx = { func, arg, fsys->extfs.block_size };
+
+	return ext4fs_scan_runs(&fsys->extfs, threads, ext4fs_map_one, &ctx);
+}
+
 static int ext4fs_fsstat(struct filesys_spec *fsys, struct xfsstat *stbuf)
 {
 	struct ext_filesystem *fs = &fsys->extfs;
@@ -1055,9 +2128,22 @@ static int ext4fs_fsstat(struct filesys_spec *fsys, struct xfsstat *stbuf)
 struct filesys_operations extfs_operations = {
 	.mount       = ext4fs_mount,
 	.dir_iterate = ext4fs_list_files,
+	.dir_match   = ext4fs_list_matching,
+	.dir_lookup  = ext4fs_dir_lookup,
 	.umount      = ext4fs_umount,
 	.open        = ext4fs_open,
 	.fsstat      = ext4fs_fsstat,
 	.label       = ext4fs_label,
+	.warmup      = ext4fs_warmup,
+	.uuid        = ext4fs_uuid,
+	.snapshot    = ext4fs_snapshot,
+	.scan_inodes = ext4fs_scan,
+	.catalog     = ext4fs_list_paths,
+	.query       = ext4fs_find_paths,
+	.used_ranges = ext4fs_used_ranges,
+	.readlink    = ext4fs_readlink,
+	.block_map   = ext4fs_block_map,
+	.stamp       = ext4fs_stamp,
+	.casefold    = ext4fs_casefold,
 };
 
@@ -32,22 +32,58 @@
 #define RECOVER	1
 #define SCAN		0
 
+#ifndef S_IFLNK
 #define S_IFLNK		0120000		/* symbolic link */
+#endif
 #define BLOCK_NO_ONE		1
 #define SUPERBLOCK_SECTOR	2
 #define SUPERBLOCK_SIZE	1024
 #define F_FILE			1
 
+#define EXT4_HUGE_FILE_FL		0x00040000 /* Set to each huge file */
 #define EXT4_EXTENTS_FL		0x00080000 /* Inode uses extents */
+#define EXT4_INLINE_DATA_FL		0x10000000 /* Inode has inline data */
 #define EXT4_EXT_MAGIC			0xf30a
+#define EXT_INIT_MAX_LEN		(1 << 15) /* longer ee_len: unwritten */
+#define EXT4_MAX_EXTENT_DEPTH		5
+#define EXT4_EXTENT_BATCH		(1 << 20) /* tree bytes read per batch */
+#define EXT4_RA_MIN			(128 << 10) /* readahead window bounds */
+#define EXT4_RA_MAX			(16 << 20)
+#define EXT4_RA_RUNS			64	/* runs prefetched per top-up */
+#define EXT4_RA_TRIGGER			2	/* sequential reads before readahead */
+#define EXT4_RA_LEAD_MS			500	/* how far ahead of the reader to stay */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE	0x0008
 #define EXT4_FEATURE_RO_COMPAT_GDT_CSUM	0x0010
 #define EXT4_FEATURE_INCOMPAT_EXTENTS	0x0040
+#define EXT4_FEATURE_INCOMPAT_INLINE_DATA	0x8000
+#define EXT4_FEATURE_INCOMPAT_64BIT	0x0080
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM	0x0400
+#define EXT4_SCAN_IO			(1 << 20) /* bytes per read of a bulk scan */
+#define EXT4_CAT_BATCH			4096	/* entries a catalogue worker buffers */
+#define EXT4_FOLD_DIRS			1024	/* directories kept case-folded */
+#define EXT2_MIN_DESC_SIZE		32
+#define EXT4_MIN_DESC_SIZE_64BIT	64
+#define EXT2_MAX_DESC_SIZE		EXT2_MIN_BLOCK_SIZE
 #define EXT4_INDIRECT_BLOCKS		12
 
 #define EXT4_BG_INODE_UNINIT		0x0001
 #define EXT4_BG_BLOCK_UNINIT		0x0002
 #define EXT4_BG_INODE_ZEROED		0x0004
 
+#define EXT2_GOOD_OLD_INODE_SIZE	128
+#define EXT4_EPOCH_BITS		2
+#define EXT4_EPOCH_MASK		((1 << EXT4_EPOCH_BITS) - 1)
+
+#define EXT4_XATTR_MAGIC		0xEA020000
+#define EXT4_XATTR_INDEX_SYSTEM	7
+#define EXT4_XATTR_PAD			4
+#define EXT4_XATTR_LEN(name_len) \
+	(((name_len) + EXT4_XATTR_PAD - 1 + sizeof(struct ext4_xattr_entry)) & \
+	 ~(EXT4_XATTR_PAD - 1))
+#define EXT4_MIN_INLINE_DATA_SIZE	60
+#define EXT4_INLINE_DOTDOT_SIZE	4
+
 /*
  * ext4_inode has i_block array (60 bytes total).
  * The first 12 bytes store ext4_extent_header;
@@ -86,6 +122,87 @@ struct ext4_extent_header {
 	uint32_t	eh_generation;	/* generation of the tree */
 };
 
+/*
+ * Extended attribute entry, as found after the in-inode xattr magic.
+ * Inline data lives in i_block plus the value of "system.data".
+ */
+struct ext4_xattr_entry {
+	uint8_t		e_name_len;	/* length of name */
+	uint8_t		e_name_index;	/* attribute name index */
+	uint16_t	e_value_offs;	/* offset in disk block of value */
+	uint32_t	e_value_inum;	/* inode in which the value is stored */
+	uint32_t	e_value_size;	/* size of attribute value */
+	uint32_t	e_hash;		/* hash value of name and value */
+	/* followed by e_name[e_name_len] */
+};
+
+/*
+ * Metadata snapshot sidecar: what earlier sessions learned about the
+ * directory tree, inode attributes and block maps, saved so that a later
+ * mount of the unchanged filesystem can answer lookups without the image.
+ * All records are fixed size and the file is used through a read-only
+ * mapping; the superblock UUID and mount/write times key it.
+ */
+#define EXT4_SNAP_MAGIC		"EOKSNAP1"
+#define EXT4_SNAP_HASH		4096
+
+/* ext4_snap_inode flags */
+#define EXT4_SNAP_ATTR		0x0001	/* attributes are valid */
+#define EXT4_SNAP_RUNS		0x0002	/* block map is complete */
+#define EXT4_SNAP_DIR		0x0004	/* every directory entry is listed */
+
+struct ext4_snap_header {
+	char     magic[8];
+	uint8_t  uuid[16];
+	uint32_t mtime;		/* superblock mount time */
+	uint32_t utime;		/* superblock write time */
+	uint32_t mnt_count;
+	uint32_t ninodes;
+	uint32_t ndirents;
+	uint32_t nruns;
+	uint64_t inodes_off;	/* sorted by ino */
+	uint64_t dirents_off;	/* per directory, sorted by name */
+	uint64_t runs_off;
+	uint64_t names_off;
+	uint64_t names_size;
+};
+
+struct ext4_snap_time {
+	int64_t  sec;
+	uint32_t nsec;
+	uint32_t pad;
+};
+
+struct ext4_snap_inode {
+	uint32_t ino;
+	uint32_t flags;
+	uint32_t dirent;	/* first directory entry */
+	uint32_t ndirents;
+	uint32_t run;		/* first run */
+	uint32_t nruns;
+	uint16_t mode;
+	uint16_t nlinks;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t iflags;	/* inode flags */
+	uint64_t size;
+	uint64_t blocks;
+	uint32_t dtime;
+	uint32_t pad;
+	struct ext4_snap_time atime;
+	struct ext4_snap_time ctime;
+	struct ext4_snap_time mtime;
+	struct ext4_snap_time crtime;
+};
+
+struct ext4_snap_dirent {
+	uint32_t name_off;
+	uint16_t name_len;
+	uint8_t  type;		/* FILETYPE_* */
+	uint8_t  pad;
+	uint32_t ino;
+};
+
 struct part_descr;
 struct ext_filesystem {
 	/* Total Sector of partition */
@@ -100,6 +217,10 @@ struct ext_filesystem {
 	uint32_t gdtable_blkno;
 	/* Total block groups of partition */
 	uint32_t no_blkgrp;
+	/* Group descriptor size on disk */
+	uint32_t desc_size;
+	/* Decoded group descriptors */
+	struct ext2fs_group *groups;
 	/* No of blocks required for bgdtable */
 	uint32_t no_blk_pergdt;
 	/* save info */
@@ -126,6 +247,12 @@ struct ext_filesystem {
 
 	/* Partition Device Descriptor */
 	struct part_descr *dev_desc;
+	/* Background metadata warm-up, if running */
+	struct ext4fs_warmup *warmup;
+	/* Metadata snapshot sidecar, if attached */
+	struct ext4_snap *snap;
+	/* Case-insensitive lookup index, if enabled */
+	struct ext4_fold *fold;
 	/* fs root */
 	struct ext2_data ext4fs_root[1];
 };
@@ -135,7 +262,82 @@ static inline void *zalloc(size_t size)
 	return calloc(1, size);
 }
 
+/* Does the extra inode field end inside the extra_isize bytes? */
+#define EXT4_FITS_IN_INODE(extra, field) \
+	(offsetof(struct ext2_inode_extra, field) + \
+	 sizeof((extra)->field) <= (extra)->extra_isize)
+
 int ext4fs_read_inode(struct ext_filesystem *, struct ext2_data *data, int ino,
-		      struct ext2_inode *inode);
+		      struct ext2fs_inode *inode);
+void ext4fs_decode_inode(struct ext_filesystem *, struct ext2_data *data,
+		      const char *buf, struct ext2fs_inode *inode);
+void ext4fs_inode_xstat(uint32_t ino, const struct ext2fs_inode *inode, struct xstat *st);
+int ext4fs_load_runs(struct ext_filesystem *, struct ext2fs_node *node);
+
+/*
+ * Whole-filesystem inode scan: block groups are shared out to threads
+ * that read inode tables sequentially, skipping unused inodes.  func is
+ * called for every inode in use, one call at a time; a nonzero return
+ * stops the scan.  A filter, if given, is run by the scanning threads on
+ * the raw on-disk inode first and only the inodes it accepts are decoded.
+ */
+typedef int (*ext4fs_inode_func_t)(void *arg, uint32_t ino, struct ext2fs_inode *inode);
+typedef int (*ext4fs_raw_filter_t)(void *arg, const char *raw);
+int ext4fs_scan_inodes(struct ext_filesystem *, int threads, ext4fs_inode_func_t func, void *arg);
+int ext4fs_scan_filtered(struct ext_filesystem *, int threads, ext4fs_raw_filter_t filter,
+			 void *farg, ext4fs_inode_func_t func, void *arg);
+
+/*
+ * Block ownership: the runs of every block map, decoded in parallel while
+ * the inode tables are scanned.  Inline data and fast symlinks own no
+ * blocks and are left out.
+ */
+typedef int (*ext4fs_run_func_t)(void *arg, uint32_t ino, const struct ext2fs_run *run);
+int ext4fs_scan_runs(struct ext_filesystem *, int threads, ext4fs_run_func_t func, void *arg);
+
+/*
+ * Path catalogue: every directory is read in physical block order and
+ * full paths are rebuilt from the (parent, name, child) entries, without
+ * walking the tree.  func gets each path and its parent directory with
+ * the ino, mode, nlinks, uid, gid, size, blocks and mtime of its inode,
+ * grouped by directory.  A query catalogues only the inodes that match q, keeping just
+ * the entries that lead to them.
+ */
+typedef int (*ext4fs_path_func_t)(void *arg, const char *path, uint32_t parent, struct xstat *st);
+int ext4fs_catalog(struct ext_filesystem *, int threads, ext4fs_path_func_t func, void *arg);
+int ext4fs_query(struct ext_filesystem *, int threads, const struct xquery *q,
+		 ext4fs_path_func_t func, void *arg);
+
+/*
+ * Allocated blocks from the block bitmaps, as runs in ascending order.
+ * Groups whose bitmap was never initialized count their own metadata.
+ */
+typedef int (*ext4fs_blocks_func_t)(void *arg, uint64_t blk, uint64_t count);
+int ext4fs_used_blocks(struct ext_filesystem *, ext4fs_blocks_func_t func, void *arg);
+
+/*
+ * Case-insensitive lookup: a directory gets a hash of its case-folded
+ * names the first time it is searched, and keeps it while it is among
+ * the most recently used.
+ */
+struct ext4_fold *ext4_fold_create(void);
+void ext4_fold_destroy(struct ext4_fold *);
+int  ext4_fold_add(struct ext4_fold *, uint32_t dir, const char *buf, uint64_t len);
+int  ext4_fold_lookup(struct ext4_fold *, uint32_t dir, const char *name, uint32_t *ino, int *type,
+		char *real);
+
+struct ext4_snap *ext4_snap_open(const char *path, struct ext2_sblock *sb);
+int  ext4_snap_save(struct ext4_snap *);
+void ext4_snap_close(struct ext4_snap *);
+const struct ext4_snap_inode *ext4_snap_find(struct ext4_snap *, uint32_t ino);
+const struct ext4_snap_inode *ext4_snap_lookup(struct ext4_snap *, const char *path, int *missing);
+const struct ext4_snap_dirent *ext4_snap_dirents(struct ext4_snap *, const struct ext4_snap_inode *);
+const char *ext4_snap_name(struct ext4_snap *, const struct ext4_snap_dirent *);
+const struct ext2fs_run *ext4_snap_runs(struct ext4_snap *, const struct ext4_snap_inode *);
+void ext4_snap_get_inode(const struct ext4_snap_inode *, struct ext2fs_inode *);
+void ext4_snap_add_inode(struct ext4_snap *, uint32_t ino, const struct ext2fs_inode *);
+void ext4_snap_add_runs(struct ext4_snap *, uint32_t ino, const struct ext2fs_run *, int n);
+void ext4_snap_add_entry(struct ext4_snap *, uint32_t dir, const char *name, int type, uint32_t ino);
+void ext4_snap_dir_done(struct ext4_snap *, uint32_t dir);
 
 #endif
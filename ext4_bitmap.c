@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext.h"
+#include "ext4.h"
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+
+/* A range of blocks holding some group's bitmaps or inode table. */
+struct ext4_meta_range {
+	uint64_t blk;
+	uint64_t count;
+};
+
+struct ext4_used {
+	struct ext_filesystem *fs;
+	ext4fs_blocks_func_t func;
+	void     *arg;
+	uint64_t  run_blk;	/* pending run, not yet reported */
+	uint64_t  run_count;
+	struct ext4_meta_range *meta;
+	uint32_t  nr_meta;
+	int       csum;		/* uninit flags can be trusted */
+	int       stopped;	/* func asked to stop */
+};
+
+static int ext4_used_add(struct ext4_used *u, uint64_t blk, uint64_t count)
+{
+	if (u->run_count && u->run_blk + u->run_count == blk) {
+		u->run_count += count;
+		return 0;
+	}
+	if (u->run_count && u->func(u->arg, u->run_blk, u->run_count))
+		return u->stopped = 1;
+	u->run_blk = blk;
+	u->run_count = count;
+	return 0;
+}
+
+static int ext4_is_power_of(uint32_t n, uint32_t base)
+{
+	while (n > 1 && n % base == 0)
+		n /= base;
+	return n == 1;
+}
+
+/* Does group g carry a superblock and descriptor table copy? */
+static int ext4_group_has_super(struct ext2_sblock *sblock, uint32_t g)
+{
+	if (!(sblock->feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) || g <= 1)
+		return 1;
+	return ext4_is_power_of(g, 3) || ext4_is_power_of(g, 5) || ext4_is_power_of(g, 7);
+}
+
+static int ext4_block_uninit(struct ext4_used *u, uint32_t g)
+{
+	return u->csum && (u->fs->groups[g].flags & EXT4_BG_BLOCK_UNINIT);
+}
+
+static int ext4_cmp_meta(const void *a, const void *b)
+{
+	const struct ext4_meta_range *x = a, *y = b;
+
+	return x->blk < y->blk ? -1 : x->blk > y->blk;
+}
+
+/* Every group's bitmaps and inode table, sorted by block. */
+static int ext4_used_load_meta(struct ext4_used *u)
+{
+	struct ext_filesystem *fs = u->fs;
+	struct ext2_sblock *sblock = &fs->ext4fs_root->sblock;
+	uint64_t itable = ((uint64_t)sblock->inodes_per_group * fs->inodesz + fs->block_size - 1) /
+			  fs->block_size;
+	uint32_t g;
+
+	u->meta = malloc(fs->no_blkgrp * 3 * sizeof *u->meta);
+	if (!u->meta)
+		return 0;
+	for (g = 0; g < fs->no_blkgrp; g++) {
+		u->meta[u->nr_meta].blk = fs->groups[g].block_bitmap;
+		u->meta[u->nr_meta++].count = 1;
+		u->meta[u->nr_meta].blk = fs->groups[g].inode_bitmap;
+		u->meta[u->nr_meta++].count = 1;
+		u->meta[u->nr_meta].blk = fs->groups[g].inode_table;
+		u->meta[u->nr_meta++].count = itable;
+	}
+	qsort(u->meta, u->nr_meta, sizeof *u->meta, ext4_cmp_meta);
+	return 1;
+}
+
+static void ext4_bitmap_set(uint8_t *bitmap, uint64_t from, uint64_t to)
+{
+	for (; from < to; from++)
+		bitmap[from >> 3] |= 1 << (from & 7);
+}
+
+/*
+ * A BLOCK_UNINIT group has no bitmap on disk; its blocks in use are the
+ * superblock and descriptor copies and whatever group metadata flex_bg
+ * placed in it.
+ */
+static int ext4_used_uninit_bitmap(struct ext4_used *u, uint32_t g, uint64_t start,
+		uint32_t nblocks, uint8_t *bitmap)
+{
+	struct ext_filesystem *fs = u->fs;
+	struct ext2_sblock *sblock = &fs->ext4fs_root->sblock;
+	uint32_t lo, hi, mid;
+
+	if (!u->meta && !ext4_used_load_meta(u))
+		return 1;
+	memset(bitmap, 0, fs->block_size);
+	if (ext4_group_has_super(sblock, g))
+		ext4_bitmap_set(bitmap, 0, MIN(nblocks, 1 + fs->no_blk_pergdt +
+					      (uint64_t)sblock->reserved_gdt_blocks));
+
+	/* First range that may reach into the group. */
+	lo = 0;
+	hi = u->nr_meta;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (u->meta[mid].blk + u->meta[mid].count <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < u->nr_meta && u->meta[lo].blk < start + nblocks; lo++) {
+		uint64_t from = MAX(u->meta[lo].blk, start);
+		uint64_t to = MIN(u->meta[lo].blk + u->meta[lo].count, start + nblocks);
+
+		if (from < to)
+			ext4_bitmap_set(bitmap, from - start, to - start);
+	}
+	return 0;
+}
+
+static int ext4_used_group(struct ext4_used *u, uint64_t start, uint32_t nblocks,
+		const uint8_t *bitmap)
+{
+	uint32_t b = 0, e;
+
+	while (b < nblocks) {
+		/* Step over whole bytes of free blocks. */
+		if ((b & 7) == 0 && bitmap[b >> 3] == 0) {
+			b += 8;
+			continue;
+		}
+		if (!(bitmap[b >> 3] & (1 << (b & 7)))) {
+			b++;
+			continue;
+		}
+		for (e = b + 1; e < nblocks; e++) {
+			if ((e & 7) == 0 && bitmap[e >> 3] == 0xff && e + 8 <= nblocks) {
+				e += 7;
+				continue;
+			}
+			if (!(bitmap[e >> 3] & (1 << (e & 7))))
+				break;
+		}
+		if (ext4_used_add(u, start + b, e - b))
+			return 1;
+		b = e;
+	}
+	return 0;
+}
+
+/*
+ * Report the allocated blocks.  Block bitmaps that sit next to each other
+ * on disk, as flex_bg lays them out, are read together.
+ */
+int ext4fs_used_blocks(struct ext_filesystem *fs, ext4fs_blocks_func_t func, void *arg)
+{
+	struct ext2_data *data = fs->ext4fs_root;
+	struct ext2_sblock *sblock = &data->sblock;
+	uint32_t per_io = EXT4_SCAN_IO / fs->block_size;
+	struct ext4_used u;
+	uint8_t *buf, *bitmap;
+	uint32_t g, e, i, nblocks;
+	uint64_t start;
+	int status = 1;
+
+	memset(&u, 0, sizeof u);
+	u.fs = fs;
+	u.func = func;
+	u.arg = arg;
+	u.csum = sblock->feature_ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+					      EXT4_FEATURE_RO_COMPAT_METADATA_CSUM);
+	buf = malloc((uint64_t)per_io * fs->block_size);
+	if (!buf)
+		return 1;
+
+	/* Blocks in front of group 0, the boot block with 1k blocks. */
+	if (sblock->first_data_block && ext4_used_add(&u, 0, sblock->first_data_block))
+		goto out;
+
+	for (g = 0; g < fs->no_blkgrp; g = e) {
+		/* Gather groups whose bitmaps follow each other on disk. */
+		for (e = g + 1; !ext4_block_uninit(&u, g) && e < fs->no_blkgrp && e - g < per_io &&
+		     !ext4_block_uninit(&u, e) &&
+		     fs->groups[e].block_bitmap == fs->groups[g].block_bitmap + (e - g); e++)
+			;
+		if (!ext4_block_uninit(&u, g) &&
+		    vfs_devread(fs->dev_desc, fs->groups[g].block_bitmap << LOG2_EXT2_BLOCK_SIZE(data),
+				0, (e - g) * fs->block_size, (char *)buf) == 0) {
+			fprintf(stderr, "can't read block bitmap of group %u\n", g);
+			goto out;
+		}
+
+		for (i = g; i < e; i++) {
+			start = sblock->first_data_block + (uint64_t)i * sblock->blocks_per_group;
+			nblocks = MIN(sblock->blocks_per_group, fs->total_blocks - start);
+			bitmap = buf + (uint64_t)(i - g) * fs->block_size;
+			if (ext4_block_uninit(&u, i) &&
+			    ext4_used_uninit_bitmap(&u, i, start, nblocks, bitmap))
+				goto out;
+			if (ext4_used_group(&u, start, nblocks, bitmap))
+				goto out;
+		}
+	}
+	if (u.run_count && func(arg, u.run_blk, u.run_count))
+		u.stopped = 1;
+	status = 0;
+out:
+	free(u.meta);
+	free(buf);
+	return u.stopped ? 0 : status;
+}
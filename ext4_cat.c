@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "ext.h"
+#include "ext4.h"
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+
+struct ext4_cat_inode {
+	uint32_t ino;
+	uint16_t mode;
+	uint16_t nlinks;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	uint64_t blocks;
+	struct xtimespec mtime;
+};
+
+/* A directory entry: child is called name in parent. */
+struct ext4_cat_edge {
+	uint32_t parent;
+	uint32_t child;
+	size_t   name;		/* offset in the name pool */
+	uint32_t len;
+};
+
+#define EXT4_CAT_NO_EDGE	((size_t)-1)
+
+/* ext4_cat_dir.state */
+#define EXT4_CAT_UNRESOLVED	0
+#define EXT4_CAT_VISITING	1
+#define EXT4_CAT_RESOLVED	2	/* path is set, NULL if unreachable */
+
+struct ext4_cat_dir {
+	struct ext2fs_node node;
+	size_t  edge;		/* entry naming this directory */
+	char   *path;
+	int     state;
+};
+
+/* Read order of the directories. */
+struct ext4_cat_order {
+	uint64_t first;		/* first physical block */
+	size_t   dir;
+};
+
+struct ext4_cat {
+	struct ext_filesystem *fs;
+	const struct xquery *query;	/* NULL to catalogue everything */
+	xmutex_t lock;
+	struct ext4_cat_inode *inodes;
+	size_t   nr_inodes, max_inodes;
+	struct ext4_cat_dir *dirs;
+	size_t   nr_dirs, max_dirs;
+	struct ext4_cat_order *order;
+	struct ext4_cat_edge *edges;
+	size_t   nr_edges, max_edges;
+	char    *names;
+	size_t   names_len, names_max;
+	struct ext4_cat_dir **stack;
+	size_t   max_stack;
+	size_t   next;		/* next directory to hand out */
+	int      status;	/* fatal, the catalogue is abandoned */
+	int      errors;	/* directories that could not be read */
+};
+
+/* Entries a worker collects before adding them to the catalogue. */
+struct ext4_cat_batch {
+	struct ext4_cat_edge edges[EXT4_CAT_BATCH];
+	int    nr;
+	size_t names_len;
+	char   names[EXT4_CAT_BATCH * 255];
+};
+
+static int ext4_cat_cmp_inode(const void *a, const void *b)
+{
+	const struct ext4_cat_inode *x = a, *y = b;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int ext4_cat_cmp_dir(const void *a, const void *b)
+{
+	const struct ext4_cat_dir *x = a, *y = b;
+
+	return x->node.ino < y->node.ino ? -1 : x->node.ino > y->node.ino;
+}
+
+static int ext4_cat_cmp_order(const void *a, const void *b)
+{
+	const struct ext4_cat_order *x = a, *y = b;
+
+	return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/* By directory, then in the order the entries were found on disk. */
+static int ext4_cat_cmp_edge(const void *a, const void *b)
+{
+	const struct ext4_cat_edge *x = a, *y = b;
+
+	if (x->parent != y->parent)
+		return x->parent < y->parent ? -1 : 1;
+	return x->name < y->name ? -1 : x->name > y->name;
+}
+
+static struct ext4_cat_dir *ext4_cat_find_dir(struct ext4_cat *cat, uint32_t ino)
+{
+	struct ext4_cat_dir key;
+
+	key.node.ino = ino;
+	return bsearch(&key, cat->dirs, cat->nr_dirs, sizeof key, ext4_cat_cmp_dir);
+}
+
+static struct ext4_cat_inode *ext4_cat_find_inode(struct ext4_cat *cat, uint32_t ino)
+{
+	struct ext4_cat_inode key;
+
+	key.ino = ino;
+	return bsearch(&key, cat->inodes, cat->nr_inodes, sizeof key, ext4_cat_cmp_inode);
+}
+
+/*
+ * Query prefilter, run by the scanning threads on the raw inode: only the
+ * fixed-offset fields the query tests are read, and nothing is decoded.
+ * Directories always pass, they are needed to name the matches.
+ */
+static int ext4_cat_raw_match(void *arg, const char *raw)
+{
+	struct ext4_cat *cat = arg;
+	const struct xquery *q = cat->query;
+	const struct ext2_inode *ri = (const struct ext2_inode *)raw;
+	struct ext2_inode_extra extra;
+	uint64_t size;
+	int64_t mtime;
+
+	if ((ri->mode & FILETYPE_INO_MASK) == FILETYPE_INO_DIRECTORY)
+		return 1;
+	if (q->type && (ri->mode & FILETYPE_INO_MASK) != q->type)
+		return 0;
+	size = ri->size | (uint64_t)ri->dir_acl << 32;
+	if (size < q->size_min || size > q->size_max)
+		return 0;
+	if (q->uid != XQUERY_ANY && (ri->uid | (ri->osd2[1] & 0xffff) << 16) != q->uid)
+		return 0;
+	if (q->gid != XQUERY_ANY && (ri->gid | (ri->osd2[1] & 0xffff0000)) != q->gid)
+		return 0;
+
+	mtime = (int32_t)ri->mtime;
+	if (cat->fs->inodesz > EXT2_GOOD_OLD_INODE_SIZE) {
+		memcpy(&extra, raw + EXT2_GOOD_OLD_INODE_SIZE, offsetof(struct ext2_inode_extra, atime_extra));
+		if (extra.extra_isize <= cat->fs->inodesz - EXT2_GOOD_OLD_INODE_SIZE &&
+		    EXT4_FITS_IN_INODE(&extra, mtime_extra))
+			mtime += (int64_t)(extra.mtime_extra & EXT4_EPOCH_MASK) << 32;
+	}
+	return mtime >= q->mtime_min && mtime <= q->mtime_max;
+}
+
+/* Inode scan callback; calls are serialized by the scanner. */
+static int ext4_cat_add_inode(void *arg, uint32_t ino, struct ext2fs_inode *inode)
+{
+	struct ext4_cat *cat = arg;
+	struct ext4_cat_inode *ci;
+	struct ext4_cat_dir *d;
+	struct xstat st;
+
+	ext4fs_inode_xstat(ino, inode, &st);
+	if (!cat->query || vfs_query_match(cat->query, &st)) {
+		if (!xgrow((void **)&cat->inodes, &cat->max_inodes, cat->nr_inodes + 1, sizeof *ci))
+			return cat->status = 1;
+		ci = &cat->inodes[cat->nr_inodes++];
+		ci->ino    = ino;
+		ci->mode   = st.mode;
+		ci->nlinks = st.nlinks;
+		ci->uid    = st.uid;
+		ci->gid    = st.gid;
+		ci->size   = st.size;
+		ci->blocks = st.blocks;
+		ci->mtime  = st.mtime;
+	}
+
+	if ((inode->mode & FILETYPE_INO_MASK) != FILETYPE_INO_DIRECTORY)
+		return 0;
+	if (!xgrow((void **)&cat->dirs, &cat->max_dirs, cat->nr_dirs + 1, sizeof *d))
+		return cat->status = 1;
+	d = &cat->dirs[cat->nr_dirs++];
+	memset(d, 0, sizeof *d);
+	d->node.data = cat->fs->ext4fs_root;
+	d->node.ino = ino;
+	d->node.inode = *inode;
+	d->node.inode_read = 1;
+	d->edge = EXT4_CAT_NO_EDGE;
+	return 0;
+}
+
+/* Hand out the next directory, in read order once that is known. */
+static struct ext4_cat_dir *ext4_cat_next(struct ext4_cat *cat, size_t *index)
+{
+	size_t i;
+
+	xmutex_lock(cat->lock);
+	if (cat->status || cat->next >= cat->nr_dirs) {
+		xmutex_unlock(cat->lock);
+		return NULL;
+	}
+	i = cat->next++;
+	xmutex_unlock(cat->lock);
+
+	*index = i;
+	return &cat->dirs[cat->order[i].dir];
+}
+
+static void ext4_cat_error(struct ext4_cat *cat, const char *what, struct ext4_cat_dir *d)
+{
+	fprintf(stderr, "catalogue: can't %s directory %d\n", what, d->node.ino);
+	xmutex_lock(cat->lock);
+	cat->errors++;
+	xmutex_unlock(cat->lock);
+}
+
+/* Decode the block maps; most live in the inode and cost no I/O. */
+static void ext4_cat_map_worker(void *p)
+{
+	struct ext4_cat *cat = p;
+	struct ext4_cat_dir *d;
+	size_t i;
+
+	while ((d = ext4_cat_next(cat, &i)) != NULL) {
+		if (d->node.inode.flags & EXT4_INLINE_DATA_FL) {
+			if (!ext4fs_read_inode(cat->fs, d->node.data, d->node.ino, &d->node.inode))
+				ext4_cat_error(cat, "read", d);
+		} else if (!ext4fs_load_runs(cat->fs, &d->node)) {
+			ext4_cat_error(cat, "map", d);
+		} else if (d->node.nr_runs) {
+			cat->order[i].first = d->node.runs[0].pblk;
+		}
+	}
+}
+
+static int ext4_cat_flush(struct ext4_cat *cat, struct ext4_cat_batch *b)
+{
+	int i, status = 0;
+
+	xmutex_lock(cat->lock);
+	if (!xgrow((void **)&cat->edges, &cat->max_edges, cat->nr_edges + b->nr, sizeof *cat->edges) ||
+	    !xgrow((void **)&cat->names, &cat->names_max, cat->names_len + b->names_len, 1)) {
+		status = cat->status = 1;
+	} else {
+		for (i = 0; i < b->nr; i++) {
+			cat->edges[cat->nr_edges] = b->edges[i];
+			cat->edges[cat->nr_edges++].name += cat->names_len;
+		}
+		memcpy(cat->names + cat->names_len, b->names, b->names_len);
+		cat->names_len += b->names_len;
+	}
+	xmutex_unlock(cat->lock);
+	b->nr = 0;
+	b->names_len = 0;
+	return status;
+}
+
+/*
+ * Collect the entries of one directory block, less "." and "..".  A query
+ * keeps only the entries that name a directory or a match.
+ */
+static int ext4_cat_parse(struct ext4_cat *cat, struct ext4_cat_batch *b, uint32_t parent,
+		const char *blk, uint32_t len)
+{
+	struct ext2_dirent de;
+	struct ext4_cat_edge *e;
+	const char *name;
+	uint32_t off;
+
+	for (off = 0; off + sizeof de <= len; off += de.direntlen) {
+		memcpy(&de, blk + off, sizeof de);
+		if (de.direntlen < sizeof de || de.direntlen > len - off)
+			break;
+		if (!de.inode || !de.namelen || de.namelen > de.direntlen - sizeof de)
+			continue;
+		name = blk + off + sizeof de;
+		if (name[0] == '.' && (de.namelen == 1 || (de.namelen == 2 && name[1] == '.')))
+			continue;
+		if (cat->query && !ext4_cat_find_inode(cat, de.inode) && !ext4_cat_find_dir(cat, de.inode))
+			continue;
+
+		if (b->nr == EXT4_CAT_BATCH && ext4_cat_flush(cat, b))
+			return 1;
+		e = &b->edges[b->nr++];
+		e->parent = parent;
+		e->child  = de.inode;
+		e->name   = b->names_len;
+		e->len    = de.namelen;
+		memcpy(b->names + b->names_len, name, de.namelen);
+		b->names_len += de.namelen;
+	}
+	return 0;
+}
+
+static int ext4_cat_read_dir(struct ext4_cat *cat, struct ext4_cat_dir *d,
+		struct ext4_cat_batch *b, char *buf)
+{
+	struct ext_filesystem *fs = cat->fs;
+	struct ext2fs_node *node = &d->node;
+	uint32_t bs = fs->block_size, per_io = EXT4_SCAN_IO / bs;
+	uint64_t nblocks = (node->inode.size + bs - 1) / bs;
+	struct ext2fs_run *run;
+	uint32_t b0, n, i;
+	int r;
+
+	for (r = 0; r < node->nr_runs; r++) {
+		run = &node->runs[r];
+		if (run->flags & EXT2FS_RUN_UNWRITTEN)
+			continue;
+		for (b0 = 0; b0 < run->len && run->lblk + b0 < nblocks; b0 += n) {
+			n = MIN(run->len - b0, per_io);
+			n = MIN(n, nblocks - run->lblk - b0);
+			if (vfs_devread(fs->dev_desc, (run->pblk + b0) << LOG2_EXT2_BLOCK_SIZE(node->data),
+					0, n * bs, buf) == 0) {
+				ext4_cat_error(cat, "read", d);
+				return 0;
+			}
+			for (i = 0; i < n; i++)
+				if (ext4_cat_parse(cat, b, node->ino, buf + i * bs, bs))
+					return 1;
+		}
+	}
+	return 0;
+}
+
+static void ext4_cat_read_worker(void *p)
+{
+	struct ext4_cat *cat = p;
+	struct ext4_cat_batch *b = malloc(sizeof *b);
+	char *buf = malloc(MAX(EXT4_SCAN_IO, cat->fs->block_size));
+	struct ext4_cat_dir *d;
+	size_t i;
+	int status = 0;
+
+	if (!b || !buf) {
+		xmutex_lock(cat->lock);
+		cat->status = 1;
+		xmutex_unlock(cat->lock);
+		goto out;
+	}
+	b->nr = 0;
+	b->names_len = 0;
+	while (!status && (d = ext4_cat_next(cat, &i)) != NULL) {
+		if (d->node.inode.flags & EXT4_INLINE_DATA_FL)
+			status = d->node.inode.inline_data &&
+				 ext4_cat_parse(cat, b, d->node.ino, d->node.inode.inline_data,
+						d->node.inode.inline_size);
+		else
+			status = ext4_cat_read_dir(cat, d, b, buf);
+	}
+	if (!status)
+		ext4_cat_flush(cat, b);
+out:
+	free(b);
+	free(buf);
+}
+
+/*
+ * Build the path of a directory: climb to an ancestor whose path is known,
+ * then fill in the paths on the way back down.  Directories that do not
+ * lead to the root, through a missing entry or a loop, get no path.
+ */
+static const char *ext4_cat_dir_path(struct ext4_cat *cat, struct ext4_cat_dir *d)
+{
+	struct ext4_cat_dir *up = d;
+	struct ext4_cat_edge *e;
+	const char *base;
+	size_t n = 0;
+
+	while (up && up->state == EXT4_CAT_UNRESOLVED) {
+		if (up->node.ino == EXT2_ROOT_INO) {
+			up->path = strdup("");
+			up->state = EXT4_CAT_RESOLVED;
+			break;
+		}
+		if (up->edge == EXT4_CAT_NO_EDGE) {
+			up->state = EXT4_CAT_RESOLVED;
+			break;
+		}
+		if (!xgrow((void **)&cat->stack, &cat->max_stack, n + 1, sizeof *cat->stack)) {
+			cat->status = 1;
+			break;
+		}
+		up->state = EXT4_CAT_VISITING;
+		cat->stack[n++] = up;
+		up = ext4_cat_find_dir(cat, cat->edges[up->edge].parent);
+	}
+
+	base = up && up->state == EXT4_CAT_RESOLVED ? up->path : NULL;
+	while (n--) {
+		up = cat->stack[n];
+		e = &cat->edges[up->edge];
+		if (base) {
+			up->path = malloc(strlen(base) + e->len + 2);
+			if (up->path)
+				sprintf(up->path, "%s/%.*s", base, (int)e->len, cat->names + e->name);
+		}
+		up->state = EXT4_CAT_RESOLVED;
+		base = up->path;
+	}
+	return d->path;
+}
+
+static void ext4_cat_emit(struct ext4_cat *cat, ext4fs_path_func_t func, void *arg)
+{
+	struct ext4_cat_edge *e;
+	struct ext4_cat_inode *ci;
+	struct ext4_cat_dir *d;
+	const char *base = NULL;
+	uint32_t parent = 0;
+	char *path = NULL;
+	size_t i, len, max = 0;
+	struct xstat st;
+
+	/* Name each directory by the first entry that points to it. */
+	for (i = 0; i < cat->nr_edges; i++) {
+		d = ext4_cat_find_dir(cat, cat->edges[i].child);
+		if (d && d->edge == EXT4_CAT_NO_EDGE)
+			d->edge = i;
+	}
+
+	for (i = 0; i < cat->nr_edges && !cat->status; i++) {
+		e = &cat->edges[i];
+		if (i == 0 || e->parent != parent) {
+			parent = e->parent;
+			d = ext4_cat_find_dir(cat, parent);
+			base = d ? ext4_cat_dir_path(cat, d) : NULL;
+		}
+		ci = ext4_cat_find_inode(cat, e->child);
+		if (!base || !ci)
+			continue;
+
+		len = strlen(base) + e->len + 2;
+		if (!xgrow((void **)&path, &max, len, 1)) {
+			cat->status = 1;
+			break;
+		}
+		sprintf(path, "%s/%.*s", base, (int)e->len, cat->names + e->name);
+		memset(&st, 0, sizeof st);
+		st.ino    = ci->ino;
+		st.mode   = ci->mode;
+		st.nlinks = ci->nlinks;
+		st.uid    = ci->uid;
+		st.gid    = ci->gid;
+		st.size   = ci->size;
+		st.blocks = ci->blocks;
+		st.mtime  = ci->mtime;
+		if (func(arg, path, e->parent, &st))
+			break;
+	}
+	free(path);
+}
+
+/*
+ * The inode tables are scanned first, then all directory blocks are read
+ * in physical order, then the paths are joined in memory.
+ */
+static int ext4_cat_run(struct ext_filesystem *fs, int threads, const struct xquery *q,
+		ext4fs_path_func_t func, void *arg)
+{
+	struct ext4_cat cat;
+	size_t i, n;
+
+	memset(&cat, 0, sizeof cat);
+	cat.fs = fs;
+	cat.query = q;
+	cat.lock = xmutex_create();
+	if (!cat.lock)
+		return 1;
+	if (threads <= 0)
+		threads = xcpu_count();
+
+	if (ext4fs_scan_filtered(fs, threads, q ? ext4_cat_raw_match : NULL, &cat,
+				 ext4_cat_add_inode, &cat))
+		cat.errors++;
+	if (cat.status || cat.errors)
+		goto out;
+	qsort(cat.inodes, cat.nr_inodes, sizeof *cat.inodes, ext4_cat_cmp_inode);
+	qsort(cat.dirs, cat.nr_dirs, sizeof *cat.dirs, ext4_cat_cmp_dir);
+
+	cat.order = zalloc(MAX(cat.nr_dirs, 1) * sizeof *cat.order);
+	if (!cat.order) {
+		cat.status = 1;
+		goto out;
+	}
+	for (i = 0; i < cat.nr_dirs; i++)
+		cat.order[i].dir = i;
+	n = MIN((size_t)threads, MAX(cat.nr_dirs, 1));
+	xthread_run(n, ext4_cat_map_worker, &cat);
+
+	qsort(cat.order, cat.nr_dirs, sizeof *cat.order, ext4_cat_cmp_order);
+	cat.next = 0;
+	xthread_run(n, ext4_cat_read_worker, &cat);
+	if (cat.status)
+		goto out;
+
+	qsort(cat.edges, cat.nr_edges, sizeof *cat.edges, ext4_cat_cmp_edge);
+	ext4_cat_emit(&cat, func, arg);
+out:
+	if (cat.status)
+		fprintf(stderr, "catalogue: out of memory\n");
+	for (i = 0; i < cat.nr_dirs; i++) {
+		free(cat.dirs[i].node.runs);
+		free(cat.dirs[i].node.inode.inline_data);
+		free(cat.dirs[i].path);
+	}
+	free(cat.inodes);
+	free(cat.dirs);
+	free(cat.order);
+	free(cat.edges);
+	free(cat.names);
+	free(cat.stack);
+	xmutex_destroy(cat.lock);
+	return cat.status || cat.errors;
+}
+
+/*
+ * Catalogue every path with the given number of threads (0: one per CPU).
+ * Returns 0 when every directory was read.
+ */
+int ext4fs_catalog(struct ext_filesystem *fs, int threads, ext4fs_path_func_t func, void *arg)
+{
+	return ext4_cat_run(fs, threads, NULL, func, arg);
+}
+
+/*
+ * Catalogue the paths of the inodes that match q.  Only the matches are
+ * kept from the inode scan, and only the directories leading to one are
+ * given a path.
+ */
+int ext4fs_query(struct ext_filesystem *fs, int threads, const struct xquery *q,
+		ext4fs_path_func_t func, void *arg)
+{
+	return ext4_cat_run(fs, threads, q, func, arg);
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext.h"
+#include "ext4.h"
+#include "util.h"
+#include "thread.h"
+#include "casefold.h"
+
+#define EXT4_FOLD_HASH		256	/* buckets of directories */
+
+/* A directory entry, chained to the others in its bucket. */
+struct ext4_fold_ent {
+	uint32_t hash;
+	uint32_t ino;
+	uint32_t name;		/* offset in the name pool */
+	uint16_t len;
+	uint8_t  type;
+	uint32_t next;		/* index + 1 of the next entry, 0 at the end */
+};
+
+struct ext4_fold_dir {
+	uint32_t ino;
+	struct ext4_fold_ent *ents;
+	uint32_t *buckets;
+	uint32_t mask;
+	char    *names;
+	struct ext4_fold_dir *hnext;
+	struct ext4_fold_dir *prev, *next;	/* most recently used first */
+};
+
+struct ext4_fold {
+	xmutex_t lock;
+	struct ext4_fold_dir *hash[EXT4_FOLD_HASH];
+	struct ext4_fold_dir lru;
+	int      ndirs;
+};
+
+struct ext4_fold *ext4_fold_create(void)
+{
+	struct ext4_fold *fold = zalloc(sizeof *fold);
+
+	if (!fold)
+		return NULL;
+	fold->lock = xmutex_create();
+	if (!fold->lock) {
+		free(fold);
+		return NULL;
+	}
+	fold->lru.prev = fold->lru.next = &fold->lru;
+	return fold;
+}
+
+static void ext4_fold_free_dir(struct ext4_fold_dir *d)
+{
+	free(d->ents);
+	free(d->buckets);
+	free(d->names);
+	free(d);
+}
+
+static void ext4_fold_unlink(struct ext4_fold_dir *d)
+{
+	d->prev->next = d->next;
+	d->next->prev = d->prev;
+}
+
+static void ext4_fold_push(struct ext4_fold *fold, struct ext4_fold_dir *d)
+{
+	d->next = fold->lru.next;
+	d->prev = &fold->lru;
+	d->next->prev = d;
+	fold->lru.next = d;
+}
+
+void ext4_fold_destroy(struct ext4_fold *fold)
+{
+	struct ext4_fold_dir *d, *next;
+
+	if (!fold)
+		return;
+	for (d = fold->lru.next; d != &fold->lru; d = next) {
+		next = d->next;
+		ext4_fold_free_dir(d);
+	}
+	xmutex_destroy(fold->lock);
+	free(fold);
+}
+
+static struct ext4_fold_dir *ext4_fold_find_dir(struct ext4_fold *fold, uint32_t ino)
+{
+	struct ext4_fold_dir *d;
+
+	for (d = fold->hash[ino % EXT4_FOLD_HASH]; d; d = d->hnext)
+		if (d->ino == ino)
+			return d;
+	return NULL;
+}
+
+static void ext4_fold_evict(struct ext4_fold *fold)
+{
+	struct ext4_fold_dir *d = fold->lru.prev, **pp;
+
+	for (pp = &fold->hash[d->ino % EXT4_FOLD_HASH]; *pp != d; pp = &(*pp)->hnext)
+		;
+	*pp = d->hnext;
+	ext4_fold_unlink(d);
+	ext4_fold_free_dir(d);
+	fold->ndirs--;
+}
+
+/* Does name a come before name b in byte order? */
+static int ext4_fold_before(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int c = memcmp(a, b, MIN(alen, blen));
+
+	return c < 0 || (c == 0 && alen < blen);
+}
+
+/*
+ * Index the entries of directory ino, given as the byte stream of its
+ * blocks.  Names that fold to the same key are reported here, once each
+ * time the directory is indexed.
+ */
+int ext4_fold_add(struct ext4_fold *fold, uint32_t ino, const char *buf, uint64_t len)
+{
+	struct ext4_fold_dir *d;
+	struct ext4_fold_ent *e, *o;
+	struct ext2_dirent de;
+	const char *name;
+	uint64_t off;
+	uint32_t n = 0, nb = 16, i, names = 0;
+
+	for (off = 0; off + sizeof de <= len; off += de.direntlen) {
+		memcpy(&de, buf + off, sizeof de);
+		if (de.direntlen < sizeof de || de.direntlen > len - off)
+			break;
+		n += de.inode && de.namelen;
+	}
+	while (nb < n)
+		nb *= 2;
+
+	d = zalloc(sizeof *d);
+	if (!d)
+		return 1;
+	d->ino = ino;
+	d->mask = nb - 1;
+	d->ents = malloc(MAX(n, 1) * sizeof *d->ents);
+	d->buckets = zalloc(nb * sizeof *d->buckets);
+	d->names = malloc(MAX(len, 1));
+	if (!d->ents || !d->buckets || !d->names) {
+		ext4_fold_free_dir(d);
+		return 1;
+	}
+
+	for (off = 0, i = 0; off + sizeof de <= len && i < n; off += de.direntlen) {
+		memcpy(&de, buf + off, sizeof de);
+		if (de.direntlen < sizeof de || de.direntlen > len - off)
+			break;
+		if (!de.inode || !de.namelen)
+			continue;
+		name = buf + off + sizeof de;
+		e = &d->ents[i];
+		e->len  = MIN(de.namelen, de.direntlen - sizeof de);
+		e->hash = casefold_hash(name, e->len);
+		e->ino  = de.inode;
+		e->type = de.filetype;
+		e->name = names;
+		memcpy(d->names + names, name, e->len);
+		names += e->len;
+
+		for (o = d->buckets[e->hash & d->mask] ? &d->ents[d->buckets[e->hash & d->mask] - 1] : NULL;
+		     o; o = o->next ? &d->ents[o->next - 1] : NULL) {
+			if (o->hash == e->hash &&
+			    casefold_equal(d->names + o->name, o->len, name, e->len)) {
+				fprintf(stderr, "directory %u: \"%.*s\" and \"%.*s\" differ only in case\n",
+					ino, (int)o->len, d->names + o->name, (int)e->len, name);
+				break;
+			}
+		}
+		e->next = d->buckets[e->hash & d->mask];
+		d->buckets[e->hash & d->mask] = ++i;
+	}
+
+	xmutex_lock(fold->lock);
+	if (ext4_fold_find_dir(fold, ino)) {
+		/* Another thread got there first. */
+		xmutex_unlock(fold->lock);
+		ext4_fold_free_dir(d);
+		return 0;
+	}
+	if (fold->ndirs >= EXT4_FOLD_DIRS)
+		ext4_fold_evict(fold);
+	d->hnext = fold->hash[ino % EXT4_FOLD_HASH];
+	fold->hash[ino % EXT4_FOLD_HASH] = d;
+	ext4_fold_push(fold, d);
+	fold->ndirs++;
+	xmutex_unlock(fold->lock);
+	return 0;
+}
+
+/*
+ * Look name up in directory dir regardless of case.  Of the entries that
+ * match, the one spelt exactly like name wins, else the first in byte
+ * order.  Returns 1 and sets *ino, the dirent *type and, unless it is
+ * NULL, the name as spelt on disk in real[256] if found; 0 if not, -1 if
+ * the directory has no index yet.
+ */
+int ext4_fold_lookup(struct ext4_fold *fold, uint32_t dir, const char *name, uint32_t *ino, int *type,
+		char *real)
+{
+	struct ext4_fold_dir *d;
+	struct ext4_fold_ent *e, *best = NULL;
+	size_t len = strlen(name);
+	uint32_t hash = casefold_hash(name, len), i;
+
+	xmutex_lock(fold->lock);
+	d = ext4_fold_find_dir(fold, dir);
+	if (!d) {
+		xmutex_unlock(fold->lock);
+		return -1;
+	}
+	ext4_fold_unlink(d);
+	ext4_fold_push(fold, d);
+
+	for (i = d->buckets[hash & d->mask]; i; i = e->next) {
+		e = &d->ents[i - 1];
+		if (e->hash != hash || !casefold_equal(d->names + e->name, e->len, name, len))
+			continue;
+		if (e->len == len && memcmp(d->names + e->name, name, len) == 0) {
+			best = e;
+			break;
+		}
+		if (!best || ext4_fold_before(d->names + e->name, e->len, d->names + best->name, best->len))
+			best = e;
+	}
+	if (best) {
+		*ino = best->ino;
+		*type = best->type;
+		if (real) {
+			memcpy(real, d->names + best->name, best->len);
+			real[best->len] = '\0';
+		}
+	}
+	xmutex_unlock(fold->lock);
+	return best != NULL;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext.h"
+#include "ext4.h"
+#include "disk.h"
+#include "fs.h"
+#include "util.h"
+#include "thread.h"
+
+struct ext4_scan {
+	struct ext_filesystem *fs;
+	ext4fs_raw_filter_t filter;
+	void      *farg;
+	ext4fs_inode_func_t func;
+	void      *arg;
+	int        parallel;	/* func does its own locking */
+	xmutex_t   lock;
+	uint32_t   next_group;
+	int        stop;
+	int        status;
+};
+
+/* Does inode table block b of a group hold any inode in use? */
+static int ext4_scan_block_used(const uint8_t *bitmap, uint32_t b, uint32_t per_block)
+{
+	uint32_t i;
+
+	for (i = b * per_block; i < (b + 1) * per_block; i++)
+		if (bitmap[i >> 3] & (1 << (i & 7)))
+			return 1;
+	return 0;
+}
+
+static int ext4_scan_group(struct ext4_scan *scan, uint32_t g, uint8_t *bitmap, char *buf)
+{
+	struct ext_filesystem *fs = scan->fs;
+	struct ext2_data *data = fs->ext4fs_root;
+	struct ext2_sblock *sblock = &data->sblock;
+	struct ext2fs_group *grp = &fs->groups[g];
+	uint32_t ipg = sblock->inodes_per_group;
+	uint32_t per_block = fs->block_size / fs->inodesz;
+	uint32_t per_io = EXT4_SCAN_IO / fs->block_size;
+	uint32_t used = ipg, nblocks, b, e, i;
+	struct ext2fs_inode inode;
+	const char *raw;
+	int stop;
+
+	/* Group checksums make the uninit flag and unused count trustworthy. */
+	if (sblock->feature_ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+					 EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) {
+		if (grp->flags & EXT4_BG_INODE_UNINIT)
+			return 0;
+		used = ipg - MIN(grp->itable_unused, ipg);
+	}
+	if (used == 0)
+		return 0;
+	if (vfs_devread(fs->dev_desc, grp->inode_bitmap << LOG2_EXT2_BLOCK_SIZE(data), 0,
+			fs->block_size, (char *)bitmap) == 0)
+		return 1;
+
+	/* Read runs of table blocks that hold inodes in use. */
+	nblocks = (used + per_block - 1) / per_block;
+	for (b = 0; b < nblocks; b = e) {
+		if (!ext4_scan_block_used(bitmap, b, per_block)) {
+			e = b + 1;
+			continue;
+		}
+		for (e = b + 1; e < nblocks && e - b < per_io &&
+		     ext4_scan_block_used(bitmap, e, per_block); e++)
+			;
+		if (vfs_devread(fs->dev_desc, (grp->inode_table + b) << LOG2_EXT2_BLOCK_SIZE(data),
+				0, (e - b) * fs->block_size, buf) == 0)
+			return 1;
+
+		for (i = b * per_block; i < e * per_block && i < used; i++) {
+			if (!(bitmap[i >> 3] & (1 << (i & 7))))
+				continue;
+			raw = buf + (i - b * per_block) * fs->inodesz;
+			if (scan->filter && !scan->filter(scan->farg, raw))
+				continue;
+			ext4fs_decode_inode(fs, data, raw, &inode);
+			xmutex_lock(scan->lock);
+			stop = scan->stop;
+			if (scan->parallel) {
+				xmutex_unlock(scan->lock);
+				if (!stop)
+					stop = scan->func(scan->arg, g * ipg + i + 1, &inode);
+				xmutex_lock(scan->lock);
+				stop = scan->stop |= stop;
+			} else if (!stop && scan->func(scan->arg, g * ipg + i + 1, &inode)) {
+				stop = scan->stop = 1;
+			}
+			xmutex_unlock(scan->lock);
+			if (stop)
+				return 0;
+		}
+	}
+	return 0;
+}
+
+static void ext4_scan_worker(void *p)
+{
+	struct ext4_scan *scan = p;
+	uint8_t *bitmap = malloc(scan->fs->block_size);
+	char *buf = malloc(MAX(EXT4_SCAN_IO, scan->fs->block_size));
+	uint32_t g;
+
+	for (;;) {
+		xmutex_lock(scan->lock);
+		if (!bitmap || !buf) {
+			scan->stop = scan->status = 1;
+		}
+		if (scan->stop || scan->next_group >= scan->fs->no_blkgrp) {
+			xmutex_unlock(scan->lock);
+			break;
+		}
+		g = scan->next_group++;
+		xmutex_unlock(scan->lock);
+
+		if (ext4_scan_group(scan, g, bitmap, buf)) {
+			fprintf(stderr, "inode scan: can't read group %u\n", g);
+			xmutex_lock(scan->lock);
+			scan->stop = scan->status = 1;
+			xmutex_unlock(scan->lock);
+		}
+	}
+	free(bitmap);
+	free(buf);
+}
+
+/*
+ * Scan with the given number of threads (0: one per CPU).  Unless the scan
+ * is parallel, calls to func are serialized.  Returns 0 when the scan
+ * completed or was stopped by func.
+ */
+static int ext4_scan_run(struct ext_filesystem *fs, int threads, ext4fs_raw_filter_t filter,
+		void *farg, ext4fs_inode_func_t func, void *arg, int parallel)
+{
+	struct ext4_scan scan;
+
+	memset(&scan, 0, sizeof scan);
+	scan.fs = fs;
+	scan.filter = filter;
+	scan.farg = farg;
+	scan.func = func;
+	scan.arg = arg;
+	scan.parallel = parallel;
+	scan.lock = xmutex_create();
+	if (!scan.lock)
+		return 1;
+	if (threads <= 0)
+		threads = xcpu_count();
+	xthread_run(MIN((uint32_t)threads, MAX(fs->no_blkgrp, 1)), ext4_scan_worker, &scan);
+	xmutex_destroy(scan.lock);
+	return scan.status;
+}
+
+/* Scan every inode in use. */
+int ext4fs_scan_inodes(struct ext_filesystem *fs, int threads, ext4fs_inode_func_t func, void *arg)
+{
+	return ext4_scan_run(fs, threads, NULL, NULL, func, arg, 0);
+}
+
+/* Scan the inodes that filter accepts; calls to the filter may overlap. */
+int ext4fs_scan_filtered(struct ext_filesystem *fs, int threads, ext4fs_raw_filter_t filter,
+		void *farg, ext4fs_inode_func_t func, void *arg)
+{
+	return ext4_scan_run(fs, threads, filter, farg, func, arg, 0);
+}
+
+struct ext4_scan_maps {
+	struct ext_filesystem *fs;
+	ext4fs_run_func_t func;
+	void     *arg;
+	xmutex_t  lock;
+	int       errors;
+};
+
+/* Decode one block map on the scanning thread, then hand over its runs. */
+static int ext4_scan_map(void *arg, uint32_t ino, struct ext2fs_inode *inode)
+{
+	struct ext4_scan_maps *maps = arg;
+	uint16_t type = inode->mode & FILETYPE_INO_MASK;
+	struct ext2fs_node node;
+	int i, stop = 0;
+
+	if (inode->flags & EXT4_INLINE_DATA_FL)
+		return 0;
+	if (type != FILETYPE_INO_REG && type != FILETYPE_INO_DIRECTORY &&
+	    (type != FILETYPE_INO_SYMLINK || inode->size <= 60))
+		return 0;
+
+	memset(&node, 0, sizeof node);
+	node.data = maps->fs->ext4fs_root;
+	node.ino = ino;
+	node.inode = *inode;
+	node.inode_read = 1;
+	if (!ext4fs_load_runs(maps->fs, &node)) {
+		fprintf(stderr, "block map scan: can't map inode %u\n", ino);
+		xmutex_lock(maps->lock);
+		maps->errors++;
+		xmutex_unlock(maps->lock);
+		return 0;
+	}
+	xmutex_lock(maps->lock);
+	for (i = 0; i < node.nr_runs && !stop; i++)
+		stop = maps->func(maps->arg, ino, &node.runs[i]);
+	xmutex_unlock(maps->lock);
+	free(node.runs);
+	return stop;
+}
+
+/*
+ * Call func for every run of every block map, with the given number of
+ * threads.  The maps are decoded on the threads that scan the inode
+ * tables; calls to func are serialized and come in logical order for each
+ * inode.  Returns 0 when every map was read or func stopped the scan.
+ */
+int ext4fs_scan_runs(struct ext_filesystem *fs, int threads, ext4fs_run_func_t func, void *arg)
+{
+	struct ext4_scan_maps maps;
+	int status;
+
+	memset(&maps, 0, sizeof maps);
+	maps.fs = fs;
+	maps.func = func;
+	maps.arg = arg;
+	maps.lock = xmutex_create();
+	if (!maps.lock)
+		return 1;
+	status = ext4_scan_run(fs, threads, NULL, NULL, ext4_scan_map, &maps, 1);
+	xmutex_destroy(maps.lock);
+	return status || maps.errors;
+}
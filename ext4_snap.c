@@ -0,0 +1,713 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "ext.h"
+#include "ext4.h"
+#include "util.h"
+
+/* A directory entry seen during this session. */
+struct snap_entry {
+	char    *name;
+	uint16_t name_len;
+	uint8_t  type;
+	uint32_t ino;
+};
+
+/* What this session learned about one inode. */
+struct snap_rec {
+	struct ext4_snap_inode attr;	/* ino, flags and attributes */
+	struct ext2fs_run *runs;
+	struct snap_entry *ents;
+	int nents;
+	int maxents;
+	struct snap_rec *hnext;
+};
+
+struct ext4_snap {
+	char *path;
+	struct ext4_snap_header key;
+
+	/* The mapped sidecar, if one matched the filesystem */
+	const uint8_t *map;
+	uint64_t size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+	const struct ext4_snap_header *hdr;
+	const struct ext4_snap_inode *inodes;
+	const struct ext4_snap_dirent *dirents;
+	const struct ext2fs_run *runs;
+	const char *names;
+
+	/* Records to merge in on save */
+	struct snap_rec *hash[EXT4_SNAP_HASH];
+	int nrecs;
+	int dirty;
+};
+
+#ifdef _WIN32
+static int snap_map(struct ext4_snap *snap)
+{
+	LARGE_INTEGER size;
+
+	snap->file = CreateFileA(snap->path, GENERIC_READ, FILE_SHARE_READ, NULL,
+				 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (snap->file == INVALID_HANDLE_VALUE)
+		return 1;
+	if (!GetFileSizeEx(snap->file, &size) || size.QuadPart == 0)
+		goto fail;
+	snap->mapping = CreateFileMappingA(snap->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!snap->mapping)
+		goto fail;
+	snap->map = MapViewOfFile(snap->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!snap->map) {
+		CloseHandle(snap->mapping);
+		goto fail;
+	}
+	snap->size = size.QuadPart;
+	return 0;
+fail:
+	CloseHandle(snap->file);
+	return 1;
+}
+
+static void snap_unmap(struct ext4_snap *snap)
+{
+	if (!snap->map)
+		return;
+	UnmapViewOfFile(snap->map);
+	CloseHandle(snap->mapping);
+	CloseHandle(snap->file);
+	snap->map = NULL;
+}
+#else
+static int snap_map(struct ext4_snap *snap)
+{
+	off_t size;
+	void *map;
+	int fd;
+
+	fd = open(snap->path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	size = lseek(fd, 0, SEEK_END);
+	if (size <= 0) {
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 1;
+	snap->map = map;
+	snap->size = size;
+	return 0;
+}
+
+static void snap_unmap(struct ext4_snap *snap)
+{
+	if (!snap->map)
+		return;
+	munmap((void *)snap->map, snap->size);
+	snap->map = NULL;
+}
+#endif
+
+/* Does a table of n records of size sz at off fit in the mapping? */
+static int snap_fits(struct ext4_snap *snap, uint64_t off, uint64_t n, uint64_t sz)
+{
+	return off % 8 == 0 && off <= snap->size && n <= (snap->size - off) / sz;
+}
+
+static int snap_validate(struct ext4_snap *snap)
+{
+	const struct ext4_snap_header *hdr = (const void *)snap->map;
+
+	if (snap->size < sizeof *hdr ||
+	    memcmp(hdr->magic, EXT4_SNAP_MAGIC, sizeof hdr->magic))
+		return 0;
+	/* Any mount or write since the snapshot was taken makes it stale. */
+	if (memcmp(hdr->uuid, snap->key.uuid, sizeof hdr->uuid) ||
+	    hdr->mtime != snap->key.mtime || hdr->utime != snap->key.utime ||
+	    hdr->mnt_count != snap->key.mnt_count)
+		return 0;
+	if (!snap_fits(snap, hdr->inodes_off, hdr->ninodes, sizeof(struct ext4_snap_inode)) ||
+	    !snap_fits(snap, hdr->dirents_off, hdr->ndirents, sizeof(struct ext4_snap_dirent)) ||
+	    !snap_fits(snap, hdr->runs_off, hdr->nruns, sizeof(struct ext2fs_run)) ||
+	    !snap_fits(snap, hdr->names_off, hdr->names_size, 1))
+		return 0;
+	snap->hdr = hdr;
+	snap->inodes = (const void *)(snap->map + hdr->inodes_off);
+	snap->dirents = (const void *)(snap->map + hdr->dirents_off);
+	snap->runs = (const void *)(snap->map + hdr->runs_off);
+	snap->names = (const char *)snap->map + hdr->names_off;
+	return 1;
+}
+
+/*
+ * Attach the sidecar at path.  A missing or stale one is ignored, and the
+ * returned snapshot only collects records for the next save.
+ */
+struct ext4_snap *ext4_snap_open(const char *path, struct ext2_sblock *sb)
+{
+	struct ext4_snap *snap = zalloc(sizeof *snap);
+
+	if (!snap)
+		return NULL;
+	snap->path = strdup(path);
+	if (!snap->path) {
+		free(snap);
+		return NULL;
+	}
+	memcpy(snap->key.magic, EXT4_SNAP_MAGIC, sizeof snap->key.magic);
+	memcpy(snap->key.uuid, sb->unique_id, sizeof snap->key.uuid);
+	snap->key.mtime = sb->mtime;
+	snap->key.utime = sb->utime;
+	snap->key.mnt_count = sb->mnt_count;
+
+	if (snap_map(snap) == 0 && !snap_validate(snap)) {
+		fprintf(stderr, "snapshot %s is stale, rebuilding.\n", path);
+		snap_unmap(snap);
+	}
+	return snap;
+}
+
+const struct ext4_snap_inode *ext4_snap_find(struct ext4_snap *snap, uint32_t ino)
+{
+	uint32_t lo = 0, hi, mid;
+
+	if (!snap || !snap->map)
+		return NULL;
+	hi = snap->hdr->ninodes;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (snap->inodes[mid].ino == ino)
+			return &snap->inodes[mid];
+		if (snap->inodes[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* The directory entries of si, or NULL if they would run off the table. */
+const struct ext4_snap_dirent *ext4_snap_dirents(struct ext4_snap *snap, const struct ext4_snap_inode *si)
+{
+	if (si->dirent > snap->hdr->ndirents || si->ndirents > snap->hdr->ndirents - si->dirent)
+		return NULL;
+	return &snap->dirents[si->dirent];
+}
+
+/* The name of a directory entry; not NUL terminated. */
+const char *ext4_snap_name(struct ext4_snap *snap, const struct ext4_snap_dirent *de)
+{
+	if (de->name_off > snap->hdr->names_size ||
+	    de->name_len > snap->hdr->names_size - de->name_off)
+		return NULL;
+	return snap->names + de->name_off;
+}
+
+const struct ext2fs_run *ext4_snap_runs(struct ext4_snap *snap, const struct ext4_snap_inode *si)
+{
+	if (si->run > snap->hdr->nruns || si->nruns > snap->hdr->nruns - si->run)
+		return NULL;
+	return &snap->runs[si->run];
+}
+
+static int snap_namecmp(const char *a, int alen, const char *b, int blen)
+{
+	int r = memcmp(a, b, MIN(alen, blen));
+
+	return r ? r : alen - blen;
+}
+
+static const struct ext4_snap_dirent *snap_find_entry(struct ext4_snap *snap,
+		const struct ext4_snap_inode *dir, const char *name, int len)
+{
+	const struct ext4_snap_dirent *de = ext4_snap_dirents(snap, dir);
+	uint32_t lo = 0, hi = dir->ndirents, mid;
+	const char *s;
+	int r;
+
+	if (!de)
+		return NULL;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		s = ext4_snap_name(snap, &de[mid]);
+		if (!s)
+			return NULL;
+		r = snap_namecmp(name, len, s, de[mid].name_len);
+		if (r == 0)
+			return &de[mid];
+		if (r > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/*
+ * Resolve a path in the snapshot.  Returns NULL when any component is
+ * unknown or a symlink, leaving the lookup to the filesystem; *missing
+ * is set if a fully listed directory lacks a component.
+ */
+const struct ext4_snap_inode *ext4_snap_lookup(struct ext4_snap *snap, const char *path, int *missing)
+{
+	const struct ext4_snap_inode *si = ext4_snap_find(snap, EXT2_ROOT_INO);
+	const struct ext4_snap_dirent *de;
+	const char *p = path;
+	int len;
+
+	*missing = 0;
+	while (si && *p) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+		len = strcspn(p, "/");
+		if (len == 1 && *p == '.') {
+			p += len;
+			continue;
+		}
+		if ((si->flags & EXT4_SNAP_ATTR) &&
+		    (si->mode & FILETYPE_INO_MASK) != FILETYPE_INO_DIRECTORY)
+			return NULL;
+		de = snap_find_entry(snap, si, p, len);
+		if (!de && (si->flags & EXT4_SNAP_DIR))
+			*missing = 1;
+		if (!de || de->type == FILETYPE_SYMLINK)
+			return NULL;
+		si = ext4_snap_find(snap, de->ino);
+		if (si && de->type == FILETYPE_UNKNOWN &&
+		    (!(si->flags & EXT4_SNAP_ATTR) ||
+		     (si->mode & FILETYPE_INO_MASK) == FILETYPE_INO_SYMLINK))
+			return NULL;
+		p += len;
+	}
+	return si;
+}
+
+static void snap_get_time(struct ext2_timespec *ts, const struct ext4_snap_time *st)
+{
+	ts->sec = st->sec;
+	ts->nsec = st->nsec;
+}
+
+static void snap_put_time(struct ext4_snap_time *st, const struct ext2_timespec *ts)
+{
+	st->sec = ts->sec;
+	st->nsec = ts->nsec;
+	st->pad = 0;
+}
+
+/* Fill the attribute fields of an in-memory inode from the snapshot. */
+void ext4_snap_get_inode(const struct ext4_snap_inode *si, struct ext2fs_inode *inode)
+{
+	memset(inode, 0, sizeof *inode);
+	inode->mode = si->mode;
+	inode->nlinks = si->nlinks;
+	inode->uid = si->uid;
+	inode->gid = si->gid;
+	inode->flags = si->iflags;
+	inode->size = si->size;
+	inode->blocks = si->blocks;
+	inode->dtime = si->dtime;
+	snap_get_time(&inode->atime, &si->atime);
+	snap_get_time(&inode->ctime, &si->ctime);
+	snap_get_time(&inode->mtime, &si->mtime);
+	snap_get_time(&inode->crtime, &si->crtime);
+}
+
+static struct snap_rec *snap_rec(struct ext4_snap *snap, uint32_t ino)
+{
+	struct snap_rec **pp = &snap->hash[ino % EXT4_SNAP_HASH], *rec;
+
+	for (rec = *pp; rec; rec = rec->hnext)
+		if (rec->attr.ino == ino)
+			return rec;
+	rec = zalloc(sizeof *rec);
+	if (!rec)
+		return NULL;
+	rec->attr.ino = ino;
+	rec->hnext = *pp;
+	*pp = rec;
+	snap->nrecs++;
+	return rec;
+}
+
+void ext4_snap_add_inode(struct ext4_snap *snap, uint32_t ino, const struct ext2fs_inode *inode)
+{
+	struct snap_rec *rec;
+
+	if (!snap || !(rec = snap_rec(snap, ino)))
+		return;
+	rec->attr.flags |= EXT4_SNAP_ATTR;
+	rec->attr.mode = inode->mode;
+	rec->attr.nlinks = inode->nlinks;
+	rec->attr.uid = inode->uid;
+	rec->attr.gid = inode->gid;
+	rec->attr.iflags = inode->flags;
+	rec->attr.size = inode->size;
+	rec->attr.blocks = inode->blocks;
+	rec->attr.dtime = inode->dtime;
+	snap_put_time(&rec->attr.atime, &inode->atime);
+	snap_put_time(&rec->attr.ctime, &inode->ctime);
+	snap_put_time(&rec->attr.mtime, &inode->mtime);
+	snap_put_time(&rec->attr.crtime, &inode->crtime);
+	snap->dirty = 1;
+}
+
+void ext4_snap_add_runs(struct ext4_snap *snap, uint32_t ino, const struct ext2fs_run *runs, int n)
+{
+	struct snap_rec *rec;
+
+	if (!snap || !(rec = snap_rec(snap, ino)) || (rec->attr.flags & EXT4_SNAP_RUNS))
+		return;
+	rec->runs = malloc(MAX(n, 1) * sizeof *runs);
+	if (!rec->runs)
+		return;
+	memcpy(rec->runs, runs, n * sizeof *runs);
+	rec->attr.nruns = n;
+	rec->attr.flags |= EXT4_SNAP_RUNS;
+	snap->dirty = 1;
+}
+
+void ext4_snap_add_entry(struct ext4_snap *snap, uint32_t dir, const char *name, int type, uint32_t ino)
+{
+	const struct ext4_snap_inode *si;
+	struct snap_entry *ent;
+	struct snap_rec *rec;
+	int len = strlen(name);
+
+	if (!snap)
+		return;
+	/* Already known, from the sidecar or a full listing this session. */
+	si = ext4_snap_find(snap, dir);
+	if (si && snap_find_entry(snap, si, name, len))
+		return;
+	if (!(rec = snap_rec(snap, dir)) || (rec->attr.flags & EXT4_SNAP_DIR))
+		return;
+	if (rec->nents == rec->maxents) {
+		int max = rec->maxents ? rec->maxents * 2 : 8;
+
+		ent = realloc(rec->ents, max * sizeof *ent);
+		if (!ent)
+			return;
+		rec->ents = ent;
+		rec->maxents = max;
+	}
+	ent = &rec->ents[rec->nents];
+	ent->name = strdup(name);
+	if (!ent->name)
+		return;
+	ent->name_len = len;
+	ent->type = type;
+	ent->ino = ino;
+	rec->nents++;
+	snap->dirty = 1;
+}
+
+/* Every entry of dir has now been added. */
+void ext4_snap_dir_done(struct ext4_snap *snap, uint32_t dir)
+{
+	struct snap_rec *rec;
+
+	if (!snap || !(rec = snap_rec(snap, dir)))
+		return;
+	rec->attr.flags |= EXT4_SNAP_DIR;
+	snap->dirty = 1;
+}
+
+/* Output tables, built in memory then written in one pass. */
+struct snap_out {
+	struct ext4_snap_inode *inodes;
+	struct ext4_snap_dirent *dirents;
+	struct ext2fs_run *runs;
+	char *names;
+	uint32_t ninodes, ndirents, nruns;
+	uint64_t names_size;
+	uint64_t maxinodes, maxdirents, maxruns, maxnames;
+	int nomem;
+};
+
+/* Make room for n more items in a growing table. */
+static int snap_reserve(struct snap_out *out, void **p, uint64_t *max, uint64_t used,
+		uint64_t n, size_t sz)
+{
+	uint64_t want = *max ? *max : 256;
+	void *np;
+
+	if (used + n <= *max)
+		return 1;
+	while (want < used + n)
+		want *= 2;
+	np = realloc(*p, want * sz);
+	if (!np) {
+		out->nomem = 1;
+		return 0;
+	}
+	*p = np;
+	*max = want;
+	return 1;
+}
+
+/* An entry to be written, from either the sidecar or this session. */
+struct snap_ent_src {
+	const char *name;
+	uint16_t name_len;
+	uint8_t  type;
+	uint32_t ino;
+	int      seq;
+};
+
+static int snap_cmp_ent(const void *a, const void *b)
+{
+	const struct snap_ent_src *x = a, *y = b;
+	int r = snap_namecmp(x->name, x->name_len, y->name, y->name_len);
+
+	return r ? r : x->seq - y->seq;
+}
+
+static int snap_cmp_rec(const void *a, const void *b)
+{
+	uint32_t x = (*(struct snap_rec * const *)a)->attr.ino;
+	uint32_t y = (*(struct snap_rec * const *)b)->attr.ino;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Merge what the sidecar and this session know about one inode. */
+static void snap_emit(struct ext4_snap *snap, struct snap_out *out,
+		const struct ext4_snap_inode *si, struct snap_rec *rec)
+{
+	struct ext4_snap_inode *io;
+	const struct ext4_snap_dirent *de = NULL;
+	const struct ext2fs_run *runs = NULL;
+	struct snap_ent_src *ents;
+	uint32_t n = 0, i, nruns = 0;
+
+	if (!snap_reserve(out, (void **)&out->inodes, &out->maxinodes, out->ninodes, 1, sizeof *out->inodes))
+		return;
+	io = &out->inodes[out->ninodes++];
+	if (rec && ((rec->attr.flags & EXT4_SNAP_ATTR) || !si))
+		*io = rec->attr;
+	else
+		*io = *si;
+	io->flags = (si ? si->flags : 0) | (rec ? rec->attr.flags : 0);
+
+	/* Block map */
+	if (rec && (rec->attr.flags & EXT4_SNAP_RUNS)) {
+		runs = rec->runs;
+		nruns = rec->attr.nruns;
+	} else if (si && (si->flags & EXT4_SNAP_RUNS)) {
+		runs = ext4_snap_runs(snap, si);
+		nruns = runs ? si->nruns : 0;
+		if (!runs)
+			io->flags &= ~EXT4_SNAP_RUNS;
+	}
+	io->run = out->nruns;
+	io->nruns = nruns;
+	if (nruns && snap_reserve(out, (void **)&out->runs, &out->maxruns, out->nruns, nruns, sizeof *out->runs)) {
+		memcpy(out->runs + out->nruns, runs, nruns * sizeof *runs);
+		out->nruns += nruns;
+	}
+
+	/* Directory entries: this session's first, then the sidecar's. */
+	if (si)
+		de = ext4_snap_dirents(snap, si);
+	ents = malloc(((rec ? rec->nents : 0) + (de ? si->ndirents : 0) + 1) * sizeof *ents);
+	if (!ents) {
+		out->nomem = 1;
+		return;
+	}
+	for (i = 0; rec && i < (uint32_t)rec->nents; i++, n++) {
+		ents[n].name = rec->ents[i].name;
+		ents[n].name_len = rec->ents[i].name_len;
+		ents[n].type = rec->ents[i].type;
+		ents[n].ino = rec->ents[i].ino;
+		ents[n].seq = n;
+	}
+	for (i = 0; de && i < si->ndirents; i++) {
+		ents[n].name = ext4_snap_name(snap, &de[i]);
+		if (!ents[n].name)
+			continue;
+		ents[n].name_len = de[i].name_len;
+		ents[n].type = de[i].type;
+		ents[n].ino = de[i].ino;
+		ents[n].seq = n;
+		n++;
+	}
+	qsort(ents, n, sizeof *ents, snap_cmp_ent);
+
+	io->dirent = out->ndirents;
+	io->ndirents = 0;
+	for (i = 0; i < n; i++) {
+		struct ext4_snap_dirent *d;
+
+		if (i > 0 && !snap_namecmp(ents[i].name, ents[i].name_len,
+					   ents[i - 1].name, ents[i - 1].name_len))
+			continue;
+		if (!snap_reserve(out, (void **)&out->dirents, &out->maxdirents, out->ndirents, 1,
+				  sizeof *out->dirents) ||
+		    !snap_reserve(out, (void **)&out->names, &out->maxnames, out->names_size,
+				  ents[i].name_len, 1))
+			break;
+		d = &out->dirents[out->ndirents++];
+		d->name_off = out->names_size;
+		d->name_len = ents[i].name_len;
+		d->type = ents[i].type;
+		d->pad = 0;
+		d->ino = ents[i].ino;
+		memcpy(out->names + out->names_size, ents[i].name, ents[i].name_len);
+		out->names_size += ents[i].name_len;
+		io->ndirents++;
+	}
+	free(ents);
+}
+
+static int snap_write(FILE *fp, const void *p, uint64_t len, uint64_t *off)
+{
+	static const char zero[8];
+	int pad = (8 - len % 8) % 8;
+
+	if ((len && fwrite(p, len, 1, fp) != 1) || (pad && fwrite(zero, pad, 1, fp) != 1))
+		return 1;
+	*off += len + pad;
+	return 0;
+}
+
+/*
+ * Write the sidecar again with this session's records merged in.  It is
+ * built next to the old one and renamed over it.
+ */
+int ext4_snap_save(struct ext4_snap *snap)
+{
+	struct ext4_snap_header hdr = snap->key;
+	struct snap_out out = { 0 };
+	struct snap_rec **recs, *rec;
+	uint32_t i = 0, j = 0, nmapped;
+	char tmp[strlen(snap->path) + 5];
+	uint64_t off = 0;
+	FILE *fp;
+	int k, status = 1;
+
+	if (!snap->dirty)
+		return 0;
+	recs = malloc((snap->nrecs + 1) * sizeof *recs);
+	if (!recs)
+		return 1;
+	for (k = 0, j = 0; k < EXT4_SNAP_HASH; k++)
+		for (rec = snap->hash[k]; rec; rec = rec->hnext)
+			recs[j++] = rec;
+	qsort(recs, snap->nrecs, sizeof *recs, snap_cmp_rec);
+
+	nmapped = snap->map ? snap->hdr->ninodes : 0;
+	for (i = 0, j = 0; (i < nmapped || j < (uint32_t)snap->nrecs) && !out.nomem; ) {
+		const struct ext4_snap_inode *si = i < nmapped ? &snap->inodes[i] : NULL;
+
+		rec = j < (uint32_t)snap->nrecs ? recs[j] : NULL;
+		if (si && rec && si->ino == rec->attr.ino) {
+			snap_emit(snap, &out, si, rec);
+			i++, j++;
+		} else if (si && (!rec || si->ino < rec->attr.ino)) {
+			snap_emit(snap, &out, si, NULL);
+			i++;
+		} else {
+			snap_emit(snap, &out, NULL, rec);
+			j++;
+		}
+	}
+	free(recs);
+	if (out.nomem)
+		goto done;
+
+	hdr.ninodes = out.ninodes;
+	hdr.ndirents = out.ndirents;
+	hdr.nruns = out.nruns;
+	hdr.inodes_off = (sizeof hdr + 7) & ~7ULL;
+	hdr.dirents_off = hdr.inodes_off + ((out.ninodes * sizeof *out.inodes + 7) & ~7ULL);
+	hdr.runs_off = hdr.dirents_off + ((out.ndirents * sizeof *out.dirents + 7) & ~7ULL);
+	hdr.names_off = hdr.runs_off + ((out.nruns * sizeof *out.runs + 7) & ~7ULL);
+	hdr.names_size = out.names_size;
+
+	snprintf(tmp, sizeof tmp, "%s.new", snap->path);
+	fp = fopen(tmp, "wb");
+	if (!fp) {
+		fprintf(stderr, "can't write snapshot %s\n", tmp);
+		goto done;
+	}
+	status = snap_write(fp, &hdr, sizeof hdr, &off) ||
+		 snap_write(fp, out.inodes, out.ninodes * sizeof *out.inodes, &off) ||
+		 snap_write(fp, out.dirents, out.ndirents * sizeof *out.dirents, &off) ||
+		 snap_write(fp, out.runs, out.nruns * sizeof *out.runs, &off) ||
+		 snap_write(fp, out.names, out.names_size, &off);
+	status |= fclose(fp) != 0;
+
+	/* The old file must not be mapped while it is replaced. */
+	snap_unmap(snap);
+	if (status == 0) {
+		remove(snap->path);
+		status = rename(tmp, snap->path) != 0;
+	}
+	if (status)
+		remove(tmp);
+done:
+	free(out.inodes);
+	free(out.dirents);
+	free(out.runs);
+	free(out.names);
+	return status;
+}
+
+void ext4_snap_close(struct ext4_snap *snap)
+{
+	struct snap_rec *rec;
+	int k, i;
+
+	if (!snap)
+		return;
+	snap_unmap(snap);
+	for (k = 0; k < EXT4_SNAP_HASH; k++) {
+		while ((rec = snap->hash[k])) {
+			snap->hash[k] = rec->hnext;
+			for (i = 0; i < rec->nents; i++)
+				free(rec->ents[i].name);
+			free(rec->ents);
+			free(rec->runs);
+			free(rec);
+		}
+	}
+	free(snap->path);
+	free(snap);
+}
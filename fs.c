@@ -23,23 +23,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "disk.h"
 #include "util.h"
 #include "fs.h"
+#include "casefold.h"
+
+/* The wildcards a Windows file pattern may hold. */
+#define DOS_STAR	'<'
+#define DOS_QM		'>'
+#define DOS_DOT		'"'
+#define VFS_WILD(c)	((c) == '*' || (c) == '?' || (c) == DOS_STAR || (c) == DOS_QM || (c) == DOS_DOT)
 
 struct filesys_descr {
 	struct filesys_operations *fs_ops;
 	struct filesys_spec       *fs_data;
 };
 
-int vfs_devread(part_descr_t part_info, int sector, int byte_offset, int byte_len, char *buf)
+int vfs_devread(part_descr_t part_info, int64_t sector, int byte_offset, int byte_len, char *buf)
 {
 	unsigned block_len;
 	unsigned char sec_buf[SECTOR_SIZE];
 
 	/* Check partition boundaries */
 	if ((sector < 0) || ((sector + ((byte_offset + byte_len - 1) >> SECTOR_BITS)) >= part_info->length)) {
-		printf("%s read outside partition %d\n", __func__, sector);
+		fprintf(stderr, "%s read outside partition %lld\n", __func__, (long long)sector);
 		return 0;
 	}
 
@@ -47,17 +55,17 @@ int vfs_devread(part_descr_t part_info, int sector, int byte_offset, int byte_le
 	sector += byte_offset >> SECTOR_BITS;
 	byte_offset &= SECTOR_SIZE - 1;
 #ifdef DEBUG
-	printf(" <%d, %d, %d>\n", sector, byte_offset, byte_len);
+	printf(" <%lld, %d, %d>\n", (long long)sector, byte_offset, byte_len);
 #endif
 	if (part_info == NULL) {
-		printf("** Invalid Block Device Descriptor (NULL)\n");
+		fprintf(stderr, "** Invalid Block Device Descriptor (NULL)\n");
 		return 0;
 	}
 
 	if (byte_offset != 0) {
 		/* read first part which isn't aligned with start of sector */
 		if (part_read(part_info, sector, 1, (uint8_t*)sec_buf) < 0 ) {
-			printf(" ** ext2fs_devread() read error **\n");
+			fprintf(stderr, " ** ext2fs_devread() read error **\n");
 			return 0;
 		}
 		memcpy(buf, sec_buf + byte_offset,
@@ -83,7 +91,7 @@ int vfs_devread(part_descr_t part_info, int sector, int byte_offset, int byte_le
 	}
 
 	if (part_read(part_info, sector, block_len / SECTOR_SIZE, (uint8_t*)buf) < 0) {
-		printf(" ** %s read error - block\n", __func__);
+		fprintf(stderr, " ** %s read error - block\n", __func__);
 		return 0;
 	}
 	block_len = byte_len & ~(SECTOR_SIZE - 1);
@@ -94,7 +102,7 @@ int vfs_devread(part_descr_t part_info, int sector, int byte_offset, int byte_le
 	if (byte_len != 0) {
 		/* read rest of data which are not in whole sector */
 		if (part_read(part_info, sector, 1, sec_buf) < 0) {
-			printf("* %s read error - last part\n", __func__);
+			fprintf(stderr, "* %s read error - last part\n", __func__);
 			return 0;
 		}
 		memcpy(buf, sec_buf, byte_len);
@@ -102,6 +110,16 @@ int vfs_devread(part_descr_t part_info, int sector, int byte_offset, int byte_le
 	return 1;
 }
 
+/* Hint that sectors will be read soon; clipped to the partition. */
+void vfs_devprefetch(part_descr_t part_info, int64_t sector, int64_t nsect)
+{
+	if (sector < 0 || (uint64_t)sector >= part_info->length || nsect <= 0)
+		return;
+	if ((uint64_t)(sector + nsect) > part_info->length)
+		nsect = part_info->length - sector;
+	part_prefetch(part_info, sector, nsect);
+}
+
 extern struct filesys_operations extfs_operations;
 static struct filesys_operations * allfs[] = {
 	&extfs_operations,
@@ -134,6 +152,193 @@ int vfs_dir_iterate(filesys_t fs, const char *dir, int (*foreach)(void *, const
 	return fs->fs_ops->dir_iterate(fs->fs_data, dir, foreach, user_data);
 }
 
+struct vfs_pattern {
+	uint32_t *cp;		/* the pattern's code points */
+	int       len;
+	int       nocase;
+	uint8_t  *states;
+	uint8_t  *cur, *next;	/* pattern positions still in play */
+	int     (*func)(void *, const char *, struct xstat *, int is_dir);
+	void     *arg;
+};
+
+static int vfs_pattern_init(struct vfs_pattern *pat, const char *pattern, int nocase)
+{
+	const char *p = pattern, *end = pattern + strlen(pattern);
+	int wild = 0;
+
+	memset(pat, 0, sizeof *pat);
+	pat->nocase = nocase;
+	pat->cp = malloc((end - p + 1) * sizeof *pat->cp);
+	pat->states = malloc(2 * (end - p + 1));
+	if (!pat->cp || !pat->states) {
+		free(pat->cp);
+		free(pat->states);
+		return -1;
+	}
+	pat->cur = pat->states;
+	pat->next = pat->states + (end - p + 1);
+	while (p < end) {
+		pat->cp[pat->len] = casefold_decode(&p, end, nocase);
+		wild |= VFS_WILD(pat->cp[pat->len]);
+		pat->len++;
+	}
+	return wild;
+}
+
+static void vfs_pattern_free(struct vfs_pattern *pat)
+{
+	free(pat->cp);
+	free(pat->states);
+}
+
+/*
+ * Follow the moves that take no character of the name: c is the next one,
+ * or 0 at its end.
+ */
+static void vfs_pattern_close(struct vfs_pattern *pat, uint8_t *set, uint32_t c)
+{
+	int i;
+
+	for (i = 0; i < pat->len; i++) {
+		if (!set[i])
+			continue;
+		switch (pat->cp[i]) {
+		case '*':
+		case DOS_STAR:
+			set[i + 1] = 1;
+			break;
+		case DOS_QM:
+			if (c == 0 || c == '.')
+				set[i + 1] = 1;
+			break;
+		case DOS_DOT:
+			if (c == 0)
+				set[i + 1] = 1;
+			break;
+		}
+	}
+}
+
+/*
+ * Match name against the pattern the way Windows does: '*' takes any run
+ * of characters, '?' any one.  DOS_STAR takes any run up to but not
+ * including the last dot, DOS_QM any one character but stands for none
+ * before a dot or the end, and DOS_DOT matches a dot or the end of the name.
+ */
+static int vfs_pattern_match(struct vfs_pattern *pat, const char *name)
+{
+	const char *p = name, *end = name + strlen(name);
+	const char *last_dot = strrchr(name, '.'), *at;
+	uint8_t *tmp;
+	uint32_t c, pc;
+	int i;
+
+	memset(pat->cur, 0, pat->len + 1);
+	pat->cur[0] = 1;
+	vfs_pattern_close(pat, pat->cur, (uint8_t)*p);
+	while (p < end) {
+		at = p;
+		c = casefold_decode(&p, end, pat->nocase);
+		memset(pat->next, 0, pat->len + 1);
+		for (i = 0; i < pat->len; i++) {
+			if (!pat->cur[i])
+				continue;
+			switch (pc = pat->cp[i]) {
+			case '*':
+				pat->next[i] = 1;
+				break;
+			case DOS_STAR:
+				if (!last_dot || at < last_dot)
+					pat->next[i] = 1;
+				break;
+			case '?':
+				pat->next[i + 1] = 1;
+				break;
+			case DOS_QM:
+				if (c != '.')
+					pat->next[i + 1] = 1;
+				break;
+			case DOS_DOT:
+				if (c == '.')
+					pat->next[i + 1] = 1;
+				break;
+			default:
+				if (pc == c)
+					pat->next[i + 1] = 1;
+			}
+		}
+		vfs_pattern_close(pat, pat->next, (uint8_t)*p);
+		tmp = pat->cur;
+		pat->cur = pat->next;
+		pat->next = tmp;
+	}
+	return pat->cur[pat->len];
+}
+
+int vfs_name_match(const char *pattern, const char *name, int nocase)
+{
+	struct vfs_pattern pat;
+	int match;
+
+	if (vfs_pattern_init(&pat, pattern, nocase) < 0)
+		return 0;
+	match = vfs_pattern_match(&pat, name);
+	vfs_pattern_free(&pat);
+	return match;
+}
+
+static int vfs_pattern_filter(void *arg, const char *name)
+{
+	return vfs_pattern_match(arg, name);
+}
+
+/* For filesystems that can't filter before they stat. */
+static int vfs_pattern_each(void *arg, const char *name, struct xstat *st, int is_dir)
+{
+	struct vfs_pattern *pat = arg;
+
+	if (!vfs_pattern_match(pat, name))
+		return 0;
+	return pat->func(pat->arg, name, st, is_dir);
+}
+
+static int vfs_pattern_call(void *arg, const char *name, struct xstat *st, int is_dir)
+{
+	struct vfs_pattern *pat = arg;
+
+	return pat->func(pat->arg, name, st, is_dir);
+}
+
+/*
+ * List the entries of dir whose names match a Windows file pattern (see
+ * vfs_pattern_match), ignoring case if nocase is set.  Only those entries
+ * are stat'ed.  A pattern without wildcards is a single lookup, which
+ * follows the filesystem's own case rules.
+ */
+int vfs_dir_iterate_pattern(filesys_t fs, const char *dir, const char *pattern, int nocase,
+		int (*func)(void *, const char *, struct xstat *, int is_dir), void *arg)
+{
+	struct vfs_pattern pat;
+	int wild, status;
+
+	if (!pattern || !pattern[0])
+		return vfs_dir_iterate(fs, dir, func, arg);
+	wild = vfs_pattern_init(&pat, pattern, nocase);
+	if (wild < 0)
+		return -1;
+	pat.func = func;
+	pat.arg = arg;
+	if (!wild && fs->fs_ops->dir_lookup)
+		status = fs->fs_ops->dir_lookup(fs->fs_data, dir, pattern, vfs_pattern_call, &pat);
+	else if (fs->fs_ops->dir_match)
+		status = fs->fs_ops->dir_match(fs->fs_data, dir, vfs_pattern_filter, vfs_pattern_call, &pat);
+	else
+		status = fs->fs_ops->dir_iterate(fs->fs_data, dir, vfs_pattern_each, &pat);
+	vfs_pattern_free(&pat);
+	return status;
+}
+
 int vfs_umount(filesys_t fsys)
 {
 	int x;
@@ -142,11 +347,150 @@ int vfs_umount(filesys_t fsys)
 	return x;
 }
 
+/* Start loading likely-needed metadata in the background. */
+int vfs_warmup(filesys_t fsys, unsigned int ms, uint64_t bytes)
+{
+	if (!fsys->fs_ops->warmup)
+		return 0;
+	return fsys->fs_ops->warmup(fsys->fs_data, ms, bytes);
+}
+
+/* Keep a metadata snapshot at path, used by later mounts. */
+int vfs_snapshot(filesys_t fsys, const char *path)
+{
+	if (!fsys->fs_ops->snapshot)
+		return 1;
+	return fsys->fs_ops->snapshot(fsys->fs_data, path);
+}
+
+/*
+ * Call func for every inode in use, reading inode tables directly with
+ * several threads; calls are serialized.  Nonzero from func stops it.
+ */
+int vfs_scan_inodes(filesys_t fsys, int threads, int (*func)(void *, struct xstat *), void *arg)
+{
+	if (!fsys->fs_ops->scan_inodes)
+		return 1;
+	return fsys->fs_ops->scan_inodes(fsys->fs_data, threads, func, arg);
+}
+
+/*
+ * Call func with the full path and the parent directory's inode of every
+ * entry below the root, built from bulk directory reads instead of a tree
+ * walk.  Only ino, mode, nlinks, uid, gid, size, blocks and mtime are filled
+ * in.  Nonzero from func stops it.
+ */
+int vfs_catalog(filesys_t fsys, int threads, int (*func)(void *, const char *, uint32_t, struct xstat *), void *arg)
+{
+	if (!fsys->fs_ops->catalog)
+		return 1;
+	return fsys->fs_ops->catalog(fsys->fs_data, threads, func, arg);
+}
+
+/* A query that matches every inode. */
+void vfs_query_init(struct xquery *q)
+{
+	memset(q, 0, sizeof *q);
+	q->uid = XQUERY_ANY;
+	q->gid = XQUERY_ANY;
+	q->size_max = UINT64_MAX;
+	q->mtime_min = INT64_MIN;
+	q->mtime_max = INT64_MAX;
+}
+
+int vfs_query_match(const struct xquery *q, const struct xstat *st)
+{
+	return (!q->type || (st->mode & S_IFMT) == q->type) &&
+	       (q->uid == XQUERY_ANY || st->uid == q->uid) &&
+	       (q->gid == XQUERY_ANY || st->gid == q->gid) &&
+	       st->size >= q->size_min && st->size <= q->size_max &&
+	       st->mtime.sec >= q->mtime_min && st->mtime.sec <= q->mtime_max;
+}
+
+/*
+ * Call func, as vfs_catalog does, for the paths of the inodes that match
+ * q.  The inode tables are filtered first and only the directories on the
+ * way to a match are named.  A file with several links is reported once
+ * per link.  Nonzero from func stops it.
+ */
+int vfs_query(filesys_t fsys, int threads, const struct xquery *q,
+	      int (*func)(void *, const char *, uint32_t, struct xstat *), void *arg)
+{
+	if (!fsys->fs_ops->query)
+		return 1;
+	return fsys->fs_ops->query(fsys->fs_data, threads, q, func, arg);
+}
+
+/*
+ * Call func for each allocated range of every file and directory, with
+ * the inode that owns it; ranges come in logical order per inode but the
+ * inodes in no order.  Calls are serialized.  Nonzero from func stops it.
+ */
+int vfs_block_map(filesys_t fsys, int threads, int (*func)(void *, uint32_t, const struct xextent *), void *arg)
+{
+	if (!fsys->fs_ops->block_map)
+		return 1;
+	return fsys->fs_ops->block_map(fsys->fs_data, threads, func, arg);
+}
+
+/*
+ * The identity of the filesystem and of its last change: data derived from
+ * the metadata stays valid as long as the stamp does.
+ */
+int vfs_stamp(filesys_t fsys, uint8_t stamp[32])
+{
+	if (!fsys->fs_ops->stamp)
+		return 1;
+	return fsys->fs_ops->stamp(fsys->fs_data, stamp);
+}
+
+/*
+ * Make path lookups ignore case, by Unicode simple case folding of the
+ * names.  Where names differ only in case, the exact spelling wins, else
+ * the first in byte order.  Switch it before the filesystem is in use.
+ */
+int vfs_casefold(filesys_t fsys, int on)
+{
+	if (!fsys->fs_ops->casefold)
+		return 1;
+	return fsys->fs_ops->casefold(fsys->fs_data, on);
+}
+
+/*
+ * Call func for each range of the partition the filesystem has in use,
+ * in bytes and ascending order.  Nonzero from func stops it.
+ */
+int vfs_used_ranges(filesys_t fsys, int (*func)(void *, uint64_t, uint64_t), void *arg)
+{
+	if (!fsys->fs_ops->used_ranges)
+		return 1;
+	return fsys->fs_ops->used_ranges(fsys->fs_data, func, arg);
+}
+
+/*
+ * Put the target of the symbolic link at path into buf, cut to size - 1
+ * bytes and terminated.  Returns the length of the whole target, or -1 if
+ * path is not a symbolic link.
+ */
+int vfs_readlink(filesys_t fsys, const char *path, char *buf, int size)
+{
+	if (!fsys->fs_ops->readlink)
+		return -1;
+	return fsys->fs_ops->readlink(fsys->fs_data, path, buf, size);
+}
+
 int vfs_label(filesys_t fsys, char *buf, int size)
 {
 	return fsys->fs_ops->label(fsys->fs_data, buf, size);
 }
 
+int vfs_uuid(filesys_t fsys, uint8_t uuid[16])
+{
+	if (!fsys->fs_ops->uuid)
+		return 1;
+	return fsys->fs_ops->uuid(fsys->fs_data, uuid);
+}
+
 int vfs_stat(filesys_t fsys, struct xfsstat *st)
 {
 	return fsys->fs_ops->fsstat(fsys->fs_data,st);
@@ -157,7 +501,7 @@ file_entry_t vfs_open(filesys_t fs, const char *dir)
 	return fs->fs_ops->open(fs->fs_data, dir);
 }
 
-int vfs_file_read(file_entry_t filp, filesys_t fs, int offset, char *buf, unsigned len)
+int vfs_file_read(file_entry_t filp, filesys_t fs, int64_t offset, char *buf, unsigned len)
 {
 	return filp->read(filp, fs->fs_data, offset,  buf, len);
 }
@@ -172,3 +516,52 @@ int vfs_file_stat(file_entry_t filp, filesys_t fs, struct xstat *st)
 	return filp->stat(filp, fs->fs_data, st);
 }
 
+
+int vfs_file_extent_map(file_entry_t filp, filesys_t fs, uint64_t start, struct xextent *ext, int max)
+{
+	if (!filp->extent_map)
+		return -1;
+	return filp->extent_map(filp, fs->fs_data, start, ext, max);
+}
+
+/*
+ * Find the first offset >= offset that is (want_data) or is not data.
+ * Unwritten ranges read as zeroes and count as holes.  Returns -1 when
+ * offset is at or past the end of file, or when no data follows it.
+ */
+static int64_t vfs_file_seek(file_entry_t filp, filesys_t fs, int64_t offset, int want_data)
+{
+	struct xextent ext[32];
+	struct xstat st;
+	uint64_t pos;
+	int n, x;
+
+	if (offset < 0 || vfs_file_stat(filp, fs, &st) < 0 || (uint64_t)offset >= st.size)
+		return -1;
+
+	pos = offset;
+	while (pos < st.size) {
+		n = vfs_file_extent_map(filp, fs, pos, ext, sizeof ext / sizeof ext[0]);
+		if (n <= 0)
+			return -1;
+		for (x = 0; x < n; ++x) {
+			int is_data = !(ext[x].flags & (XEXTENT_HOLE | XEXTENT_UNWRITTEN));
+
+			if (is_data == want_data)
+				return ext[x].logical > pos ? ext[x].logical : pos;
+		}
+		pos = ext[n - 1].logical + ext[n - 1].length;
+	}
+	/* There is an implicit hole at the end of every file. */
+	return want_data ? -1 : (int64_t)st.size;
+}
+
+int64_t vfs_file_seek_data(file_entry_t filp, filesys_t fs, int64_t offset)
+{
+	return vfs_file_seek(filp, fs, offset, 1);
+}
+
+int64_t vfs_file_seek_hole(file_entry_t filp, filesys_t fs, int64_t offset)
+{
+	return vfs_file_seek(filp, fs, offset, 0);
+}
@@ -26,14 +26,24 @@
 #define __XOKAN_FS_H__
 struct part_descr;
 
+struct xtimespec {
+	int64_t  sec;
+	uint32_t nsec;
+};
+
 struct xstat {
 	uint16_t mode;
-	uint32_t atime;
-	uint32_t ctime;
-	uint32_t mtime;
+	uint16_t nlinks;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t ino;
+	uint64_t size;
+	uint64_t blocks;	/* 512-byte units */
+	struct xtimespec atime;
+	struct xtimespec ctime;
+	struct xtimespec mtime;
+	struct xtimespec crtime;
 	uint32_t dtime;
-	uint32_t size;
-	uint32_t size_high;
 };
 
 struct xfsstat {
@@ -42,12 +52,39 @@ struct xfsstat {
 	uint64_t free_size;
 };
 
+/* One range of a file, as returned by an extent map query; in bytes. */
+struct xextent {
+	uint64_t logical;
+	uint64_t physical;	/* offset in the partition, 0 if none */
+	uint64_t length;
+	uint32_t flags;
+};
+
+#define XEXTENT_HOLE		0x0001	/* no blocks allocated */
+#define XEXTENT_UNWRITTEN	0x0002	/* allocated, reads as zeroes */
+#define XEXTENT_INLINE		0x0004	/* data is stored in the inode */
+#define XEXTENT_LAST		0x0008	/* range reaches the end of file */
+
+/* Inode attribute filter for vfs_query; all the given tests must hold. */
+struct xquery {
+	uint16_t type;		/* S_IFMT bits of the mode, 0 for any */
+	uint32_t uid;		/* XQUERY_ANY for any */
+	uint32_t gid;		/* XQUERY_ANY for any */
+	uint64_t size_min;
+	uint64_t size_max;
+	int64_t  mtime_min;	/* seconds, inclusive */
+	int64_t  mtime_max;
+};
+
+#define XQUERY_ANY		0xffffffffU
+
 struct filesys_spec;
 typedef struct file_entry * file_entry_t;
 struct file_entry {
-	int (*read)(struct file_entry *, struct filesys_spec*, int offset, char *buf, unsigned len);
+	int (*read)(struct file_entry *, struct filesys_spec*, int64_t offset, char *buf, unsigned len);
 	int (*stat)(struct file_entry *, struct filesys_spec *, struct xstat *st);
 	int (*close)(struct file_entry *, struct filesys_spec *);
+	int (*extent_map)(struct file_entry *, struct filesys_spec *, uint64_t start, struct xextent *, int max);
 };
 
 struct filesys_operations {
@@ -57,20 +94,57 @@ struct filesys_operations {
 	int (*label)(struct filesys_spec *, char *buf, int buflen);
 	int (*fsstat)(struct filesys_spec *, struct xfsstat *);
 	struct file_entry *(*open)(struct filesys_spec *, const char *file);
+	int (*warmup)(struct filesys_spec *, unsigned int ms, uint64_t bytes);
+	int (*uuid)(struct filesys_spec *, uint8_t uuid[16]);
+	int (*snapshot)(struct filesys_spec *, const char *path);
+	int (*scan_inodes)(struct filesys_spec *, int threads, int (*)(void *, struct xstat *), void *);
+	int (*catalog)(struct filesys_spec *, int threads, int (*)(void *, const char *path, uint32_t parent, struct xstat *), void *);
+	int (*used_ranges)(struct filesys_spec *, int (*)(void *, uint64_t off, uint64_t len), void *);
+	int (*readlink)(struct filesys_spec *, const char *path, char *buf, int size);
+	int (*query)(struct filesys_spec *, int threads, const struct xquery *,
+		     int (*)(void *, const char *path, uint32_t parent, struct xstat *), void *);
+	int (*block_map)(struct filesys_spec *, int threads, int (*)(void *, uint32_t ino, const struct xextent *), void *);
+	int (*stamp)(struct filesys_spec *, uint8_t stamp[32]);
+	int (*casefold)(struct filesys_spec *, int on);
+	int (*dir_match)(struct filesys_spec *, const char *dir, int (*match)(void *, const char *name),
+			 int (*)(void *, const char *, struct xstat *, int is_dir), void *);
+	int (*dir_lookup)(struct filesys_spec *, const char *dir, const char *name,
+			  int (*)(void *, const char *, struct xstat *, int is_dir), void *);
 };
 
 typedef struct filesys_descr *filesys_t;
 
-int vfs_devread(struct part_descr *part_info, int sector, int byte_offset, int byte_len, char *buf);
+int vfs_devread(struct part_descr *part_info, int64_t sector, int byte_offset, int byte_len, char *buf);
+void vfs_devprefetch(struct part_descr *part_info, int64_t sector, int64_t nsect);
 filesys_t vfs_mount(struct part_descr* part);
 int vfs_umount(filesys_t fsys);
+int vfs_warmup(filesys_t fsys, unsigned int ms, uint64_t bytes);
+int vfs_snapshot(filesys_t fsys, const char *path);
+int vfs_scan_inodes(filesys_t fsys, int threads, int (*)(void *, struct xstat *), void *);
+int vfs_catalog(filesys_t fsys, int threads, int (*)(void *, const char *path, uint32_t parent, struct xstat *), void *);
+void vfs_query_init(struct xquery *);
+int vfs_query_match(const struct xquery *, const struct xstat *);
+int vfs_query(filesys_t fsys, int threads, const struct xquery *,
+	      int (*)(void *, const char *path, uint32_t parent, struct xstat *), void *);
+int vfs_block_map(filesys_t fsys, int threads, int (*)(void *, uint32_t ino, const struct xextent *), void *);
+int vfs_stamp(filesys_t fsys, uint8_t stamp[32]);
+int vfs_casefold(filesys_t fsys, int on);
+int vfs_used_ranges(filesys_t fsys, int (*)(void *, uint64_t off, uint64_t len), void *);
+int vfs_readlink(filesys_t fsys, const char *path, char *buf, int size);
 int vfs_label(filesys_t, char *, int);
+int vfs_uuid(filesys_t, uint8_t uuid[16]);
 int vfs_stat(filesys_t, struct xfsstat *);
 int vfs_dir_iterate(filesys_t, const char *dir, int (*)(void *, const char *, struct xstat *, int is_dir), void *);
+int vfs_name_match(const char *pattern, const char *name, int nocase);
+int vfs_dir_iterate_pattern(filesys_t, const char *dir, const char *pattern, int nocase,
+			    int (*)(void *, const char *, struct xstat *, int is_dir), void *);
 file_entry_t vfs_open(filesys_t fs, const char *dir);
-int vfs_file_read(file_entry_t filp, filesys_t fs, int offset,  char *buf, unsigned len);
+int vfs_file_read(file_entry_t filp, filesys_t fs, int64_t offset,  char *buf, unsigned len);
 int vfs_file_close(file_entry_t filp, filesys_t fs);
 int vfs_file_stat(file_entry_t filp, filesys_t fs, struct xstat *);
+int vfs_file_extent_map(file_entry_t filp, filesys_t fs, uint64_t start, struct xextent *, int max);
+int64_t vfs_file_seek_data(file_entry_t filp, filesys_t fs, int64_t offset);
+int64_t vfs_file_seek_hole(file_entry_t filp, filesys_t fs, int64_t offset);
 
 #endif
 
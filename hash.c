@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+#include "hash.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HASH_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return (uint64_t)get_le32(p + 4) << 32 | get_le32(p);
+}
+
+/* SHA-256, FIPS 180-4. */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n)	((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_blocks_c(uint32_t state[8], const uint8_t *p, size_t n)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (; n; n--, p += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = get_be32(p + i * 4);
+		for (; i < 64; i++)
+			w[i] = w[i - 16] + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			       w[i - 7] + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+			     sha256_k[i] + w[i];
+			t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef HASH_SHA_NI
+/* The same compression with the SHA-NI instructions, four rounds a step. */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_ni(uint32_t state[8], const uint8_t *p, size_t n)
+{
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+	int i;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);		/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);		/* CDGH */
+
+	for (; n; n--, p += 64) {
+		abef = state0;
+		cdgh = state1;
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i * 16)), swap);
+			else
+				w[i & 3] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+						      _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4)),
+					w[(i + 3) & 3]);
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);			/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1);		/* DCHG */
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static int sha256_have_ni(void)
+{
+	unsigned a, b, c, d;
+
+	if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) || !(c & bit_SSSE3))
+		return 0;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid_count(7, 0, a, b, c, d);
+	return (b >> 29) & 1;
+}
+#endif
+
+static void sha256_blocks(struct sha256_ctx *ctx, const uint8_t *p, size_t n)
+{
+#ifdef HASH_SHA_NI
+	if (ctx->ni) {
+		sha256_blocks_ni(ctx->state, p, n);
+		return;
+	}
+#endif
+	sha256_blocks_c(ctx->state, p, n);
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, iv, sizeof iv);
+	ctx->count = 0;
+#ifdef HASH_SHA_NI
+	ctx->ni = sha256_have_ni();
+#else
+	ctx->ni = 0;
+#endif
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t used = ctx->count & 63, n;
+
+	ctx->count += len;
+	if (used) {
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256_blocks(ctx, ctx->buf, 1);
+	}
+	if (len >= 64) {
+		sha256_blocks(ctx, p, len / 64);
+		p += len & ~(size_t)63;
+		len &= 63;
+	}
+	memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_SIZE])
+{
+	uint64_t bits = ctx->count * 8;
+	size_t used = ctx->count & 63;
+	int i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->buf + used, 0, 64 - used);
+		sha256_blocks(ctx, ctx->buf, 1);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		ctx->buf[56 + i] = bits >> (56 - i * 8);
+	sha256_blocks(ctx, ctx->buf, 1);
+	for (i = 0; i < 32; i++)
+		digest[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+}
+
+/*
+ * XXH3, 64-bit variant, as specified by the xxHash project.  Inputs up to
+ * 240 bytes have dedicated mixers; longer ones go through eight
+ * accumulators fed 64-byte stripes, scrambled after each 1 KB block.
+ */
+#define XXH_PRIME32_1	0x9E3779B1U
+#define XXH_PRIME32_2	0x85EBCA77U
+#define XXH_PRIME32_3	0xC2B2AE3DU
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1	0x165667919E3779F9ULL
+#define XXH_PRIME_MX2	0x9FB21C651E98DF25ULL
+
+#define XXH_STRIPE	64
+#define XXH_SECRET	192
+#define XXH_LIMIT	(XXH_SECRET - XXH_STRIPE)
+#define XXH_BLOCK_STRIPES	(XXH_LIMIT / 8)
+#define XXH_MIDSIZE	240
+
+static const uint8_t xxh3_secret[XXH_SECRET] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static uint64_t xxh_mul128_fold64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 p = (unsigned __int128)a * b;
+
+	return (uint64_t)p ^ (uint64_t)(p >> 64);
+#else
+	uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+	uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+	uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+	uint64_t hi_hi = (a >> 32) * (b >> 32);
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+
+	return ((cross << 32) | (lo_lo & 0xffffffff)) ^ ((hi_lo >> 32) + (cross >> 32) + hi_hi);
+#endif
+}
+
+static uint64_t xxh_rotl64(uint64_t x, int r)
+{
+	return x << r | x >> (64 - r);
+}
+
+static uint64_t xxh_swap64(uint64_t x)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		r = r << 8 | ((x >> (i * 8)) & 0xff);
+	return r;
+}
+
+static uint64_t xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	return h ^ (h >> 32);
+}
+
+static uint64_t xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= XXH_PRIME_MX1;
+	return h ^ (h >> 32);
+}
+
+static uint64_t xxh3_mix16(const uint8_t *p, const uint8_t *secret)
+{
+	return xxh_mul128_fold64(get_le64(p) ^ get_le64(secret), get_le64(p + 8) ^ get_le64(secret + 8));
+}
+
+static uint64_t xxh3_short(const uint8_t *p, size_t len)
+{
+	const uint8_t *s = xxh3_secret;
+	uint64_t acc, lo, hi;
+	uint32_t combined;
+	size_t i;
+
+	if (len == 0)
+		return xxh64_avalanche(get_le64(s + 56) ^ get_le64(s + 64));
+	if (len <= 3) {
+		combined = (uint32_t)p[0] << 16 | (uint32_t)p[len >> 1] << 24 | p[len - 1] | (uint32_t)len << 8;
+		return xxh64_avalanche(combined ^ (uint64_t)(get_le32(s) ^ get_le32(s + 4)));
+	}
+	if (len <= 8) {
+		acc = (get_le32(p + len - 4) + ((uint64_t)get_le32(p) << 32)) ^ (get_le64(s + 8) ^ get_le64(s + 16));
+		acc ^= xxh_rotl64(acc, 49) ^ xxh_rotl64(acc, 24);
+		acc *= XXH_PRIME_MX2;
+		acc ^= (acc >> 35) + len;
+		acc *= XXH_PRIME_MX2;
+		return acc ^ (acc >> 28);
+	}
+	if (len <= 16) {
+		lo = get_le64(p) ^ (get_le64(s + 24) ^ get_le64(s + 32));
+		hi = get_le64(p + len - 8) ^ (get_le64(s + 40) ^ get_le64(s + 48));
+		return xxh3_avalanche(len + xxh_swap64(lo) + hi + xxh_mul128_fold64(lo, hi));
+	}
+	acc = len * XXH_PRIME64_1;
+	if (len <= 128) {
+		for (i = 0; i < 4 && len > 32 * i; i++) {
+			acc += xxh3_mix16(p + 16 * i, s + 32 * i);
+			acc += xxh3_mix16(p + len - 16 * (i + 1), s + 32 * i + 16);
+		}
+		return xxh3_avalanche(acc);
+	}
+	for (i = 0; i < 8; i++)
+		acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+	acc = xxh3_avalanche(acc);
+	for (i = 8; i < len / 16; i++)
+		acc += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+	acc += xxh3_mix16(p + len - 16, s + 136 - 17);
+	return xxh3_avalanche(acc);
+}
+
+static void xxh3_stripe(uint64_t acc[8], const uint8_t *p, const uint8_t *secret)
+{
+	uint64_t v, k;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		v = get_le64(p + i * 8);
+		k = v ^ get_le64(secret + i * 8);
+		acc[i ^ 1] += v;
+		acc[i] += (k & 0xffffffff) * (k >> 32);
+	}
+}
+
+static void xxh3_scramble(uint64_t acc[8])
+{
+	const uint8_t *s = xxh3_secret + XXH_LIMIT;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		acc[i] ^= acc[i] >> 47;
+		acc[i] ^= get_le64(s + i * 8);
+		acc[i] *= XXH_PRIME32_1;
+	}
+}
+
+/* Feed whole stripes, scrambling at the end of every block. */
+static void xxh3_stripes(uint64_t acc[8], size_t *done, const uint8_t *p, size_t n)
+{
+	for (; n; n--, p += XXH_STRIPE) {
+		xxh3_stripe(acc, p, xxh3_secret + *done * 8);
+		if (++*done == XXH_BLOCK_STRIPES) {
+			xxh3_scramble(acc);
+			*done = 0;
+		}
+	}
+}
+
+void xxh3_init(struct xxh3_ctx *ctx)
+{
+	static const uint64_t init[8] = {
+		XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+		XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1,
+	};
+
+	memcpy(ctx->acc, init, sizeof init);
+	ctx->total = 0;
+	ctx->buffered = 0;
+	ctx->stripes = 0;
+}
+
+void xxh3_update(struct xxh3_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+
+	ctx->total += len;
+	/* Keep the input while it fits: the tail must stay for the digest. */
+	if (ctx->buffered + len <= XXH3_BUF) {
+		memcpy(ctx->buf + ctx->buffered, p, len);
+		ctx->buffered += len;
+		return;
+	}
+	if (ctx->buffered) {
+		n = XXH3_BUF - ctx->buffered;
+		memcpy(ctx->buf + ctx->buffered, p, n);
+		p += n;
+		len -= n;
+		xxh3_stripes(ctx->acc, &ctx->stripes, ctx->buf, XXH3_BUF / XXH_STRIPE);
+		ctx->buffered = 0;
+	}
+	if (len > XXH3_BUF) {
+		n = (len - 1) / XXH3_BUF * XXH3_BUF;
+		xxh3_stripes(ctx->acc, &ctx->stripes, p, n / XXH_STRIPE);
+		p += n;
+		len -= n;
+		/* The last stripe may reach back before the remaining input. */
+		memcpy(ctx->buf + XXH3_BUF - XXH_STRIPE, p - XXH_STRIPE, XXH_STRIPE);
+	}
+	memcpy(ctx->buf, p, len);
+	ctx->buffered = len;
+}
+
+uint64_t xxh3_digest(struct xxh3_ctx *ctx)
+{
+	uint64_t acc[8], h;
+	size_t done = ctx->stripes;
+	uint8_t last[XXH_STRIPE];
+	const uint8_t *tail;
+	size_t catchup;
+	int i;
+
+	if (ctx->total <= XXH_MIDSIZE)
+		return xxh3_short(ctx->buf, ctx->total);
+
+	memcpy(acc, ctx->acc, sizeof acc);
+	if (ctx->buffered >= XXH_STRIPE) {
+		xxh3_stripes(acc, &done, ctx->buf, (ctx->buffered - 1) / XXH_STRIPE);
+		tail = ctx->buf + ctx->buffered - XXH_STRIPE;
+	} else {
+		catchup = XXH_STRIPE - ctx->buffered;
+		memcpy(last, ctx->buf + XXH3_BUF - catchup, catchup);
+		memcpy(last + catchup, ctx->buf, ctx->buffered);
+		tail = last;
+	}
+	xxh3_stripe(acc, tail, xxh3_secret + XXH_LIMIT - 7);
+
+	h = ctx->total * XXH_PRIME64_1;
+	for (i = 0; i < 4; i++)
+		h += xxh_mul128_fold64(acc[2 * i] ^ get_le64(xxh3_secret + 11 + 16 * i),
+				       acc[2 * i + 1] ^ get_le64(xxh3_secret + 11 + 16 * i + 8));
+	return xxh3_avalanche(h);
+}
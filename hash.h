@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __XOKAN_HASH_H__
+#define __XOKAN_HASH_H__
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Content hashes: SHA-256, using the SHA extensions of x86 processors
+ * when the CPU has them, and the 64-bit XXH3 hash with its default
+ * secret and seed 0.  Both take their input in pieces of any size.
+ */
+#define SHA256_SIZE	32
+#define XXH3_BUF	256	/* input kept back for the last stripe */
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;		/* bytes so far */
+	uint8_t  buf[64];
+	int      ni;		/* use the SHA instructions */
+};
+
+struct xxh3_ctx {
+	uint64_t acc[8];
+	uint64_t total;
+	size_t   buffered;
+	size_t   stripes;	/* stripes done in the current block */
+	uint8_t  buf[XXH3_BUF];
+};
+
+void sha256_init(struct sha256_ctx *);
+void sha256_update(struct sha256_ctx *, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *, uint8_t digest[SHA256_SIZE]);
+
+void xxh3_init(struct xxh3_ctx *);
+void xxh3_update(struct xxh3_ctx *, const void *data, size_t len);
+uint64_t xxh3_digest(struct xxh3_ctx *);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "disk.h"
+#include "util.h"
+
+/* A raw disk or filesystem image in a plain file; works everywhere. */
+struct img_disk {
+	struct disk_descr    disk;
+	uint64_t             capacity;
+	FILE                *fp;
+};
+
+static uint64_t img_disk_capacity(disk_descr_t disk)
+{
+	struct img_disk *img = (struct img_disk *)disk;
+	return img->capacity;
+}
+
+static int img_disk_read(disk_descr_t disk, int64_t start, int64_t num, uint8_t *buf)
+{
+	struct img_disk *img = (struct img_disk *)disk;
+
+	if (xfseek(img->fp, start * SECTOR_SIZE, SEEK_SET) ||
+	    fread(buf, SECTOR_SIZE, num, img->fp) != (size_t)num)
+		return -1;
+	return 0;
+}
+
+static int img_disk_write(disk_descr_t disk, int64_t start, int64_t num, const uint8_t *buf)
+{
+	struct img_disk *img = (struct img_disk *)disk;
+
+	if (xfseek(img->fp, start * SECTOR_SIZE, SEEK_SET) ||
+	    fwrite(buf, SECTOR_SIZE, num, img->fp) != (size_t)num)
+		return -1;
+	return 0;
+}
+
+static void img_disk_release(disk_descr_t disk)
+{
+	struct img_disk *img = (struct img_disk *)disk;
+	fclose(img->fp);
+}
+
+static int img_disk_create(disk_descr_t disk, const char *path, uint32_t flags)
+{
+	struct img_disk *img = (struct img_disk *)disk;
+
+	img->fp = fopen(path, (flags & DISK_FLAG_WRITE) ? "r+b" : "rb");
+	if (!img->fp) {
+		fprintf(stderr, "can't open image: %s\n", path);
+		return -1;
+	}
+	if (xfseek(img->fp, 0, SEEK_END)) {
+		fclose(img->fp);
+		return -1;
+	}
+	img->capacity = xftell(img->fp) / SECTOR_SIZE;
+	fprintf(stderr, "image: %llu sectors\n", (unsigned long long)img->capacity);
+	disk->release  = img_disk_release;
+	disk->read     = img_disk_read;
+	disk->write    = img_disk_write;
+	disk->capacity = img_disk_capacity;
+	return 0;
+}
+
+struct disk_probe_spec img_disk_spec = {
+	.name  = "image",
+	.size  = sizeof (struct img_disk),
+	.probe = img_disk_create,
+};
@@ -82,7 +82,7 @@ static int phy_get_info(struct phy_disk *phy)
 
 	succ = GetFileSizeEx(phy->hFile, &size);
 	if (!succ) {
-		printf("can't get capacity size\n");
+		fprintf(stderr, "can't get capacity size\n");
 		return -1;
 	}
 	phy->capacity = size.QuadPart / SECTOR_SIZE;
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "bcache.h"
+#include "profile.h"
+
+/* Name a per-filesystem file after the filesystem UUID. */
+int profile_path(filesys_t fs, const char *dir, const char *ext, char *path, int len)
+{
+	uint8_t uuid[16];
+	int n, i;
+
+	if (vfs_uuid(fs, uuid) != 0)
+		return 1;
+	n = snprintf(path, len, "%s/", dir);
+	for (i = 0; i < 16 && n < len; i++)
+		n += snprintf(path + n, len - n, "%02x", uuid[i]);
+	if (n < len)
+		n += snprintf(path + n, len - n, "%s", ext);
+	return n >= len;
+}
+
+/* Start recording the chunks demand reads touch. */
+int profile_record(part_descr_t part)
+{
+	if (!part->cache)
+		return 1;
+	return bcache_trace_start(part->cache);
+}
+
+/*
+ * Queue the chunks of a saved profile for prefetch, in ascending order,
+ * merging runs separated by at most PROFILE_GAP chunks.  At most budget
+ * bytes are requested.
+ */
+int profile_replay(part_descr_t part, const char *path, uint64_t budget)
+{
+	struct profile_header hdr;
+	uint64_t chunk = 0, start = 0, end = 0, left;
+	uint32_t i, shift;
+	FILE *fp;
+	int c;
+
+	if (!part->cache)
+		return 1;
+	fp = fopen(path, "rb");
+	if (!fp)
+		return 1;
+	if (fread(&hdr, sizeof hdr, 1, fp) != 1 ||
+	    memcmp(hdr.magic, PROFILE_MAGIC, sizeof hdr.magic) ||
+	    hdr.chunk_bits != BCACHE_CHUNK_BITS) {
+		fprintf(stderr, "ignoring bad profile %s\n", path);
+		fclose(fp);
+		return 1;
+	}
+
+	left = budget >> (BCACHE_CHUNK_BITS + SECTOR_BITS);
+	for (i = 0; i < hdr.count && left > 0; i++) {
+		uint64_t delta = 0;
+
+		for (shift = 0; (c = fgetc(fp)) != EOF && shift < 64; shift += 7) {
+			delta |= (uint64_t)(c & 0x7f) << shift;
+			if (!(c & 0x80))
+				break;
+		}
+		if (c == EOF)
+			break;
+		chunk += delta;
+		if (end > start && chunk <= end + PROFILE_GAP) {
+			left -= MIN(chunk + 1 - end, left);
+			end = chunk + 1;
+			continue;
+		}
+		if (end > start &&
+		    bcache_prefetch(part->cache, start << BCACHE_CHUNK_BITS,
+				    (end - start) << BCACHE_CHUNK_BITS))
+			break;
+		start = chunk;
+		end = chunk + 1;
+		left--;
+	}
+	if (end > start)
+		bcache_prefetch(part->cache, start << BCACHE_CHUNK_BITS,
+				(end - start) << BCACHE_CHUNK_BITS);
+	fclose(fp);
+	return 0;
+}
+
+/* Write what this session read, replacing any earlier profile. */
+int profile_save(part_descr_t part, const char *path)
+{
+	struct profile_header hdr;
+	uint32_t *chunks, prev = 0;
+	uint8_t var[5];
+	FILE *fp;
+	int i, n, k;
+
+	if (!part->cache)
+		return 1;
+	n = bcache_trace_get(part->cache, &chunks);
+	if (n <= 0)
+		return 1;
+	fp = fopen(path, "wb");
+	if (!fp) {
+		fprintf(stderr, "can't write profile %s\n", path);
+		free(chunks);
+		return 1;
+	}
+	memcpy(hdr.magic, PROFILE_MAGIC, sizeof hdr.magic);
+	hdr.chunk_bits = BCACHE_CHUNK_BITS;
+	hdr.count = n;
+	fwrite(&hdr, sizeof hdr, 1, fp);
+	for (i = 0; i < n; i++) {
+		uint32_t delta = chunks[i] - prev;
+
+		prev = chunks[i];
+		k = 0;
+		do {
+			var[k] = delta & 0x7f;
+			delta >>= 7;
+			if (delta)
+				var[k] |= 0x80;
+			k++;
+		} while (delta);
+		fwrite(var, 1, k, fp);
+	}
+	free(chunks);
+	return fclose(fp) != 0;
+}
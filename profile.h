@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __XOKAN_PROFILE_H__
+#define __XOKAN_PROFILE_H__
+#include <stdint.h>
+#include "disk.h"
+#include "fs.h"
+
+/*
+ * Access profiles: the cache chunks a session read on demand, saved per
+ * filesystem UUID and prefetched again on the next mount.  The file is a
+ * header followed by the sorted chunk numbers as varint deltas.
+ */
+#define PROFILE_MAGIC		"EOKPROF1"
+#define PROFILE_GAP		2	/* chunks bridged when coalescing */
+
+struct profile_header {
+	char     magic[8];
+	uint32_t chunk_bits;
+	uint32_t count;
+};
+
+int profile_path(filesys_t fs, const char *dir, const char *ext, char *path, int len);
+int profile_record(part_descr_t part);
+int profile_replay(part_descr_t part, const char *path, uint64_t budget);
+int profile_save(part_descr_t part, const char *path);
+
+#endif
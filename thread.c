@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include "thread.h"
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600	/* condition variables, GetTickCount64 */
+#endif
+#include <windows.h>
+
+struct xmutex {
+	CRITICAL_SECTION lock;
+};
+
+struct xcond {
+	CONDITION_VARIABLE cond;
+};
+
+struct xthread {
+	HANDLE handle;
+	void (*func)(void *);
+	void *arg;
+};
+
+xmutex_t xmutex_create(void)
+{
+	xmutex_t m = calloc(1, sizeof *m);
+
+	if (m)
+		InitializeCriticalSection(&m->lock);
+	return m;
+}
+
+void xmutex_destroy(xmutex_t m)
+{
+	DeleteCriticalSection(&m->lock);
+	free(m);
+}
+
+void xmutex_lock(xmutex_t m)
+{
+	EnterCriticalSection(&m->lock);
+}
+
+void xmutex_unlock(xmutex_t m)
+{
+	LeaveCriticalSection(&m->lock);
+}
+
+xcond_t xcond_create(void)
+{
+	xcond_t c = calloc(1, sizeof *c);
+
+	if (c)
+		InitializeConditionVariable(&c->cond);
+	return c;
+}
+
+void xcond_destroy(xcond_t c)
+{
+	free(c);
+}
+
+int xcond_wait(xcond_t c, xmutex_t m, int timeout_ms)
+{
+	if (!SleepConditionVariableCS(&c->cond, &m->lock,
+				timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms))
+		return GetLastError() == ERROR_TIMEOUT ? 1 : -1;
+	return 0;
+}
+
+void xcond_signal(xcond_t c)
+{
+	WakeConditionVariable(&c->cond);
+}
+
+void xcond_broadcast(xcond_t c)
+{
+	WakeAllConditionVariable(&c->cond);
+}
+
+static DWORD WINAPI xthread_start(LPVOID arg)
+{
+	xthread_t t = arg;
+
+	t->func(t->arg);
+	return 0;
+}
+
+xthread_t xthread_create(void (*func)(void *), void *arg)
+{
+	xthread_t t = calloc(1, sizeof *t);
+
+	if (!t)
+		return NULL;
+	t->func = func;
+	t->arg = arg;
+	t->handle = CreateThread(NULL, 0, xthread_start, t, 0, NULL);
+	if (t->handle == NULL) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void xthread_join(xthread_t t)
+{
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+	free(t);
+}
+
+uint64_t xclock_ms(void)
+{
+	return GetTickCount64();
+}
+
+int xcpu_count(void)
+{
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+}
+
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+struct xmutex {
+	pthread_mutex_t lock;
+};
+
+struct xcond {
+	pthread_cond_t cond;
+};
+
+struct xthread {
+	pthread_t thread;
+	void (*func)(void *);
+	void *arg;
+};
+
+xmutex_t xmutex_create(void)
+{
+	xmutex_t m = calloc(1, sizeof *m);
+
+	if (m)
+		pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+void xmutex_destroy(xmutex_t m)
+{
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+void xmutex_lock(xmutex_t m)
+{
+	pthread_mutex_lock(&m->lock);
+}
+
+void xmutex_unlock(xmutex_t m)
+{
+	pthread_mutex_unlock(&m->lock);
+}
+
+xcond_t xcond_create(void)
+{
+	xcond_t c = calloc(1, sizeof *c);
+	pthread_condattr_t attr;
+
+	if (c) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&c->cond, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+	return c;
+}
+
+void xcond_destroy(xcond_t c)
+{
+	pthread_cond_destroy(&c->cond);
+	free(c);
+}
+
+int xcond_wait(xcond_t c, xmutex_t m, int timeout_ms)
+{
+	struct timespec ts;
+	int e;
+
+	if (timeout_ms < 0)
+		return pthread_cond_wait(&c->cond, &m->lock) ? -1 : 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	e = pthread_cond_timedwait(&c->cond, &m->lock, &ts);
+	if (e == ETIMEDOUT)
+		return 1;
+	return e ? -1 : 0;
+}
+
+void xcond_signal(xcond_t c)
+{
+	pthread_cond_signal(&c->cond);
+}
+
+void xcond_broadcast(xcond_t c)
+{
+	pthread_cond_broadcast(&c->cond);
+}
+
+static void *xthread_start(void *arg)
+{
+	xthread_t t = arg;
+
+	t->func(t->arg);
+	return NULL;
+}
+
+xthread_t xthread_create(void (*func)(void *), void *arg)
+{
+	xthread_t t = calloc(1, sizeof *t);
+
+	if (!t)
+		return NULL;
+	t->func = func;
+	t->arg = arg;
+	if (pthread_create(&t->thread, NULL, xthread_start, t)) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void xthread_join(xthread_t t)
+{
+	pthread_join(t->thread, NULL);
+	free(t);
+}
+
+uint64_t xclock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int xcpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+}
+#endif
+
+void xthread_run(int n, void (*func)(void *), void *arg)
+{
+	xthread_t *threads;
+	int i, started = 0;
+
+	if (n <= 0)
+		n = xcpu_count();
+	threads = calloc(n, sizeof *threads);
+	for (i = 0; threads && i < n; i++) {
+		threads[started] = xthread_create(func, arg);
+		if (threads[started])
+			started++;
+	}
+	if (started == 0)
+		func(arg);
+	for (i = 0; i < started; i++)
+		xthread_join(threads[i]);
+	free(threads);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2013, Renyi su <surenyi@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer. Redistributions in binary form must
+ * reproduce the above copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __XOKAN_THREAD_H__
+#define __XOKAN_THREAD_H__
+#include <stdint.h>
+
+/*
+ * Minimal thread primitives for the portable layers: Win32 threads and
+ * critical sections on Windows, pthreads elsewhere.
+ */
+typedef struct xmutex  *xmutex_t;
+typedef struct xcond   *xcond_t;
+typedef struct xthread *xthread_t;
+
+xmutex_t  xmutex_create(void);
+void      xmutex_destroy(xmutex_t);
+void      xmutex_lock(xmutex_t);
+void      xmutex_unlock(xmutex_t);
+
+xcond_t   xcond_create(void);
+void      xcond_destroy(xcond_t);
+/* Wait with the mutex held; timeout_ms < 0 waits forever. 1 on timeout. */
+int       xcond_wait(xcond_t, xmutex_t, int timeout_ms);
+void      xcond_signal(xcond_t);
+void      xcond_broadcast(xcond_t);
+
+xthread_t xthread_create(void (*func)(void *), void *arg);
+void      xthread_join(xthread_t);
+/*
+ * Run func(arg) on n threads (0: one per CPU) and wait for them all.
+ * If no thread can be started func runs once on the caller's thread.
+ */
+void      xthread_run(int n, void (*func)(void *), void *arg);
+
+/* Monotonic clock in milliseconds. */
+uint64_t  xclock_ms(void);
+int       xcpu_count(void);
+
+#endif
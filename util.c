@@ -20,10 +20,31 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <stdio.h>
+#include <stdlib.h>
 #include "util.h"
 
+int xgrow(void **array, size_t *max, size_t need, size_t size)
+{
+	size_t n = *max ? *max : 256;
+	void *p;
+
+	if (need <= *max)
+		return 1;
+	while (n < need)
+		n *= 2;
+	p = realloc(*array, n * size);
+	if (!p)
+		return 0;
+	*array = p;
+	*max = n;
+	return 1;
+}
+
+#ifdef _WIN32
 int utf16_to_utf8(const wchar_t *utf16,size_t is, char *utfc,size_t os)
 {
 	(void)is;
@@ -35,4 +56,4 @@ int utf8_to_utf16(const char *utfc,size_t is,wchar_t *utf16,size_t os)
 	(void)is;
 	return MultiByteToWideChar(CP_UTF8, 0, utfc, -1, utf16, os);
 }
-
+#endif
@@ -25,7 +25,22 @@
 #define __XOKAN_UTILS_H__
 struct filesys_descr;
 
+#include <stddef.h>
+
 #define MIN(a, b) ((a) > (b) ? (b) : (a))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* 64-bit stdio offsets */
+#ifdef _WIN32
+#define xfseek _fseeki64
+#define xftell _ftelli64
+#else
+#define xfseek fseeko
+#define xftell ftello
+#endif
+
+/* Grow a malloc'ed array to hold need elements; 0 if out of memory. */
+int xgrow(void **array, size_t *max, size_t need, size_t size);
 
 int utf16_to_utf8(const wchar_t *utf16,size_t is,char *utfc,size_t os);
 int utf8_to_utf16(const char *utfc,size_t is,wchar_t *utf16,size_t os);
@@ -33,7 +48,7 @@ int utf8_to_utf16(const char *utfc,size_t is,wchar_t *utf16,size_t os);
 int eokan_load(int debug);
 void eokan_unload();
 int eokan_umount(int c);
-int eokan_main(struct filesys_descr * fs, int drive);
+int eokan_main(struct filesys_descr * fs, int drive, int casefold);
 
 #endif
 
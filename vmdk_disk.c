@@ -78,34 +78,34 @@ static int vmdk_get_info(struct vmdk_disk *vmdk)
     VixDiskLibInfo *info = NULL;
     VixError error;
 
-	printf("Transport mode \"%s\".\n", vmdk->VixDiskLib_GetTransportMode(vmdk->disk_handle));
+	fprintf(stderr, "Transport mode \"%s\".\n", vmdk->VixDiskLib_GetTransportMode(vmdk->disk_handle));
 
     error = vmdk->VixDiskLib_GetInfo(vmdk->disk_handle, &info);
 	if (error != VIX_OK)
 		return -1;
 
 	vmdk->capacity = info->capacity;
-    printf("Capacity          = %I64u sectors\n", (uint64_t)info->capacity);
-    printf("number of links   = %d\n" ,info->numLinks);
-    printf("adapter type      = ");
+    fprintf(stderr, "Capacity          = %I64u sectors\n", (uint64_t)info->capacity);
+    fprintf(stderr, "number of links   = %d\n" ,info->numLinks);
+    fprintf(stderr, "adapter type      = ");
     switch (info->adapterType) {
     case VIXDISKLIB_ADAPTER_IDE:
-       printf("IDE");
+       fprintf(stderr, "IDE");
        break;
     case VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC:
-       printf("BusLogic SCSI");
+       fprintf(stderr, "BusLogic SCSI");
        break;
     case VIXDISKLIB_ADAPTER_SCSI_LSILOGIC:
-       printf("LsiLogic SCSI");
+       fprintf(stderr, "LsiLogic SCSI");
        break;
     default:
-       printf("unknown");
+       fprintf(stderr, "unknown");
        break;
     }
-    printf("\nBIOS geometry     = %u/%u/%u\n", info->biosGeo.cylinders, info->biosGeo.heads ,info->biosGeo.sectors);
-    printf("physical geometry = %u/%u/%u\n",  info->physGeo.cylinders,  info->physGeo.heads, info->physGeo.sectors);
+    fprintf(stderr, "\nBIOS geometry     = %u/%u/%u\n", info->biosGeo.cylinders, info->biosGeo.heads ,info->biosGeo.sectors);
+    fprintf(stderr, "physical geometry = %u/%u/%u\n",  info->physGeo.cylinders,  info->physGeo.heads, info->physGeo.sectors);
     vmdk->VixDiskLib_FreeInfo(info);
-    printf("Transport modes supported by vixDiskLib: %s\n", vmdk->VixDiskLib_ListTransportModes());
+    fprintf(stderr, "Transport modes supported by vixDiskLib: %s\n", vmdk->VixDiskLib_ListTransportModes());
 	return 0;
 }
 